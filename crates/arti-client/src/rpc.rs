@@ -43,6 +43,9 @@ impl rpc::RpcMethod for GetClientStatus {
 /// Run forever, delivering updates about a client's bootstrap and health information.
 ///
 /// (This method can return updates that have no visible changes.)
+///
+/// Each update describes the whole status, so a client that only wants to follow
+/// the current status can ask for fewer updates with `update_filter` in its request's `meta`.
 #[derive(Deftly, Debug, Serialize, Deserialize)]
 #[derive_deftly(rpc::DynMethod)]
 #[deftly(rpc(method_name = "arti:watch_client_status"))]
@@ -199,11 +199,178 @@ typedef struct ArtiRpcStr ArtiRpcStr;
  */
 typedef struct ArtiRpcHandle ArtiRpcHandle;
 
+/**
+ * A data stream that is still being opened through Arti.
+ *
+ * Created with `arti_rpc_conn_open_stream_nonblocking`;
+ * it must eventually be freed with `arti_rpc_pending_stream_free`.
+ *
+ * This is a thread-safe type: you may safely use it from multiple threads at once.
+ */
+typedef struct ArtiRpcPendingStream ArtiRpcPendingStream;
+
+/**
+ * A fixed set of open connections to the same Arti instance.
+ *
+ * Created with `arti_rpc_connect_pool`;
+ * it must eventually be freed with `arti_rpc_conn_pool_free`.
+ *
+ * This is a thread-safe type: you may safely use it from multiple threads at once.
+ * Spreading requests across the connections in a pool with `arti_rpc_conn_pool_get`
+ * avoids the contention that comes from sending every request over a single connection.
+ */
+typedef struct ArtiRpcConnPool ArtiRpcConnPool;
+
+/**
+ * An RPC request that is being built, one parameter at a time.
+ *
+ * Created with `arti_rpc_request_new`;
+ * it must eventually be freed with `arti_rpc_request_free`.
+ *
+ * This is a thread-safe type: you may safely use it from multiple threads at once.
+ * Changes to it, and sends of it, happen one at a time.
+ */
+typedef struct ArtiRpcRequestBuilder ArtiRpcRequestBuilder;
+
+/**
+ * A connection to Arti that is still being made.
+ *
+ * Created with `arti_rpc_connect_async`;
+ * it must eventually be freed with `arti_rpc_pending_connect_free`.
+ *
+ * This is a thread-safe type: you may safely use it from multiple threads at once.
+ * (Only one call to `arti_rpc_pending_connect_finish` or `arti_rpc_pending_connect_wait`
+ * will ever return the connection.)
+ */
+typedef struct ArtiRpcPendingConnect ArtiRpcPendingConnect;
+
 /**
  * The type of a message returned by an RPC request.
  */
 typedef int ArtiRpcResponseType;
 
+/**
+ * A way of separating messages from one another on an RPC connection,
+ * as used by `arti_rpc_connect_with_framing`.
+ */
+typedef int ArtiRpcFraming;
+
+/**
+ * A kind of event reported to an `ArtiRpcTraceHook`:
+ * one of the `ARTI_RPC_TRACE_EVENT_*` constants.
+ */
+typedef int ArtiRpcTraceEvent;
+
+/**
+ * What to do when a response would exceed a limit set with `arti_rpc_conn_set_queue_limits`:
+ * one of the `ARTI_RPC_OVERFLOW_*` constants.
+ */
+typedef int ArtiRpcOverflowPolicy;
+
+/**
+ * The number of buckets in each latency histogram of an `ArtiRpcConnStats`.
+ */
+#define ARTI_RPC_N_LATENCY_BUCKETS 32
+
+/**
+ * Statistics about the activity on an `ArtiRpcConn`, as filled in by `arti_rpc_conn_get_stats`.
+ *
+ * Each latency histogram has `ARTI_RPC_N_LATENCY_BUCKETS` buckets, bucketed by powers of two:
+ * bucket 0 counts latencies of less than one microsecond,
+ * and for `i >= 1`, bucket `i` counts latencies of at least `2^(i-1)`
+ * but less than `2^i` microseconds.
+ * The last bucket also counts every latency larger than that.
+ */
+typedef struct ArtiRpcConnStats {
+  /**
+   * The number of requests that we have sent.
+   */
+  uint64_t requests_sent;
+  /**
+   * The number of requests that have received a final response.
+   */
+  uint64_t requests_completed;
+  /**
+   * The number of requests that have not yet received a final response.
+   */
+  uint64_t n_pending;
+  /**
+   * The number of responses that have arrived, but which nobody has taken yet.
+   */
+  uint64_t n_queued;
+  /**
+   * The total length of the messages that we have received, not counting framing.
+   */
+  uint64_t bytes_read;
+  /**
+   * The total length of the messages that we have sent, not counting framing.
+   */
+  uint64_t bytes_written;
+  /**
+   * The number of times that one waiting thread has handed off reading from Arti to another.
+   */
+  uint64_t reader_handoffs;
+  /**
+   * The total length of the responses that have arrived, but which nobody has taken yet.
+   */
+  uint64_t queued_bytes;
+  /**
+   * The number of times that the background reader has stopped reading,
+   * to wait for room in a queue.
+   */
+  uint64_t reader_blocks;
+  /**
+   * A histogram of the time from sending each request to receiving its first update.
+   */
+  uint64_t first_update_latency[ARTI_RPC_N_LATENCY_BUCKETS];
+  /**
+   * A histogram of the time from sending each request to receiving its final response.
+   */
+  uint64_t final_latency[ARTI_RPC_N_LATENCY_BUCKETS];
+} ArtiRpcConnStats;
+
+/**
+ * A function to receive responses to a request sent with `arti_rpc_conn_execute_with_callback`.
+ *
+ * It is called with the `user_data` pointer that was passed to
+ * `arti_rpc_conn_execute_with_callback`.
+ *
+ * For each response, `response_type` is the type of the response
+ * (as for `arti_rpc_handle_wait`),
+ * `response` is the response itself, and `error` is NULL.
+ * If the connection fails before a final response arrives,
+ * `response_type` is zero, `response` is NULL, and `error` describes the failure.
+ *
+ * The `response` and `error` pointers are only valid until the callback returns;
+ * the callback must not free them.
+ */
+typedef void (*ArtiRpcResponseCallback)(void *user_data,
+                                        ArtiRpcResponseType response_type,
+                                        const char *response,
+                                        const ArtiRpcError *error);
+
+/**
+ * A function to receive trace events on a connection, as installed by
+ * `arti_rpc_conn_set_trace_hook`.
+ *
+ * It is called with the `user_data` pointer that was passed to `arti_rpc_conn_set_trace_hook`,
+ * the ID of the request (encoded as JSON, so that numeric and string IDs can be told apart),
+ * the `ARTI_RPC_TRACE_EVENT_*` constant for the event,
+ * and the time at which the event happened.
+ *
+ * That time is in nanoseconds since the Unix epoch.
+ * It comes from a monotonic clock that was matched to the system clock
+ * when the hook was installed,
+ * so the differences between times are accurate even if the system clock later changes.
+ *
+ * The `request_id` pointer is only valid until the hook returns;
+ * the hook must not free it.
+ */
+typedef void (*ArtiRpcTraceHook)(void *user_data,
+                                 const char *request_id,
+                                 ArtiRpcTraceEvent event,
+                                 uint64_t timestamp_ns);
+
 /**
  * A constant indicating that a message is a final result.
  *
@@ -227,6 +394,77 @@ typedef int ArtiRpcResponseType;
  */
 #define ARTI_RPC_RESPONSE_TYPE_ERROR 3
 
+/**
+ * A constant indicating that messages should be terminated by newlines.
+ *
+ * Every connection uses this framing unless it asks for another one.
+ */
+#define ARTI_RPC_FRAMING_JSON_LINES 0
+
+/**
+ * A constant indicating that each message should be preceded by its length.
+ *
+ * This is cheaper for both sides to parse, especially for large messages.
+ */
+#define ARTI_RPC_FRAMING_LENGTH_PREFIXED 1
+
+/**
+ * A trace event indicating that the application has handed us a request,
+ * and we have assigned it an ID.
+ */
+#define ARTI_RPC_TRACE_EVENT_SUBMITTED 1
+
+/**
+ * A trace event indicating that we have finished writing a request to Arti.
+ *
+ * (The time since `ARTI_RPC_TRACE_EVENT_SUBMITTED` is mostly spent
+ * waiting for other threads to finish their own writes.)
+ */
+#define ARTI_RPC_TRACE_EVENT_WRITTEN 2
+
+/**
+ * A trace event indicating that we have read a non-final update for a request from Arti.
+ */
+#define ARTI_RPC_TRACE_EVENT_UPDATE_RECEIVED 3
+
+/**
+ * A trace event indicating that we have read the final response for a request from Arti.
+ */
+#define ARTI_RPC_TRACE_EVENT_FINAL_RECEIVED 4
+
+/**
+ * A trace event indicating that we have handed a response to whoever was waiting for it,
+ * or to its callback.
+ *
+ * Responses that we discard are never reported with this event.
+ */
+#define ARTI_RPC_TRACE_EVENT_DELIVERED 5
+
+/**
+ * An overflow policy: stop reading from Arti until the application has taken
+ * enough responses to make room.
+ *
+ * This delays the responses to _every_ request on the connection,
+ * and pushes the back-pressure all the way to Arti.
+ * Only a background reader thread ever waits for room,
+ * so setting a limit with this policy launches one.
+ */
+#define ARTI_RPC_OVERFLOW_BLOCK 0
+
+/**
+ * An overflow policy: discard the oldest queued updates for the request, until there is room.
+ */
+#define ARTI_RPC_OVERFLOW_DROP_OLDEST_UPDATES 1
+
+/**
+ * An overflow policy: fail the request, discarding its queued responses.
+ *
+ * Whoever next waits for the request gets `ARTI_RPC_STATUS_QUEUE_OVERFLOW`,
+ * and any further responses to it are discarded.
+ * (The request is not cancelled; you may want to cancel it yourself.)
+ */
+#define ARTI_RPC_OVERFLOW_FAIL_REQUEST 2
+
 /**
  * The function has returned successfully.
  */
@@ -323,6 +561,30 @@ typedef int ArtiRpcResponseType;
  */
 #define ARTI_RPC_STATUS_NOT_AUTHENTICATED 12
 
+/**
+ * A non-blocking operation could not complete without blocking.
+ *
+ * (For example, we tried to get a response to a request with `arti_rpc_handle_try_wait`,
+ * but no response was ready yet.  Try again later.)
+ */
+#define ARTI_RPC_STATUS_WOULD_BLOCK 13
+
+/**
+ * An operation did not complete before its deadline.
+ *
+ * (For example, we waited for a response with `arti_rpc_handle_wait_timeout`,
+ * but none arrived in time.)
+ */
+#define ARTI_RPC_STATUS_TIMED_OUT 14
+
+/**
+ * A request failed because too many of its responses were waiting to be taken.
+ *
+ * (This only happens once you have set a limit with `arti_rpc_conn_set_queue_limits`,
+ * using `ARTI_RPC_OVERFLOW_FAIL_REQUEST`.)
+ */
+#define ARTI_RPC_STATUS_QUEUE_OVERFLOW 15
+
 
 
 
@@ -363,6 +625,123 @@ ArtiRpcStatus arti_rpc_connect(const char *connection_string,
                                ArtiRpcConn **rpc_conn_out,
                                ArtiRpcError **error_out);
 
+/**
+ * Begin opening a new connection to an Arti instance, without waiting for it to be ready.
+ *
+ * Behaves the same as `arti_rpc_connect`, except that
+ * the work of connecting and authenticating happens on another thread,
+ * and this function returns as soon as it has begun.
+ * It sets `*pending_out` to a newly allocated `ArtiRpcPendingConnect`.
+ * Use `arti_rpc_pending_connect_finish` or `arti_rpc_pending_connect_wait`
+ * to get the connection once it is ready.
+ *
+ * As soon as Arti has told us our session,
+ * the new connection asks Arti for its proxy information, without waiting for the answer;
+ * the first call to `arti_rpc_conn_open_stream` then uses that answer,
+ * rather than making a round trip of its own.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*pending_out`.
+ * Otherwise return some other status code, set `*pending_out` to NULL, and set
+ * `*error_out` (if provided) to a newly allocated error object.
+ * (Errors that happen while connecting are reported when the connection is finished.)
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*pending_out` and `*error_out`,
+ * if set, are eventually freed.
+ */
+ArtiRpcStatus arti_rpc_connect_async(const char *connection_string,
+                                     ArtiRpcPendingConnect **pending_out,
+                                     ArtiRpcError **error_out);
+
+/**
+ * Return a file descriptor that becomes readable once `pending` is ready to finish.
+ *
+ * Applications that run an event loop can add this descriptor to their `poll()` set
+ * (or equivalent), and call `arti_rpc_pending_connect_finish` once it becomes readable.
+ *
+ * Return -1 if `pending` is NULL.
+ *
+ * This function is not yet supported on Windows;
+ * there, it always returns `INVALID_SOCKET`.
+ *
+ * # Ownership
+ *
+ * The descriptor is owned by `pending`; it remains valid until `pending` is freed.
+ * The caller must not read from it, write to it, or close it.
+ */
+ArtiRpcRawSocket arti_rpc_pending_connect_get_pollable_fd(const ArtiRpcPendingConnect *pending);
+
+/**
+ * Return the connection from `pending`, if it is ready, without blocking.
+ *
+ * If the connection is ready, return `ARTI_RPC_STATUS_SUCCESS`,
+ * and set `*rpc_conn_out` to a new ArtiRpcConn.
+ *
+ * If we are still connecting, return `ARTI_RPC_STATUS_WOULD_BLOCK`,
+ * and set `*rpc_conn_out` to NULL.
+ *
+ * Otherwise return some other status code, set `*rpc_conn_out` to NULL,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * Once this function has returned `ARTI_RPC_STATUS_SUCCESS` or an error,
+ * `pending` is finished: further calls will give an error.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*rpc_conn_out` and `*error_out`,
+ * if set, are eventually freed.
+ */
+ArtiRpcStatus arti_rpc_pending_connect_finish(const ArtiRpcPendingConnect *pending,
+                                              ArtiRpcConn **rpc_conn_out,
+                                              ArtiRpcError **error_out);
+
+/**
+ * Wait until the connection from `pending` is ready, and return it.
+ *
+ * Behaves the same as `arti_rpc_pending_connect_finish`,
+ * except that it blocks until the connection is ready (or has failed),
+ * and never returns `ARTI_RPC_STATUS_WOULD_BLOCK`.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*rpc_conn_out` and `*error_out`,
+ * if set, are eventually freed.
+ */
+ArtiRpcStatus arti_rpc_pending_connect_wait(const ArtiRpcPendingConnect *pending,
+                                            ArtiRpcConn **rpc_conn_out,
+                                            ArtiRpcError **error_out);
+
+/**
+ * Release storage held by an `ArtiRpcPendingConnect`.
+ *
+ * If the connection has not yet been returned,
+ * it is closed once it is ready.
+ */
+void arti_rpc_pending_connect_free(ArtiRpcPendingConnect *pending);
+
+/**
+ * Try to open a new connection to an Arti instance, asking Arti to use `framing`
+ * once it has authenticated.
+ *
+ * Behaves the same as `arti_rpc_connect`, except for the framing:
+ * `framing` must be one of the `ARTI_RPC_FRAMING_*` constants.
+ * If Arti doesn't support the requested framing,
+ * the connection keeps using `ARTI_RPC_FRAMING_JSON_LINES`.
+ *
+ * The framing only affects how messages are sent between this library and Arti:
+ * requests and responses are always passed to and from the application as JSON strings.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*rpc_conn_out` and `*error_out`,
+ * if set, are eventually freed.
+ */
+ArtiRpcStatus arti_rpc_connect_with_framing(const char *connection_string,
+                                            ArtiRpcFraming framing,
+                                            ArtiRpcConn **rpc_conn_out,
+                                            ArtiRpcError **error_out);
+
 /**
  * Given a pointer to an RPC connection, return the object ID for its negotiated session.
  *
@@ -404,6 +783,30 @@ ArtiRpcStatus arti_rpc_conn_execute(const ArtiRpcConn *rpc_conn,
                                     ArtiRpcStr **response_out,
                                     ArtiRpcError **error_out);
 
+/**
+ * Run an RPC request over `rpc_conn`, and wait up to `timeout_ms` milliseconds
+ * for a successful response.
+ *
+ * Behaves as `arti_rpc_conn_execute`, except that Arti is told to give up on the
+ * request after `timeout_ms` milliseconds.
+ * If no response has arrived by then, this function cancels the request,
+ * and returns `ARTI_RPC_STATUS_TIMED_OUT`.
+ *
+ * The first call to this function on a connection starts a background thread
+ * to read responses from Arti.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_execute_with_timeout(const ArtiRpcConn *rpc_conn,
+                                                 const char *msg,
+                                                 uint64_t timeout_ms,
+                                                 ArtiRpcStr **response_out,
+                                                 ArtiRpcError **error_out);
+
 /**
  * Send an RPC request over `rpc_conn`, and return a handle that can wait for a successful response.
  *
@@ -429,105 +832,594 @@ ArtiRpcStatus arti_rpc_conn_execute_with_handle(const ArtiRpcConn *rpc_conn,
                                                 ArtiRpcError **error_out);
 
 /**
- * Wait until some response arrives on an arti_rpc_handle, or until an error occurs.
+ * Send a batch of RPC requests over `rpc_conn`,
+ * and return a handle for each one that can wait for a successful response.
  *
- * On success, return `ARTI_RPC_STATUS_SUCCESS`; set `*response_out`, if present, to a
- * newly allocated string, and set `*response_type_out`, to the type of the response.
- * (The type will be `ARTI_RPC_RESPONSE_TYPE_RESULT` if the response is a final result,
- * or `ARTI_RPC_RESPONSE_TYPE_ERROR` if the response is a final error,
- * or `ARTI_RPC_RESPONSE_TYPE_UPDATE` if the response is a non-final update.)
+ * `msgs` must point to an array of `n_msgs` strings,
+ * each of which should be a valid RPC request in JSON format.
+ * As with `arti_rpc_conn_execute_with_handle`, you can omit their `id` fields.
  *
- * Otherwise return some other status code, set `*response_out` to NULL,
- * set `*response_type_out` to zero,
- * and set `*error_out` (if provided) to a newly allocated error object.
+ * All of the requests are written to Arti at once:
+ * this is much more efficient than sending them one at a time.
  *
- * Note that receiving an error reply from Arti is _not_ treated as an error in this function.
- * That is to say, if Arti sends back an error, this function will return `ARTI_SUCCESS`,
- * and deliver the error from Arti in `*response_out`, setting `*response_type_out` to
- * `ARTI_RPC_RESPONSE_TYPE_ERROR`.
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`, and set each element of `handles_out`
+ * to a newly allocated `ArtiRpcHandle` for the corresponding request.
  *
- * It is safe to call this function on the same handle from multiple threads at once.
- * If you do, each response will be sent to exactly one thread.
- * It is unspecified which thread will receive which response or which error.
+ * Otherwise return some other status code, set every element of `handles_out` to NULL,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ * In this case, none of the requests are sent.
+ *
+ * (If `msgs` or `handles_out` is NULL, or any element of `msgs` is NULL,
+ * no request will be sent, and an error will be returned.)
  *
  * # Ownership
  *
  * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
  *
- * The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+ * The caller is responsible for making sure that every element of `handles_out`, if set,
+ * is eventually freed.
+ *
+ * # Correctness requirements
+ *
+ * `msgs` must point to an array of at least `n_msgs` valid pointers,
+ * and `handles_out` must point to an array with room for at least `n_msgs` pointers.
  */
-ArtiRpcStatus arti_rpc_handle_wait(const ArtiRpcHandle *handle,
-                                   ArtiRpcStr **response_out,
-                                   ArtiRpcResponseType *response_type_out,
-                                   ArtiRpcError **error_out);
+ArtiRpcStatus arti_rpc_conn_execute_batch(const ArtiRpcConn *rpc_conn,
+                                          const char *const *msgs,
+                                          size_t n_msgs,
+                                          ArtiRpcHandle **handles_out,
+                                          ArtiRpcError **error_out);
 
 /**
- * Release storage held by an `ArtiRpcHandle`.
+ * Start building an RPC request to invoke `method` on the object `obj`,
+ * without having to format it as JSON.
+ *
+ * Add parameters to the request with the `arti_rpc_request_set_param_*` functions,
+ * and send it with `arti_rpc_conn_submit`.
+ * A request can be sent any number of times, and reused with `arti_rpc_request_reset`:
+ * doing so avoids allocating a new request each time.
  *
- * NOTE, TODO: This does not cancel the request, but that is not guaranteed.
- * Once we implement cancellation, this may behave differently.
+ * On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*builder_out` to a newly allocated
+ * `ArtiRpcRequestBuilder`.
+ *
+ * Otherwise return some other status code, set `*builder_out` to NULL,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*builder_out`, if set,
+ * is eventually freed with `arti_rpc_request_free`.
  */
-void arti_rpc_handle_free(ArtiRpcHandle *handle);
+ArtiRpcStatus arti_rpc_request_new(const char *obj,
+                                   const char *method,
+                                   ArtiRpcRequestBuilder **builder_out,
+                                   ArtiRpcError **error_out);
 
 /**
- * Free a string returned by the Arti RPC API.
+ * Discard every parameter of the request in `builder`,
+ * and make it into a request to invoke `method` on the object `obj`.
+ *
+ * This reuses the storage that `builder` already holds.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code, and set `*error_out` (if provided)
+ * to a newly allocated error object; in this case, `builder` is unchanged.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
  */
-void arti_rpc_str_free(ArtiRpcStr *string);
+ArtiRpcStatus arti_rpc_request_reset(const ArtiRpcRequestBuilder *builder,
+                                     const char *obj,
+                                     const char *method,
+                                     ArtiRpcError **error_out);
 
 /**
- * Return a const pointer to the underlying nul-terminated string from an `ArtiRpcStr`.
+ * Set the parameter called `name` to the string `value`,
+ * in the request in `builder`.
  *
- * The resulting string is guaranteed to be valid UTF-8.
+ * If the parameter was already set, this replaces its old value.
  *
- * (Returns NULL if the input is NULL.)
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code, and set `*error_out` (if provided)
+ * to a newly allocated error object; in this case, `builder` is unchanged.
  *
- * # Correctness requirements
+ * # Ownership
  *
- * The resulting string pointer is valid only for as long as the input `string` is not freed.
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
  */
-const char *arti_rpc_str_get(const ArtiRpcStr *string);
+ArtiRpcStatus arti_rpc_request_set_param_str(const ArtiRpcRequestBuilder *builder,
+                                             const char *name,
+                                             const char *value,
+                                             ArtiRpcError **error_out);
 
 /**
- * Close and free an open Arti RPC connection.
+ * Set the parameter called `name` to the integer `value`,
+ * in the request in `builder`.
+ *
+ * Note that values larger than `±2^53-1` may not work with all JSON implementations.
+ *
+ * Otherwise as for `arti_rpc_request_set_param_str`.
  */
-void arti_rpc_conn_free(ArtiRpcConn *rpc_conn);
+ArtiRpcStatus arti_rpc_request_set_param_int(const ArtiRpcRequestBuilder *builder,
+                                             const char *name,
+                                             int64_t value,
+                                             ArtiRpcError **error_out);
 
 /**
- * Try to open an anonymized data stream over Arti.
+ * Set the parameter called `name` to the boolean `value`,
+ * in the request in `builder`.
  *
- * Use the proxy information associated with `rpc_conn` to make the stream,
- * and store the resulting fd (or `SOCKET` on Windows) into `*socket_out`.
- *
- * The stream will target the address `hostname`:`port`.
+ * Any nonzero `value` is true.
  *
- * If `on_object` is provided, it is an `ObjectId` for client-like object
- * (such as a Session or a Client)
- * that should be used to make the stream.
+ * Otherwise as for `arti_rpc_request_set_param_str`.
+ */
+ArtiRpcStatus arti_rpc_request_set_param_bool(const ArtiRpcRequestBuilder *builder,
+                                              const char *name,
+                                              int value,
+                                              ArtiRpcError **error_out);
+
+/**
+ * Send the request in `builder` over `rpc_conn`,
+ * and return a handle that can wait for a successful response.
  *
- * The resulting stream will be configured
- * not to share a circuit with any other stream
- * having a different `isolation`.
- * (If your application doesn't care about isolating its streams from one another,
- * it is acceptable to leave `isolation` as an empty string.)
+ * The request is given a newly generated ID.
+ * Since it was built with `ArtiRpcRequestBuilder`, it needs no validation,
+ * and this is cheaper than `arti_rpc_conn_execute_with_handle`.
+ * `builder` is unchanged, and can be sent again.
  *
- * If `stream_id_out` is provided,
- * the resulting stream will have an identifier within the RPC system,
- * so that you can run other RPC commands on it.
+ * On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*handle_out` to a newly allocated `ArtiRpcHandle`.
  *
- * On success, return `ARTI_RPC_STATUS_SUCCESS`.
- * Otherwise return some other status code, set `*socket_out` to -1
- * (or `INVALID_SOCKET` on Windows),
+ * Otherwise return some other status code, set `*handle_out` to NULL,
  * and set `*error_out` (if provided) to a newly allocated error object.
  *
- * # Caveats
+ * # Ownership
  *
- * When possible, use a hostname rather than an IP address.
- * If you *must* use an IP address, make sure that you have not gotten it
- * by a non-anonymous DNS lookup.
- * (Calling `gethostname()` or `getaddrinfo()` directly
- * would lose anonymity: they inform the user's DNS server,
- * and possibly many other parties, about the target address
- * you are trying to visit.)
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*handle_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_submit(const ArtiRpcConn *rpc_conn,
+                                   const ArtiRpcRequestBuilder *builder,
+                                   ArtiRpcHandle **handle_out,
+                                   ArtiRpcError **error_out);
+
+/**
+ * Release storage held by an `ArtiRpcRequestBuilder`.
+ */
+void arti_rpc_request_free(ArtiRpcRequestBuilder *builder);
+
+/**
+ * Send an RPC request over `rpc_conn`, and arrange for `callback` to receive every response.
+ *
+ * The message `msg` should be a valid RPC request in JSON format.
+ * If you omit its `id` field, one will be generated: this is typically the best way to use this function.
+ *
+ * `callback` is invoked once for every update, and once for the final result or error,
+ * from whichever thread is reading from `rpc_conn` when the response arrives.
+ * That is usually a background thread that this library uses to read from `rpc_conn`,
+ * but it can also be any of your threads that is waiting for a response on `rpc_conn`.
+ * If the connection fails before a final response arrives,
+ * `callback` is instead invoked once to report the failure.
+ * After a final response or a failure, `callback` is never invoked again.
+ * See `ArtiRpcResponseCallback` for details of its arguments.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code, and set `*error_out` (if provided)
+ * to a newly allocated error object; in this case, `callback` is never invoked.
+ *
+ * # Correctness requirements
+ *
+ * `callback` and `user_data` must be safe to use from any thread,
+ * and `user_data` must remain valid until `callback` has received a final response or a failure.
+ *
+ * `callback` must not block for long: no other responses on `rpc_conn`
+ * can be delivered while it is running.
+ * It may send other requests on `rpc_conn`,
+ * but it must not wait for their responses
+ * (as `arti_rpc_conn_execute` or `arti_rpc_handle_wait` would):
+ * doing so would deadlock.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_execute_with_callback(const ArtiRpcConn *rpc_conn,
+                                                  const char *msg,
+                                                  ArtiRpcResponseCallback callback,
+                                                  void *user_data,
+                                                  ArtiRpcError **error_out);
+
+/**
+ * Wait until some response arrives on an arti_rpc_handle, or until an error occurs.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`; set `*response_out`, if present, to a
+ * newly allocated string, and set `*response_type_out`, to the type of the response.
+ * (The type will be `ARTI_RPC_RESPONSE_TYPE_RESULT` if the response is a final result,
+ * or `ARTI_RPC_RESPONSE_TYPE_ERROR` if the response is a final error,
+ * or `ARTI_RPC_RESPONSE_TYPE_UPDATE` if the response is a non-final update.)
+ *
+ * Otherwise return some other status code, set `*response_out` to NULL,
+ * set `*response_type_out` to zero,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * Note that receiving an error reply from Arti is _not_ treated as an error in this function.
+ * That is to say, if Arti sends back an error, this function will return `ARTI_SUCCESS`,
+ * and deliver the error from Arti in `*response_out`, setting `*response_type_out` to
+ * `ARTI_RPC_RESPONSE_TYPE_ERROR`.
+ *
+ * It is safe to call this function on the same handle from multiple threads at once.
+ * If you do, each response will be sent to exactly one thread.
+ * It is unspecified which thread will receive which response or which error.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_handle_wait(const ArtiRpcHandle *handle,
+                                   ArtiRpcStr **response_out,
+                                   ArtiRpcResponseType *response_type_out,
+                                   ArtiRpcError **error_out);
+
+/**
+ * Wait up to `timeout_ms` milliseconds for some response to arrive on an arti_rpc_handle.
+ *
+ * If a response arrives in time, behave as `arti_rpc_handle_wait`.
+ *
+ * If no response arrives in time, return `ARTI_RPC_STATUS_TIMED_OUT`,
+ * set `*response_out` to NULL, set `*response_type_out` to zero,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ * The request is not cancelled: you can wait for it again,
+ * or cancel it with `arti_rpc_handle_cancel`.
+ *
+ * The first time this function is called on any handle for a given connection,
+ * the connection starts a background thread to read responses from Arti.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_handle_wait_timeout(const ArtiRpcHandle *handle,
+                                           uint64_t timeout_ms,
+                                           ArtiRpcStr **response_out,
+                                           ArtiRpcResponseType *response_type_out,
+                                           ArtiRpcError **error_out);
+
+/**
+ * Check whether some response has arrived on an arti_rpc_handle, without blocking.
+ *
+ * If a response is ready, behave as `arti_rpc_handle_wait`:
+ * return `ARTI_RPC_STATUS_SUCCESS`; set `*response_out`, if present, to a
+ * newly allocated string, and set `*response_type_out`, to the type of the response.
+ *
+ * If no response is ready yet, return `ARTI_RPC_STATUS_WOULD_BLOCK`,
+ * set `*response_out` to NULL, set `*response_type_out` to zero,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * Otherwise return some other status code, as `arti_rpc_handle_wait` would.
+ *
+ * The first time this function is called on any handle for a given connection,
+ * the connection starts a background thread to read responses from Arti.
+ * To find out when this function is worth calling again,
+ * use `arti_rpc_conn_get_pollable_fd`.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_handle_try_wait(const ArtiRpcHandle *handle,
+                                       ArtiRpcStr **response_out,
+                                       ArtiRpcResponseType *response_type_out,
+                                       ArtiRpcError **error_out);
+
+/**
+ * Get a file descriptor that becomes readable whenever some response is ready on `rpc_conn`.
+ *
+ * Applications that run an event loop can add this descriptor to their `poll()` set
+ * (or equivalent), and call `arti_rpc_handle_try_wait` on their outstanding handles
+ * once it becomes readable.
+ * The descriptor is level-triggered: it remains readable
+ * for as long as any response is waiting to be taken,
+ * or after the connection has failed.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*fd_out` to the descriptor.
+ * Otherwise return some other status code, set `*fd_out` to -1,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * This function is not yet supported on Windows;
+ * there, it always returns `ARTI_RPC_STATUS_NOT_SUPPORTED`.
+ *
+ * # Ownership
+ *
+ * The descriptor is owned by `rpc_conn`; it remains valid at least until `rpc_conn` is freed.
+ * The caller must not read from it, write to it, or close it.
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_get_pollable_fd(const ArtiRpcConn *rpc_conn,
+                                            ArtiRpcRawSocket *fd_out,
+                                            ArtiRpcError **error_out);
+
+/**
+ * Launch a dedicated background thread to read responses on `rpc_conn`,
+ * if one is not already running.
+ *
+ * By default, threads that are waiting for responses take turns reading from the connection.
+ * Applications with a large number of concurrent requests per connection
+ * should call this function once, right after connecting:
+ * afterwards, a single thread reads every response
+ * and hands it directly to whoever is waiting for it.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_launch_background_reader(const ArtiRpcConn *rpc_conn,
+                                                     ArtiRpcError **error_out);
+
+/**
+ * Fill `*stats_out` with statistics about the activity on `rpc_conn`.
+ *
+ * The counters are maintained without locking,
+ * so collecting these statistics costs almost nothing,
+ * and calling this function does not slow down other threads' requests.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code, set every field of `*stats_out` to zero,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_get_stats(const ArtiRpcConn *rpc_conn,
+                                      ArtiRpcConnStats *stats_out,
+                                      ArtiRpcError **error_out);
+
+/**
+ * Set the limits on how many responses `rpc_conn` will queue for the application,
+ * and what to do when a response would exceed them.
+ *
+ * `max_request_msgs` and `max_request_bytes` limit the number of responses,
+ * and their total length, that are queued for any single request.
+ * `max_conn_bytes` limits the total length of the responses queued for the whole connection.
+ * A limit of zero means that there is no limit.
+ * (An empty queue always has room for one response, whatever the limits.)
+ *
+ * `policy` must be one of the `ARTI_RPC_OVERFLOW_*` constants.
+ * Only updates are ever held back, discarded, or counted as an overflow:
+ * a final response is always queued.
+ * Responses for requests sent with `arti_rpc_conn_execute_with_callback` are never counted.
+ *
+ * The new limits replace any previous ones, and apply to every response that arrives from now on.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_set_queue_limits(const ArtiRpcConn *rpc_conn,
+                                             size_t max_request_msgs,
+                                             size_t max_request_bytes,
+                                             size_t max_conn_bytes,
+                                             ArtiRpcOverflowPolicy policy,
+                                             ArtiRpcError **error_out);
+
+/**
+ * Install `hook` to be told about every step in the life of each request on `rpc_conn`.
+ *
+ * See `ArtiRpcTraceHook` for its arguments,
+ * and the `ARTI_RPC_TRACE_EVENT_*` constants for the events it receives.
+ *
+ * A connection can have only one trace hook, and it can't be removed.
+ * When no hook is installed, tracing costs no more than checking for a hook.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code (`ARTI_RPC_STATUS_INVALID_INPUT`
+ * if `rpc_conn` already has a trace hook),
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Correctness requirements
+ *
+ * `hook` and `user_data` must be safe to use from several threads at once,
+ * and `user_data` must remain valid for as long as `rpc_conn` exists.
+ *
+ * `hook` is called from whichever thread caused each event,
+ * including the thread that is reading responses from Arti,
+ * without holding any of this library's locks.
+ * It should return quickly,
+ * and it must not wait for any response on `rpc_conn`.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_set_trace_hook(const ArtiRpcConn *rpc_conn,
+                                           ArtiRpcTraceHook hook,
+                                           void *user_data,
+                                           ArtiRpcError **error_out);
+
+/**
+ * Ask Arti to cancel the request associated with `handle`, which must belong to `rpc_conn`.
+ *
+ * If Arti cancels the request, its final response will be an error;
+ * it may also finish in some other way before Arti can cancel it.
+ * Either way, you can still wait on `handle` for that final response.
+ * Any updates for the request that have not yet been received are discarded,
+ * as are any that arrive later.
+ *
+ * If the request has already received its final response, this function has no effect.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_handle_cancel(const ArtiRpcConn *rpc_conn,
+                                     const ArtiRpcHandle *handle,
+                                     ArtiRpcError **error_out);
+
+/**
+ * Release storage held by an `ArtiRpcHandle`.
+ *
+ * This does not cancel the request: use `arti_rpc_handle_cancel` for that.
+ *
+ * Any responses that have arrived for the request, but have not been received,
+ * are discarded, as are any that arrive later.
+ */
+void arti_rpc_handle_free(ArtiRpcHandle *handle);
+
+/**
+ * Free a string returned by the Arti RPC API.
+ */
+void arti_rpc_str_free(ArtiRpcStr *string);
+
+/**
+ * Return a const pointer to the underlying nul-terminated string from an `ArtiRpcStr`.
+ *
+ * The resulting string is guaranteed to be valid UTF-8.
+ *
+ * (Returns NULL if the input is NULL.)
+ *
+ * # Correctness requirements
+ *
+ * The resulting string pointer is valid only for as long as the input `string` is not freed.
+ */
+const char *arti_rpc_str_get(const ArtiRpcStr *string);
+
+/**
+ * Return the length of the underlying string from an `ArtiRpcStr`, in bytes.
+ *
+ * The length does not include the terminating nul.
+ * Unlike `strlen()`, this function takes constant time.
+ *
+ * (Returns 0 if the input is NULL.)
+ */
+size_t arti_rpc_str_len(const ArtiRpcStr *string);
+
+/**
+ * Find a single value within the JSON text held in an `ArtiRpcStr`,
+ * without decoding the rest of it.
+ *
+ * The value is named by `pointer`, a JSON pointer as described in RFC 6901:
+ * for example, `"/result/id"` names the `id` field of a response's `result` object,
+ * and `"/result/list/0"` names the first element of its `list` array.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`;
+ * set `*value_out` to a pointer to the start of the value's JSON encoding within `string`,
+ * and set `*len_out` to its length in bytes.
+ * For example, if the value is a JSON string, it will begin and end with a quotation mark,
+ * and any escapes within it are left as they are.
+ * If there is no such value, set `*value_out` to NULL and `*len_out` to zero.
+ *
+ * Otherwise return some other status code, set `*value_out` to NULL,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The returned value is borrowed from `string`, and is **not** nul-terminated.
+ * It becomes invalid as soon as `string` is freed.
+ * The caller must not modify or free it.
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_str_get_json_pointer(const ArtiRpcStr *string,
+                                            const char *pointer,
+                                            const char **value_out,
+                                            size_t *len_out,
+                                            ArtiRpcError **error_out);
+
+/**
+ * Find the `result` object within a response held in an `ArtiRpcStr`.
+ *
+ * Behaves as `arti_rpc_str_get_json_pointer` with the pointer `"/result"`:
+ * if `response` has a `result` field, set `*value_out` and `*len_out` to
+ * the location and length of its value within `response`.
+ * If `response` is not a successful response, set `*value_out` to NULL and `*len_out` to zero.
+ *
+ * # Ownership
+ *
+ * As for `arti_rpc_str_get_json_pointer`.
+ */
+ArtiRpcStatus arti_rpc_response_get_result(const ArtiRpcStr *response,
+                                           const char **value_out,
+                                           size_t *len_out,
+                                           ArtiRpcError **error_out);
+
+/**
+ * Find the `update` object within a response held in an `ArtiRpcStr`.
+ *
+ * Behaves as `arti_rpc_response_get_result`, but for the `update` field
+ * of a non-final response.
+ *
+ * # Ownership
+ *
+ * As for `arti_rpc_str_get_json_pointer`.
+ */
+ArtiRpcStatus arti_rpc_response_get_update(const ArtiRpcStr *response,
+                                           const char **value_out,
+                                           size_t *len_out,
+                                           ArtiRpcError **error_out);
+
+/**
+ * Close and free an open Arti RPC connection.
+ */
+void arti_rpc_conn_free(ArtiRpcConn *rpc_conn);
+
+/**
+ * Try to open an anonymized data stream over Arti.
+ *
+ * Use the proxy information associated with `rpc_conn` to make the stream,
+ * and store the resulting fd (or `SOCKET` on Windows) into `*socket_out`.
+ *
+ * The stream will target the address `hostname`:`port`.
+ *
+ * If `on_object` is provided, it is an `ObjectId` for client-like object
+ * (such as a Session or a Client)
+ * that should be used to make the stream.
+ *
+ * The resulting stream will be configured
+ * not to share a circuit with any other stream
+ * having a different `isolation`.
+ * (If your application doesn't care about isolating its streams from one another,
+ * it is acceptable to leave `isolation` as an empty string.)
+ *
+ * If `stream_id_out` is provided,
+ * the resulting stream will have an identifier within the RPC system,
+ * so that you can run other RPC commands on it.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code, set `*socket_out` to -1
+ * (or `INVALID_SOCKET` on Windows),
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Caveats
+ *
+ * When possible, use a hostname rather than an IP address.
+ * If you *must* use an IP address, make sure that you have not gotten it
+ * by a non-anonymous DNS lookup.
+ * (Calling `gethostname()` or `getaddrinfo()` directly
+ * would lose anonymity: they inform the user's DNS server,
+ * and possibly many other parties, about the target address
+ * you are trying to visit.)
  *
  * The resulting socket will actually be a TCP connection to Arti,
  * not directly to your destination.
@@ -562,6 +1454,291 @@ ArtiRpcStatus arti_rpc_conn_open_stream(const ArtiRpcConn *rpc_conn,
                                         ArtiRpcStr **stream_id_out,
                                         ArtiRpcError **error_out);
 
+/**
+ * Begin opening a new data stream through Arti, without waiting for it to connect.
+ *
+ * Behaves the same as `arti_rpc_conn_open_stream`, except that
+ * instead of waiting for Arti to report whether the stream has connected,
+ * this function returns as soon as the stream has been requested.
+ * It sets `*pending_out` to a newly allocated `ArtiRpcPendingStream`,
+ * which you can use to wait for the stream without blocking,
+ * alongside as many other pending streams as you like.
+ *
+ * To do so, get the pending stream's socket with `arti_rpc_pending_stream_get_socket`,
+ * and wait until it is readable
+ * (or writable, if `arti_rpc_pending_stream_wants_write` returns 1),
+ * using `poll()` or an equivalent.
+ * Then call `arti_rpc_pending_stream_advance`,
+ * which returns `ARTI_RPC_STATUS_WOULD_BLOCK` if you need to wait again.
+ *
+ * (This function may still block briefly:
+ * it may need to ask Arti for its SOCKS address,
+ * it connects to that address on the local host,
+ * and if `stream_id_out` is provided, it asks Arti for a new stream ID.)
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code, set `*pending_out` to NULL,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that
+ * `*pending_out`, `*stream_id_out`, and `*error_out`, if set,
+ * are eventually freed.
+ *
+ * If `stream_id_out` is provided and this function succeeds,
+ * the caller is responsible for releasing the ObjectId,
+ * whether or not the stream eventually connects.
+ */
+ArtiRpcStatus arti_rpc_conn_open_stream_nonblocking(const ArtiRpcConn *rpc_conn,
+                                                    const char *hostname,
+                                                    int port,
+                                                    const char *on_object,
+                                                    const char *isolation,
+                                                    ArtiRpcPendingStream **pending_out,
+                                                    ArtiRpcStr **stream_id_out,
+                                                    ArtiRpcError **error_out);
+
+/**
+ * Open several new data streams through Arti at once.
+ *
+ * Behaves like calling `arti_rpc_conn_open_stream` once for each of the `n_streams` entries
+ * in `hostnames`, `ports`, and `isolations`, except that
+ * all of the stream IDs (if requested) are obtained with a single batch of requests,
+ * and the SOCKS handshakes for the streams are performed in parallel.
+ * All of the streams are opened relative to `on_object`, if provided.
+ *
+ * If we were able to try opening the streams,
+ * return `ARTI_RPC_STATUS_SUCCESS`, even if some of the streams failed,
+ * and fill in each element of the output arrays, as follows:
+ *
+ * - If the corresponding stream was opened successfully,
+ *   set its element of `statuses_out` to `ARTI_RPC_STATUS_SUCCESS`,
+ *   its element of `sockets_out` to the stream's fd (or `SOCKET` on Windows),
+ *   and its element of `stream_ids_out` (if provided) to a newly allocated
+ *   `ArtiRpcStr` holding the stream's ObjectId.
+ * - Otherwise, set its element of `statuses_out` to some other status code,
+ *   its element of `sockets_out` to -1 (or `INVALID_SOCKET` on Windows),
+ *   its element of `stream_ids_out` (if provided) to NULL,
+ *   and its element of `errors_out` (if provided) to a newly allocated error object.
+ *   (The stream's ObjectId, if any, has already been released.)
+ *
+ * Otherwise return some other status code,
+ * set every element of `statuses_out` to that status code,
+ * set every element of `sockets_out` to -1 (or `INVALID_SOCKET` on Windows),
+ * set every element of `stream_ids_out` and `errors_out` (if provided) to NULL,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed,
+ * and that every non-NULL element of `stream_ids_out` and `errors_out` is eventually freed.
+ *
+ * The caller is responsible for making sure that every valid element of `sockets_out`
+ * is eventually closed.
+ *
+ * If `stream_ids_out` is provided, the caller is responsible for releasing
+ * every ObjectId that it receives, perhaps with `arti_rpc_conn_release_objects`.
+ *
+ * # Correctness requirements
+ *
+ * `hostnames`, `ports`, and `isolations` must each point to an array of at least `n_streams`
+ * elements; no element of `hostnames` or `isolations` may be NULL.
+ *
+ * `sockets_out`, `statuses_out`, and (if provided) `stream_ids_out` and `errors_out`
+ * must each point to an array with room for at least `n_streams` elements.
+ */
+ArtiRpcStatus arti_rpc_conn_open_streams(const ArtiRpcConn *rpc_conn,
+                                         size_t n_streams,
+                                         const char *const *hostnames,
+                                         const int *ports,
+                                         const char *on_object,
+                                         const char *const *isolations,
+                                         ArtiRpcRawSocket *sockets_out,
+                                         ArtiRpcStr **stream_ids_out,
+                                         ArtiRpcStatus *statuses_out,
+                                         ArtiRpcError **errors_out,
+                                         ArtiRpcError **error_out);
+
+/**
+ * Tell Arti to release every one of the `n_objects` ObjectIds in `objects`,
+ * using a single batch of requests.
+ *
+ * Releasing an ObjectId tells Arti that we no longer intend to refer to it:
+ * see `rpc:release` in the RPC specification.
+ * Every release is attempted, even if some of them fail.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise (if any release failed) return some other status code,
+ * and set `*error_out` (if provided) to a newly allocated error object
+ * describing the first failure.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * # Correctness requirements
+ *
+ * `objects` must point to an array of at least `n_objects` valid pointers.
+ */
+ArtiRpcStatus arti_rpc_conn_release_objects(const ArtiRpcConn *rpc_conn,
+                                            const char *const *objects,
+                                            size_t n_objects,
+                                            ArtiRpcError **error_out);
+
+/**
+ * Return the socket for a pending stream, so that the caller can wait for it to become ready.
+ *
+ * Return -1 (or `INVALID_SOCKET` on Windows) if `pending` is NULL,
+ * or if `arti_rpc_pending_stream_advance` has already finished it.
+ *
+ * # Ownership
+ *
+ * The socket is owned by `pending`:
+ * the caller must not read from it, write to it, or close it.
+ * It remains valid until `arti_rpc_pending_stream_advance` finishes `pending`,
+ * or until `pending` is freed.
+ */
+ArtiRpcRawSocket arti_rpc_pending_stream_get_socket(const ArtiRpcPendingStream *pending);
+
+/**
+ * Return 1 if a pending stream is waiting for its socket to become writable,
+ * and 0 if it is waiting for its socket to become readable (or if `pending` is NULL).
+ */
+int arti_rpc_pending_stream_wants_write(const ArtiRpcPendingStream *pending);
+
+/**
+ * Make as much progress on opening a pending stream as possible, without blocking.
+ *
+ * If the stream has opened successfully, return `ARTI_RPC_STATUS_SUCCESS`,
+ * and store its fd (or `SOCKET` on Windows) into `*socket_out`.
+ * The socket is still in nonblocking mode.
+ *
+ * If the stream is still opening, return `ARTI_RPC_STATUS_WOULD_BLOCK`,
+ * and set `*socket_out` to -1 (or `INVALID_SOCKET` on Windows).
+ * The caller should wait for the stream's socket to become ready, and try again.
+ *
+ * Otherwise return some other status code, set `*socket_out` to -1
+ * (or `INVALID_SOCKET` on Windows),
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * Once this function has returned `ARTI_RPC_STATUS_SUCCESS` or an error,
+ * `pending` is finished: further calls will give an error.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ *
+ * The caller is responsible for making sure that `*socket_out`, if set,
+ * is eventually closed.
+ */
+ArtiRpcStatus arti_rpc_pending_stream_advance(const ArtiRpcPendingStream *pending,
+                                              ArtiRpcRawSocket *socket_out,
+                                              ArtiRpcError **error_out);
+
+/**
+ * Release storage held by an `ArtiRpcPendingStream`.
+ *
+ * If the stream has not yet been returned by `arti_rpc_pending_stream_advance`,
+ * its socket is closed.
+ */
+void arti_rpc_pending_stream_free(ArtiRpcPendingStream *pending);
+
+/**
+ * Ask Arti again for the proxy information associated with `rpc_conn`.
+ *
+ * Ordinarily, there is no need to call this function:
+ * `arti_rpc_conn_open_stream` looks up Arti's SOCKS address the first time it is called,
+ * remembers it, and looks it up again whenever it can no longer connect to it.
+ * Call this function if you know that Arti's proxy configuration has changed.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_refresh_proxy_info(const ArtiRpcConn *rpc_conn,
+                                               ArtiRpcError **error_out);
+
+/**
+ * Keep up to `depth` connections to Arti's SOCKS proxy open and ready,
+ * so that `arti_rpc_conn_open_stream` can use them without waiting.
+ *
+ * Each pooled connection has already done the initial part of the SOCKS handshake,
+ * so that opening a stream on it only requires sending the final request.
+ * The pool is refilled in the background whenever a connection is taken from it.
+ *
+ * If a pool is already enabled on `rpc_conn`, or `depth` is 0, this function does nothing.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS`.
+ * Otherwise return some other status code,
+ * and set `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+ */
+ArtiRpcStatus arti_rpc_conn_enable_socks_pool(const ArtiRpcConn *rpc_conn,
+                                              size_t depth,
+                                              ArtiRpcError **error_out);
+
+/**
+ * Try to open `n_conns` new connections to an Arti instance, as a pool.
+ *
+ * The location of the instance and the method to connect to it are described in
+ * `connection_string`, as for `arti_rpc_connect`.
+ * Each connection is authenticated separately, and negotiates its own session.
+ * If `n_conns` is 0, a single connection is opened.
+ *
+ * On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*pool_out` to a new ArtiRpcConnPool.
+ * Otherwise return some other status code, set `*pool_out` to NULL, and set
+ * `*error_out` (if provided) to a newly allocated error object.
+ *
+ * # Ownership
+ *
+ * The caller is responsible for making sure that `*pool_out` and `*error_out`,
+ * if set, are eventually freed.
+ */
+ArtiRpcStatus arti_rpc_connect_pool(const char *connection_string,
+                                    size_t n_conns,
+                                    ArtiRpcConnPool **pool_out,
+                                    ArtiRpcError **error_out);
+
+/**
+ * Return the connection in `pool` that currently has the fewest outstanding requests.
+ *
+ * (Returns NULL if `pool` is NULL.)
+ *
+ * Object IDs are only meaningful on the connection that created them:
+ * if a request refers to an object that you got from an earlier request,
+ * you must send it on the same connection as that earlier request.
+ *
+ * # Ownership
+ *
+ * The resulting connection belongs to `pool`:
+ * it lives for no longer than `pool`, and you must not free it with `arti_rpc_conn_free`.
+ */
+const ArtiRpcConn *arti_rpc_conn_pool_get(const ArtiRpcConnPool *pool);
+
+/**
+ * Return the number of connections in `pool`.
+ *
+ * (Returns 0 if `pool` is NULL.)
+ */
+size_t arti_rpc_conn_pool_len(const ArtiRpcConnPool *pool);
+
+/**
+ * Close and free every connection in an `ArtiRpcConnPool`.
+ *
+ * # Correctness requirements
+ *
+ * No connection from `arti_rpc_conn_pool_get` may be used after this function is called.
+ */
+void arti_rpc_conn_pool_free(ArtiRpcConnPool *pool);
+
 /**
  * Return a string representing the meaning of a given `ArtiRpcStatus`.
  *
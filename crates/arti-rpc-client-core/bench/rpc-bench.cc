@@ -0,0 +1,855 @@
+// Benchmarks for the C API of arti-rpc-client-core.
+//
+// This program drives the API in arti-rpc-client-core.h against a mock
+// Arti: a thread in this process that speaks just enough of the RPC
+// protocol (over a Unix socket, with JSON-lines framing) and of SOCKS5 to
+// keep the client library busy.  Because the mock does no real work, the
+// numbers it reports measure the overhead of the client library itself,
+// plus whatever artificial latency you ask the mock to add.
+//
+// To build it (on a Unix-like system, from this directory):
+//
+//     cargo build --release -p arti-rpc-client-core --features full
+//     c++ -O2 -std=c++17 -I.. -o rpc-bench rpc-bench.cc
+//         -L../../../target/release -larti_rpc_client_core -lpthread
+//
+// (The second and third lines above are a single command.)
+//
+// To run it:
+//
+//     LD_LIBRARY_PATH=../../../target/release ./rpc-bench [OPTIONS]
+//
+// Options:
+//
+//     --bench NAME[,NAME...]  Which benchmarks to run.  (Default: all of
+//                             execute,pipeline,threads,stream)
+//     --iterations N          Requests to send in each benchmark. (10000)
+//     --latency-us N          Delay before the mock answers each request
+//                             with its final result. (0)
+//     --connect-latency-us N  Delay before the mock answers each request
+//                             to authenticate or for proxy info. (0)
+//     --updates N             Updates to send before each final result. (0)
+//     --payload N             Bytes of padding in each final result. (0)
+//     --depth N               Requests in flight at once, for "pipeline",
+//                             or connections opened at once, for
+//                             "connect_async". (16)
+//     --threads N             Waiting threads, for "threads". (4)
+//     --background-reader     Launch a background reader on each connection.
+//     --trace                 Install a trace hook on each connection, and
+//                             report where each request spent its time.
+//
+// The benchmarks are:
+//
+//     execute   arti_rpc_conn_execute, one request at a time.
+//     pipeline  arti_rpc_conn_execute_with_handle with up to --depth requests
+//               outstanding, waiting on each handle with arti_rpc_handle_wait.
+//     threads   arti_rpc_conn_execute from --threads threads at once,
+//               all sharing one connection.
+//     submit    arti_rpc_conn_submit, one request at a time, reusing a single
+//               ArtiRpcRequestBuilder instead of formatting JSON.
+//     stream    arti_rpc_conn_open_stream, through the mock SOCKS5 proxy.
+//     connect   arti_rpc_connect, followed by arti_rpc_conn_open_stream on
+//               the new connection, one connection at a time.
+//     connect_async
+//               arti_rpc_connect_async for --depth connections at once,
+//               followed by arti_rpc_conn_open_stream on each as it becomes
+//               ready.  (Neither "connect" benchmark runs by default.)
+//
+// For each benchmark, we write a single line of JSON to stdout, giving the
+// configuration, the throughput in operations per second, and the 50th,
+// 99th, and 99.9th percentile latency of a single operation in
+// microseconds.  Errors go to stderr.
+//
+// With --trace, each line also gives the mean time that a request spent
+// being written ("trace_write_us"), waiting for Arti ("trace_arti_us"), and
+// being handed from the reader to its waiter ("trace_handoff_us").
+//
+// This is not meant to be used for anything but measuring Arti.
+
+#include "arti-rpc-client-core.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Configuration for the mock and for the benchmarks.
+struct Options {
+  std::vector<std::string> benches = {"execute", "pipeline", "threads",
+                                      "submit", "stream"};
+  unsigned long iterations = 10000;
+  unsigned long latency_us = 0;
+  unsigned long connect_latency_us = 0;
+  unsigned long updates = 0;
+  unsigned long payload = 0;
+  unsigned long depth = 16;
+  unsigned long threads = 4;
+  bool background_reader = false;
+  bool trace = false;
+  // Where the mock Arti is listening.  (Not an option; set once it exists.)
+  std::string connect_string;
+};
+
+[[noreturn]] void
+die(const std::string &msg)
+{
+  fprintf(stderr, "rpc-bench: %s\n", msg.c_str());
+  exit(1);
+}
+
+// Exit with a message if `status` is not a success; free `err`.
+void
+check(ArtiRpcStatus status, ArtiRpcError *err, const char *what)
+{
+  if (status == ARTI_RPC_STATUS_SUCCESS)
+    return;
+  std::string msg = std::string(what) + ": " + arti_rpc_status_to_str(status);
+  if (err) {
+    msg += ": ";
+    msg += arti_rpc_err_message(err);
+    arti_rpc_err_free(err);
+  }
+  die(msg);
+}
+
+// Write all of `data` to `fd`; return false on failure.
+bool
+write_all(int fd, const char *data, size_t len)
+{
+  while (len) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Read exactly `len` bytes from `fd`; return false on failure.
+bool
+read_all(int fd, void *out, size_t len)
+{
+  char *p = static_cast<char *>(out);
+  while (len) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Return the raw JSON text of the value of the first member called `key`
+// in `json`, or an empty string.
+//
+// This is nowhere near a real JSON parser: it only needs to understand the
+// requests that the client library sends, which it encodes compactly and
+// with "id" before everything else.
+std::string
+raw_member(const std::string &json, const char *key)
+{
+  std::string needle = std::string("\"") + key + "\":";
+  size_t pos = json.find(needle);
+  if (pos == std::string::npos)
+    return "";
+  pos += needle.size();
+  size_t end = pos;
+  if (json[pos] == '"') {
+    for (end = pos + 1; end < json.size() && json[end] != '"'; ++end) {
+      if (json[end] == '\\')
+        ++end;
+    }
+    ++end;
+  } else {
+    end = json.find_first_of(",}", pos);
+  }
+  return json.substr(pos, end - pos);
+}
+
+// A mock SOCKS5 proxy that accepts every connection it is asked for.
+class MockSocks {
+ public:
+  MockSocks()
+  {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener_ < 0 ||
+        bind(listener_, reinterpret_cast<sockaddr *>(&addr), len) < 0 ||
+        listen(listener_, 128) < 0 ||
+        getsockname(listener_, reinterpret_cast<sockaddr *>(&addr), &len) < 0)
+      die("can't open mock SOCKS listener");
+    port_ = ntohs(addr.sin_port);
+    std::thread([this] { accept_loop(); }).detach();
+  }
+
+  unsigned short port() const { return port_; }
+
+ private:
+  void accept_loop()
+  {
+    for (;;) {
+      int fd = accept(listener_, nullptr, nullptr);
+      if (fd < 0)
+        return;
+      std::thread([fd] { serve(fd); }).detach();
+    }
+  }
+
+  // Answer a single SOCKS5 handshake with username/password authentication,
+  // then wait for the client to close the connection.
+  static void serve(int fd)
+  {
+    unsigned char buf[256];
+    unsigned char len;
+    static const unsigned char choose_auth[] = {5, 2};
+    static const unsigned char auth_ok[] = {1, 0};
+    static const unsigned char connected[] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+    bool ok =
+        // Greeting: version, number of methods, methods.
+        read_all(fd, buf, 2) && read_all(fd, buf + 2, buf[1]) &&
+        write_all(fd, reinterpret_cast<const char *>(choose_auth), 2) &&
+        // Username and password.
+        read_all(fd, buf, 1) && read_all(fd, &len, 1) &&
+        read_all(fd, buf, len) && read_all(fd, &len, 1) &&
+        read_all(fd, buf, len) &&
+        write_all(fd, reinterpret_cast<const char *>(auth_ok), 2) &&
+        // CONNECT to a hostname and port.
+        read_all(fd, buf, 4) && buf[3] == 3 && read_all(fd, &len, 1) &&
+        read_all(fd, buf, len) && read_all(fd, buf, 2) &&
+        write_all(fd, reinterpret_cast<const char *>(connected),
+                  sizeof(connected));
+    while (ok && recv(fd, buf, sizeof(buf), 0) > 0) {
+    }
+    close(fd);
+  }
+
+  int listener_;
+  unsigned short port_;
+};
+
+// A mock Arti RPC server, listening on a Unix socket.
+class MockArti {
+ public:
+  MockArti(const Options &opts, unsigned short socks_port)
+      : opts_(opts), socks_port_(socks_port)
+  {
+    char dir[] = "/tmp/rpc-bench-XXXXXX";
+    if (!mkdtemp(dir))
+      die("can't make temporary directory");
+    dir_ = dir;
+    path_ = dir_ + "/arti.sock";
+
+    listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path_.size() >= sizeof(addr.sun_path))
+      die("socket path too long");
+    strcpy(addr.sun_path, path_.c_str());
+    if (listener_ < 0 ||
+        bind(listener_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+            0 ||
+        listen(listener_, 16) < 0)
+      die("can't open mock Arti listener");
+
+    std::string padding(opts_.payload, 'x');
+    payload_ = "{\"payload\":\"" + padding + "\"}";
+    std::thread([this] { accept_loop(); }).detach();
+  }
+
+  ~MockArti()
+  {
+    unlink(path_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  std::string connect_string() const { return "unix:" + path_; }
+
+ private:
+  // A reply that the mock will send once `due` has passed.
+  struct Scheduled {
+    Clock::time_point due;
+    unsigned long seq;
+    std::string text;
+    bool operator>(const Scheduled &other) const
+    {
+      return due != other.due ? due > other.due : seq > other.seq;
+    }
+  };
+
+  // The state for a single connection from the client library.
+  struct Session {
+    int fd;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::priority_queue<Scheduled, std::vector<Scheduled>,
+                        std::greater<Scheduled>>
+        outbox;
+    unsigned long seq = 0;
+    bool closed = false;
+
+    void send_at(Clock::time_point due, std::string text)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      outbox.push(Scheduled{due, seq++, std::move(text)});
+      cv.notify_one();
+    }
+  };
+
+  void accept_loop()
+  {
+    for (;;) {
+      int fd = accept(listener_, nullptr, nullptr);
+      if (fd < 0)
+        return;
+      auto session = std::make_shared<Session>();
+      session->fd = fd;
+      std::thread([session] { write_loop(*session); }).detach();
+      std::thread([this, session] { read_loop(*session); }).detach();
+    }
+  }
+
+  // Read requests from the client library, and schedule their replies.
+  void read_loop(Session &session)
+  {
+    std::string buf;
+    char chunk[65536];
+    unsigned long n_streams = 0;
+    for (;;) {
+      ssize_t n = recv(session.fd, chunk, sizeof(chunk), 0);
+      if (n <= 0)
+        break;
+      buf.append(chunk, n);
+      size_t start = 0, nl;
+      while ((nl = buf.find('\n', start)) != std::string::npos) {
+        respond(session, buf.substr(start, nl - start), n_streams);
+        start = nl + 1;
+      }
+      buf.erase(0, start);
+    }
+    std::lock_guard<std::mutex> guard(session.lock);
+    session.closed = true;
+    session.cv.notify_one();
+  }
+
+  void respond(Session &session, const std::string &request,
+               unsigned long &n_streams)
+  {
+    std::string id = raw_member(request, "id");
+    std::string method = raw_member(request, "method");
+    auto reply = [&](const std::string &kind, const std::string &body) {
+      return "{\"id\":" + id + ",\"" + kind + "\":" + body + "}\n";
+    };
+    auto now = Clock::now();
+
+    auto connect_due = now + std::chrono::microseconds(opts_.connect_latency_us);
+
+    if (method == "\"auth:authenticate\"") {
+      session.send_at(connect_due,
+                      reply("result", "{\"session\":\"bench-session\"}"));
+    } else if (method == "\"arti:get_rpc_proxy_info\"") {
+      session.send_at(
+          connect_due, reply("result",
+                     "{\"proxies\":[{\"listener\":{\"socks5\":"
+                     "{\"tcp_address\":\"127.0.0.1:" +
+                         std::to_string(socks_port_) + "\"}}}]}"));
+    } else if (method == "\"arti:new_stream_handle\"") {
+      session.send_at(
+          now, reply("result", "{\"id\":\"stream-" +
+                                   std::to_string(++n_streams) + "\"}"));
+    } else if (method == "\"rpc:release\"" || method == "\"rpc:cancel\"") {
+      session.send_at(now, reply("result", "{}"));
+    } else if (method == "\"arti:x_open_stream_fd\"") {
+      // Like an Arti that can't send streams as file descriptors.
+      session.send_at(now, reply("error", "{\"message\":\"no such method\","
+                                          "\"code\":-32601,\"kinds\":[]}"));
+    } else {
+      if (request.find("\"updates\":true") != std::string::npos) {
+        for (unsigned long i = 0; i < opts_.updates; ++i) {
+          session.send_at(now, reply("update",
+                                     "{\"n\":" + std::to_string(i) + "}"));
+        }
+      }
+      session.send_at(now + std::chrono::microseconds(opts_.latency_us),
+                      reply("result", payload_));
+    }
+  }
+
+  // Write every reply whose time has come, until the client goes away.
+  static void write_loop(Session &session)
+  {
+    std::unique_lock<std::mutex> guard(session.lock);
+    std::string batch;
+    for (;;) {
+      if (session.closed)
+        break;
+      if (session.outbox.empty()) {
+        session.cv.wait(guard);
+        continue;
+      }
+      auto due = session.outbox.top().due;
+      if (due > Clock::now()) {
+        session.cv.wait_until(guard, due);
+        continue;
+      }
+      // Send everything that's ready in one write, as Arti would.
+      batch.clear();
+      while (!session.outbox.empty() &&
+             session.outbox.top().due <= Clock::now()) {
+        batch += session.outbox.top().text;
+        session.outbox.pop();
+      }
+      guard.unlock();
+      bool ok = write_all(session.fd, batch.data(), batch.size());
+      guard.lock();
+      if (!ok)
+        break;
+    }
+    guard.unlock();
+    // Wait for the reader to notice that the client is gone.
+    shutdown(session.fd, SHUT_RDWR);
+    guard.lock();
+    while (!session.closed)
+      session.cv.wait(guard);
+    close(session.fd);
+  }
+
+  const Options &opts_;
+  unsigned short socks_port_;
+  std::string dir_;
+  std::string path_;
+  std::string payload_;
+  int listener_;
+};
+
+// The timestamps that a trace hook has reported for each request.
+class Tracer {
+ public:
+  static void hook(void *user_data, const char *request_id,
+                   ArtiRpcTraceEvent event, uint64_t timestamp_ns)
+  {
+    auto *self = static_cast<Tracer *>(user_data);
+    if (event < 1 || event > ARTI_RPC_TRACE_EVENT_DELIVERED)
+      return;
+    std::lock_guard<std::mutex> guard(self->lock_);
+    // Later events of the same kind replace earlier ones, so that
+    // "delivered" refers to the final response.
+    self->events_[request_id][event] = timestamp_ns;
+  }
+
+  // Return the mean number of microseconds between events `from` and `to`,
+  // over every request that reported both.
+  double mean_us(ArtiRpcTraceEvent from, ArtiRpcTraceEvent to)
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    double total = 0;
+    size_t n = 0;
+    for (const auto &entry : events_) {
+      const auto &ts = entry.second;
+      if (ts[from] && ts[to] >= ts[from]) {
+        total += ts[to] - ts[from];
+        ++n;
+      }
+    }
+    return n ? total / n / 1000.0 : 0;
+  }
+
+ private:
+  std::mutex lock_;
+  std::unordered_map<std::string,
+                     std::array<uint64_t, ARTI_RPC_TRACE_EVENT_DELIVERED + 1>>
+      events_;
+};
+
+// The results of a single benchmark.
+struct Result {
+  std::vector<double> latencies_us;
+  double seconds = 0;
+  ArtiRpcConnStats stats{};
+};
+
+ArtiRpcConn *
+open_conn(const Options &opts, const std::string &connect_string,
+          Tracer *tracer)
+{
+  ArtiRpcConn *conn = nullptr;
+  ArtiRpcError *err = nullptr;
+  check(arti_rpc_connect(connect_string.c_str(), &conn, &err), err,
+        "arti_rpc_connect");
+  if (tracer) {
+    check(arti_rpc_conn_set_trace_hook(conn, Tracer::hook, tracer, &err), err,
+          "arti_rpc_conn_set_trace_hook");
+  }
+  if (opts.background_reader) {
+    check(arti_rpc_conn_launch_background_reader(conn, &err), err,
+          "arti_rpc_conn_launch_background_reader");
+  }
+  return conn;
+}
+
+// Return the text of a benchmark request.
+std::string
+bench_request(const Options &opts)
+{
+  std::string req =
+      "{\"obj\":\"bench-session\",\"method\":\"arti:x-bench\",\"params\":{}";
+  if (opts.updates)
+    req += ",\"meta\":{\"updates\":true}";
+  return req + "}";
+}
+
+double
+micros_since(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::micro>(Clock::now() - start)
+      .count();
+}
+
+void
+execute_one(const ArtiRpcConn *conn, const std::string &req)
+{
+  ArtiRpcStr *response = nullptr;
+  ArtiRpcError *err = nullptr;
+  check(arti_rpc_conn_execute(conn, req.c_str(), &response, &err), err,
+        "arti_rpc_conn_execute");
+  arti_rpc_str_free(response);
+}
+
+// Wait for the final response on `handle`, and free it.
+void
+wait_final(ArtiRpcHandle *handle)
+{
+  ArtiRpcResponseType type;
+  do {
+    ArtiRpcStr *response = nullptr;
+    ArtiRpcError *err = nullptr;
+    check(arti_rpc_handle_wait(handle, &response, &type, &err), err,
+          "arti_rpc_handle_wait");
+    arti_rpc_str_free(response);
+  } while (type == ARTI_RPC_RESPONSE_TYPE_UPDATE);
+  arti_rpc_handle_free(handle);
+}
+
+void
+bench_execute(const Options &opts, const ArtiRpcConn *conn, Result &result)
+{
+  std::string req = bench_request(opts);
+  for (unsigned long i = 0; i < opts.iterations; ++i) {
+    auto start = Clock::now();
+    execute_one(conn, req);
+    result.latencies_us.push_back(micros_since(start));
+  }
+}
+
+void
+bench_pipeline(const Options &opts, const ArtiRpcConn *conn, Result &result)
+{
+  std::string req = bench_request(opts);
+  std::deque<std::pair<ArtiRpcHandle *, Clock::time_point>> in_flight;
+  unsigned long sent = 0;
+  while (sent < opts.iterations || !in_flight.empty()) {
+    while (sent < opts.iterations && in_flight.size() < opts.depth) {
+      ArtiRpcHandle *handle = nullptr;
+      ArtiRpcError *err = nullptr;
+      auto start = Clock::now();
+      check(arti_rpc_conn_execute_with_handle(conn, req.c_str(), &handle,
+                                              &err),
+            err, "arti_rpc_conn_execute_with_handle");
+      in_flight.emplace_back(handle, start);
+      ++sent;
+    }
+    auto [handle, start] = in_flight.front();
+    in_flight.pop_front();
+    wait_final(handle);
+    result.latencies_us.push_back(micros_since(start));
+  }
+}
+
+void
+bench_submit(const Options &opts, const ArtiRpcConn *conn, Result &result)
+{
+  ArtiRpcRequestBuilder *builder = nullptr;
+  ArtiRpcError *err = nullptr;
+  check(arti_rpc_request_new("bench-session", "arti:x-bench", &builder, &err),
+        err, "arti_rpc_request_new");
+  for (unsigned long i = 0; i < opts.iterations; ++i) {
+    auto start = Clock::now();
+    ArtiRpcHandle *handle = nullptr;
+    check(arti_rpc_conn_submit(conn, builder, &handle, &err), err,
+          "arti_rpc_conn_submit");
+    wait_final(handle);
+    result.latencies_us.push_back(micros_since(start));
+  }
+  arti_rpc_request_free(builder);
+}
+
+void
+bench_threads(const Options &opts, const ArtiRpcConn *conn, Result &result)
+{
+  std::string req = bench_request(opts);
+  std::vector<std::vector<double>> per_thread(opts.threads);
+  std::vector<std::thread> threads;
+  for (unsigned long t = 0; t < opts.threads; ++t) {
+    unsigned long n = opts.iterations / opts.threads +
+                      (t < opts.iterations % opts.threads ? 1 : 0);
+    threads.emplace_back([&, t, n] {
+      for (unsigned long i = 0; i < n; ++i) {
+        auto start = Clock::now();
+        execute_one(conn, req);
+        per_thread[t].push_back(micros_since(start));
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (auto &latencies : per_thread) {
+    result.latencies_us.insert(result.latencies_us.end(), latencies.begin(),
+                               latencies.end());
+  }
+}
+
+// Open a stream on `conn`, and close it.
+void
+open_one_stream(const ArtiRpcConn *conn)
+{
+  ArtiRpcRawSocket sock;
+  ArtiRpcError *err = nullptr;
+  check(arti_rpc_conn_open_stream(conn, "www.example.com", 80, nullptr, "",
+                                  &sock, nullptr, &err),
+        err, "arti_rpc_conn_open_stream");
+  close(sock);
+}
+
+void
+bench_stream(const Options &opts, const ArtiRpcConn *conn, Result &result)
+{
+  for (unsigned long i = 0; i < opts.iterations; ++i) {
+    auto start = Clock::now();
+    open_one_stream(conn);
+    result.latencies_us.push_back(micros_since(start));
+  }
+}
+
+void
+bench_connect(const Options &opts, const ArtiRpcConn *, Result &result)
+{
+  for (unsigned long i = 0; i < opts.iterations; ++i) {
+    ArtiRpcConn *conn = nullptr;
+    ArtiRpcError *err = nullptr;
+    auto start = Clock::now();
+    check(arti_rpc_connect(opts.connect_string.c_str(), &conn, &err), err,
+          "arti_rpc_connect");
+    open_one_stream(conn);
+    result.latencies_us.push_back(micros_since(start));
+    arti_rpc_conn_free(conn);
+  }
+}
+
+void
+bench_connect_async(const Options &opts, const ArtiRpcConn *, Result &result)
+{
+  std::vector<ArtiRpcPendingConnect *> pending;
+  for (unsigned long sent = 0; sent < opts.iterations;) {
+    auto start = Clock::now();
+    for (; sent < opts.iterations && pending.size() < opts.depth; ++sent) {
+      ArtiRpcPendingConnect *p = nullptr;
+      ArtiRpcError *err = nullptr;
+      check(arti_rpc_connect_async(opts.connect_string.c_str(), &p, &err), err,
+            "arti_rpc_connect_async");
+      pending.push_back(p);
+    }
+    for (auto *p : pending) {
+      ArtiRpcConn *conn = nullptr;
+      ArtiRpcError *err = nullptr;
+      check(arti_rpc_pending_connect_wait(p, &conn, &err), err,
+            "arti_rpc_pending_connect_wait");
+      open_one_stream(conn);
+      result.latencies_us.push_back(micros_since(start));
+      arti_rpc_conn_free(conn);
+      arti_rpc_pending_connect_free(p);
+    }
+    pending.clear();
+  }
+}
+
+// Return the `q`th quantile of the sorted list `v`.
+double
+quantile(const std::vector<double> &v, double q)
+{
+  if (v.empty())
+    return 0;
+  size_t idx = static_cast<size_t>(q * (v.size() - 1) + 0.5);
+  return v[std::min(idx, v.size() - 1)];
+}
+
+void
+report(const Options &opts, const std::string &name, Result &result,
+       Tracer *tracer)
+{
+  auto &v = result.latencies_us;
+  std::sort(v.begin(), v.end());
+  bool uses_threads = name == "threads";
+  bool uses_depth = name == "pipeline" || name == "connect_async";
+  printf("{\"bench\":\"%s\",\"iterations\":%zu,\"threads\":%lu,"
+         "\"depth\":%lu,\"latency_us\":%lu,\"updates\":%lu,\"payload\":%lu,"
+         "\"background_reader\":%s,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+         "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+         "\"bytes_read\":%llu,\"bytes_written\":%llu,"
+         "\"reader_handoffs\":%llu",
+         name.c_str(), v.size(), uses_threads ? opts.threads : 1,
+         uses_depth ? opts.depth : 1, opts.latency_us, opts.updates,
+         opts.payload, opts.background_reader ? "true" : "false",
+         result.seconds, v.size() / result.seconds, quantile(v, 0.5),
+         quantile(v, 0.99), quantile(v, 0.999), v.empty() ? 0.0 : v.back(),
+         (unsigned long long)result.stats.bytes_read,
+         (unsigned long long)result.stats.bytes_written,
+         (unsigned long long)result.stats.reader_handoffs);
+  if (tracer) {
+    printf(",\"trace_write_us\":%.1f,\"trace_arti_us\":%.1f,"
+           "\"trace_handoff_us\":%.1f",
+           tracer->mean_us(ARTI_RPC_TRACE_EVENT_SUBMITTED,
+                           ARTI_RPC_TRACE_EVENT_WRITTEN),
+           tracer->mean_us(ARTI_RPC_TRACE_EVENT_WRITTEN,
+                           ARTI_RPC_TRACE_EVENT_FINAL_RECEIVED),
+           tracer->mean_us(ARTI_RPC_TRACE_EVENT_FINAL_RECEIVED,
+                           ARTI_RPC_TRACE_EVENT_DELIVERED));
+  }
+  printf("}\n");
+  fflush(stdout);
+}
+
+unsigned long
+parse_number(const char *flag, const char *arg)
+{
+  char *end;
+  if (!arg)
+    die(std::string("missing argument for ") + flag);
+  unsigned long n = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0')
+    die(std::string("bad number for ") + flag + ": " + arg);
+  return n;
+}
+
+Options
+parse_args(int argc, char **argv)
+{
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string flag = argv[i];
+    const char *arg = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (flag == "--background-reader") {
+      opts.background_reader = true;
+      continue;
+    }
+    if (flag == "--trace") {
+      opts.trace = true;
+      continue;
+    }
+    ++i;
+    if (flag == "--bench") {
+      if (!arg)
+        die("missing argument for --bench");
+      opts.benches.clear();
+      std::string list = arg;
+      size_t start = 0, comma;
+      do {
+        comma = list.find(',', start);
+        opts.benches.push_back(list.substr(start, comma - start));
+        start = comma + 1;
+      } while (comma != std::string::npos);
+    } else if (flag == "--iterations") {
+      opts.iterations = parse_number(argv[i - 1], arg);
+    } else if (flag == "--latency-us") {
+      opts.latency_us = parse_number(argv[i - 1], arg);
+    } else if (flag == "--connect-latency-us") {
+      opts.connect_latency_us = parse_number(argv[i - 1], arg);
+    } else if (flag == "--updates") {
+      opts.updates = parse_number(argv[i - 1], arg);
+    } else if (flag == "--payload") {
+      opts.payload = parse_number(argv[i - 1], arg);
+    } else if (flag == "--depth") {
+      opts.depth = std::max(1UL, parse_number(argv[i - 1], arg));
+    } else if (flag == "--threads") {
+      opts.threads = std::max(1UL, parse_number(argv[i - 1], arg));
+    } else {
+      die("unrecognized option " + flag);
+    }
+  }
+  return opts;
+}
+
+}  // namespace
+
+int
+main(int argc, char **argv)
+{
+  Options opts = parse_args(argc, argv);
+  MockSocks socks;
+  MockArti arti(opts, socks.port());
+  opts.connect_string = arti.connect_string();
+
+  for (const auto &name : opts.benches) {
+    void (*run)(const Options &, const ArtiRpcConn *, Result &);
+    if (name == "execute")
+      run = bench_execute;
+    else if (name == "pipeline")
+      run = bench_pipeline;
+    else if (name == "threads")
+      run = bench_threads;
+    else if (name == "submit")
+      run = bench_submit;
+    else if (name == "stream")
+      run = bench_stream;
+    else if (name == "connect")
+      run = bench_connect;
+    else if (name == "connect_async")
+      run = bench_connect_async;
+    else
+      die("unrecognized benchmark " + name);
+
+    // Use a fresh connection for each benchmark, so that their statistics
+    // don't mix.
+    // The tracer must outlive the connection.
+    std::unique_ptr<Tracer> tracer(opts.trace ? new Tracer : nullptr);
+    ArtiRpcConn *conn = open_conn(opts, opts.connect_string, tracer.get());
+    Result result;
+    result.latencies_us.reserve(opts.iterations);
+    auto start = Clock::now();
+    run(opts, conn, result);
+    result.seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    ArtiRpcError *err = nullptr;
+    check(arti_rpc_conn_get_stats(conn, &result.stats, &err), err,
+          "arti_rpc_conn_get_stats");
+    arti_rpc_conn_free(conn);
+    report(opts, name, result, tracer.get());
+  }
+  return 0;
+}
@@ -6,13 +6,18 @@
 use std::{
     io::{self, BufReader},
     path::PathBuf,
-    sync::{Arc, Mutex},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex,
+    },
+    time::{Duration, Instant},
 };
 
 use crate::{
     llconn,
     msgs::{
-        request::InvalidRequestError,
+        builder::RequestBuilder,
+        request::{self, InvalidRequestError, Request},
         response::{ResponseKind, RpcError, ValidatedResponse},
         AnyRequestId, ObjectId,
     },
@@ -20,13 +25,32 @@ use crate::{
 };
 
 mod auth;
+mod connecting;
 mod connimpl;
+#[cfg(unix)]
+mod fdpass;
+mod inproc;
+mod limits;
+mod notify;
+mod pending;
+mod pool;
+mod socks_pool;
+mod stats;
 mod stream;
+mod trace;
 
 use crate::util::Utf8CString;
+pub use connecting::PendingConnect;
 pub use connimpl::RpcConn;
+pub use inproc::{
+    register_inproc_connector, unregister_inproc_connector, InprocConnector, InprocStreams,
+};
+pub use limits::{OverflowPolicy, QueueLimits};
+pub use pool::RpcConnPool;
 use serde::{de::DeserializeOwned, Deserialize};
-pub use stream::StreamError;
+pub use stats::{RpcConnStats, N_LATENCY_BUCKETS};
+pub use stream::{PendingStream, StreamError, StreamTarget};
+pub use trace::TraceEvent;
 
 /// A handle to an open request.
 ///
@@ -47,6 +71,12 @@ pub struct RequestHandle {
     conn: Mutex<Arc<connimpl::Receiver>>,
     /// The ID of this request.
     id: AnyRequestId,
+    /// True if we have returned a final response (or a fatal error) for this request.
+    ///
+    /// Once this is set, the `Receiver` is no longer tracking our ID,
+    /// so we must not tell it to forget about that ID when we are dropped:
+    /// the caller might have reused it for some other request.
+    finished: AtomicBool,
 }
 
 // TODO RPC: Possibly abolish these types.
@@ -141,6 +171,12 @@ impl std::fmt::Display for ErrorResponse {
 ///
 type FinalResponse = Result<SuccessResponse, ErrorResponse>;
 
+/// The decoded outcome of an internally generated request.
+///
+/// The outer `Result` reports whether we got a usable reply at all;
+/// the inner one reports whether that reply was a success.
+type InternalResponse<T> = Result<Result<T, ErrorResponse>, ProtoError>;
+
 /// Any of the three types of Arti responses.
 #[derive(Clone, Debug)]
 #[allow(clippy::exhaustive_structs)]
@@ -155,13 +191,38 @@ pub enum AnyResponse {
 // TODO RPC: DODGY TYPES END.
 
 /// Information about how to construct a connection to an Arti instance.
+#[derive(Clone)]
 pub struct RpcConnBuilder {
-    /// A path to a unix domain socket at which Arti is listening.
-    // TODO RPC: Right now this is the only kind of supported way to connect.
-    unix_socket: PathBuf,
-    // todo RPC: include selector for how to connect.
-    //
+    /// Where Arti is listening, and how to reach it.
+    target: ConnectTarget,
     // TODO RPC: Possibly kill off the builder entirely.
+    /// If true, launch a background reader thread as soon as we connect.
+    ///
+    /// See [`RpcConn::launch_background_reader`].
+    background_reader: bool,
+    /// The framing to ask Arti to use once we have authenticated.
+    framing: llconn::Framing,
+    /// If true, ask Arti for its proxy information as soon as we have authenticated.
+    ///
+    /// See [`RpcConnBuilder::prefetch_proxy_info`].
+    prefetch_proxy_info: bool,
+    /// If true, accept data streams from Arti as file descriptors on this connection.
+    ///
+    /// See [`RpcConnBuilder::stream_fd_passing`].
+    stream_fd_passing: bool,
+    /// The largest length-prefixed response that we accept.
+    ///
+    /// See [`RpcConnBuilder::max_response_len`].
+    max_response_len: usize,
+}
+
+/// A way to reach an Arti instance.
+#[derive(Clone)]
+enum ConnectTarget {
+    /// A path to a unix domain socket at which Arti is listening.
+    UnixSocket(PathBuf),
+    /// The name of an [`InprocConnector`] for an Arti instance in this process.
+    Inproc(String),
 }
 
 // TODO: For FFI purposes, define a slightly higher level API that
@@ -170,7 +231,8 @@ pub struct RpcConnBuilder {
 impl RpcConnBuilder {
     /// Create a Builder from a connect string.
     ///
-    /// (Right now the only supported string type is "unix:" followed by a path.)
+    /// (Right now the supported string types are "unix:" followed by a path,
+    /// and "inproc:" followed by the name of an [`InprocConnector`].)
     //
     // TODO RPC: Should this take an OsString?
     //
@@ -181,10 +243,10 @@ impl RpcConnBuilder {
         let (kind, location) = s
             .split_once(':')
             .ok_or(BuilderError::InvalidConnectString)?;
-        if kind == "unix" {
-            Ok(Self::new_unix_socket(location))
-        } else {
-            Err(BuilderError::InvalidConnectString)
+        match kind {
+            "unix" => Ok(Self::new_unix_socket(location)),
+            "inproc" => Ok(Self::new_inproc(location)),
+            _ => Err(BuilderError::InvalidConnectString),
         }
     }
 
@@ -194,32 +256,161 @@ impl RpcConnBuilder {
     /// unix sockets are not supported.  On these environments,
     /// the `connect` attempt will later fail with `SchemeNotSupported`.
     pub fn new_unix_socket(addr: impl Into<PathBuf>) -> Self {
+        Self::with_target(ConnectTarget::UnixSocket(addr.into()))
+    }
+
+    /// Create a Builder to connect to an Arti instance in this process,
+    /// using the [`InprocConnector`] registered under `name`.
+    ///
+    /// See [`register_inproc_connector`].
+    /// The connector only needs to be registered by the time we `connect`.
+    pub fn new_inproc(name: impl Into<String>) -> Self {
+        Self::with_target(ConnectTarget::Inproc(name.into()))
+    }
+
+    /// Create a Builder with default settings to connect to `target`.
+    fn with_target(target: ConnectTarget) -> Self {
         Self {
-            unix_socket: addr.into(),
+            target,
+            background_reader: false,
+            framing: llconn::Framing::default(),
+            prefetch_proxy_info: false,
+            stream_fd_passing: false,
+            max_response_len: llconn::DEFAULT_MAX_RESPONSE_LEN,
         }
     }
 
+    /// Configure whether the resulting connection should launch
+    /// a dedicated background reader thread as soon as it is connected.
+    ///
+    /// See [`RpcConn::launch_background_reader`] for details.
+    /// By default, this is off.
+    pub fn background_reader(mut self, enable: bool) -> Self {
+        self.background_reader = enable;
+        self
+    }
+
+    /// Configure which framing the resulting connection should ask Arti to use
+    /// once it has authenticated.
+    ///
+    /// If Arti doesn't support the requested framing,
+    /// the connection keeps using the default ([`llconn::Framing::JsonLines`]).
+    /// Either way, responses are handed to the application as JSON.
+    pub fn framing(mut self, framing: llconn::Framing) -> Self {
+        self.framing = framing;
+        self
+    }
+
+    /// Configure whether the resulting connection should ask Arti for its proxy information
+    /// as soon as it has authenticated, without waiting for the answer.
+    ///
+    /// The first stream that we open on the connection will then use that answer,
+    /// instead of making its own round trip to Arti.
+    /// (This is wasted effort if the application never opens a stream.)
+    /// By default, this is off.
+    pub fn prefetch_proxy_info(mut self, enable: bool) -> Self {
+        self.prefetch_proxy_info = enable;
+        self
+    }
+
+    /// Configure whether the resulting connection should accept data streams from Arti
+    /// as file descriptors passed over the RPC socket itself.
+    ///
+    /// When this is on, and we are connected over a Unix domain socket,
+    /// [`RpcConn::open_stream_fd`] is available,
+    /// and the `arti_rpc_conn_open_stream` FFI function tries it before using SOCKS.
+    ///
+    /// This needs an Arti that implements the experimental `arti:x_open_stream_fd` method;
+    /// Arti implements it on its Unix domain socket listeners when built with tokio.
+    /// By default, this is off.
+    pub fn stream_fd_passing(mut self, enable: bool) -> Self {
+        self.stream_fd_passing = enable;
+        self
+    }
+
+    /// Configure the longest response, in bytes,
+    /// that the resulting connection accepts under [`llconn::Framing::LengthPrefixed`].
+    ///
+    /// A longer response is treated as a fatal error on the connection.
+    /// We don't allocate space for a response until its bytes arrive,
+    /// so this is a guard against a broken Arti, not against large allocations.
+    /// By default, this is 1 GiB.
+    pub fn max_response_len(mut self, max_response_len: usize) -> Self {
+        self.max_response_len = max_response_len;
+        self
+    }
+
     /// Try to connect to an Arti process as specified by this Builder.
     pub fn connect(&self) -> Result<RpcConn, ConnectError> {
+        let (mut conn, scheme_name) = match &self.target {
+            ConnectTarget::UnixSocket(path) => (
+                Self::connect_unix(path, self.stream_fd_passing)?,
+                "inherent:unix_path",
+            ),
+            ConnectTarget::Inproc(name) => {
+                // Dropping our writer closes the stream, which is all the shutdown we need.
+                let (reader, writer) = inproc::connect(name)?;
+                let conn = RpcConn::new(
+                    llconn::Reader::new(BufReader::new(reader)),
+                    llconn::Writer::new(writer),
+                );
+                (conn, "inherent:inproc")
+            }
+        };
+
+        conn.set_max_response_len(self.max_response_len);
+        let session_id = conn.authenticate_inherent(scheme_name, self.framing)?;
+        conn.session = Some(session_id);
+
+        if self.prefetch_proxy_info {
+            conn.prefetch_proxy_info()?;
+        }
+
+        if self.background_reader {
+            conn.launch_background_reader()?;
+        }
+
+        Ok(conn)
+    }
+
+    /// Open an unauthenticated connection to a unix socket at `path`.
+    ///
+    /// If `fd_passing` is true, keep any file descriptors that Arti sends us on it.
+    fn connect_unix(path: &std::path::Path, fd_passing: bool) -> Result<RpcConn, ConnectError> {
         #[cfg(not(unix))]
         {
+            let _ = (path, fd_passing);
             return Err(ConnectError::SchemeNotSupported);
         }
         #[cfg(unix)]
         {
-            let sock = std::os::unix::net::UnixStream::connect(&self.unix_socket)
+            let sock = std::os::unix::net::UnixStream::connect(path)
                 .map_err(|e| ConnectError::CannotConnect(Arc::new(e)))?;
             let sock_dup = sock
                 .try_clone()
                 .map_err(|e| ConnectError::CannotConnect(Arc::new(e)))?;
-            let mut conn = RpcConn::new(
-                llconn::Reader::new(Box::new(BufReader::new(sock))),
-                llconn::Writer::new(Box::new(sock_dup)),
-            );
-
-            let session_id = conn.authenticate_inherent("inherent:unix_path")?;
-            conn.session = Some(session_id);
-
+            let sock_shutdown = sock
+                .try_clone()
+                .map_err(|e| ConnectError::CannotConnect(Arc::new(e)))?;
+            let writer = llconn::Writer::new(Box::new(sock_dup));
+            let mut conn = if fd_passing {
+                let passed_fds = Arc::new(fdpass::PassedFds::default());
+                let mut conn = RpcConn::new(
+                    llconn::Reader::new(BufReader::new(fdpass::FdRecvStream::new(
+                        sock,
+                        Arc::clone(&passed_fds),
+                    ))),
+                    writer,
+                );
+                conn.passed_fds = Some(passed_fds);
+                conn
+            } else {
+                RpcConn::new(llconn::Reader::new(BufReader::new(sock)), writer)
+            };
+            conn.set_shutdown_on_drop(move || {
+                // If this fails, the socket is already unusable, so there's nothing to do.
+                let _ignore = sock_shutdown.shutdown(std::net::Shutdown::Both);
+            });
             Ok(conn)
         }
     }
@@ -248,6 +439,43 @@ impl AnyResponse {
     }
 }
 
+/// Helper: Try to decode the `result` field of `response` (a reply to `cmd`) as a `T`.
+///
+/// Treat any failure to decode it as an internal error.
+fn decode_internal_response<T: DeserializeOwned>(
+    cmd: &str,
+    response: FinalResponse,
+) -> InternalResponse<T> {
+    match response {
+        Ok(success) => match success.decode::<T>() {
+            Ok(result) => Ok(Ok(result)),
+            Err(json_error) => Err(ProtoError::InternalRequestFailed(UnexpectedReply {
+                request: cmd.to_string(),
+                reply: Utf8CString::from(success).to_string(),
+                problem: UnexpectedReplyProblem::CannotDecode(Arc::new(json_error)),
+            })),
+        },
+        Err(error) => Ok(Err(error)),
+    }
+}
+
+/// Helper: Wait for the final response on `handle` (a reply to `cmd`), and decode it as a `T`.
+///
+/// Behaves like [`RpcConn::execute_internal_ok`], for a request that has already been sent.
+fn wait_internal_ok<T: DeserializeOwned>(
+    cmd: &str,
+    handle: RequestHandle,
+) -> Result<T, ProtoError> {
+    match decode_internal_response(cmd, handle.wait()?)? {
+        Ok(v) => Ok(v),
+        Err(err_response) => Err(ProtoError::InternalRequestFailed(UnexpectedReply {
+            request: cmd.to_string(),
+            reply: err_response.to_string(),
+            problem: UnexpectedReplyProblem::ErrorNotExpected,
+        })),
+    }
+}
+
 impl RpcConn {
     /// Return the ObjectId for the negotiated Session.
     ///
@@ -273,6 +501,37 @@ impl RpcConn {
         hnd.wait()
     }
 
+    /// Like `execute`, but give up after `timeout`.
+    ///
+    /// We tell Arti about the timeout (as `timeout_ms` in the request's `meta`),
+    /// so that it can cancel the request itself once the time is up.
+    /// If we still have no final response by then, we cancel the request,
+    /// as with [`cancel`](Self::cancel), and return [`ProtoError::TimedOut`].
+    ///
+    /// (This launches a background reader thread, if there is not one already:
+    /// see [`RequestHandle::wait_with_updates_timeout`].)
+    pub fn execute_with_timeout(
+        &self,
+        cmd: &str,
+        timeout: Duration,
+    ) -> Result<FinalResponse, ProtoError> {
+        let deadline = Instant::now() + timeout;
+        let cmd = request::with_timeout(cmd, timeout)?;
+        let hnd = self.execute_with_handle(&cmd)?;
+        loop {
+            let remaining = deadline.saturating_duration_since(Instant::now());
+            match hnd.wait_with_updates_timeout(remaining)? {
+                Some(AnyResponse::Success(s)) => return Ok(Ok(s)),
+                Some(AnyResponse::Error(e)) => return Ok(Err(e)),
+                Some(AnyResponse::Update(_)) => {}
+                None => {
+                    self.cancel(hnd.id())?;
+                    return Err(ProtoError::TimedOut);
+                }
+            }
+        }
+    }
+
     /// Helper for executing internally-generated requests and decoding their results.
     ///
     /// Behaves like `execute`, except on success, where it tries to decode the `result` field
@@ -286,17 +545,26 @@ impl RpcConn {
         &self,
         cmd: &str,
     ) -> Result<Result<T, ErrorResponse>, ProtoError> {
-        match self.execute(cmd)? {
-            Ok(success) => match success.decode::<T>() {
-                Ok(result) => Ok(Ok(result)),
-                Err(json_error) => Err(ProtoError::InternalRequestFailed(UnexpectedReply {
-                    request: cmd.to_string(),
-                    reply: Utf8CString::from(success).to_string(),
-                    problem: UnexpectedReplyProblem::CannotDecode(Arc::new(json_error)),
-                })),
-            },
-            Err(error) => Ok(Err(error)),
-        }
+        decode_internal_response(cmd, self.execute(cmd)?)
+    }
+
+    /// Helper for executing a batch of internally-generated requests and decoding their results.
+    ///
+    /// Behaves like `execute_internal`, except that it sends all of `cmds` at once
+    /// with [`execute_batch`](RpcConn::execute_batch),
+    /// and returns a separate outcome for each command, in the same order.
+    ///
+    /// Don't use this for user-generated requests.
+    pub(crate) fn execute_internal_batch<T: DeserializeOwned>(
+        &self,
+        cmds: &[&str],
+    ) -> Result<Vec<InternalResponse<T>>, ProtoError> {
+        let handles = self.execute_batch(cmds)?;
+        Ok(cmds
+            .iter()
+            .zip(handles)
+            .map(|(cmd, hnd)| decode_internal_response(cmd, hnd.wait()?))
+            .collect())
     }
 
     /// Helper for executing internally-generated requests and decoding their results.
@@ -309,25 +577,114 @@ impl RpcConn {
         &self,
         cmd: &str,
     ) -> Result<T, ProtoError> {
-        match self.execute_internal(cmd)? {
-            Ok(v) => Ok(v),
-            Err(err_response) => Err(ProtoError::InternalRequestFailed(UnexpectedReply {
-                request: cmd.to_string(),
-                reply: err_response.to_string(),
-                problem: UnexpectedReplyProblem::ErrorNotExpected,
-            })),
-        }
+        wait_internal_ok(cmd, self.execute_with_handle(cmd)?)
     }
 
-    /// Cancel a request by ID.
-    pub fn cancel(&self, _id: &AnyRequestId) -> Result<(), ProtoError> {
-        todo!()
+    /// Ask Arti to cancel the request with ID `id`.
+    ///
+    /// If Arti cancels the request, its final response will be an error;
+    /// but it may finish in some other way before Arti can cancel it.
+    /// Either way, any updates for the request that are already queued,
+    /// or that arrive later, are discarded.
+    ///
+    /// Does nothing if we are not waiting for a final response to any such request.
+    pub fn cancel(&self, id: &AnyRequestId) -> Result<(), ProtoError> {
+        /// Parameters for an `rpc:cancel` request.
+        #[derive(serde::Serialize, Debug)]
+        struct CancelParams<'a> {
+            /// The request to cancel.
+            request_id: &'a AnyRequestId,
+        }
+
+        if !self.note_cancelled(id) {
+            return Ok(());
+        }
+        let request = Request::new(
+            ObjectId::connection_id(),
+            "rpc:cancel",
+            CancelParams { request_id: id },
+        );
+        // We don't need the reply to our cancel request: by dropping its handle,
+        // we make sure that it gets discarded as soon as it arrives.
+        drop(self.send_request(&request.encode()?)?);
+        Ok(())
     }
     /// Like `execute`, but don't wait.  This lets the caller see the
     /// request ID and  maybe cancel it.
     pub fn execute_with_handle(&self, cmd: &str) -> Result<RequestHandle, ProtoError> {
         self.send_request(cmd)
     }
+    /// Like `execute_with_handle`, but send several commands at once.
+    ///
+    /// All of the commands are written to Arti together,
+    /// which is much cheaper than sending them one at a time.
+    /// Return a handle for each command, in the same order as `cmds`.
+    ///
+    /// If any of the commands is invalid, or uses an ID that is already in use,
+    /// nothing is sent, and this function returns an error.
+    pub fn execute_batch(&self, cmds: &[&str]) -> Result<Vec<RequestHandle>, ProtoError> {
+        self.send_request_batch(cmds)
+    }
+    /// Like `execute_with_handle`, but send a request that was built with a [`RequestBuilder`].
+    ///
+    /// The request always gets a new ID, which you can find with [`RequestHandle::id`].
+    /// Since the request is already encoded, this is cheaper than sending it as a string.
+    pub fn submit(&self, request: &RequestBuilder) -> Result<RequestHandle, ProtoError> {
+        self.send_built_request(request)
+    }
+    /// Launch a dedicated background thread to read responses from Arti,
+    /// if one is not already running.
+    ///
+    /// By default, whichever thread is waiting for a response
+    /// takes responsibility for reading from the connection,
+    /// and hands that responsibility to another waiting thread when it is done.
+    /// That works well with a handful of outstanding requests.
+    /// With a large number of them, it is more efficient to have a single thread
+    /// that reads every response and hands it directly to the thread waiting for it.
+    ///
+    /// Once launched, the background reader runs until the connection is closed.
+    ///
+    /// (A background reader is also launched automatically
+    /// when it is needed by [`RequestHandle::try_wait`], [`RpcConn::pollable_fd`],
+    /// or [`RpcConn::execute_with_callback`].)
+    pub fn launch_background_reader(&self) -> Result<(), ProtoError> {
+        self.ensure_background_reader()
+    }
+
+    /// Send a request, and arrange for `callback` to receive every response to it.
+    ///
+    /// Unlike a [`RequestHandle`], this does not require any thread to wait for responses:
+    /// `callback` is invoked for each update, and for the final success or error,
+    /// from whichever thread is reading from this connection when the response arrives.
+    /// That is usually the background reader thread,
+    /// but it can also be any other thread that is waiting for a response on this `RpcConn`,
+    /// since a waiting thread may read from the connection until the background reader takes over.
+    /// If the connection fails before a final response arrives,
+    /// `callback` receives the error instead.
+    /// In any case, once `callback` has received a final response or an error,
+    /// it is not invoked again.
+    ///
+    /// The callback runs without holding any of this connection's locks,
+    /// so it may send other requests on this `RpcConn`.
+    /// But it must not wait for their responses, since that would deadlock,
+    /// and it should not block for long:
+    /// no other responses can be delivered until it returns.
+    ///
+    /// Return the ID of the request.
+    pub fn execute_with_callback<F>(
+        &self,
+        cmd: &str,
+        mut callback: F,
+    ) -> Result<AnyRequestId, ProtoError>
+    where
+        F: FnMut(Result<AnyResponse, ProtoError>) + Send + 'static,
+    {
+        self.send_request_with_callback(
+            cmd,
+            Box::new(move |response| callback(response.map(AnyResponse::from_validated))),
+        )
+    }
+
     /// As execute(), but run update_cb for every update we receive.
     pub fn execute_with_updates<F>(
         &self,
@@ -346,8 +703,6 @@ impl RpcConn {
             }
         }
     }
-
-    // TODO RPC: shutdown() on the socket on Drop.
 }
 
 impl RequestHandle {
@@ -385,15 +740,86 @@ impl RequestHandle {
     /// (TODO RPC: Maybe rename that error.)
     pub fn wait_with_updates(&self) -> Result<AnyResponse, ProtoError> {
         let conn = self.conn.lock().expect("Poisoned lock");
-        let validated = conn.wait_on_message_for(&self.id)?;
+        let validated = conn.wait_on_message_for(&self.id);
+        self.note_outcome(validated.as_ref().map(Some));
+        let validated = validated?;
 
         Ok(AnyResponse::from_validated(validated))
     }
-    // TODO RPC: Cancel on drop.
-    // TODO RPC: way to drop without cancelling.
 
-    // TODO RPC: Sketch out how we would want to do this in an async world,
-    // or with poll
+    /// As [`wait_with_updates`](Self::wait_with_updates),
+    /// but return `Ok(None)` if no response arrives within `timeout`.
+    ///
+    /// Timing out does not cancel the request: you can wait for it again later,
+    /// or cancel it with [`RpcConn::cancel`].
+    ///
+    /// The first call launches a background thread to read responses from Arti
+    /// (as with [`try_wait`](Self::try_wait)),
+    /// since a thread that is blocked reading from Arti has no way to stop in time.
+    pub fn wait_with_updates_timeout(
+        &self,
+        timeout: Duration,
+    ) -> Result<Option<AnyResponse>, ProtoError> {
+        let deadline = Instant::now() + timeout;
+        let conn = self.conn.lock().expect("Poisoned lock");
+        Arc::clone(&conn).ensure_background_reader()?;
+        let validated = conn.wait_on_message_for_until(&self.id, Some(deadline));
+        self.note_outcome(validated.as_ref().map(Option::as_ref));
+
+        Ok(validated?.map(AnyResponse::from_validated))
+    }
+
+    /// Return the next success, failure, or update from this handle, if one is ready.
+    ///
+    /// Return `Ok(None)` if no response is ready yet.  Never blocks.
+    ///
+    /// The first call launches a background thread to read responses from Arti,
+    /// since there is no longer any guarantee that some other thread is blocking
+    /// on the connection and reading on our behalf.
+    /// To learn when calling this function again is worthwhile,
+    /// poll the descriptor from [`RpcConn::pollable_fd`].
+    ///
+    /// As with [`wait_with_updates`](Self::wait_with_updates),
+    /// once this function returns Success or Error, you shouldn't call it again.
+    pub fn try_wait(&self) -> Result<Option<AnyResponse>, ProtoError> {
+        let conn = self.conn.lock().expect("Poisoned lock");
+        Arc::clone(&conn).ensure_background_reader()?;
+        let validated = conn.try_take_message_for(&self.id);
+        self.note_outcome(validated.as_ref().map(Option::as_ref));
+
+        Ok(validated?.map(AnyResponse::from_validated))
+    }
+
+    /// Helper: If `outcome` means that this request is complete, record that fact.
+    ///
+    /// (Nearly any error from the `Receiver` means that it is no longer tracking this request.)
+    fn note_outcome(&self, outcome: Result<Option<&ValidatedResponse>, &ProtoError>) {
+        let finished = match outcome {
+            Ok(Some(response)) => response.is_final(),
+            Ok(None) => false,
+            Err(ProtoError::DuplicateWait) => false,
+            Err(_) => true,
+        };
+        if finished {
+            self.finished.store(true, Ordering::Release);
+        }
+    }
+
+    // TODO RPC: Sketch out how we would want to do this in an async world.
+}
+
+impl Drop for RequestHandle {
+    fn drop(&mut self) {
+        // TODO RPC: Cancel on drop, and provide a way to drop without cancelling.
+        //
+        // For now, we just stop tracking the request,
+        // so that any responses we've queued (or that arrive later)
+        // are discarded rather than kept forever.
+        if !self.finished.load(Ordering::Acquire) {
+            let conn = self.conn.lock().expect("Poisoned lock");
+            conn.forget_request(&self.id);
+        }
+    }
 }
 
 /// An error (or other condition) that has caused an RPC connection to shut down.
@@ -466,6 +892,26 @@ pub enum ProtoError {
     /// We got a response to some internally generated request that wasn't what we expected.
     #[error("{0}")]
     InternalRequestFailed(#[source] UnexpectedReply),
+
+    /// We were unable to set up background reading of responses.
+    #[error("Unable to launch background reader: {0}")]
+    BackgroundReader(#[source] Arc<io::Error>),
+
+    /// We gave up waiting for a response to a request with a timeout.
+    ///
+    /// (We have asked Arti to cancel the request.)
+    #[error("Request timed out")]
+    TimedOut,
+
+    /// A request failed because too many of its responses were waiting for us to take them.
+    ///
+    /// (See [`OverflowPolicy::FailRequest`].)
+    #[error("Too many responses queued for request")]
+    QueueOverflow,
+
+    /// We tried to install a trace hook on a connection that already had one.
+    #[error("Connection already has a trace hook")]
+    TraceHookAlreadySet,
 }
 
 /// An error while trying to connect to the Arti process.
@@ -488,6 +934,14 @@ pub enum ConnectError {
     /// A protocol error occurred during negotiations.
     #[error("Error while negotiating with Arti: {0}")]
     ProtoError(#[from] ProtoError),
+    /// Tried to finish a [`PendingConnect`] that had already returned a connection or an error.
+    #[error("Connection attempt was already finished")]
+    AlreadyFinished,
+    /// The thread that was connecting on behalf of a [`PendingConnect`] failed.
+    ///
+    /// (This should be impossible.)
+    #[error("Internal error: connecting thread exited without a result")]
+    ConnectThreadFailed,
 }
 define_from_for_arc!(serde_json::Error => ConnectError [BadMessage]);
 
@@ -557,7 +1011,7 @@ mod test {
     use super::*;
 
     /// helper: Return a dummy RpcConn, along with a socketpair for it to talk to.
-    fn dummy_connected() -> (RpcConn, socketpair::SocketpairStream) {
+    pub(super) fn dummy_connected() -> (RpcConn, socketpair::SocketpairStream) {
         let (s1, s2) = socketpair::socketpair_stream().unwrap();
         let s1_w = s1.try_clone().unwrap();
         let s1_r = io::BufReader::new(s1);
@@ -566,7 +1020,8 @@ mod test {
         (conn, s2)
     }
 
-    fn write_val(w: &mut impl io::Write, v: &serde_json::Value) {
+    /// helper: Write `v` to `w` as a single line of JSON.
+    pub(super) fn write_val(w: &mut impl io::Write, v: &serde_json::Value) {
         let mut enc = serde_json::to_string(v).unwrap();
         enc.push('\n');
         w.write_all(enc.as_bytes()).unwrap();
@@ -603,8 +1058,409 @@ mod test {
         assert_eq!(map.get("xyz"), Some(&serde_json::Value::Number(3.into())));
     }
 
+    #[test]
+    fn submit_built() {
+        let (conn, sock) = dummy_connected();
+
+        let fake_arti_thread = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            for _ in 0..2 {
+                let mut s = String::new();
+                let _len = sock.read_line(&mut s).unwrap();
+                let request: serde_json::Value = serde_json::from_str(&s).unwrap();
+                let response = serde_json::json!({
+                    "id": request["id"].clone(),
+                    "result": request["params"].clone(),
+                });
+                write_val(sock.get_mut(), &response);
+            }
+            sock // prevent close
+        });
+
+        let builder = RequestBuilder::new("fred", "arti:x-frob");
+        builder.param_str("s", "x\ny").param_int("n", 3);
+        let h1 = conn.submit(&builder).unwrap();
+        let h2 = conn.submit(&builder).unwrap();
+        assert_ne!(h1.id(), h2.id());
+        for h in [h1, h2] {
+            let r = h.wait().unwrap().unwrap();
+            let r: serde_json::Value = serde_json::from_str(r.as_ref()).unwrap();
+            assert_eq!(r["result"], serde_json::json!({"s": "x\ny", "n": 3}));
+        }
+        let _sock = fake_arti_thread.join().unwrap();
+    }
+
+    #[test]
+    fn stats() {
+        let (conn, sock) = dummy_connected();
+        assert_eq!(conn.stats().requests_sent, 0);
+
+        let fake_arti_thread = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            let mut s = String::new();
+            let _len = sock.read_line(&mut s).unwrap();
+            let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+            let id = request.id().clone();
+            for n in 1..=2 {
+                write_val(
+                    sock.get_mut(),
+                    &serde_json::json!({"id": id.clone(), "update": {"n": n}}),
+                );
+            }
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": id.clone(), "result": {}}),
+            );
+            (sock, s.len())
+        });
+
+        let handle = conn
+            .execute_with_handle(
+                r#"{"obj":"x","method":"arti:x-frob","params":{}, "meta":{"updates":true}}"#,
+            )
+            .unwrap();
+        let stats = conn.stats();
+        assert_eq!(stats.requests_sent, 1);
+        assert_eq!(stats.n_pending, 1);
+        let (_sock, request_len) = fake_arti_thread.join().unwrap();
+        assert_eq!(stats.bytes_written, request_len as u64);
+
+        while !matches!(handle.wait_with_updates().unwrap(), AnyResponse::Success(_)) {}
+        let stats = conn.stats();
+        assert_eq!(stats.requests_completed, 1);
+        assert_eq!(stats.n_pending, 0);
+        assert_eq!(stats.n_queued, 0);
+        assert_eq!(stats.reader_handoffs, 0);
+        assert!(stats.bytes_read > 0);
+        assert_eq!(stats.first_update_latency.iter().sum::<u64>(), 1);
+        assert_eq!(stats.final_latency.iter().sum::<u64>(), 1);
+    }
+
+    #[test]
+    fn trace_hook() {
+        let (conn, sock) = dummy_connected();
+        let events = Arc::new(Mutex::new(Vec::new()));
+        let events2 = Arc::clone(&events);
+        conn.set_trace_hook(move |id, event, at| {
+            events2.lock().unwrap().push((id.clone(), event, at));
+        })
+        .unwrap();
+        assert!(matches!(
+            conn.set_trace_hook(|_, _, _| {}),
+            Err(ProtoError::TraceHookAlreadySet)
+        ));
+
+        let fake_arti_thread = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            let mut s = String::new();
+            let _len = sock.read_line(&mut s).unwrap();
+            let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+            let id = request.id().clone();
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": id.clone(), "update": {"n": 1}}),
+            );
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": id.clone(), "result": {}}),
+            );
+            sock
+        });
+
+        let handle = conn
+            .execute_with_handle(
+                r#"{"obj":"x","method":"arti:x-frob","params":{}, "meta":{"updates":true}}"#,
+            )
+            .unwrap();
+        while !matches!(handle.wait_with_updates().unwrap(), AnyResponse::Success(_)) {}
+        let _sock = fake_arti_thread.join().unwrap();
+
+        let events = events.lock().unwrap();
+        assert!(events.iter().all(|(id, _, _)| id == handle.id()));
+        assert!(events.windows(2).all(|w| w[0].2 <= w[1].2));
+        use TraceEvent as E;
+        assert_eq!(
+            events.iter().map(|(_, e, _)| *e).collect::<Vec<_>>(),
+            vec![
+                E::Submitted,
+                E::Written,
+                E::UpdateReceived,
+                E::Delivered,
+                E::FinalReceived,
+                E::Delivered
+            ]
+        );
+    }
+
+    /// Helper: Return a connection with `limits` and a background reader,
+    /// along with a thread that plays Arti.
+    ///
+    /// The thread answers a single request with `n_updates` updates and a result,
+    /// and then returns its socket.
+    ///
+    /// We also return a handle for that request,
+    /// once all of its responses have been read.
+    fn conn_with_limits(
+        limits: QueueLimits,
+        n_updates: usize,
+        wait_for: impl Fn(&RpcConnStats) -> bool,
+    ) -> (
+        RpcConn,
+        RequestHandle,
+        thread::JoinHandle<socketpair::SocketpairStream>,
+    ) {
+        let (conn, sock) = dummy_connected();
+        conn.set_queue_limits(limits).unwrap();
+        conn.launch_background_reader().unwrap();
+
+        let fake_arti_thread = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            let mut s = String::new();
+            let _len = sock.read_line(&mut s).unwrap();
+            let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+            let id = request.id().clone();
+            for n in 1..=n_updates {
+                write_val(
+                    sock.get_mut(),
+                    &serde_json::json!({"id": id.clone(), "update": {"n": n}}),
+                );
+            }
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": id.clone(), "result": {}}),
+            );
+            sock.into_inner()
+        });
+
+        let handle = conn
+            .execute_with_handle(
+                r#"{"obj":"x","method":"arti:x-frob","params":{}, "meta":{"updates":true}}"#,
+            )
+            .unwrap();
+        let mut n_polls = 0;
+        while !wait_for(&conn.stats()) {
+            n_polls += 1;
+            assert!(n_polls < 1000, "{:?}", conn.stats());
+            thread::sleep(Duration::from_millis(10));
+        }
+        (conn, handle, fake_arti_thread)
+    }
+
+    /// Helper: Return the "n" of every update we can take from `handle`, until its final response.
+    fn take_updates(handle: &RequestHandle) -> Vec<u64> {
+        let mut ns = Vec::new();
+        loop {
+            match handle.wait_with_updates().unwrap() {
+                AnyResponse::Update(u) => {
+                    let v: serde_json::Value = serde_json::from_str(u.as_ref()).unwrap();
+                    ns.push(v["update"]["n"].as_u64().unwrap());
+                }
+                AnyResponse::Success(_) => return ns,
+                AnyResponse::Error(e) => panic!("{:?}", e),
+            }
+        }
+    }
+
+    #[test]
+    fn queue_limit_drop_oldest() {
+        let limits = QueueLimits {
+            max_request_msgs: Some(3),
+            policy: OverflowPolicy::DropOldestUpdates,
+            ..QueueLimits::default()
+        };
+        let (conn, handle, fake_arti_thread) =
+            conn_with_limits(limits, 6, |stats| stats.requests_completed == 1);
+
+        let stats = conn.stats();
+        assert_eq!(stats.n_queued, 4);
+        assert_eq!(stats.reader_blocks, 0);
+        // We dropped the oldest updates, but kept the final response.
+        assert_eq!(take_updates(&handle), vec![4, 5, 6]);
+        assert_eq!(conn.stats().queued_bytes, 0);
+        let _sock = fake_arti_thread.join().unwrap();
+    }
+
+    #[test]
+    fn queue_limit_fail() {
+        let limits = QueueLimits {
+            max_request_bytes: Some(100),
+            policy: OverflowPolicy::FailRequest,
+            ..QueueLimits::default()
+        };
+        let (conn, handle, fake_arti_thread) =
+            conn_with_limits(limits, 10, |stats| stats.requests_completed == 1);
+
+        // The failure counts as one queued message, until somebody takes it.
+        assert_eq!(conn.stats().n_queued, 1);
+        assert!(matches!(
+            handle.wait_with_updates(),
+            Err(ProtoError::QueueOverflow)
+        ));
+        assert!(matches!(
+            handle.wait_with_updates(),
+            Err(ProtoError::RequestCompleted)
+        ));
+        let stats = conn.stats();
+        assert_eq!(stats.n_pending, 0);
+        assert_eq!(stats.n_queued, 0);
+        assert_eq!(stats.queued_bytes, 0);
+        let _sock = fake_arti_thread.join().unwrap();
+    }
+
+    #[test]
+    fn queue_limit_block() {
+        let limits = QueueLimits {
+            max_request_msgs: Some(2),
+            policy: OverflowPolicy::Block,
+            ..QueueLimits::default()
+        };
+        let (conn, handle, fake_arti_thread) =
+            conn_with_limits(limits, 5, |stats| stats.reader_blocks > 0);
+
+        let stats = conn.stats();
+        assert_eq!(stats.n_queued, 2);
+        assert!(stats.queued_bytes > 0);
+        assert_eq!(stats.requests_completed, 0);
+        // Nothing was lost: the reader just waited for us.
+        assert_eq!(take_updates(&handle), vec![1, 2, 3, 4, 5]);
+        assert_eq!(conn.stats().queued_bytes, 0);
+        let _sock = fake_arti_thread.join().unwrap();
+    }
+
+    #[test]
+    fn cancel() {
+        let (conn, sock) = dummy_connected();
+
+        let fake_arti_thread = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            let mut s = String::new();
+            let _len = sock.read_line(&mut s).unwrap();
+            let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+            let id = request.id().clone();
+            for n in 1..=2 {
+                write_val(
+                    sock.get_mut(),
+                    &serde_json::json!({"id": id.clone(), "update": {"n": n}}),
+                );
+            }
+
+            s.clear();
+            let _len = sock.read_line(&mut s).unwrap();
+            let cancel: serde_json::Value = serde_json::from_str(&s).unwrap();
+            assert_eq!(cancel["obj"], "connection");
+            assert_eq!(cancel["method"], "rpc:cancel");
+            assert_eq!(
+                cancel["params"]["request_id"],
+                serde_json::json!(id.clone())
+            );
+
+            // This update arrives after the cancel, and should be discarded.
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": id.clone(), "update": {"n": 3}}),
+            );
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": id.clone(), "error": {
+                    "message": "RPC request was cancelled", "code": 4, "kinds": [], "data": {}
+                }}),
+            );
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": cancel["id"].clone(), "result": {}}),
+            );
+            sock // prevent close
+        });
+
+        let handle = conn
+            .execute_with_handle(r#"{"obj":"x","method":"arti:x-frob","params":{}}"#)
+            .unwrap();
+        assert!(matches!(
+            handle.wait_with_updates().unwrap(),
+            AnyResponse::Update(_)
+        ));
+        conn.cancel(handle.id()).unwrap();
+        assert!(matches!(
+            handle.wait_with_updates().unwrap(),
+            AnyResponse::Error(_)
+        ));
+        assert_eq!(conn.n_outstanding(), 0);
+
+        // Cancelling a request that has finished does nothing.
+        conn.cancel(handle.id()).unwrap();
+        assert_eq!(conn.n_outstanding(), 0);
+
+        let _sock = fake_arti_thread.join().unwrap();
+    }
+
+    #[test]
+    fn timeouts() {
+        let (conn, sock) = dummy_connected();
+        let (tx, rx) = std::sync::mpsc::channel::<()>();
+
+        let fake_arti_thread = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            let mut s = String::new();
+            let _len = sock.read_line(&mut s).unwrap();
+            let request: serde_json::Value = serde_json::from_str(&s).unwrap();
+            assert_eq!(request["meta"]["timeout_ms"], 50);
+
+            // Say nothing until we see the cancel.
+            s.clear();
+            let _len = sock.read_line(&mut s).unwrap();
+            let cancel: serde_json::Value = serde_json::from_str(&s).unwrap();
+            assert_eq!(cancel["method"], "rpc:cancel");
+            assert_eq!(cancel["params"]["request_id"], request["id"]);
+
+            // Now a request that we answer only after the client has timed out once.
+            s.clear();
+            let _len = sock.read_line(&mut s).unwrap();
+            let request: serde_json::Value = serde_json::from_str(&s).unwrap();
+            rx.recv().unwrap();
+            write_val(
+                sock.get_mut(),
+                &serde_json::json!({"id": request["id"].clone(), "result": {}}),
+            );
+            sock // prevent close
+        });
+
+        let outcome = conn.execute_with_timeout(
+            r#"{"obj":"x","method":"arti:x-frob","params":{}}"#,
+            Duration::from_millis(50),
+        );
+        assert!(matches!(outcome, Err(ProtoError::TimedOut)));
+
+        let handle = conn
+            .execute_with_handle(r#"{"obj":"x","method":"arti:x-frob","params":{}}"#)
+            .unwrap();
+        let outcome = handle
+            .wait_with_updates_timeout(Duration::from_millis(10))
+            .unwrap();
+        assert!(outcome.is_none());
+        tx.send(()).unwrap();
+        let outcome = handle
+            .wait_with_updates_timeout(Duration::from_secs(60))
+            .unwrap();
+        assert!(matches!(outcome, Some(AnyResponse::Success(_))));
+
+        let _sock = fake_arti_thread.join().unwrap();
+    }
+
     #[test]
     fn complex() {
+        complex_workload(false);
+    }
+
+    #[test]
+    fn complex_background_reader() {
+        complex_workload(true);
+    }
+
+    /// Run a large number of concurrent requests with interleaved responses,
+    /// and make sure that each one gets the right answer.
+    ///
+    /// If `background_reader` is true, use a dedicated background reader thread.
+    fn complex_workload(background_reader: bool) {
         use std::sync::atomic::Ordering::SeqCst;
         let n_threads = 16;
         let n_commands_per_thread = 4096;
@@ -612,6 +1468,9 @@ mod test {
         let n_completed = Arc::new(AtomicUsize::new(0));
 
         let (conn, sock) = dummy_connected();
+        if background_reader {
+            conn.launch_background_reader().unwrap();
+        }
         let conn = Arc::new(conn);
         let mut user_threads = Vec::new();
         let mut rng = testing_rng();
@@ -700,6 +1559,11 @@ mod test {
                 n_commands_total - (n_commands_per_thread + 1) * scramble_factor;
 
             'outer: loop {
+                if n_received == n_commands_total {
+                    // We've answered everything.  (We can't wait for the socket to close:
+                    // a background reader keeps it open until we close it ourselves.)
+                    break 'outer;
+                }
                 let flush_pending_at = if n_received >= scramble_threshold {
                     1
                 } else {
@@ -752,7 +1616,6 @@ mod test {
                 }
             }
         });
-        drop(conn);
         for t in user_threads {
             t.join().unwrap();
         }
@@ -760,6 +1623,179 @@ mod test {
         worker_thread.join().unwrap();
 
         assert_eq!(n_completed.load(SeqCst), n_commands_total);
+        // Every request was answered, and nothing was left behind in a queue.
+        let stats = conn.stats();
+        assert_eq!(stats.requests_sent, n_commands_total as u64);
+        assert_eq!(stats.requests_completed, n_commands_total as u64);
+        assert_eq!(stats.n_pending, 0);
+        assert_eq!(stats.n_queued, 0);
+        assert_eq!(stats.queued_bytes, 0);
+        if background_reader {
+            // Only the background reader read from Arti:
+            // no waiting thread ever had to take over that job.
+            assert_eq!(stats.reader_handoffs, 0);
+        }
+    }
+
+    #[test]
+    fn try_wait() {
+        let (conn, sock) = dummy_connected();
+        #[cfg(unix)]
+        assert!(conn.pollable_fd().unwrap() >= 0);
+
+        let req = r#"{"obj":"fred","method":"arti:x-frob","params":{},"meta":{"updates":true}}"#;
+        let hnd1 = conn.execute_with_handle(req).unwrap();
+        let hnd2 = conn.execute_with_handle(req).unwrap();
+        // Nobody has answered yet.
+        assert!(hnd1.try_wait().unwrap().is_none());
+
+        /// Helper: call try_wait until it gives a response or an error.
+        fn try_wait_until_ready(hnd: &RequestHandle) -> Result<AnyResponse, ProtoError> {
+            loop {
+                if let Some(r) = hnd.try_wait().transpose() {
+                    return r;
+                }
+                thread::sleep(Duration::from_millis(1));
+            }
+        }
+
+        let mut sock = BufReader::new(sock);
+        let mut s = String::new();
+        let _len = sock.read_line(&mut s).unwrap();
+        let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+        let update = serde_json::json!({
+            "id": request.id().clone(),
+            "update": { "xyz" : 2 }
+        });
+        let response = serde_json::json!({
+            "id": request.id().clone(),
+            "result": { "xyz" : 3 }
+        });
+        write_val(sock.get_mut(), &update);
+        write_val(sock.get_mut(), &response);
+
+        assert!(matches!(
+            try_wait_until_ready(&hnd1).unwrap(),
+            AnyResponse::Update(_)
+        ));
+        assert!(matches!(
+            try_wait_until_ready(&hnd1).unwrap(),
+            AnyResponse::Success(_)
+        ));
+        assert!(matches!(hnd1.try_wait(), Err(ProtoError::RequestCompleted)));
+
+        // Once the connection is closed, the other request should fail.
+        drop(sock);
+        assert!(matches!(
+            try_wait_until_ready(&hnd2),
+            Err(ProtoError::Shutdown(ShutdownError::ConnectionClosed))
+        ));
+    }
+
+    #[test]
+    fn callbacks() {
+        let (conn, sock) = dummy_connected();
+        let (tx, rx) = std::sync::mpsc::channel();
+
+        let req = r#"{"obj":"fred","method":"arti:x-frob","params":{},"meta":{"updates":true}}"#;
+        let tx1 = tx.clone();
+        let id1 = conn
+            .execute_with_callback(req, move |r| tx1.send((1, r)).unwrap())
+            .unwrap();
+        let _id2 = conn
+            .execute_with_callback(req, move |r| tx.send((2, r)).unwrap())
+            .unwrap();
+
+        let mut sock = BufReader::new(sock);
+        let mut s = String::new();
+        let _len = sock.read_line(&mut s).unwrap();
+        let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+        assert_eq!(request.id(), &id1);
+        for _ in 0..3 {
+            let update = serde_json::json!({
+                "id": request.id().clone(),
+                "update": { "xyz" : 2 }
+            });
+            write_val(sock.get_mut(), &update);
+        }
+        let response = serde_json::json!({
+            "id": request.id().clone(),
+            "result": { "xyz" : 3 }
+        });
+        write_val(sock.get_mut(), &response);
+
+        for _ in 0..3 {
+            let (n, r) = rx.recv().unwrap();
+            assert_eq!(n, 1);
+            assert!(matches!(r, Ok(AnyResponse::Update(_))));
+        }
+        let (n, r) = rx.recv().unwrap();
+        assert_eq!(n, 1);
+        assert!(matches!(r, Ok(AnyResponse::Success(_))));
+
+        // When the connection closes, the other callback should get an error.
+        drop(sock);
+        let (n, r) = rx.recv().unwrap();
+        assert_eq!(n, 2);
+        assert!(matches!(
+            r,
+            Err(ProtoError::Shutdown(ShutdownError::ConnectionClosed))
+        ));
+        // And now both callbacks are gone.
+        assert!(rx.recv().is_err());
+    }
+
+    #[test]
+    fn batch() {
+        let (conn, sock) = dummy_connected();
+
+        // A batch with a bad request or a duplicate ID is rejected as a whole.
+        let r = conn.execute_batch(&[
+            r#"{"obj":"fred","method":"arti:x-frob","params":{}}"#,
+            r#"{"obj":"fred"}"#,
+        ]);
+        assert!(matches!(r, Err(ProtoError::InvalidRequest(_))));
+        let dup = r#"{"id":"dup","obj":"fred","method":"arti:x-frob","params":{}}"#;
+        let r = conn.execute_batch(&[dup, dup]);
+        assert!(matches!(r, Err(ProtoError::RequestIdInUse)));
+
+        let cmds: Vec<String> = (0..20)
+            .map(|n| format!(r#"{{"obj":"fred","method":"arti:x-echo","params":{{"n":{n}}}}}"#))
+            .collect();
+        let cmds: Vec<&str> = cmds.iter().map(String::as_str).collect();
+        let handles = conn.execute_batch(&cmds).unwrap();
+        assert_eq!(handles.len(), cmds.len());
+
+        // Answer the requests in reverse order, echoing their parameters.
+        // Note that nothing was sent for the rejected batches.
+        let mut sock = BufReader::new(sock);
+        let mut lines = Vec::new();
+        for _ in 0..cmds.len() {
+            let mut s = String::new();
+            let _len = sock.read_line(&mut s).unwrap();
+            lines.push(s);
+        }
+        let requests: Vec<_> = lines
+            .iter()
+            .map(|s| ValidatedRequest::from_string_strict(s).unwrap())
+            .collect();
+        for (req, hnd) in requests.iter().zip(&handles) {
+            assert_eq!(req.id(), &hnd.id);
+        }
+        for req in requests.iter().rev() {
+            let params = serde_json::from_str::<serde_json::Value>(&req.text()).unwrap();
+            let response = serde_json::json!({
+                "id": req.id().clone(),
+                "result": params["params"],
+            });
+            write_val(sock.get_mut(), &response);
+        }
+
+        for (n, hnd) in handles.into_iter().enumerate() {
+            let r = hnd.wait().unwrap().unwrap();
+            let r = serde_json::from_str::<serde_json::Value>(r.as_ref()).unwrap();
+            assert_eq!(r["result"]["n"], n);
+        }
     }
 
     #[test]
@@ -2,7 +2,10 @@
 
 use serde::{Deserialize, Serialize};
 
-use crate::msgs::{request::Request, ObjectId};
+use crate::{
+    llconn::Framing,
+    msgs::{request::Request, ObjectId},
+};
 
 use super::{ConnectError, RpcConn};
 
@@ -11,33 +14,59 @@ use super::{ConnectError, RpcConn};
 struct AuthParams<'a> {
     /// The authentication scheme we are using.
     scheme: &'a str,
+    /// The framing that we want to use once we are authenticated, if not the default.
+    #[serde(skip_serializing_if = "Option::is_none")]
+    framing: Option<&'a str>,
 }
 /// Response to an `auth:authenticate` request.
 #[derive(Deserialize, Debug)]
 struct Authenticated {
     /// A session object that we use to access the rest of Arti's functionality.
     session: ObjectId,
+    /// The framing that Arti has switched to, if it has agreed to switch.
+    ///
+    /// (Older versions of Arti don't know about framing, and never send this.)
+    #[serde(default)]
+    framing: Option<String>,
 }
 
+/// The name for [`Framing::LengthPrefixed`] in an `auth:authenticate` request.
+const LENGTH_PREFIXED: &str = "length-prefixed";
+
 impl RpcConn {
     /// Try to negotiate "inherent" authentication, using the provided scheme name.
     ///
     /// (Inherent authentication is available whenever the client proves that they
     /// are authorized through being able to connect to Arti at all.  Examples
     /// include connecting to a unix domain socket, and an in-process Arti implementation.)
+    ///
+    /// If `framing` is not the default, ask Arti to switch to it after authenticating.
+    /// If Arti doesn't support that, we keep using the default framing.
     pub(crate) fn authenticate_inherent(
         &self,
         scheme_name: &str,
+        framing: Framing,
     ) -> Result<ObjectId, ConnectError> {
+        let requested = match framing {
+            Framing::JsonLines => None,
+            Framing::LengthPrefixed => Some(LENGTH_PREFIXED),
+        };
         let r: Request<AuthParams> = Request::new(
             ObjectId::connection_id(),
             "auth:authenticate",
             AuthParams {
                 scheme: scheme_name,
+                framing: requested,
             },
         );
         let authenticated: Authenticated = self.execute_internal_ok(&r.encode()?)?;
 
+        // Arti switches its framing immediately after sending this reply,
+        // and we haven't sent anything since our request, so we can switch now.
+        if requested.is_some() && authenticated.framing.as_deref() == requested {
+            self.set_framing(framing);
+        }
+
         Ok(authenticated.session)
     }
 }
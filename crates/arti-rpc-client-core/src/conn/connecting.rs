@@ -0,0 +1,282 @@
+//! Support for connecting to Arti without blocking the calling thread.
+//!
+//! Connecting takes at least one round trip to Arti (to authenticate),
+//! and often more (to negotiate framing, or to prefetch proxy information).
+//! An application that opens several connections at startup
+//! would rather start them all at once, and wait for them together.
+//!
+//! We do the work of connecting on a separate thread,
+//! and tell the application when it is done through a pollable notifier,
+//! just as [`RpcConn::pollable_fd`](super::RpcConn::pollable_fd) does for responses.
+
+use std::sync::{
+    atomic::{AtomicBool, Ordering},
+    Arc, Condvar, Mutex,
+};
+
+use super::{notify::Notifier, ConnectError, RpcConn, RpcConnBuilder};
+
+/// A connection to Arti that is still being made.
+///
+/// Returned by [`RpcConnBuilder::connect_nonblocking`].
+///
+/// Use [`try_finish`](Self::try_finish) to check whether the connection is ready without blocking,
+/// or [`wait`](Self::wait) to block until it is.
+/// On Unix, use [`pollable_fd`](Self::pollable_fd) to find out when it is ready
+/// from inside an event loop.
+pub struct PendingConnect {
+    /// The state that we share with the thread that is connecting.
+    shared: Arc<Shared>,
+    /// True if we have returned the outcome to the caller.
+    ///
+    /// We only change this while holding the lock on `shared.state`,
+    /// so that only one caller can ever take the outcome.
+    finished: AtomicBool,
+}
+
+impl std::fmt::Debug for PendingConnect {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("PendingConnect")
+            .field("finished", &self.finished.load(Ordering::Relaxed))
+            .finish_non_exhaustive()
+    }
+}
+
+/// The state shared between a [`PendingConnect`] and its thread.
+struct Shared {
+    /// The state itself.
+    state: Mutex<SharedState>,
+    /// A condition variable that we signal once the connecting thread is done.
+    done: Condvar,
+}
+
+/// The contents of a [`Shared`].
+struct SharedState {
+    /// True if the connecting thread is done, whether or not it set an outcome.
+    exited: bool,
+    /// The outcome of the connection attempt, once there is one.
+    outcome: Option<Result<RpcConn, ConnectError>>,
+    /// A notifier that becomes readable once the connecting thread is done.
+    ///
+    /// (Always set on platforms that support pollable notifications.)
+    notifier: Option<Notifier>,
+}
+
+/// A guard that tells a [`Shared`] that its connecting thread is done, when dropped.
+///
+/// The connecting thread holds one of these,
+/// so that we hear about it even if the thread panics.
+struct SignalOnDrop(Arc<Shared>);
+
+impl Drop for SignalOnDrop {
+    fn drop(&mut self) {
+        let mut state = self.0.state.lock().expect("poisoned");
+        state.exited = true;
+        if let Some(notifier) = state.notifier.as_mut() {
+            notifier.set_readable(true);
+        }
+        self.0.done.notify_all();
+    }
+}
+
+impl RpcConnBuilder {
+    /// Begin connecting to an Arti process as specified by this Builder,
+    /// without waiting for the connection to be ready.
+    ///
+    /// Behaves the same as [`connect()`](RpcConnBuilder::connect),
+    /// except that the work of connecting (and authenticating) happens on another thread.
+    /// Use the returned [`PendingConnect`] to get the connection once it is ready.
+    pub fn connect_nonblocking(&self) -> Result<PendingConnect, ConnectError> {
+        let notifier = {
+            #[cfg(unix)]
+            {
+                Some(Notifier::new().map_err(|e| ConnectError::CannotConnect(Arc::new(e)))?)
+            }
+            #[cfg(not(unix))]
+            {
+                None
+            }
+        };
+        let shared = Arc::new(Shared {
+            state: Mutex::new(SharedState {
+                exited: false,
+                outcome: None,
+                notifier,
+            }),
+            done: Condvar::new(),
+        });
+
+        let builder = self.clone();
+        let guard = SignalOnDrop(Arc::clone(&shared));
+        let _detached = std::thread::Builder::new()
+            .name("arti-rpc-connect".into())
+            .spawn(move || {
+                let outcome = builder.connect();
+                guard.0.state.lock().expect("poisoned").outcome = Some(outcome);
+                drop(guard);
+            })
+            .map_err(|e| ConnectError::CannotConnect(Arc::new(e)))?;
+
+        Ok(PendingConnect {
+            shared,
+            finished: AtomicBool::new(false),
+        })
+    }
+}
+
+impl PendingConnect {
+    /// Return the connection if it is ready, without blocking.
+    ///
+    /// Return `Ok(None)` if we are still connecting.
+    ///
+    /// Once this has returned a connection or an error, it will only return errors.
+    pub fn try_finish(&self) -> Result<Option<RpcConn>, ConnectError> {
+        let mut state = self.shared.state.lock().expect("poisoned");
+        if self.finished.load(Ordering::Relaxed) {
+            return Err(ConnectError::AlreadyFinished);
+        }
+        if !state.exited {
+            return Ok(None);
+        }
+        self.finished.store(true, Ordering::Relaxed);
+        take_outcome(&mut state).map(Some)
+    }
+
+    /// Wait until the connection is ready, and return it.
+    ///
+    /// Once this has returned a connection or an error, it will only return errors.
+    pub fn wait(&self) -> Result<RpcConn, ConnectError> {
+        let mut state = self
+            .shared
+            .done
+            .wait_while(self.shared.state.lock().expect("poisoned"), |s| !s.exited)
+            .expect("poisoned");
+        // (Another thread may have taken the outcome while we were waiting.)
+        if self.finished.swap(true, Ordering::Relaxed) {
+            return Err(ConnectError::AlreadyFinished);
+        }
+        take_outcome(&mut state)
+    }
+
+    /// Return a file descriptor that becomes readable once the connection is ready
+    /// (or has failed).
+    ///
+    /// The file descriptor remains owned by this `PendingConnect`;
+    /// it stays valid for as long as this `PendingConnect` exists.
+    /// The application must not read from it, write to it, or close it.
+    #[cfg(unix)]
+    pub fn pollable_fd(&self) -> std::os::fd::RawFd {
+        self.shared
+            .state
+            .lock()
+            .expect("poisoned")
+            .notifier
+            .as_ref()
+            .map(Notifier::as_raw_fd)
+            .expect("Notifier was not set")
+    }
+}
+
+/// Helper: Take the outcome from `state`, once its connecting thread is done.
+fn take_outcome(state: &mut SharedState) -> Result<RpcConn, ConnectError> {
+    // If the thread panicked, it never set an outcome.
+    state
+        .outcome
+        .take()
+        .unwrap_or(Err(ConnectError::ConnectThreadFailed))
+}
+
+#[cfg(all(test, unix))]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use std::{
+        io::{BufRead as _, BufReader, Write as _},
+        os::unix::net::UnixListener,
+    };
+
+    /// Return true if `fd` is readable, waiting up to `timeout_ms` milliseconds.
+    fn poll_readable(fd: std::os::fd::RawFd, timeout_ms: i32) -> bool {
+        let mut pfd = libc::pollfd {
+            fd,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let n = unsafe { libc::poll(&mut pfd, 1, timeout_ms) };
+        assert!(n >= 0);
+        n == 1
+    }
+
+    /// Read one request from `arti`, check its method, and return its ID as JSON text.
+    fn read_request_id(
+        arti: &mut BufReader<std::os::unix::net::UnixStream>,
+        method: &str,
+    ) -> String {
+        let mut line = String::new();
+        arti.read_line(&mut line).unwrap();
+        let v: serde_json::Value = serde_json::from_str(&line).unwrap();
+        assert_eq!(v["method"], method);
+        v["id"].to_string()
+    }
+
+    #[test]
+    fn connect_nonblocking() {
+        let dir = std::env::temp_dir().join(format!("arti-rpc-connect-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("sock");
+        let _ = std::fs::remove_file(&path);
+        let listener = UnixListener::bind(&path).unwrap();
+
+        let pending = RpcConnBuilder::new_unix_socket(&path)
+            .prefetch_proxy_info(true)
+            .connect_nonblocking()
+            .unwrap();
+        let fd = pending.pollable_fd();
+
+        let (arti, _) = listener.accept().unwrap();
+        let mut arti_reader = BufReader::new(arti.try_clone().unwrap());
+        let mut arti = arti;
+        let id = read_request_id(&mut arti_reader, "auth:authenticate");
+        assert!(pending.try_finish().unwrap().is_none());
+        assert!(!poll_readable(fd, 0));
+
+        writeln!(arti, r#"{{"id":{id},"result":{{"session":"s1"}}}}"#).unwrap();
+        // The proxy info request arrives without waiting for anything else.
+        let proxy_id = read_request_id(&mut arti_reader, "arti:get_rpc_proxy_info");
+
+        assert!(poll_readable(fd, 10_000));
+        let conn = pending.try_finish().unwrap().unwrap();
+        assert_eq!(conn.session().unwrap().as_ref(), "s1");
+        assert!(matches!(
+            pending.try_finish(),
+            Err(ConnectError::AlreadyFinished)
+        ));
+
+        // The prefetched answer is used for the SOCKS address.
+        writeln!(
+            arti,
+            r#"{{"id":{proxy_id},"result":{{"proxies":[{{"listener":{{"socks5":{{"tcp_address":"127.0.0.1:9150"}}}}}}]}}}}"#
+        )
+        .unwrap();
+        assert_eq!(
+            conn.lookup_socks_proxy_addr().unwrap(),
+            "127.0.0.1:9150".parse().unwrap()
+        );
+
+        drop(conn);
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+}
@@ -8,20 +8,30 @@
 //! Except if noted otherwise, these invariants only hold when nobody
 //! is holding the lock on [`RequestState`].
 use std::{
-    collections::{HashMap, VecDeque},
-    sync::{Arc, Condvar, Mutex, MutexGuard},
+    collections::VecDeque,
+    net::SocketAddr,
+    panic::{RefUnwindSafe, UnwindSafe},
+    sync::{atomic::AtomicBool, Arc, Condvar, Mutex, MutexGuard, OnceLock},
+    time::Instant,
 };
 
 use crate::{
     llconn,
     msgs::{
-        request::{IdGenerator, ValidatedRequest},
-        response::ValidatedResponse,
+        builder::RequestBuilder, request::ValidatedRequest, response::ValidatedResponse,
         AnyRequestId, ObjectId,
     },
 };
 
-use super::{ProtoError, ShutdownError};
+use super::{
+    limits::{OverflowPolicy, QueueLimits, QueueUsage},
+    notify::Notifier,
+    pending::PendingTable,
+    socks_pool::SocksPool,
+    stats::{bump, ConnStats, RpcConnStats},
+    trace::{TraceEvent, TraceHook},
+    ProtoError, ShutdownError,
+};
 
 /// State held by the [`RpcConn`] for a single request ID.
 #[derive(Default)]
@@ -43,8 +53,47 @@ struct RequestState {
     /// * The condvar is Some if (and only if) some thread is waiting
     ///   on it.
     waiter: Option<Arc<Condvar>>,
+    /// If present, a callback that receives every response for this request,
+    /// instead of anybody waiting for them.
+    ///
+    /// Responses for requests with a callback are still placed in `queue`,
+    /// but they are not counted in `n_queued`,
+    /// and they are removed from `queue` by [`Receiver::run_callbacks`].
+    callback: Option<Arc<Mutex<Box<ResponseCallback>>>>,
+    /// True if we have asked Arti to cancel this request.
+    ///
+    /// Once this is set, we discard any updates for this request as they arrive,
+    /// and keep only its final response.
+    cancelled: bool,
+    /// The time at which we sent this request, for our latency statistics.
+    sent_at: Option<Instant>,
+    /// True if we have received any update for this request.
+    seen_update: bool,
+    /// The total length of the messages in `queue`.
+    ///
+    /// (Like `n_queued`, this does not count the messages for requests with a callback.)
+    queued_bytes: usize,
+    /// True if this request has failed because its queue overflowed,
+    /// and nobody has been told yet.
+    ///
+    /// When this is set, `queue` is empty, and we discard every response for this request.
+    /// We count the failure itself as one message in `n_queued`,
+    /// since it is waiting for somebody to take it.
+    overflowed: bool,
 }
 
+/// A function that receives every response to a request, as it arrives.
+///
+/// It receives `Err` if the connection fails before a final response arrives.
+/// It is not called again after it receives a final response or an error.
+pub(super) type ResponseCallback = dyn FnMut(Result<ValidatedResponse, ProtoError>) + Send;
+
+/// A callback, along with the responses (or error) that we are about to give it.
+type CallbackJob = (
+    Arc<Mutex<Box<ResponseCallback>>>,
+    Vec<Result<ValidatedResponse, ProtoError>>,
+);
+
 impl RequestState {
     /// Helper: Pop and return the next message for this request.
     ///
@@ -52,32 +101,55 @@ impl RequestState {
     /// return that.
     ///
     /// If there are no queued messages and no fatal error, return None.
+    ///
+    /// If this request's queue has overflowed, return an error saying so
+    /// (before any fatal error).
+    ///
+    /// If we take a message from the queue, decrement `n_queued`,
+    /// and subtract its length from `queued_bytes`.
     fn pop_next_msg(
         &mut self,
         fatal: &Option<ShutdownError>,
-    ) -> Option<Result<ValidatedResponse, ShutdownError>> {
+        n_queued: &mut usize,
+        queued_bytes: &mut usize,
+    ) -> Option<Result<ValidatedResponse, ProtoError>> {
         if let Some(m) = self.queue.pop_front() {
+            *n_queued -= 1;
+            self.queued_bytes -= m.msg.len();
+            *queued_bytes -= m.msg.len();
             Some(Ok(m))
+        } else if self.overflowed {
+            self.overflowed = false;
+            *n_queued -= 1;
+            Some(Err(ProtoError::QueueOverflow))
         } else {
-            fatal.as_ref().map(|f| Err(f.clone()))
+            fatal.as_ref().map(|f| Err(f.clone().into()))
+        }
+    }
+
+    /// Return the amount of data queued for this request.
+    fn usage(&self) -> QueueUsage {
+        QueueUsage {
+            msgs: self.queue.len(),
+            bytes: self.queued_bytes,
         }
     }
 }
 
 /// Mutable state to implement receiving replies on an RpcConn.
 struct ReceiverState {
-    /// Helper to assign connection- unique IDs to any requests without them.
-    id_gen: IdGenerator,
     /// A fatal error, if any has occurred.
     fatal: Option<ShutdownError>,
     /// A map from request ID to the corresponding state.
     ///
+    /// This also assigns connection-unique IDs to any requests without them.
+    ///
     /// There is an entry in this map for every request that we have sent,
     /// unless we have received a final response for that request,
-    /// or we have cancelled that request.
+    /// or we have stopped tracking it (for example, because its handle was dropped).
     ///
-    /// (TODO: We might handle cancelling differently.)
-    pending: HashMap<AnyRequestId, RequestState>,
+    /// A request that we have asked Arti to cancel stays here until its final response arrives.
+    pending: PendingTable<RequestState>,
     /// A reader that we use to receive replies from Arti.
     ///
     /// Invariants:
@@ -89,25 +161,97 @@ struct ReceiverState {
     ///
     /// (Therefore, when it becomes Some, we must signal a cv, if any is set.)
     reader: Option<crate::llconn::Reader>,
+    /// The total number of messages in the `queue` of every entry in `pending`.
+    n_queued: usize,
+    /// The total length of the messages counted in `n_queued`.
+    queued_bytes: usize,
+    /// The limits on how much we queue, and what to do when we reach them.
+    limits: QueueLimits,
+    /// A condition variable that our background reader thread waits on
+    /// when it is waiting for room in a queue.
+    ///
+    /// (See [`OverflowPolicy::Block`].)
+    space: Arc<Condvar>,
+    /// True if our background reader thread is waiting on `space`.
+    reader_blocked: bool,
+    /// If present, a notifier that we keep readable for as long as
+    /// `n_queued` is nonzero, or a fatal error has occurred.
+    notifier: Option<Notifier>,
+    /// The status of our background reader thread, if we have one.
+    background_reader: BackgroundReader,
+    /// The IDs of requests with callbacks that have responses in their queues.
+    ///
+    /// Each ID appears here at most once.
+    callbacks_ready: VecDeque<AnyRequestId>,
+    /// The IDs of requests that have (or recently had) a thread waiting on their condvar,
+    /// in roughly the order in which those threads started waiting.
+    ///
+    /// We use this to find a waiter in [`alert_anybody`](Self::alert_anybody)
+    /// without scanning every pending request.
+    ///
+    /// This list may contain stale entries, for requests that no longer have a waiter,
+    /// or that are no longer pending.
+    /// We discard these as we find them,
+    /// and we compact the list whenever it grows much larger than `pending`.
+    waiting: VecDeque<AnyRequestId>,
+}
+
+/// The status of the background reader thread for a [`Receiver`].
+///
+/// By default, the reader role is passed around among whichever threads
+/// are waiting for responses.
+/// Once a background reader thread has been launched,
+/// it takes the reader permanently, and delivers every response
+/// into the queue of the corresponding request.
+enum BackgroundReader {
+    /// No background reader has been launched.
+    NotLaunched,
+    /// A background reader has been launched, but it has not yet taken the reader.
+    ///
+    /// Whoever puts the reader back must notify this condvar
+    /// before notifying anybody else.
+    WaitingForReader(Arc<Condvar>),
+    /// A background reader has taken the reader.
+    ///
+    /// (It never gives it back.)
+    Running,
 }
 
 impl ReceiverState {
     /// Notify an arbitrarily chosen request's condvar.
-    fn alert_anybody(&self) {
-        // TODO: This is O(n) in the worst case.
-        //
-        // But with luck, nobody will make a million requests and
-        // then wait on them one at a time?
-        for ent in self.pending.values() {
-            if let Some(cv) = &ent.waiter {
+    ///
+    /// If a background reader thread is waiting to take the reader, notify it instead.
+    fn alert_anybody(&mut self) {
+        if let BackgroundReader::WaitingForReader(cv) = &self.background_reader {
+            cv.notify_one();
+            return;
+        }
+        // Each stale entry is discarded only once, so this is amortized O(1).
+        while let Some(id) = self.waiting.pop_front() {
+            if let Some(cv) = self.pending.get(&id).and_then(|ent| ent.waiter.as_ref()) {
                 cv.notify_one();
                 return;
             }
         }
     }
 
-    /// Notify the condvar for every request.
+    /// Record that some thread is now waiting on the condvar for `id`.
+    fn note_waiting(&mut self, id: &AnyRequestId) {
+        self.waiting.push_back(id.clone());
+        if self.waiting.len() > 2 * self.pending.len() + 16 {
+            // Too many stale entries: get rid of them,
+            // so that this list doesn't grow without bound.
+            let pending = &self.pending;
+            self.waiting
+                .retain(|id| pending.get(id).is_some_and(|ent| ent.waiter.is_some()));
+        }
+    }
+
+    /// Notify the condvar for every request, and for the background reader thread.
     fn alert_everybody(&self) {
+        if let BackgroundReader::WaitingForReader(cv) = &self.background_reader {
+            cv.notify_one();
+        }
         for ent in self.pending.values() {
             if let Some(cv) = &ent.waiter {
                 // By our rules, each condvar is waited on by precisely one thread.
@@ -116,6 +260,251 @@ impl ReceiverState {
             }
         }
     }
+
+    /// Queue `msg` for the request with the corresponding ID.
+    ///
+    /// If some thread is waiting for that request, add its condvar to `to_wake`.
+    /// The caller must notify every condvar in `to_wake`,
+    /// but should do so only after releasing the lock on this `ReceiverState`,
+    /// so that the threads we wake don't immediately block on that lock.
+    fn queue_msg(&mut self, msg: ValidatedResponse, to_wake: &mut Vec<Arc<Condvar>>) {
+        if let Some(ent) = self.pending.get_mut(msg.id()) {
+            if ent.cancelled && !msg.is_final() {
+                // Nobody wants to hear about the progress of a cancelled request.
+                return;
+            }
+            if ent.callback.is_some() {
+                // This message will be delivered by whoever next runs our callbacks.
+                if ent.queue.is_empty() {
+                    self.callbacks_ready.push_back(msg.id().clone());
+                }
+                ent.queue.push_back(msg);
+                return;
+            }
+            if ent.overflowed {
+                // We have already given up on this request.
+                return;
+            }
+            let len = msg.msg.len();
+            let limits = &self.limits;
+            let over = |ent: &RequestState, conn_bytes| {
+                !msg.is_final() && limits.would_exceed(ent.usage(), conn_bytes, len)
+            };
+            if over(ent, self.queued_bytes) {
+                match limits.policy {
+                    OverflowPolicy::Block => {
+                        // If we are the background reader, we have already waited for room.
+                        // Otherwise, we are reading on our own behalf,
+                        // and can't wait: we queue this message anyway.
+                    }
+                    OverflowPolicy::DropOldestUpdates => {
+                        while over(ent, self.queued_bytes) {
+                            match ent.queue.front() {
+                                Some(m) if !m.is_final() => {
+                                    let m_len = m.msg.len();
+                                    ent.queue.pop_front();
+                                    ent.queued_bytes -= m_len;
+                                    self.queued_bytes -= m_len;
+                                    self.n_queued -= 1;
+                                }
+                                _ => break,
+                            }
+                        }
+                    }
+                    OverflowPolicy::FailRequest => {
+                        // Replace everything we had queued with a single failure.
+                        self.n_queued -= ent.queue.len();
+                        self.n_queued += 1;
+                        self.queued_bytes -= ent.queued_bytes;
+                        ent.queue.clear();
+                        ent.queued_bytes = 0;
+                        ent.overflowed = true;
+                        if let Some(cv) = &ent.waiter {
+                            to_wake.push(Arc::clone(cv));
+                        }
+                        self.update_notifier();
+                        return;
+                    }
+                }
+            }
+            ent.queue.push_back(msg);
+            ent.queued_bytes += len;
+            self.queued_bytes += len;
+            self.n_queued += 1;
+            if let Some(cv) = &ent.waiter {
+                to_wake.push(Arc::clone(cv));
+            }
+            self.update_notifier();
+        } else {
+            // Nothing wanted this response any longer.
+            // _Probably_ this means that we decided to cancel the
+            // request but Arti sent this response before it handled
+            // our cancellation.
+        }
+    }
+
+    /// Update `stats` to reflect the arrival of `msg`.
+    ///
+    /// Call this once for every message that we read, before delivering it.
+    fn note_arrival(&mut self, msg: &ValidatedResponse, stats: &ConnStats) {
+        bump(&stats.bytes_read, msg.msg.len() as u64);
+        let Some(ent) = self.pending.get_mut(msg.id()) else {
+            return;
+        };
+        let elapsed = ent.sent_at.map(|t| t.elapsed());
+        if msg.is_final() {
+            bump(&stats.requests_completed, 1);
+            if let Some(elapsed) = elapsed {
+                stats.final_latency.record(elapsed);
+            }
+        } else if !ent.seen_update {
+            ent.seen_update = true;
+            if let Some(elapsed) = elapsed {
+                stats.first_update_latency.record(elapsed);
+            }
+        }
+    }
+
+    /// Record `e` as a fatal error on this connection, unless one is already recorded.
+    ///
+    /// Return true if `e` was the first fatal error.
+    ///
+    /// The caller is responsible for alerting everybody.
+    fn note_fatal(&mut self, e: &ShutdownError) -> bool {
+        if self.fatal.is_some() {
+            return false;
+        }
+        self.fatal = Some(e.clone());
+        self.update_notifier();
+        // There is no point in waiting for room any longer.
+        self.note_space();
+        true
+    }
+
+    /// Return true if the background reader should wait for room before queueing `msg`.
+    ///
+    /// (See [`OverflowPolicy::Block`].)
+    fn must_wait_for_space(&self, msg: &ValidatedResponse) -> bool {
+        if self.limits.policy != OverflowPolicy::Block || msg.is_final() || self.fatal.is_some() {
+            return false;
+        }
+        self.pending.get(msg.id()).is_some_and(|ent| {
+            // (Messages that we would discard or deliver to a callback don't need room.)
+            !ent.cancelled
+                && ent.callback.is_none()
+                && !ent.overflowed
+                && self
+                    .limits
+                    .would_exceed(ent.usage(), self.queued_bytes, msg.msg.len())
+        })
+    }
+
+    /// Wake the background reader, if it is waiting for room in a queue.
+    ///
+    /// Call this whenever we remove messages from a queue, or relax our limits.
+    fn note_space(&mut self) {
+        if self.reader_blocked {
+            self.space.notify_one();
+        }
+    }
+
+    /// Note that we are cancelling the request with ID `id`,
+    /// and discard any updates already queued for it.
+    ///
+    /// Return false if we are not tracking any such request.
+    fn note_cancelled(&mut self, id: &AnyRequestId) -> bool {
+        let Some(ent) = self.pending.get_mut(id) else {
+            return false;
+        };
+        ent.cancelled = true;
+        // (If this request has a callback, we leave its queue alone:
+        // those messages are already on their way to the callback.)
+        if ent.callback.is_none() {
+            let before = ent.queue.len();
+            ent.queue.retain(|msg| msg.is_final());
+            self.n_queued -= before - ent.queue.len();
+            let bytes: usize = ent.queue.iter().map(|msg| msg.msg.len()).sum();
+            self.queued_bytes -= ent.queued_bytes - bytes;
+            ent.queued_bytes = bytes;
+            self.update_notifier();
+            self.note_space();
+        }
+        true
+    }
+
+    /// Return true if we have asked Arti to cancel the request with ID `id`.
+    fn is_cancelled(&self, id: &AnyRequestId) -> bool {
+        self.pending.get(id).is_some_and(|ent| ent.cancelled)
+    }
+
+    /// Stop tracking the request with ID `id`, discarding any messages queued for it.
+    fn remove_pending(&mut self, id: &AnyRequestId) {
+        if let Some(ent) = self.pending.remove(id) {
+            if ent.callback.is_none() {
+                self.n_queued -= ent.queue.len() + usize::from(ent.overflowed);
+                self.queued_bytes -= ent.queued_bytes;
+                self.update_notifier();
+                self.note_space();
+            }
+        }
+    }
+
+    /// Take every response that should now be delivered to a callback.
+    ///
+    /// Stop tracking any request for which we are returning a final response or an error.
+    fn take_callback_jobs(&mut self) -> Vec<CallbackJob> {
+        /// Return true if `msgs` ends with a final response.
+        fn ends_with_final(msgs: &[Result<ValidatedResponse, ProtoError>]) -> bool {
+            matches!(msgs.last(), Some(Ok(m)) if m.is_final())
+        }
+
+        let mut jobs = Vec::new();
+        while let Some(id) = self.callbacks_ready.pop_front() {
+            let Some(ent) = self.pending.get_mut(&id) else {
+                continue;
+            };
+            let Some(cb) = &ent.callback else {
+                continue;
+            };
+            let cb = Arc::clone(cb);
+            let msgs: Vec<_> = ent.queue.drain(..).map(Ok).collect();
+            if ends_with_final(&msgs) {
+                self.pending.remove(&id);
+            }
+            jobs.push((cb, msgs));
+        }
+
+        if let Some(fatal) = &self.fatal {
+            // Every remaining callback gets the fatal error.
+            let ids: Vec<_> = self
+                .pending
+                .iter()
+                .filter(|(_, ent)| ent.callback.is_some())
+                .map(|(id, _)| id)
+                .collect();
+            for id in ids {
+                let Some(ent) = self.pending.remove(&id) else {
+                    continue;
+                };
+                let Some(cb) = ent.callback else {
+                    continue;
+                };
+                let mut msgs: Vec<_> = ent.queue.into_iter().map(Ok).collect();
+                if !ends_with_final(&msgs) {
+                    msgs.push(Err(fatal.clone().into()));
+                }
+                jobs.push((cb, msgs));
+            }
+        }
+        jobs
+    }
+
+    /// Make our notifier (if any) readable or unreadable as appropriate.
+    fn update_notifier(&mut self) {
+        if let Some(notifier) = &mut self.notifier {
+            notifier.set_readable(self.n_queued > 0 || self.fatal.is_some());
+        }
+    }
 }
 
 /// Object to receive messages on an RpcConn.
@@ -134,6 +523,14 @@ pub(super) struct Receiver {
     /// This lock should only be held briefly, and never while reading from the
     /// `llconn::Reader`.
     state: Mutex<ReceiverState>,
+    /// Statistics about this connection.
+    ///
+    /// These are updated without holding `state`'s lock.
+    stats: ConnStats,
+    /// A function to tell about every step in the life of each request, if any.
+    ///
+    /// We call this without holding any of our locks.
+    trace_hook: OnceLock<Box<TraceHook>>,
 }
 
 /// An open RPC connection to Arti.
@@ -154,13 +551,64 @@ pub struct RpcConn {
     /// This lock does not nest with the`receiver` lock.  You must never hold
     /// both at the same time.
     ///
-    /// (For now, this lock is _ONLY_ held in the send_request method.)
+    /// (For now, this lock is _ONLY_ held in the send_validated
+    /// and send_request_batch methods.)
     #[educe(Debug(ignore))]
     writer: Mutex<llconn::Writer>,
 
     /// If set, we are authenticated and we have negotiated a session that has
     /// this ObjectID.
     pub(super) session: Option<ObjectId>,
+
+    /// If set, the address of Arti's SOCKS proxy, as most recently reported by Arti.
+    ///
+    /// We look this up the first time we need it, and forget it if we can't connect to it.
+    /// (See `RpcConn::connect_to_socks_proxy`.)
+    pub(super) socks_proxy_addr: Mutex<Option<SocketAddr>>,
+
+    /// If set, a request for Arti's proxy information that we sent in advance,
+    /// along with the text of that request.
+    ///
+    /// (See `RpcConn::prefetch_proxy_info`.)
+    pub(super) proxy_info_prefetch: Mutex<Option<(String, super::RequestHandle)>>,
+
+    /// If set, a pool of pre-warmed connections to Arti's SOCKS proxy.
+    ///
+    /// (See `RpcConn::enable_socks_pool`.)
+    pub(super) socks_pool: OnceLock<Arc<SocksPool>>,
+
+    /// A function to shut down our connection to Arti, if we have one.
+    ///
+    /// We use this on drop if a background reader thread is running:
+    /// otherwise, that thread would keep the connection open forever.
+    #[educe(Debug(ignore))]
+    shutdown_on_drop: Option<Box<ShutdownFn>>,
+
+    /// If set, the file descriptors that Arti has sent us on this connection.
+    ///
+    /// This is only set when our connection can carry file descriptors.
+    /// (See `RpcConn::open_stream_fd`.)
+    #[cfg(unix)]
+    pub(super) passed_fds: Option<Arc<super::fdpass::PassedFds>>,
+
+    /// True if Arti has told us that it can't send us streams as file descriptors.
+    #[cfg(unix)]
+    pub(super) fd_streams_unsupported: AtomicBool,
+}
+
+/// A function used to shut down the connection to Arti.
+///
+/// (We require the unwind-safety bounds so that `RpcConn` can be used across the FFI boundary.)
+type ShutdownFn = dyn FnOnce() + Send + Sync + UnwindSafe + RefUnwindSafe;
+
+impl Drop for RpcConn {
+    fn drop(&mut self) {
+        if let Some(shutdown) = self.shutdown_on_drop.take() {
+            if self.receiver.has_background_reader() {
+                shutdown();
+            }
+        }
+    }
 }
 
 /// Instruction to alert some additional condvar(s) before releasing our lock and returning
@@ -191,15 +639,196 @@ impl RpcConn {
         Self {
             receiver: Arc::new(Receiver {
                 state: Mutex::new(ReceiverState {
-                    id_gen: IdGenerator::default(),
                     fatal: None,
-                    pending: HashMap::new(),
+                    pending: PendingTable::default(),
                     reader: Some(reader),
+                    n_queued: 0,
+                    queued_bytes: 0,
+                    limits: QueueLimits::default(),
+                    space: Arc::new(Condvar::new()),
+                    reader_blocked: false,
+                    notifier: None,
+                    background_reader: BackgroundReader::NotLaunched,
+                    callbacks_ready: VecDeque::new(),
+                    waiting: VecDeque::new(),
                 }),
+                stats: ConnStats::default(),
+                trace_hook: OnceLock::new(),
             }),
             writer: Mutex::new(writer),
             session: None,
+            socks_proxy_addr: Mutex::new(None),
+            proxy_info_prefetch: Mutex::new(None),
+            socks_pool: OnceLock::new(),
+            shutdown_on_drop: None,
+            #[cfg(unix)]
+            passed_fds: None,
+            #[cfg(unix)]
+            fd_streams_unsupported: AtomicBool::new(false),
+        }
+    }
+
+    /// Note that we are about to ask Arti to cancel the request with ID `id`.
+    ///
+    /// Return false if we are not tracking any such request,
+    /// in which case there is nothing to cancel.
+    pub(super) fn note_cancelled(&self, id: &AnyRequestId) -> bool {
+        let mut state = self.receiver.state.lock().expect("poisoned");
+        state.note_cancelled(id)
+    }
+
+    /// Switch both directions of this connection to use `framing`.
+    ///
+    /// The caller must make sure that Arti is switching at the same point,
+    /// and that no requests are in flight.
+    ///
+    /// (We only call this while authenticating, before anybody else can use the connection,
+    /// so nobody can be holding the reader.)
+    pub(super) fn set_framing(&self, framing: llconn::Framing) {
+        self.receiver
+            .state
+            .lock()
+            .expect("poisoned")
+            .reader
+            .as_mut()
+            .expect("Tried to change framing while somebody was reading")
+            .set_framing(framing);
+        self.writer.lock().expect("poisoned").set_framing(framing);
+    }
+
+    /// Set the longest length-prefixed response that this connection accepts.
+    ///
+    /// (We only call this while connecting, before anybody else can use the connection,
+    /// so nobody can be holding the reader.)
+    pub(super) fn set_max_response_len(&self, max_response_len: usize) {
+        self.receiver
+            .state
+            .lock()
+            .expect("poisoned")
+            .reader
+            .as_mut()
+            .expect("Tried to change the response limit while somebody was reading")
+            .set_max_response_len(max_response_len);
+    }
+
+    /// Return the number of requests on this connection
+    /// that have not yet received a final response.
+    ///
+    /// (This includes requests that nobody is currently waiting for.)
+    pub fn n_outstanding(&self) -> usize {
+        self.receiver.state.lock().expect("poisoned").pending.len()
+    }
+
+    /// Return a snapshot of the statistics for this connection.
+    ///
+    /// (The counters are maintained without any locking;
+    /// this function takes our lock briefly, to count the pending requests and queued responses.)
+    pub fn stats(&self) -> RpcConnStats {
+        let mut stats = self.receiver.stats.snapshot();
+        let state = self.receiver.state.lock().expect("poisoned");
+        stats.n_pending = state.pending.len();
+        stats.n_queued = state.n_queued;
+        stats.queued_bytes = state.queued_bytes as u64;
+        stats
+    }
+
+    /// Set the limits on how many responses this connection will queue for the application,
+    /// and what to do when a response would exceed them.
+    ///
+    /// The new limits replace any previous ones,
+    /// and apply to every response that arrives from now on.
+    /// (We don't discard anything that is already queued.)
+    ///
+    /// If `limits` has any limit with [`OverflowPolicy::Block`],
+    /// this launches a background reader thread (if one is not already running).
+    pub fn set_queue_limits(&self, limits: QueueLimits) -> Result<(), ProtoError> {
+        let needs_background_reader = limits.is_limited() && limits.policy == OverflowPolicy::Block;
+        {
+            let mut state = self.receiver.state.lock().expect("poisoned");
+            state.limits = limits;
+            state.note_space();
         }
+        if needs_background_reader {
+            self.ensure_background_reader()?;
+        }
+        Ok(())
+    }
+
+    /// Install `hook` to be told about every step in the life of each request on this connection.
+    ///
+    /// See [`TraceEvent`] for the events that `hook` receives.
+    /// It receives each event along with the ID of the request,
+    /// and the time at which the event happened.
+    ///
+    /// The hook is called from whichever thread caused the event,
+    /// without holding any of this connection's locks.
+    /// Its events for responses are called from the thread that is reading from Arti,
+    /// before they are handed on: so it should return quickly.
+    ///
+    /// A connection can only have one trace hook, and it can't be removed.
+    /// Return an error if this connection already has one.
+    /// (When no hook is installed, tracing costs no more than checking for a hook.)
+    pub fn set_trace_hook<F>(&self, hook: F) -> Result<(), ProtoError>
+    where
+        F: Fn(&AnyRequestId, TraceEvent, Instant)
+            + Send
+            + Sync
+            + UnwindSafe
+            + RefUnwindSafe
+            + 'static,
+    {
+        self.receiver
+            .trace_hook
+            .set(Box::new(hook))
+            .map_err(|_| ProtoError::TraceHookAlreadySet)
+    }
+
+    /// Return a file descriptor that is readable whenever some response
+    /// is ready to be taken from this connection with [`try_wait`](super::RequestHandle::try_wait),
+    /// or a fatal error has occurred.
+    ///
+    /// The first time this is called, it launches a background reader thread
+    /// (if one is not already running).
+    ///
+    /// The file descriptor remains owned by this `RpcConn`;
+    /// it stays valid for as long as this `RpcConn` exists.
+    /// The application must not read from it, write to it, or close it.
+    #[cfg(unix)]
+    pub fn pollable_fd(&self) -> Result<std::os::fd::RawFd, ProtoError> {
+        let fd = {
+            let mut state = self.receiver.state.lock().expect("poisoned");
+            if state.notifier.is_none() {
+                let notifier =
+                    Notifier::new().map_err(|e| ProtoError::BackgroundReader(Arc::new(e)))?;
+                state.notifier = Some(notifier);
+                state.update_notifier();
+            }
+            state
+                .notifier
+                .as_ref()
+                .map(Notifier::as_raw_fd)
+                .expect("Notifier was not set")
+        };
+        self.ensure_background_reader()?;
+        Ok(fd)
+    }
+
+    /// Launch a background reader thread for this connection, if there is not one already.
+    pub(super) fn ensure_background_reader(&self) -> Result<(), ProtoError> {
+        Arc::clone(&self.receiver).ensure_background_reader()
+    }
+
+    /// Arrange for `f` to be called when this `RpcConn` is dropped,
+    /// if a background reader thread is running.
+    ///
+    /// `f` should shut down the writing half of our connection to Arti,
+    /// so that Arti will close the connection,
+    /// and the background reader thread will exit.
+    pub(super) fn set_shutdown_on_drop<F>(&mut self, f: F)
+    where
+        F: FnOnce() + Send + Sync + UnwindSafe + RefUnwindSafe + 'static,
+    {
+        self.shutdown_on_drop = Some(Box::new(f));
     }
 
     /// Send the request in `msg` on this connection, and return a RequestHandle
@@ -207,55 +836,236 @@ impl RpcConn {
     ///
     /// We validate `msg` before sending it out, and reject it if it doesn't
     /// make sense. If `msg` has no `id` field, we allocate a new one
-    /// according to the rules in [`IdGenerator`].
+    /// that is quick for us to look up;
+    /// see [`PendingTable`] for the rules.
     ///
     /// Limitation: We don't preserved unrecognized fields in the framing and meta
     /// parts of `msg`.  See notes in `request.rs`.
     pub(super) fn send_request(&self, msg: &str) -> Result<super::RequestHandle, ProtoError> {
-        use std::collections::hash_map::Entry::*;
+        let id = self.send_request_inner(msg, None)?;
+        Ok(super::RequestHandle {
+            id,
+            conn: Mutex::new(Arc::clone(&self.receiver)),
+            finished: AtomicBool::new(false),
+        })
+    }
+
+    /// Send the request in `msg` on this connection,
+    /// and arrange for `callback` to receive every response to it.
+    ///
+    /// The callback is invoked from whichever thread is reading from the connection
+    /// (usually our background reader thread), without holding any of our locks.
+    /// It may therefore send other requests on this `RpcConn`,
+    /// but it must not wait for their responses (since it holds the reader role),
+    /// and it should not block for long.
+    ///
+    /// Return the ID of the request.
+    pub(super) fn send_request_with_callback(
+        &self,
+        msg: &str,
+        callback: Box<ResponseCallback>,
+    ) -> Result<AnyRequestId, ProtoError> {
+        // Somebody needs to be reading, even if nobody is waiting.
+        self.ensure_background_reader()?;
+        self.send_request_inner(msg, Some(Arc::new(Mutex::new(callback))))
+    }
 
+    /// Send the request in `request` on this connection, and return a RequestHandle
+    /// to wait for a reply.
+    ///
+    /// Since `request` is already encoded, we don't need to validate it:
+    /// we only give it a new ID.
+    pub(super) fn send_built_request(
+        &self,
+        request: &RequestBuilder,
+    ) -> Result<super::RequestHandle, ProtoError> {
+        // We hold the builder's lock until we're done sending,
+        // so that nobody can change the request while we're borrowing it.
+        let mut request = request.lock();
+        let id =
+            self.send_validated(|pending| Ok(request.to_validated(pending.next_id())), None)?;
+        Ok(super::RequestHandle {
+            id,
+            conn: Mutex::new(Arc::clone(&self.receiver)),
+            finished: AtomicBool::new(false),
+        })
+    }
+
+    /// Helper: Send the request in `msg`, and start tracking its responses.
+    ///
+    /// If `callback` is provided, it will receive those responses.
+    /// Otherwise, someone will need to wait for them with its ID.
+    fn send_request_inner(
+        &self,
+        msg: &str,
+        callback: Option<Arc<Mutex<Box<ResponseCallback>>>>,
+    ) -> Result<AnyRequestId, ProtoError> {
+        self.send_validated(
+            |pending| {
+                Ok(ValidatedRequest::from_string_loose(msg, || {
+                    pending.next_id()
+                })?)
+            },
+            callback,
+        )
+    }
+
+    /// Helper: Send the request returned by `validate`, and start tracking its responses.
+    ///
+    /// We call `validate` with our lock held,
+    /// so that it can take a new ID from our pending table if it needs one.
+    ///
+    /// If `callback` is provided, it will receive those responses.
+    /// Otherwise, someone will need to wait for them with its ID.
+    fn send_validated<'a, F>(
+        &self,
+        validate: F,
+        callback: Option<Arc<Mutex<Box<ResponseCallback>>>>,
+    ) -> Result<AnyRequestId, ProtoError>
+    where
+        F: FnOnce(&mut PendingTable<RequestState>) -> Result<ValidatedRequest<'a>, ProtoError>,
+    {
         let mut state = self.receiver.state.lock().expect("poisoned");
         if let Some(f) = &state.fatal {
             // If there's been a fatal error we don't even try to send the request.
             return Err(f.clone().into());
         }
 
-        // Convert this request into validated form (with an ID) and re-encode it.
-        let valid: ValidatedRequest =
-            ValidatedRequest::from_string_loose(msg, || state.id_gen.next_id())?;
+        // Convert this request into validated form, with an ID.
+        let valid = validate(&mut state.pending)?;
 
         // Do the necessary housekeeping before we send the request, so that
         // we'll be able to understand the replies.
         let id = valid.id().clone();
-        match state.pending.entry(id.clone()) {
-            Occupied(_) => return Err(ProtoError::RequestIdInUse),
-            Vacant(v) => {
-                v.insert(RequestState::default());
-            }
+        let submitted_at = Instant::now();
+        let ent = RequestState {
+            callback,
+            sent_at: Some(submitted_at),
+            ..RequestState::default()
+        };
+        if state.pending.insert(id.clone(), ent).is_err() {
+            return Err(ProtoError::RequestIdInUse);
         }
         // Release the lock on the ReceiverState here; the two locks must not overlap.
         drop(state);
+        if let Some(hook) = self.receiver.tracer() {
+            hook(&id, TraceEvent::Submitted, submitted_at);
+        }
 
-        // NOTE: This is the only block of code that holds the writer lock!
+        // NOTE: This and `send_request_batch` are the only blocks of code
+        // that hold the writer lock!
         let write_outcome = { self.writer.lock().expect("poisoned").send_valid(&valid) };
 
         match write_outcome {
-            Err(e) => {
-                // A failed write is a fatal error for everybody.
-                let e = ShutdownError::Write(Arc::new(e));
-                let mut state = self.receiver.state.lock().expect("poisoned");
-                if state.fatal.is_none() {
-                    state.fatal = Some(e.clone());
-                    state.alert_everybody();
-                }
-                Err(e.into())
+            Err(e) => Err(self.note_write_failure(e, std::slice::from_ref(&id))),
+            Ok(()) => {
+                self.note_sent(std::slice::from_ref(&valid));
+                Ok(id)
+            }
+        }
+    }
+
+    /// Send every request in `msgs` on this connection, with a single vectored write,
+    /// and return a handle for each one, in the same order.
+    ///
+    /// Either all of the requests are sent, or none of them are:
+    /// if any of them is invalid, or uses an ID that is already in use,
+    /// we return an error without sending anything.
+    pub(super) fn send_request_batch(
+        &self,
+        msgs: &[&str],
+    ) -> Result<Vec<super::RequestHandle>, ProtoError> {
+        let mut state = self.receiver.state.lock().expect("poisoned");
+        if let Some(f) = &state.fatal {
+            return Err(f.clone().into());
+        }
+
+        let mut valid: Vec<ValidatedRequest> = Vec::with_capacity(msgs.len());
+        let submitted_at = Instant::now();
+        let outcome: Result<(), ProtoError> = msgs.iter().try_for_each(|msg| {
+            let v = ValidatedRequest::from_string_loose(msg, || state.pending.next_id())?;
+            let ent = RequestState {
+                sent_at: Some(submitted_at),
+                ..RequestState::default()
+            };
+            if state.pending.insert(v.id().clone(), ent).is_err() {
+                return Err(ProtoError::RequestIdInUse);
+            }
+            valid.push(v);
+            Ok(())
+        });
+        if let Err(e) = outcome {
+            // Nothing has been sent; forget every request we registered.
+            for v in &valid {
+                state.pending.remove(v.id());
             }
+            return Err(e);
+        }
+        // Release the lock on the ReceiverState here; the two locks must not overlap.
+        drop(state);
 
-            Ok(()) => Ok(super::RequestHandle {
-                id,
-                conn: Mutex::new(Arc::clone(&self.receiver)),
-            }),
+        let ids: Vec<AnyRequestId> = valid.iter().map(|v| v.id().clone()).collect();
+        if let Some(hook) = self.receiver.tracer() {
+            for id in &ids {
+                hook(id, TraceEvent::Submitted, submitted_at);
+            }
         }
+
+        // NOTE: See the note in `send_validated` about the writer lock.
+        let write_outcome = {
+            self.writer
+                .lock()
+                .expect("poisoned")
+                .send_valid_batch(&valid)
+        };
+
+        match write_outcome {
+            Err(e) => Err(self.note_write_failure(e, &ids)),
+            Ok(()) => {
+                self.note_sent(&valid);
+                Ok(ids
+                    .into_iter()
+                    .map(|id| super::RequestHandle {
+                        id,
+                        conn: Mutex::new(Arc::clone(&self.receiver)),
+                        finished: AtomicBool::new(false),
+                    })
+                    .collect())
+            }
+        }
+    }
+
+    /// Helper: Update our statistics, and tell our trace hook (if any),
+    /// to reflect that we have sent `requests`.
+    fn note_sent(&self, requests: &[ValidatedRequest<'_>]) {
+        if let Some(hook) = self.receiver.tracer() {
+            let now = Instant::now();
+            for r in requests {
+                hook(r.id(), TraceEvent::Written, now);
+            }
+        }
+        let stats = &self.receiver.stats;
+        bump(&stats.requests_sent, requests.len() as u64);
+        // (Count the newline that terminates each request, as we always have.)
+        let n_bytes: usize = requests.iter().map(|r| r.len() + 1).sum();
+        bump(&stats.bytes_written, n_bytes as u64);
+    }
+
+    /// Helper: Record that a write has failed while sending the requests in `ids`,
+    /// and return the error to report to our caller.
+    ///
+    /// A failed write is a fatal error for everybody.
+    fn note_write_failure(&self, e: std::io::Error, ids: &[AnyRequestId]) -> ProtoError {
+        let e = ShutdownError::Write(Arc::new(e));
+        let mut state = self.receiver.state.lock().expect("poisoned");
+        if state.note_fatal(&e) {
+            state.alert_everybody();
+        }
+        // We report this failure to our caller, so no callback should also get it.
+        for id in ids {
+            state.pending.remove(id);
+        }
+        e.into()
     }
 }
 
@@ -267,10 +1077,27 @@ impl Receiver {
         &self,
         id: &AnyRequestId,
     ) -> Result<ValidatedResponse, ProtoError> {
+        self.wait_on_message_for_until(id, None)
+            .map(|msg| msg.expect("Timed out without a deadline!?"))
+    }
+
+    /// As [`wait_on_message_for`](Self::wait_on_message_for), but give up at `deadline`
+    /// (if it is provided) and return `Ok(None)`.
+    ///
+    /// A waiter with a deadline never takes the reader role,
+    /// since it would have no way to stop reading in time.
+    /// Therefore, if `deadline` is provided, the caller must already have made sure
+    /// (with [`ensure_background_reader`](Self::ensure_background_reader))
+    /// that a background reader is reading on everybody's behalf.
+    pub(super) fn wait_on_message_for_until(
+        &self,
+        id: &AnyRequestId,
+        deadline: Option<Instant>,
+    ) -> Result<Option<ValidatedResponse>, ProtoError> {
         // Here in wait_on_message_for_impl, we do the the actual work
         // of waiting for the message.
         let state = self.state.lock().expect("posioned");
-        let (result, mut state, should_alert) = self.wait_on_message_for_impl(state, id);
+        let (result, mut state, should_alert) = self.wait_on_message_for_impl(state, id, deadline);
 
         // Great; we have a message or a fatal error.  All we need to do now
         // is to restore our invariants before we drop state_lock.
@@ -283,7 +1110,8 @@ impl Receiver {
             // replies for this request.
             let is_final = match &result {
                 Err(_) => true,
-                Ok(r) => r.is_final(),
+                Ok(None) => false,
+                Ok(Some(r)) => r.is_final(),
             };
 
             if is_final {
@@ -297,7 +1125,7 @@ impl Receiver {
                 // Note 3: On DuplicateWait, it is not totally clear whether we should
                 // remove or not.  But that's an internal error that should never occur,
                 // so it is probably okay if we let the _other_ waiter keep on trying.
-                state.pending.remove(id);
+                state.remove_pending(id);
             }
 
             match should_alert {
@@ -307,7 +1135,11 @@ impl Receiver {
                 AlertWhom::Everybody => state.alert_everybody(),
             }
         })();
+        drop(state);
 
+        if let (Some(hook), Ok(Some(msg))) = (self.tracer(), &result) {
+            hook(msg.id(), TraceEvent::Delivered, Instant::now());
+        }
         result
     }
 
@@ -324,12 +1156,15 @@ impl Receiver {
     ///   depending on the resulting `AlertWhom`.
     ///
     /// The caller must not drop the `MutexGuard` until it has done the above.
+    ///
+    /// Returns `Ok(None)` only if `deadline` is provided and has passed.
     fn wait_on_message_for_impl<'a>(
         &'a self,
         mut state_lock: MutexGuard<'a, ReceiverState>,
         id: &AnyRequestId,
+        deadline: Option<Instant>,
     ) -> (
-        Result<ValidatedResponse, ProtoError>,
+        Result<Option<ValidatedResponse>, ProtoError>,
         MutexGuard<'a, ReceiverState>,
         AlertWhom,
     ) {
@@ -350,6 +1185,8 @@ impl Receiver {
             return (Err(ProtoError::RequestCompleted), state_lock, should_alert);
         };
 
+        // True if we have waited on a condvar, and so might have had the reader handed to us.
+        let mut have_waited = false;
         let mut reader = loop {
             // Note: It might be nice to use a hash_map::Entry here, but it
             // doesn't really work the way we want.  The `entry()` API is always
@@ -361,9 +1198,12 @@ impl Receiver {
                 return (Err(ProtoError::DuplicateWait), state_lock, should_alert);
             }
 
-            if let Some(ready) = this_ent.pop_next_msg(&state.fatal) {
+            if let Some(ready) =
+                this_ent.pop_next_msg(&state.fatal, &mut state.n_queued, &mut state.queued_bytes)
+            {
                 // There is a reply for us, or a fatal error.
-                return (ready.map_err(ProtoError::from), state_lock, should_alert);
+                state.note_space();
+                return (ready.map(Some), state_lock, should_alert);
             }
 
             // If we reach this point, we are about to either take the reader or
@@ -371,17 +1211,50 @@ impl Receiver {
             // sure that at least one other cv gets notified.
             should_alert = AlertWhom::Anybody;
 
-            if let Some(r) = state.reader.take() {
-                // Nobody else is reading; we have to do it.
-                break r;
+            match deadline {
+                None => {
+                    if let Some(r) = state.reader.take() {
+                        // Nobody else is reading; we have to do it.
+                        if have_waited {
+                            bump(&self.stats.reader_handoffs, 1);
+                        }
+                        break r;
+                    }
+                }
+                Some(deadline) => {
+                    if Instant::now() >= deadline {
+                        // Our caller's `wait_on_message_for_until` will pass on
+                        // the reader role, if it was handed to us.
+                        return (Ok(None), state_lock, should_alert);
+                    }
+                    if state.reader.is_some() {
+                        // We won't take the reader; make sure that somebody does.
+                        state.alert_anybody();
+                    }
+                }
             }
 
             // Somebody else is reading; register a condvar.
             let cv = Arc::new(Condvar::new());
+            // (We look up our entry again, since `alert_anybody` needed all of `state`.)
+            this_ent = match state.pending.get_mut(id) {
+                Some(e) => e,
+                None => return (Err(ProtoError::RequestCompleted), state_lock, should_alert),
+            };
             this_ent.waiter = Some(Arc::clone(&cv));
+            state.note_waiting(id);
 
-            state_lock = cv.wait(state_lock).expect("poisoned lock");
+            state_lock = match deadline {
+                None => cv.wait(state_lock).expect("poisoned lock"),
+                Some(deadline) => {
+                    let timeout = deadline.saturating_duration_since(Instant::now());
+                    cv.wait_timeout(state_lock, timeout)
+                        .expect("poisoned lock")
+                        .0
+                }
+            };
             state = &mut state_lock;
+            have_waited = true;
             // Restore `this_ent`...
             let Some(e) = state.pending.get_mut(id) else {
                 return (Err(ProtoError::RequestCompleted), state_lock, should_alert);
@@ -400,7 +1273,11 @@ impl Receiver {
         // Put the reader back.
         state_lock.reader = Some(reader);
 
-        (result.map_err(ProtoError::from), state_lock, should_alert)
+        (
+            result.map(Some).map_err(ProtoError::from),
+            state_lock,
+            should_alert,
+        )
     }
 
     /// Read messages, delivering them as appropriate, until we find one for `id`,
@@ -423,21 +1300,31 @@ impl Receiver {
         MutexGuard<'a, ReceiverState>,
         AlertWhom,
     ) {
+        // Condvars for the requests whose messages we have queued since we last released the lock.
+        let mut to_wake = Vec::new();
         loop {
+            // Since we are the reader, it's our job to deliver responses to callbacks.
+            state_lock = self.run_callbacks(state_lock);
+
             // Importantly, we drop the state lock while we are reading.
             // This is okay, since all our invariants should hold at this point.
             drop(state_lock);
+            wake_all(&mut to_wake);
 
-            let result: Result<ValidatedResponse, _> = match reader.read_msg() {
-                Err(e) => Err(ShutdownError::Read(Arc::new(e))),
-                Ok(None) => Err(ShutdownError::ConnectionClosed),
-                Ok(Some(m)) => m.try_validate().map_err(ShutdownError::from),
-            };
+            let result = read_validated_msg(reader);
+            self.trace_arrival(&result);
 
             state_lock = self.state.lock().expect("poisoned lock");
             let state = &mut state_lock;
+            if let Ok(m) = &result {
+                state.note_arrival(m, &self.stats);
+            }
 
             match result {
+                Ok(m) if m.id() == id && !m.is_final() && state.is_cancelled(id) => {
+                    // This is an update for us, but we've cancelled this request;
+                    // discard it and keep reading.
+                }
                 Ok(m) if m.id() == id => {
                     // This only is for us, so there's no need to alert anybody
                     // or queue it.
@@ -448,27 +1335,246 @@ impl Receiver {
                     //
                     // If it's the first one encountered, queue the error, and
                     // return it.
-                    if state.fatal.is_none() {
-                        state.fatal = Some(e.clone());
-                    }
+                    let _first: bool = state.note_fatal(&e);
                     return (Err(e), state_lock, AlertWhom::Everybody);
                 }
                 Ok(m) => {
                     // This is a message for exactly one ID, that isn't us.
                     // Queue it and notify them.
-                    if let Some(ent) = state.pending.get_mut(m.id()) {
-                        ent.queue.push_back(m);
-                        if let Some(cv) = &ent.waiter {
-                            cv.notify_one();
-                        }
-                    } else {
-                        // Nothing wanted this response any longer.
-                        // _Probably_ this means that we decided to cancel the
-                        // request but Arti sent this response before it handled
-                        // our cancellation.
-                    }
+                    state.queue_msg(m, &mut to_wake);
                 }
             };
         }
     }
+
+    /// Return a message for the request with the provided `id`, if one is queued,
+    /// or a copy of the fatal error on this connection, if there is one.
+    ///
+    /// Return `Ok(None)` if neither is available.  Never blocks.
+    ///
+    /// Unlike [`wait_on_message_for`](Self::wait_on_message_for), this method never takes
+    /// the reader role; the caller must make sure that somebody is reading,
+    /// typically by launching a background reader.
+    pub(super) fn try_take_message_for(
+        &self,
+        id: &AnyRequestId,
+    ) -> Result<Option<ValidatedResponse>, ProtoError> {
+        let mut state_lock = self.state.lock().expect("poisoned");
+        let state: &mut ReceiverState = &mut state_lock;
+
+        let Some(this_ent) = state.pending.get_mut(id) else {
+            return Err(ProtoError::RequestCompleted);
+        };
+        if this_ent.waiter.is_some() {
+            // Somebody is already blocking on this request.
+            return Err(ProtoError::DuplicateWait);
+        }
+        let result =
+            match this_ent.pop_next_msg(&state.fatal, &mut state.n_queued, &mut state.queued_bytes)
+            {
+                None => return Ok(None),
+                Some(r) => r,
+            };
+        state.note_space();
+
+        let is_final = match &result {
+            Err(_) => true,
+            Ok(r) => r.is_final(),
+        };
+        if is_final {
+            state.remove_pending(id);
+        } else {
+            state.update_notifier();
+        }
+        drop(state_lock);
+
+        if let (Some(hook), Ok(msg)) = (self.tracer(), &result) {
+            hook(msg.id(), TraceEvent::Delivered, Instant::now());
+        }
+        result.map(Some)
+    }
+
+    /// Deliver every pending response (or fatal error) to the corresponding callbacks.
+    ///
+    /// Takes a `MutexGuard`, and releases it while the callbacks are running;
+    /// returns a new `MutexGuard` once there are no more responses to deliver.
+    ///
+    /// Only the thread holding the reader role
+    /// (or the background reader thread, after a fatal error)
+    /// may call this function:
+    /// that way, each callback receives its responses in order.
+    fn run_callbacks<'a>(
+        &'a self,
+        mut state_lock: MutexGuard<'a, ReceiverState>,
+    ) -> MutexGuard<'a, ReceiverState> {
+        loop {
+            let jobs = state_lock.take_callback_jobs();
+            if jobs.is_empty() {
+                return state_lock;
+            }
+            drop(state_lock);
+            for (cb, msgs) in jobs {
+                let mut cb = cb.lock().expect("poisoned");
+                for msg in msgs {
+                    if let (Some(hook), Ok(msg)) = (self.tracer(), &msg) {
+                        hook(msg.id(), TraceEvent::Delivered, Instant::now());
+                    }
+                    (cb)(msg);
+                }
+            }
+            state_lock = self.state.lock().expect("poisoned");
+        }
+    }
+
+    /// Return our trace hook, if we have one.
+    #[inline]
+    fn tracer(&self) -> Option<&TraceHook> {
+        self.trace_hook.get().map(Box::as_ref)
+    }
+
+    /// Tell our trace hook (if any) about the message we have just read, if there is one.
+    ///
+    /// Call this before taking our lock, so that the time we report
+    /// doesn't include any time spent waiting for it.
+    #[inline]
+    fn trace_arrival(&self, result: &Result<ValidatedResponse, ShutdownError>) {
+        if let (Some(hook), Ok(msg)) = (self.tracer(), result) {
+            hook(msg.id(), TraceEvent::received(msg), Instant::now());
+        }
+    }
+
+    /// Stop tracking the request with ID `id`.
+    ///
+    /// Any responses that have been queued for it are discarded,
+    /// as are any that arrive later.
+    pub(super) fn forget_request(&self, id: &AnyRequestId) {
+        let mut state = self.state.lock().expect("poisoned");
+        state.remove_pending(id);
+    }
+
+    /// Return true if a background reader thread has been launched for this receiver.
+    fn has_background_reader(&self) -> bool {
+        let state = self.state.lock().expect("poisoned");
+        !matches!(state.background_reader, BackgroundReader::NotLaunched)
+    }
+
+    /// Launch a background reader thread for this receiver, if there is not one already.
+    ///
+    /// The thread takes the reader role as soon as it is available,
+    /// and keeps it until the connection is closed or a fatal error occurs.
+    /// Until then, it queues every response it receives,
+    /// and wakes any thread waiting for that response.
+    pub(super) fn ensure_background_reader(self: Arc<Self>) -> Result<(), ProtoError> {
+        let cv = {
+            let mut state = self.state.lock().expect("poisoned");
+            if !matches!(state.background_reader, BackgroundReader::NotLaunched) {
+                return Ok(());
+            }
+            let cv = Arc::new(Condvar::new());
+            state.background_reader = BackgroundReader::WaitingForReader(Arc::clone(&cv));
+            cv
+        };
+
+        let receiver = Arc::clone(&self);
+        let outcome = std::thread::Builder::new()
+            .name("arti-rpc-reader".into())
+            .spawn(move || receiver.run_background_reader(&cv));
+
+        if let Err(e) = outcome {
+            let mut state = self.state.lock().expect("poisoned");
+            state.background_reader = BackgroundReader::NotLaunched;
+            return Err(ProtoError::BackgroundReader(Arc::new(e)));
+        }
+        Ok(())
+    }
+
+    /// Body of a background reader thread:
+    /// Wait to take the reader, and then deliver messages until a fatal error occurs.
+    fn run_background_reader(&self, cv: &Condvar) {
+        let mut state_lock = self.state.lock().expect("poisoned");
+        let mut reader = loop {
+            if state_lock.fatal.is_some() {
+                // Nothing left to read; just tell the callbacks.
+                let _state_lock = self.run_callbacks(state_lock);
+                return;
+            }
+            if let Some(r) = state_lock.reader.take() {
+                break r;
+            }
+            state_lock = cv.wait(state_lock).expect("poisoned");
+        };
+        state_lock.background_reader = BackgroundReader::Running;
+
+        // As in read_until_message_for, we notify waiters only after releasing the lock.
+        let mut to_wake = Vec::new();
+        loop {
+            state_lock = self.run_callbacks(state_lock);
+            // As in read_until_message_for, we drop the state lock while we are reading.
+            drop(state_lock);
+            wake_all(&mut to_wake);
+
+            let result = read_validated_msg(&mut reader);
+            self.trace_arrival(&result);
+
+            state_lock = self.state.lock().expect("poisoned");
+            match result {
+                Ok(m) => {
+                    state_lock.note_arrival(&m, &self.stats);
+                    state_lock = self.wait_for_space(state_lock, &m);
+                    state_lock.queue_msg(m, &mut to_wake);
+                }
+                Err(e) => {
+                    if state_lock.note_fatal(&e) {
+                        state_lock.alert_everybody();
+                    }
+                    let _state_lock = self.run_callbacks(state_lock);
+                    // We drop the reader here, since nobody can use it any more.
+                    return;
+                }
+            }
+        }
+    }
+}
+
+impl Receiver {
+    /// Wait (if our limits call for it) until there is room to queue `msg`.
+    ///
+    /// Takes a `MutexGuard`, and releases it while waiting;
+    /// returns a new `MutexGuard` once there is room.
+    ///
+    /// Only the background reader thread may call this:
+    /// the threads that wait for responses are the ones that make room.
+    /// (All of them have already been woken for the messages we queued earlier.)
+    fn wait_for_space<'a>(
+        &'a self,
+        mut state_lock: MutexGuard<'a, ReceiverState>,
+        msg: &ValidatedResponse,
+    ) -> MutexGuard<'a, ReceiverState> {
+        while state_lock.must_wait_for_space(msg) {
+            bump(&self.stats.reader_blocks, 1);
+            let space = Arc::clone(&state_lock.space);
+            state_lock.reader_blocked = true;
+            state_lock = space.wait(state_lock).expect("poisoned");
+            state_lock.reader_blocked = false;
+        }
+        state_lock
+    }
+}
+
+/// Notify every condvar in `to_wake`, and clear it.
+fn wake_all(to_wake: &mut Vec<Arc<Condvar>>) {
+    for cv in to_wake.drain(..) {
+        cv.notify_one();
+    }
+}
+
+/// Read and validate a single message from `reader`.
+///
+/// Treat every failure (including the end of the stream) as a fatal error.
+fn read_validated_msg(reader: &mut llconn::Reader) -> Result<ValidatedResponse, ShutdownError> {
+    match reader.read_msg() {
+        Err(e) => Err(ShutdownError::Read(Arc::new(e))),
+        Ok(None) => Err(ShutdownError::ConnectionClosed),
+        Ok(Some(m)) => m.try_validate().map_err(ShutdownError::from),
+    }
 }
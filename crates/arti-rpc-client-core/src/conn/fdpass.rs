@@ -0,0 +1,491 @@
+//! Support for receiving data streams from Arti as file descriptors.
+//!
+//! On Unix, when we reach Arti over a Unix domain socket,
+//! we can ask Arti to open a data stream for us,
+//! and hand one end of it back over the RPC connection itself
+//! as `SCM_RIGHTS` ancillary data.
+//! This saves the loopback TCP connection to Arti's SOCKS port,
+//! and the SOCKS handshake that we would otherwise run on it.
+//!
+//! The protocol is:
+//!
+//! - We send an `arti:x_open_stream_fd` request on a client-like object,
+//!   with parameters `{"hostname": ..., "port": ..., "isolation": ...}`.
+//!   (The `isolation` parameter plays the same role as the SOCKS password
+//!   in [`RpcConn::open_stream`].)
+//! - Arti opens the stream, creates a socketpair, and splices one end of it to the stream.
+//!   It answers with the result `{"fd_index": N}`,
+//!   and attaches the other end of the socketpair to the bytes of that response.
+//! - `N` is the number of file descriptors that Arti has previously sent us
+//!   on this connection, counting from 0.
+//!   Since the descriptor always arrives with (or before) the response that names it,
+//!   we can always find it once that response has been read.
+//!
+//! An Arti that does not implement this method rejects the request;
+//! we then remember not to try it again on this connection.
+//! (Arti implements it on its Unix domain socket listeners when built with tokio.
+//! Since the method is experimental,
+//! we only receive descriptors on connections that opt in with
+//! [`RpcConnBuilder::stream_fd_passing`](crate::RpcConnBuilder::stream_fd_passing).)
+
+use std::{
+    collections::HashMap,
+    io,
+    os::{
+        fd::{AsRawFd as _, FromRawFd as _, OwnedFd},
+        unix::net::UnixStream,
+    },
+    sync::{atomic::Ordering, Arc, Mutex},
+};
+
+use serde::{Deserialize, Serialize};
+
+use super::{RpcConn, StreamError};
+use crate::{
+    msgs::{request::Request, response::RpcErrorCode},
+    ObjectId,
+};
+
+/// The name of the method that asks Arti to send us a data stream as a file descriptor.
+const OPEN_STREAM_FD_METHOD: &str = "arti:x_open_stream_fd";
+
+/// The largest number of file descriptors that we accept with a single read.
+///
+/// Arti attaches at most this many descriptors to each write,
+/// and the kernel does not merge ancillary data from separate writes,
+/// so we never need more.
+const MAX_FDS_PER_READ: usize = 8;
+
+/// The file descriptors that Arti has sent us on a connection,
+/// and which nobody has claimed yet.
+#[derive(Debug, Default)]
+pub(super) struct PassedFds {
+    /// The descriptors themselves, and our count of them.
+    inner: Mutex<PassedFdsInner>,
+}
+
+/// The state behind a [`PassedFds`].
+#[derive(Debug, Default)]
+struct PassedFdsInner {
+    /// The total number of descriptors that we have received on this connection.
+    n_received: u64,
+    /// The number of requests in progress that may be answered with a descriptor.
+    n_expecting: usize,
+    /// Every descriptor that has arrived but has not been claimed, by its index.
+    ///
+    /// A descriptor can stay here after the request that it answers has finished
+    /// (if we couldn't decode the reply, say);
+    /// we close all of them once no requests are in progress.
+    /// Descriptors that arrive while no request is in progress are closed at once.
+    unclaimed: HashMap<u64, OwnedFd>,
+}
+
+/// A guard for a request that may be answered with a descriptor.
+///
+/// Returned by [`PassedFds::expect_fd`].
+struct ExpectingFd(Arc<PassedFds>);
+
+impl PassedFds {
+    /// Record that `fd` has arrived from Arti.
+    fn push(&self, fd: OwnedFd) {
+        let mut inner = self.inner.lock().expect("poisoned");
+        let index = inner.n_received;
+        inner.n_received += 1;
+        if inner.n_expecting > 0 {
+            inner.unclaimed.insert(index, fd);
+        } else {
+            // Nobody asked for this, so nobody will ever claim it.
+            drop(inner);
+            drop(fd);
+        }
+    }
+
+    /// Note that we are about to send a request that may be answered with a descriptor.
+    ///
+    /// We keep descriptors that arrive only until the returned guard (and any others
+    /// like it) is dropped, so it should live until the request has finished.
+    fn expect_fd(self: &Arc<Self>) -> ExpectingFd {
+        self.inner.lock().expect("poisoned").n_expecting += 1;
+        ExpectingFd(Arc::clone(self))
+    }
+
+    /// Claim the descriptor with index `index`, if it has arrived.
+    fn take(&self, index: u64) -> Option<OwnedFd> {
+        self.inner
+            .lock()
+            .expect("poisoned")
+            .unclaimed
+            .remove(&index)
+    }
+}
+
+impl Drop for ExpectingFd {
+    fn drop(&mut self) {
+        let orphans = {
+            let mut inner = self.0.inner.lock().expect("poisoned");
+            inner.n_expecting -= 1;
+            if inner.n_expecting > 0 {
+                return;
+            }
+            std::mem::take(&mut inner.unclaimed)
+        };
+        // Every request is done, so anything left over belonged to one that didn't claim it.
+        drop(orphans);
+    }
+}
+
+/// The reading half of a Unix-domain RPC connection,
+/// which keeps any file descriptors that arrive along with the data.
+pub(super) struct FdRecvStream {
+    /// The socket that we read from.
+    sock: UnixStream,
+    /// Where we put the descriptors that we receive.
+    fds: Arc<PassedFds>,
+}
+
+impl FdRecvStream {
+    /// Wrap `sock`, putting every descriptor that arrives on it into `fds`.
+    pub(super) fn new(sock: UnixStream, fds: Arc<PassedFds>) -> Self {
+        Self { sock, fds }
+    }
+}
+
+/// Space for the ancillary data of a single read, aligned as `cmsghdr` requires.
+#[repr(C)]
+struct CmsgBuf {
+    /// Forces the alignment of `buf`.
+    _align: [libc::cmsghdr; 0],
+    /// The space itself; more than `CMSG_SPACE` of [`MAX_FDS_PER_READ`] descriptors.
+    buf: [u8; 256],
+}
+
+impl io::Read for FdRecvStream {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let mut cmsg_buf = CmsgBuf {
+            _align: [],
+            buf: [0; 256],
+        };
+        let fd_bytes = (MAX_FDS_PER_READ * std::mem::size_of::<libc::c_int>()) as libc::c_uint;
+        // Safety: CMSG_SPACE only does arithmetic.
+        let cmsg_space = unsafe { libc::CMSG_SPACE(fd_bytes) } as usize;
+        assert!(cmsg_space <= cmsg_buf.buf.len());
+
+        let mut iov = libc::iovec {
+            iov_base: buf.as_mut_ptr().cast(),
+            iov_len: buf.len(),
+        };
+        // Safety: msghdr is a plain C struct, for which all-zeroes is a valid value.
+        let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf.buf.as_mut_ptr().cast();
+        // (The type of msg_controllen varies by platform.)
+        msg.msg_controllen = cmsg_space as _;
+
+        cfg_if::cfg_if! {
+            if #[cfg(any(target_os = "linux", target_os = "android", target_os = "freebsd",
+                         target_os = "netbsd", target_os = "openbsd"))] {
+                let flags = libc::MSG_CMSG_CLOEXEC;
+            } else {
+                let flags = 0;
+            }
+        }
+
+        let n_read = loop {
+            // Safety: `msg` refers to `iov` and `cmsg_buf`, which outlive this call,
+            // and which are valid for writing as many bytes as `msg` says.
+            let n = unsafe { libc::recvmsg(self.sock.as_raw_fd(), &mut msg, flags) };
+            match usize::try_from(n) {
+                Ok(n) => break n,
+                Err(_) => {
+                    let e = io::Error::last_os_error();
+                    if e.kind() != io::ErrorKind::Interrupted {
+                        return Err(e);
+                    }
+                }
+            }
+        };
+
+        // Safety: `msg` is the header that recvmsg filled in,
+        // and its control buffer is still alive.
+        let mut cmsg = unsafe { libc::CMSG_FIRSTHDR(&msg) };
+        while !cmsg.is_null() {
+            // Safety: CMSG_FIRSTHDR and CMSG_NXTHDR only return headers
+            // that lie within the control data that the kernel wrote.
+            let hdr = unsafe { &*cmsg };
+            if hdr.cmsg_level == libc::SOL_SOCKET && hdr.cmsg_type == libc::SCM_RIGHTS {
+                // Safety: `cmsg` is a valid header, as above.
+                let data = unsafe { libc::CMSG_DATA(cmsg) };
+                let header_len = data as usize - cmsg as usize;
+                #[allow(clippy::unnecessary_cast)] // The type of cmsg_len varies by platform.
+                let n_fds = (hdr.cmsg_len as usize).saturating_sub(header_len)
+                    / std::mem::size_of::<libc::c_int>();
+                for i in 0..n_fds {
+                    // Safety: The kernel wrote `n_fds` descriptors starting at `data`,
+                    // which need not be aligned.
+                    let fd = unsafe { data.cast::<libc::c_int>().add(i).read_unaligned() };
+                    // Safety: The kernel just gave us this descriptor, so nobody else owns it.
+                    let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+                    #[cfg(not(any(
+                        target_os = "linux",
+                        target_os = "android",
+                        target_os = "freebsd",
+                        target_os = "netbsd",
+                        target_os = "openbsd"
+                    )))]
+                    // Safety: `fd` is a valid descriptor that we own.
+                    unsafe {
+                        libc::fcntl(fd.as_raw_fd(), libc::F_SETFD, libc::FD_CLOEXEC);
+                    }
+                    self.fds.push(fd);
+                }
+            }
+            // Safety: As for CMSG_FIRSTHDR.
+            cmsg = unsafe { libc::CMSG_NXTHDR(&msg, cmsg) };
+        }
+
+        if msg.msg_flags & libc::MSG_CTRUNC != 0 {
+            // We lost some descriptors, so we can no longer match them to their indices.
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "Arti sent more file descriptors than we can receive at once",
+            ));
+        }
+
+        Ok(n_read)
+    }
+}
+
+/// Parameters for an [`OPEN_STREAM_FD_METHOD`] request.
+#[derive(Serialize, Debug)]
+struct OpenStreamFdParams<'a> {
+    /// The hostname to connect to.
+    hostname: &'a str,
+    /// The port to connect to.
+    port: u16,
+    /// The isolation string for the stream.
+    isolation: &'a str,
+}
+
+/// The result of a successful [`OPEN_STREAM_FD_METHOD`] request.
+#[derive(Deserialize, Debug)]
+struct OpenStreamFdReply {
+    /// The index of the descriptor that holds our new stream.
+    fd_index: u64,
+}
+
+impl RpcConn {
+    /// Open a new data stream, using Arti to connect anonymously to a given
+    /// address and port, and receive the stream over this RPC connection
+    /// as a file descriptor.
+    ///
+    /// Behaves the same as [`open_stream()`](RpcConn::open_stream),
+    /// except that no SOCKS connection is involved:
+    /// the resulting stream is a Unix domain socket whose other end Arti holds.
+    ///
+    /// This only works when we are connected to Arti over a Unix domain socket
+    /// with [`stream_fd_passing`](crate::RpcConnBuilder::stream_fd_passing) enabled,
+    /// and when Arti supports sending streams this way.
+    /// Otherwise, it fails with [`StreamError::FdPassingUnavailable`]
+    /// or [`StreamError::OpenStreamRejected`], respectively.
+    pub fn open_stream_fd(
+        &self,
+        on_object: Option<&ObjectId>,
+        (hostname, port): (&str, u16),
+        isolation: &str,
+    ) -> Result<UnixStream, StreamError> {
+        let fds = self
+            .passed_fds
+            .as_ref()
+            .ok_or(StreamError::FdPassingUnavailable)?;
+        let on_object = self.resolve_on_object(on_object)?;
+        let request = Request::new(
+            on_object,
+            OPEN_STREAM_FD_METHOD,
+            OpenStreamFdParams {
+                hostname,
+                port,
+                isolation,
+            },
+        );
+        // The descriptor arrives with (or before) the reply, so we must hold this until then.
+        let _expecting = fds.expect_fd();
+        let reply: OpenStreamFdReply = self
+            .execute_internal(&request.encode()?)?
+            .map_err(StreamError::OpenStreamRejected)?;
+        let fd = fds.take(reply.fd_index).ok_or(StreamError::MissingFd)?;
+        Ok(UnixStream::from(fd))
+    }
+
+    /// Try to open a data stream as with [`open_stream_fd()`](RpcConn::open_stream_fd).
+    ///
+    /// Return `Ok(None)` if this connection can't receive streams that way,
+    /// or if Arti has already told us that it doesn't support them:
+    /// the caller should then open the stream over SOCKS.
+    pub(crate) fn try_open_stream_fd(
+        &self,
+        on_object: Option<&ObjectId>,
+        target: (&str, u16),
+        isolation: &str,
+    ) -> Result<Option<UnixStream>, StreamError> {
+        if self.passed_fds.is_none() || self.fd_streams_unsupported.load(Ordering::Relaxed) {
+            return Ok(None);
+        }
+        match self.open_stream_fd(on_object, target, isolation) {
+            Ok(stream) => Ok(Some(stream)),
+            Err(StreamError::OpenStreamRejected(e))
+                if [RpcErrorCode::NO_SUCH_METHOD, RpcErrorCode::METHOD_NOT_IMPL]
+                    .contains(&e.decode().code()) =>
+            {
+                self.fd_streams_unsupported.store(true, Ordering::Relaxed);
+                Ok(None)
+            }
+            Err(e) => Err(e),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use crate::llconn;
+    use std::io::{BufRead as _, BufReader, Read as _, Write as _};
+
+    /// Write `data` to `sock`, attaching `fd` as `SCM_RIGHTS` ancillary data.
+    fn send_with_fd(sock: &UnixStream, data: &[u8], fd: &impl std::os::fd::AsRawFd) {
+        let mut cmsg_buf = CmsgBuf {
+            _align: [],
+            buf: [0; 256],
+        };
+        let fd_len = std::mem::size_of::<libc::c_int>() as libc::c_uint;
+        let mut iov = libc::iovec {
+            iov_base: data.as_ptr() as *mut libc::c_void,
+            iov_len: data.len(),
+        };
+        unsafe {
+            let mut msg: libc::msghdr = std::mem::zeroed();
+            msg.msg_iov = &mut iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cmsg_buf.buf.as_mut_ptr().cast();
+            msg.msg_controllen = libc::CMSG_SPACE(fd_len) as _;
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(fd_len) as _;
+            libc::CMSG_DATA(cmsg)
+                .cast::<libc::c_int>()
+                .write_unaligned(fd.as_raw_fd());
+            let n = libc::sendmsg(sock.as_raw_fd(), &msg, 0);
+            assert_eq!(n, data.len() as isize);
+        }
+    }
+
+    /// Return an `RpcConn` that receives descriptors, and the socket for its "Arti" end.
+    fn fd_conn() -> (RpcConn, UnixStream) {
+        let (ours, theirs) = UnixStream::pair().unwrap();
+        let fds = Arc::new(PassedFds::default());
+        let mut conn = RpcConn::new(
+            llconn::Reader::new(BufReader::new(FdRecvStream::new(
+                ours.try_clone().unwrap(),
+                Arc::clone(&fds),
+            ))),
+            llconn::Writer::new(ours),
+        );
+        conn.passed_fds = Some(fds);
+        (conn, theirs)
+    }
+
+    /// Read one request from `arti`, and return its ID as JSON text.
+    fn read_request_id(arti: &mut BufReader<UnixStream>, method: &str) -> String {
+        let mut line = String::new();
+        arti.read_line(&mut line).unwrap();
+        let v: serde_json::Value = serde_json::from_str(&line).unwrap();
+        assert_eq!(v["method"], method);
+        v["id"].to_string()
+    }
+
+    #[test]
+    fn unclaimed_fds() {
+        let fds = Arc::new(PassedFds::default());
+        let n_unclaimed = || fds.inner.lock().unwrap().unclaimed.len();
+        let new_fd = || OwnedFd::from(UnixStream::pair().unwrap().0);
+
+        // Nobody is expecting this one, so it is closed.
+        fds.push(new_fd());
+        assert_eq!(n_unclaimed(), 0);
+
+        let e1 = fds.expect_fd();
+        let e2 = fds.expect_fd();
+        fds.push(new_fd());
+        fds.push(new_fd());
+        assert_eq!(n_unclaimed(), 2);
+        assert!(fds.take(0).is_none());
+        assert!(fds.take(1).is_some());
+
+        // Descriptor 2 is kept until nobody could claim it.
+        drop(e1);
+        assert_eq!(n_unclaimed(), 1);
+        drop(e2);
+        assert_eq!(n_unclaimed(), 0);
+        assert!(fds.take(2).is_none());
+    }
+
+    #[test]
+    fn open_stream_fd() {
+        let (conn, arti) = fd_conn();
+        let obj = ObjectId::try_from("session".to_string()).unwrap();
+
+        let arti_thread = std::thread::spawn(move || {
+            let mut arti_reader = BufReader::new(arti.try_clone().unwrap());
+
+            // Answer the first request with a stream.
+            let id = read_request_id(&mut arti_reader, OPEN_STREAM_FD_METHOD);
+            let (stream_ours, mut stream_theirs) = UnixStream::pair().unwrap();
+            let reply = format!("{{\"id\":{id},\"result\":{{\"fd_index\":0}}}}\n");
+            send_with_fd(&arti, reply.as_bytes(), &stream_ours);
+            drop(stream_ours);
+            stream_theirs.write_all(b"hello").unwrap();
+
+            // Reject the second request as unsupported.
+            let id = read_request_id(&mut arti_reader, OPEN_STREAM_FD_METHOD);
+            let reply = format!(
+                "{{\"id\":{id},\"error\":{{\"message\":\"no\",\"code\":-32601,\"kinds\":[]}}}}\n"
+            );
+            (&arti).write_all(reply.as_bytes()).unwrap();
+            stream_theirs
+        });
+
+        let mut stream = conn
+            .try_open_stream_fd(Some(&obj), ("example.com", 80), "")
+            .unwrap()
+            .unwrap();
+        let mut buf = [0_u8; 5];
+        stream.read_exact(&mut buf).unwrap();
+        assert_eq!(&buf, b"hello");
+
+        assert!(conn
+            .try_open_stream_fd(Some(&obj), ("example.com", 80), "")
+            .unwrap()
+            .is_none());
+        // We don't ask again once we know that Arti can't do it.
+        assert!(conn
+            .try_open_stream_fd(Some(&obj), ("example.com", 80), "")
+            .unwrap()
+            .is_none());
+        let _stream_theirs = arti_thread.join().unwrap();
+    }
+}
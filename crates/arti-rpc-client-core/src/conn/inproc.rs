@@ -0,0 +1,129 @@
+//! Support for "inproc:" connections to an Arti instance in the same process.
+//!
+//! When an application links Arti directly, there is no need to send RPC messages
+//! through a socket: the application can instead register an [`InprocConnector`]
+//! that hands back a pair of in-memory streams connected to Arti's RPC server.
+//! (`arti-rpcserver` provides such streams via `Connection::run_inproc`.)
+//!
+//! Once a connector is registered under some name,
+//! the connect string `inproc:<name>` will use it.
+
+use std::{
+    collections::BTreeMap,
+    io,
+    sync::{Arc, Mutex},
+};
+
+use super::ConnectError;
+
+/// A pair of streams connected to an RPC server in the same process.
+///
+/// The first element receives Arti's responses; the second carries our requests.
+pub type InprocStreams = (Box<dyn io::Read + Send>, Box<dyn io::Write + Send>);
+
+/// A function that opens a new in-process connection to Arti's RPC server.
+pub type InprocConnector = dyn Fn() -> io::Result<InprocStreams> + Send + Sync;
+
+/// The connectors that have been registered with [`register_inproc_connector`], by name.
+static CONNECTORS: Mutex<BTreeMap<String, Arc<InprocConnector>>> = Mutex::new(BTreeMap::new());
+
+/// Register `connector` as the way to open connections for the connect string `inproc:<name>`.
+///
+/// Replaces any connector previously registered under the same name.
+pub fn register_inproc_connector<F>(name: &str, connector: F)
+where
+    F: Fn() -> io::Result<InprocStreams> + Send + Sync + 'static,
+{
+    CONNECTORS
+        .lock()
+        .expect("lock poisoned")
+        .insert(name.to_owned(), Arc::new(connector));
+}
+
+/// Remove the connector registered under `name`, if any.
+///
+/// Return true if there was such a connector.
+///
+/// Connections that were already opened with that connector are not affected.
+pub fn unregister_inproc_connector(name: &str) -> bool {
+    CONNECTORS
+        .lock()
+        .expect("lock poisoned")
+        .remove(name)
+        .is_some()
+}
+
+/// Open a new set of streams using the connector registered under `name`.
+pub(super) fn connect(name: &str) -> Result<InprocStreams, ConnectError> {
+    // We clone the connector out of the map so that we don't hold the lock while it runs.
+    let connector = CONNECTORS
+        .lock()
+        .expect("lock poisoned")
+        .get(name)
+        .cloned()
+        .ok_or_else(|| {
+            ConnectError::CannotConnect(Arc::new(io::Error::new(
+                io::ErrorKind::NotFound,
+                format!("No in-process connector registered as {:?}", name),
+            )))
+        })?;
+    connector().map_err(|e| ConnectError::CannotConnect(Arc::new(e)))
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use crate::conn::RpcConnBuilder;
+    use std::io::{BufRead as _, BufReader, Write as _};
+
+    #[test]
+    fn inproc_connect() {
+        let (client_sock, server_sock) = socketpair::socketpair_stream().unwrap();
+        let client_sock = Mutex::new(Some(client_sock));
+        register_inproc_connector("test-inproc", move || {
+            let sock = client_sock.lock().unwrap().take().unwrap();
+            let dup = sock.try_clone()?;
+            Ok((Box::new(sock) as _, Box::new(dup) as _))
+        });
+
+        let server = std::thread::spawn(move || {
+            let mut w = server_sock.try_clone().unwrap();
+            let mut r = BufReader::new(server_sock);
+            let mut line = String::new();
+            r.read_line(&mut line).unwrap();
+            let req: serde_json::Value = serde_json::from_str(&line).unwrap();
+            assert_eq!(req["method"], "auth:authenticate");
+            assert_eq!(req["params"]["scheme"], "inherent:inproc");
+            writeln!(w, r#"{{"id":{},"result":{{"session":"s1"}}}}"#, req["id"]).unwrap();
+        });
+
+        let conn = RpcConnBuilder::from_connect_string("inproc:test-inproc")
+            .unwrap()
+            .connect()
+            .unwrap();
+        server.join().unwrap();
+        assert_eq!(conn.session().unwrap().as_ref(), "s1");
+
+        assert!(unregister_inproc_connector("test-inproc"));
+        assert!(!unregister_inproc_connector("test-inproc"));
+        let err = RpcConnBuilder::from_connect_string("inproc:test-inproc")
+            .unwrap()
+            .connect()
+            .unwrap_err();
+        assert!(matches!(err, ConnectError::CannotConnect(_)));
+    }
+}
@@ -0,0 +1,151 @@
+//! Limits on the responses that an RPC connection will hold for the application.
+//!
+//! Every response that has arrived from Arti, but that nobody has taken yet,
+//! waits in a queue for its request.
+//! A request that streams updates faster than the application takes them
+//! would make that queue grow without bound,
+//! so we let the application put limits on it.
+//!
+//! As `tor-memquota` does on the Arti side, we account for what we hold by its size in bytes,
+//! both separately for each request and in total for the connection.
+//! Unlike `tor-memquota`, when a limit is reached,
+//! we act on the request whose response would exceed it,
+//! according to the [`OverflowPolicy`] that the application chose.
+
+/// What to do when a response would take its request (or the connection) over a [`QueueLimits`].
+///
+/// Only updates are ever held back, discarded, or counted as an overflow:
+/// a final response is always queued, since it ends its request.
+#[derive(Clone, Copy, Debug, Default, Eq, PartialEq)]
+#[non_exhaustive]
+pub enum OverflowPolicy {
+    /// Stop reading from Arti until the application has taken enough responses to make room.
+    ///
+    /// Once we stop reading, the operating system's buffers fill up,
+    /// and Arti stops sending: this pushes the back-pressure all the way to Arti.
+    /// Note that responses to _every_ request on the connection are delayed
+    /// until room is made.
+    ///
+    /// Only a background reader thread ever waits for room,
+    /// since a thread that is reading on its own behalf could wait forever.
+    /// Installing limits with this policy therefore launches a background reader.
+    #[default]
+    Block,
+    /// Discard the oldest queued updates for the request, until there is room.
+    DropOldestUpdates,
+    /// Fail the request: discard its queued responses,
+    /// and give [`ProtoError::QueueOverflow`](crate::ProtoError::QueueOverflow)
+    /// to whoever next waits for it.
+    ///
+    /// We discard any further responses to the request,
+    /// but we keep track of it (counting the failure as one queued message)
+    /// until somebody has been told about the failure, or its handle has been dropped.
+    /// After that, we ignore any responses that Arti still sends for it.
+    /// (We do not ask Arti to cancel it; the application may want to do so.)
+    FailRequest,
+}
+
+/// Limits on the responses that an [`RpcConn`](crate::RpcConn) will queue for the application.
+///
+/// By default, there are no limits.
+///
+/// Responses for requests with callbacks are never counted,
+/// since those are delivered as soon as they are read.
+#[derive(Clone, Debug, Default)]
+#[non_exhaustive]
+pub struct QueueLimits {
+    /// The largest number of responses to queue for any single request.
+    pub max_request_msgs: Option<usize>,
+    /// The largest total length of the responses to queue for any single request.
+    pub max_request_bytes: Option<usize>,
+    /// The largest total length of the responses to queue for the whole connection.
+    pub max_conn_bytes: Option<usize>,
+    /// What to do when a response would exceed one of these limits.
+    pub policy: OverflowPolicy,
+}
+
+impl QueueLimits {
+    /// Return true if any limit is set.
+    pub(super) fn is_limited(&self) -> bool {
+        self.max_request_msgs.is_some()
+            || self.max_request_bytes.is_some()
+            || self.max_conn_bytes.is_some()
+    }
+
+    /// Return true if queueing a response of `len` bytes would exceed these limits.
+    ///
+    /// `req` is what is already queued for the response's request,
+    /// and `conn_bytes` is the number of bytes already queued for the whole connection.
+    ///
+    /// An empty queue always has room for one response,
+    /// so that no single response can exceed our limits forever.
+    pub(super) fn would_exceed(&self, req: QueueUsage, conn_bytes: usize, len: usize) -> bool {
+        /// Return true if `used + len` is more than `limit`.
+        fn over(limit: Option<usize>, used: usize, len: usize) -> bool {
+            limit.is_some_and(|limit| used.saturating_add(len) > limit)
+        }
+        (req.msgs > 0
+            && (over(self.max_request_msgs, req.msgs, 1)
+                || over(self.max_request_bytes, req.bytes, len)))
+            || (conn_bytes > 0 && over(self.max_conn_bytes, conn_bytes, len))
+    }
+}
+
+/// The amount of data queued for a single request.
+#[derive(Clone, Copy, Debug)]
+pub(super) struct QueueUsage {
+    /// The number of queued responses.
+    pub(super) msgs: usize,
+    /// Their total length.
+    pub(super) bytes: usize,
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    fn usage(msgs: usize, bytes: usize) -> QueueUsage {
+        QueueUsage { msgs, bytes }
+    }
+
+    #[test]
+    fn exceed() {
+        let unlimited = QueueLimits::default();
+        assert!(!unlimited.is_limited());
+        assert!(!unlimited.would_exceed(usage(1000, 1 << 30), 1 << 30, 1 << 20));
+
+        let limits = QueueLimits {
+            max_request_msgs: Some(2),
+            max_request_bytes: Some(100),
+            max_conn_bytes: Some(300),
+            ..QueueLimits::default()
+        };
+        assert!(limits.is_limited());
+
+        assert!(!limits.would_exceed(usage(1, 10), 10, 10));
+        // Too many messages.
+        assert!(limits.would_exceed(usage(2, 10), 10, 10));
+        // Too many bytes for the request...
+        assert!(!limits.would_exceed(usage(1, 50), 50, 50));
+        assert!(limits.would_exceed(usage(1, 50), 50, 51));
+        // ... or for the connection.
+        assert!(!limits.would_exceed(usage(0, 0), 250, 50));
+        assert!(limits.would_exceed(usage(0, 0), 250, 51));
+        // But an empty queue can always take one message.
+        assert!(!limits.would_exceed(usage(0, 0), 0, 1000));
+    }
+}
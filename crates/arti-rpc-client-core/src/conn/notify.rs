@@ -0,0 +1,140 @@
+//! A pollable notification object, for integrating RpcConn with event loops.
+//!
+//! Applications that drive many requests from a single thread
+//! don't want to block in [`wait_with_updates`](super::RequestHandle::wait_with_updates).
+//! Instead, they ask for a file descriptor that they can add to their `poll`/`epoll` set,
+//! and call [`try_wait`](super::RequestHandle::try_wait) once it becomes readable.
+
+use std::io;
+
+#[cfg(unix)]
+use std::{
+    io::{Read as _, Write as _},
+    os::{fd::AsRawFd as _, fd::RawFd, unix::net::UnixStream},
+};
+
+/// A level-triggered notification object backed by a socketpair.
+///
+/// The "poll side" of the pair is readable if and only if
+/// the notifier has been marked readable.
+///
+/// This type does no locking of its own: it is kept inside the `ReceiverState`,
+/// and is only touched while holding that lock.
+#[cfg(unix)]
+pub(super) struct Notifier {
+    /// The side of the socketpair that we expose to the application.
+    ///
+    /// We read from this side ourselves in order to make it unreadable again.
+    poll_side: UnixStream,
+    /// The side of the socketpair that we write to in order to make `poll_side` readable.
+    signal_side: UnixStream,
+    /// True if we have written a byte to `signal_side` that we have not drained.
+    readable: bool,
+}
+
+#[cfg(unix)]
+impl Notifier {
+    /// Construct a new Notifier, initially unreadable.
+    pub(super) fn new() -> io::Result<Self> {
+        let (poll_side, signal_side) = UnixStream::pair()?;
+        poll_side.set_nonblocking(true)?;
+        signal_side.set_nonblocking(true)?;
+        Ok(Self {
+            poll_side,
+            signal_side,
+            readable: false,
+        })
+    }
+
+    /// Make this notifier readable if `readable` is true, and unreadable otherwise.
+    ///
+    /// Never blocks.
+    pub(super) fn set_readable(&mut self, readable: bool) {
+        if readable == self.readable {
+            return;
+        }
+        if readable {
+            // We only ever have a single byte outstanding, so this can't fail with WouldBlock.
+            // If it fails for some other reason, the socketpair is broken,
+            // and there is nothing better for us to do than to keep going.
+            let _ignore = self.signal_side.write(&[1]);
+        } else {
+            let mut buf = [0_u8; 16];
+            // Drain until we get WouldBlock (or some other error).
+            while matches!(self.poll_side.read(&mut buf), Ok(n) if n > 0) {}
+        }
+        self.readable = readable;
+    }
+
+    /// Return the file descriptor that the application should poll.
+    pub(super) fn as_raw_fd(&self) -> RawFd {
+        self.poll_side.as_raw_fd()
+    }
+}
+
+/// Placeholder for platforms where we don't yet support pollable notifications.
+#[cfg(not(unix))]
+pub(super) struct Notifier(void::Void);
+
+#[cfg(not(unix))]
+impl Notifier {
+    /// Return an error: we don't support pollable notifications here.
+    pub(super) fn new() -> io::Result<Self> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    /// Impossible: no Notifier can exist on this platform.
+    pub(super) fn set_readable(&mut self, _readable: bool) {
+        void::unreachable(self.0)
+    }
+}
+
+#[cfg(all(test, unix))]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    /// Return the number of bytes that are waiting on the poll side of `n`,
+    /// and put them back.
+    fn n_pending(n: &mut Notifier) -> usize {
+        let mut buf = [0_u8; 16];
+        let count = match n.poll_side.read(&mut buf) {
+            Ok(count) => count,
+            Err(e) if e.kind() == io::ErrorKind::WouldBlock => 0,
+            Err(e) => panic!("{e}"),
+        };
+        n.signal_side.write_all(&buf[..count]).unwrap();
+        count
+    }
+
+    #[test]
+    fn readable() {
+        let mut n = Notifier::new().unwrap();
+        assert_eq!(n_pending(&mut n), 0);
+
+        n.set_readable(true);
+        n.set_readable(true);
+        assert_eq!(n_pending(&mut n), 1);
+
+        n.set_readable(false);
+        assert_eq!(n_pending(&mut n), 0);
+        n.set_readable(false);
+        assert_eq!(n_pending(&mut n), 0);
+
+        n.set_readable(true);
+        assert_eq!(n_pending(&mut n), 1);
+    }
+}
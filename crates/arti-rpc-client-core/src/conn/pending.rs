@@ -0,0 +1,353 @@
+//! The table of requests that an RPC connection is tracking.
+//!
+//! We look up a request in this table for every response that we receive,
+//! so it is on the hot path.
+//! Nearly every request uses an ID that we chose ourselves,
+//! so we choose IDs that name a slot in a generational slab:
+//! looking one up is a bounds check and a compare, with no hashing.
+//! Requests with IDs that the application chose
+//! are kept in a `HashMap` instead.
+//!
+//! ## ID encoding
+//!
+//! An ID that we choose is a negative JSON integer,
+//! encoding a slot index and that slot's generation as
+//! `-1 - (generation << SLOT_BITS | slot)`.
+//! We bump a slot's generation every time it is vacated,
+//! so that a late response to a finished request
+//! is never mistaken for a response to a newer request in the same slot.
+//! The encoded value always fits in 53 bits,
+//! so that every JSON implementation can represent it exactly.
+//!
+//! An application may use negative integer IDs of its own.
+//! That is harmless: we never choose an ID that is already in use,
+//! and an application's ID only lives in a slot
+//! if we would have chosen that very ID next.
+
+use std::collections::HashMap;
+
+use crate::msgs::{request::IdGenerator, AnyRequestId};
+
+/// The number of bits of an encoded ID that hold the slot index.
+const SLOT_BITS: u32 = 24;
+/// The number of bits of an encoded ID that hold the generation.
+const GENERATION_BITS: u32 = 29;
+/// The largest number of slots that we will ever allocate.
+///
+/// Once this many requests are pending, we fall back to the IDs from an [`IdGenerator`].
+const MAX_SLOTS: usize = 1 << SLOT_BITS;
+/// A mask for the generation of a slot.
+const GENERATION_MASK: u32 = (1 << GENERATION_BITS) - 1;
+
+/// A single slot in a [`PendingTable`].
+struct Slot<T> {
+    /// The generation of this slot.
+    ///
+    /// The ID of the value in this slot (if any) encodes this generation.
+    generation: u32,
+    /// The value in this slot, if the slot is occupied.
+    value: Option<T>,
+}
+
+/// A map from request ID to the state for that request.
+///
+/// Behaves like a `HashMap<AnyRequestId, T>`,
+/// except that IDs from [`next_id`](Self::next_id) are looked up without hashing.
+pub(super) struct PendingTable<T> {
+    /// The slab of values whose IDs we chose.
+    slots: Vec<Slot<T>>,
+    /// The indices of every vacant entry in `slots`.
+    ///
+    /// We reuse the most recently vacated slot first, since it is likeliest to be in cache.
+    free: Vec<u32>,
+    /// The values whose IDs we did not choose, or which didn't fit in `slots`.
+    by_id: HashMap<AnyRequestId, T>,
+    /// A generator for the IDs that we use once every slot is full.
+    fallback_ids: IdGenerator,
+    /// The number of occupied entries in `slots`.
+    n_slotted: usize,
+}
+
+impl<T> Default for PendingTable<T> {
+    fn default() -> Self {
+        Self {
+            slots: Vec::new(),
+            free: Vec::new(),
+            by_id: HashMap::new(),
+            fallback_ids: IdGenerator::default(),
+            n_slotted: 0,
+        }
+    }
+}
+
+/// Return the ID for the given slot index and generation.
+fn encode(slot: usize, generation: u32) -> AnyRequestId {
+    // (This can't overflow: the total is less than 2^53.)
+    let key = (i64::from(generation) << SLOT_BITS) | slot as i64;
+    AnyRequestId::Number(-1 - key)
+}
+
+/// If `id` could be an ID for a slot, return the slot index and generation that it encodes.
+#[inline]
+fn decode(id: &AnyRequestId) -> Option<(usize, u32)> {
+    let AnyRequestId::Number(n) = id else {
+        return None;
+    };
+    let key = n.checked_add(1)?.checked_neg()?;
+    if !(0..1 << (SLOT_BITS + GENERATION_BITS)).contains(&key) {
+        return None;
+    }
+    let slot = (key & (MAX_SLOTS as i64 - 1)) as usize;
+    let generation = (key >> SLOT_BITS) as u32;
+    Some((slot, generation))
+}
+
+impl<T> PendingTable<T> {
+    /// Return the index of the slot that holds the value for `id`, if there is one.
+    #[inline]
+    fn slot_for(&self, id: &AnyRequestId) -> Option<usize> {
+        let (slot, generation) = decode(id)?;
+        let s = self.slots.get(slot)?;
+        (s.generation == generation && s.value.is_some()).then_some(slot)
+    }
+
+    /// Return the slot index and generation that the next call to `insert` would use
+    /// for an ID that we chose, if there is room in the slab.
+    fn next_slot(&self) -> Option<(usize, u32)> {
+        match self.free.last() {
+            Some(&slot) => Some((slot as usize, self.slots[slot as usize].generation)),
+            None if self.slots.len() < MAX_SLOTS => Some((self.slots.len(), 0)),
+            None => None,
+        }
+    }
+
+    /// Return an ID that is not currently in use.
+    ///
+    /// The ID will only be stored in the slab if it is passed to [`insert`](Self::insert)
+    /// before any other change to this table.
+    pub(super) fn next_id(&mut self) -> AnyRequestId {
+        loop {
+            let Some((slot, generation)) = self.next_slot() else {
+                return self.fallback_ids.next_id();
+            };
+            let id = encode(slot, generation);
+            if !self.by_id.contains_key(&id) {
+                return id;
+            }
+            // The application is already using this ID for a request of its own.
+            // Skip the slot's current generation, and try again.
+            if slot == self.slots.len() {
+                self.slots.push(Slot {
+                    generation: 0,
+                    value: None,
+                });
+                self.free.push(slot as u32);
+            }
+            let s = &mut self.slots[slot];
+            s.generation = (s.generation + 1) & GENERATION_MASK;
+        }
+    }
+
+    /// Store `value` for `id`.
+    ///
+    /// Return `value` back as an error if `id` is already in use.
+    pub(super) fn insert(&mut self, id: AnyRequestId, value: T) -> Result<(), T> {
+        if self.contains_key(&id) {
+            return Err(value);
+        }
+        match decode(&id) {
+            Some(next) if Some(next) == self.next_slot() => {
+                let (slot, generation) = next;
+                if slot == self.slots.len() {
+                    self.slots.push(Slot {
+                        generation,
+                        value: Some(value),
+                    });
+                } else {
+                    self.free.pop();
+                    self.slots[slot].value = Some(value);
+                }
+                self.n_slotted += 1;
+            }
+            _ => {
+                self.by_id.insert(id, value);
+            }
+        }
+        Ok(())
+    }
+
+    /// Return true if there is a value for `id`.
+    pub(super) fn contains_key(&self, id: &AnyRequestId) -> bool {
+        self.slot_for(id).is_some() || (!self.by_id.is_empty() && self.by_id.contains_key(id))
+    }
+
+    /// Return a reference to the value for `id`, if there is one.
+    #[inline]
+    pub(super) fn get(&self, id: &AnyRequestId) -> Option<&T> {
+        match self.slot_for(id) {
+            Some(slot) => self.slots[slot].value.as_ref(),
+            None if self.by_id.is_empty() => None,
+            None => self.by_id.get(id),
+        }
+    }
+
+    /// Return a mutable reference to the value for `id`, if there is one.
+    #[inline]
+    pub(super) fn get_mut(&mut self, id: &AnyRequestId) -> Option<&mut T> {
+        match self.slot_for(id) {
+            Some(slot) => self.slots[slot].value.as_mut(),
+            None if self.by_id.is_empty() => None,
+            None => self.by_id.get_mut(id),
+        }
+    }
+
+    /// Remove and return the value for `id`, if there is one.
+    pub(super) fn remove(&mut self, id: &AnyRequestId) -> Option<T> {
+        match self.slot_for(id) {
+            Some(slot) => {
+                let s = &mut self.slots[slot];
+                s.generation = (s.generation + 1) & GENERATION_MASK;
+                self.free.push(slot as u32);
+                self.n_slotted -= 1;
+                s.value.take()
+            }
+            None if self.by_id.is_empty() => None,
+            None => self.by_id.remove(id),
+        }
+    }
+
+    /// Return the number of values in this table.
+    pub(super) fn len(&self) -> usize {
+        self.n_slotted + self.by_id.len()
+    }
+
+    /// Return an iterator over every value in this table, in no particular order.
+    pub(super) fn values(&self) -> impl Iterator<Item = &T> + '_ {
+        self.iter().map(|(_, v)| v)
+    }
+
+    /// Return an iterator over every ID and value in this table, in no particular order.
+    pub(super) fn iter(&self) -> impl Iterator<Item = (AnyRequestId, &T)> + '_ {
+        let slotted = self
+            .slots
+            .iter()
+            .enumerate()
+            .filter_map(|(slot, s)| s.value.as_ref().map(|v| (encode(slot, s.generation), v)));
+        slotted.chain(self.by_id.iter().map(|(id, v)| (id.clone(), v)))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    #[test]
+    fn encoding() {
+        assert_eq!(encode(0, 0), AnyRequestId::Number(-1));
+        assert_eq!(decode(&AnyRequestId::Number(-1)), Some((0, 0)));
+        for (slot, generation) in [(1, 0), (0, 1), (MAX_SLOTS - 1, GENERATION_MASK), (77, 3)] {
+            assert_eq!(decode(&encode(slot, generation)), Some((slot, generation)));
+        }
+        let AnyRequestId::Number(biggest) = encode(MAX_SLOTS - 1, GENERATION_MASK) else {
+            panic!()
+        };
+        assert!(biggest.unsigned_abs() <= 1 << 53);
+
+        for id in [
+            AnyRequestId::Number(0),
+            AnyRequestId::Number(7),
+            AnyRequestId::Number(i64::MIN),
+            AnyRequestId::Number(-(1 << 53) - 1),
+            AnyRequestId::String("-1".into()),
+        ] {
+            assert_eq!(decode(&id), None);
+        }
+    }
+
+    #[test]
+    fn slots() {
+        let mut t: PendingTable<&str> = PendingTable::default();
+        let a = t.next_id();
+        t.insert(a.clone(), "a").unwrap();
+        let b = t.next_id();
+        assert_ne!(a, b);
+        t.insert(b.clone(), "b").unwrap();
+        assert_eq!(t.insert(b.clone(), "again"), Err("again"));
+        assert_eq!(t.len(), 2);
+        assert!(t.by_id.is_empty());
+        assert_eq!(t.get(&a), Some(&"a"));
+        *t.get_mut(&b).unwrap() = "bb";
+
+        // A removed slot gets reused under a new generation, so its old ID stays dead.
+        assert_eq!(t.remove(&a), Some("a"));
+        assert_eq!(t.remove(&a), None);
+        let c = t.next_id();
+        assert_ne!(a, c);
+        assert_eq!(decode(&a).unwrap().0, decode(&c).unwrap().0);
+        t.insert(c.clone(), "c").unwrap();
+        assert_eq!(t.get(&a), None);
+        assert_eq!(t.get(&c), Some(&"c"));
+
+        let mut all: Vec<_> = t.values().copied().collect();
+        all.sort();
+        assert_eq!(all, vec!["bb", "c"]);
+        assert_eq!(t.slots.len(), 2);
+    }
+
+    #[test]
+    fn application_ids() {
+        let mut t: PendingTable<&str> = PendingTable::default();
+        let fred = AnyRequestId::from("fred".to_string());
+        t.insert(fred.clone(), "fred").unwrap();
+        t.insert(AnyRequestId::Number(7), "seven").unwrap();
+        assert_eq!(t.insert(fred.clone(), "fred2"), Err("fred2"));
+
+        // An application ID that we would choose next goes in its slot...
+        let next = t.next_id();
+        t.insert(next.clone(), "app").unwrap();
+        assert_eq!(t.slot_for(&next), Some(0));
+
+        // ...but one that names another generation of a slot lives in the map,
+        // and we skip that generation once we reach it.
+        let (slot, generation) = decode(&next).unwrap();
+        let later = encode(slot, generation + 1);
+        t.insert(later.clone(), "later").unwrap();
+        assert_eq!(t.get(&next), Some(&"app"));
+        assert_eq!(t.get(&later), Some(&"later"));
+        assert_eq!(t.remove(&next), Some("app"));
+        let ours = t.next_id();
+        assert_eq!(decode(&ours), Some((slot, generation + 2)));
+        t.insert(ours.clone(), "ours").unwrap();
+        assert_eq!(t.get(&later), Some(&"later"));
+        assert_eq!(t.len(), 4);
+
+        // We never hand out an ID that the application is using.
+        let mut ids = vec![];
+        for _ in 0..10 {
+            let id = t.next_id();
+            assert!(!t.contains_key(&id));
+            t.insert(id.clone(), "x").unwrap();
+            ids.push(id);
+        }
+        for id in &ids {
+            assert_eq!(t.remove(id), Some("x"));
+        }
+        assert_eq!(t.remove(&fred), Some("fred"));
+        assert_eq!(t.remove(&later), Some("later"));
+        assert_eq!(t.iter().count(), 2);
+    }
+}
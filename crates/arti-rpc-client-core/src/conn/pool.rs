@@ -0,0 +1,125 @@
+//! A pool of RPC connections to a single Arti instance.
+//!
+//! Every [`RpcConn`] sends all of its requests over a single socket,
+//! and each request and response has to pass through that connection's locks.
+//! When many threads are making requests at once, that can become a bottleneck;
+//! spreading the requests across several connections avoids it.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use super::{ConnectError, RpcConn, RpcConnBuilder};
+
+/// A fixed set of authenticated [`RpcConn`]s to the same Arti instance.
+///
+/// Use [`get`](RpcConnPool::get) to pick the connection
+/// that currently has the fewest outstanding requests.
+///
+/// Note that each connection in the pool negotiates its own session with Arti,
+/// and that Arti's object IDs are only meaningful on the connection that created them.
+/// So if you make a request referring to an object that you got from an earlier request,
+/// you must make it on the same connection as that earlier request:
+/// keep the `&RpcConn` from `get`, rather than calling `get` again.
+#[derive(Debug)]
+pub struct RpcConnPool {
+    /// The connections in this pool.
+    ///
+    /// Invariant: This is never empty.
+    conns: Vec<RpcConn>,
+    /// The index at which [`get`](RpcConnPool::get) should next start looking.
+    ///
+    /// We rotate this so that ties are broken in round-robin order.
+    next: AtomicUsize,
+}
+
+impl RpcConnPool {
+    /// Open `n_conns` connections to Arti, as specified by `builder`.
+    ///
+    /// Each connection is authenticated separately.
+    /// If `n_conns` is zero, we open a single connection.
+    pub fn connect(builder: &RpcConnBuilder, n_conns: usize) -> Result<Self, ConnectError> {
+        let conns = (0..n_conns.max(1))
+            .map(|_| builder.connect())
+            .collect::<Result<Vec<_>, _>>()?;
+        Ok(Self::from_conns(conns))
+    }
+
+    /// Construct a pool from a nonempty list of connections.
+    fn from_conns(conns: Vec<RpcConn>) -> Self {
+        assert!(!conns.is_empty());
+        Self {
+            conns,
+            next: AtomicUsize::new(0),
+        }
+    }
+
+    /// Return the connection in this pool that has the fewest outstanding requests.
+    ///
+    /// Ties are broken in round-robin order.
+    pub fn get(&self) -> &RpcConn {
+        let n = self.conns.len();
+        let start = self.next.fetch_add(1, Ordering::Relaxed) % n;
+        (0..n)
+            .map(|offset| &self.conns[(start + offset) % n])
+            .min_by_key(|conn| conn.n_outstanding())
+            .expect("RpcConnPool was empty")
+    }
+
+    /// Return every connection in this pool.
+    pub fn connections(&self) -> &[RpcConn] {
+        &self.conns[..]
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use crate::conn::test::dummy_connected;
+
+    #[test]
+    fn least_loaded() {
+        let (conns, _socks): (Vec<_>, Vec<_>) = (0..3).map(|_| dummy_connected()).unzip();
+        let pool = RpcConnPool::from_conns(conns);
+        let same = |a: &RpcConn, b: &RpcConn| std::ptr::eq(a, b);
+
+        // With nothing outstanding, we go round-robin.
+        let picks: Vec<&RpcConn> = (0..3).map(|_| pool.get()).collect();
+        for (pick, conn) in picks.iter().zip(pool.connections()) {
+            assert!(same(pick, conn));
+        }
+
+        // Load up the first two connections; every pick should then be the third,
+        // until it is as busy as they are.
+        let busy = |conn: &RpcConn, n: usize| -> Vec<crate::conn::RequestHandle> {
+            (0..n)
+                .map(|_| {
+                    conn.execute_with_handle(r#"{"obj":"x","method":"arti:x-frob","params":{}}"#)
+                        .unwrap()
+                })
+                .collect()
+        };
+        let _h0 = busy(&pool.connections()[0], 2);
+        let _h1 = busy(&pool.connections()[1], 1);
+        for _ in 0..5 {
+            assert!(same(pool.get(), &pool.connections()[2]));
+        }
+        let _h2 = busy(&pool.connections()[2], 2);
+        for _ in 0..5 {
+            assert!(same(pool.get(), &pool.connections()[1]));
+        }
+        assert_eq!(pool.connections()[0].n_outstanding(), 2);
+    }
+}
@@ -0,0 +1,137 @@
+//! A pool of pre-warmed connections to Arti's SOCKS proxy.
+//!
+//! Opening a stream from scratch requires a TCP connection to Arti,
+//! and then several round trips of SOCKS handshake.
+//! Only the last of those round trips depends on the stream we want to open,
+//! so we can do all the others ahead of time, in the background.
+
+use std::{
+    collections::VecDeque,
+    net::SocketAddr,
+    sync::{Arc, Mutex, Weak},
+};
+
+use super::stream::{prewarm_socks, PrewarmedSocks};
+
+/// A pool of connections to Arti's SOCKS proxy, on which the initial handshake is done.
+///
+/// The pool is refilled by a background thread whenever it has fewer than
+/// `depth` connections ready.
+#[derive(Debug)]
+pub(super) struct SocksPool {
+    /// The number of connections we try to keep ready.
+    depth: usize,
+    /// Mutable state for this pool.
+    ///
+    /// This lock is never held while connecting to Arti.
+    state: Mutex<PoolState>,
+}
+
+/// Mutable state for a [`SocksPool`].
+#[derive(Debug, Default)]
+struct PoolState {
+    /// The address of Arti's SOCKS proxy, if we know it.
+    ///
+    /// Every connection in `ready` is to this address.
+    addr: Option<SocketAddr>,
+    /// Connections that are ready for use, with the oldest first.
+    ready: VecDeque<PrewarmedSocks>,
+    /// True if a background thread is currently refilling `ready`.
+    refilling: bool,
+}
+
+impl SocksPool {
+    /// Create a new empty SocksPool, which will try to keep `depth` connections ready.
+    ///
+    /// The pool will not fill until it has been told an address with [`note_addr`](Self::note_addr).
+    pub(super) fn new(depth: usize) -> Arc<Self> {
+        Arc::new(Self {
+            depth,
+            state: Mutex::new(PoolState::default()),
+        })
+    }
+
+    /// Take a ready connection from this pool, if there is one that is still usable,
+    /// and start refilling the pool.
+    pub(super) fn take(self: &Arc<Self>) -> Option<PrewarmedSocks> {
+        let mut state = self.state.lock().expect("poisoned");
+        let mut found = None;
+        while let Some(warm) = state.ready.pop_front() {
+            if warm.is_alive() {
+                found = Some(warm);
+                break;
+            }
+        }
+        self.maybe_refill(&mut state);
+        found
+    }
+
+    /// Tell this pool that Arti's SOCKS proxy is at `addr`.
+    ///
+    /// If this is a new address, discard any connections to the old one.
+    /// In any case, start refilling the pool if needed.
+    pub(super) fn note_addr(self: &Arc<Self>, addr: SocketAddr) {
+        let mut state = self.state.lock().expect("poisoned");
+        if state.addr != Some(addr) {
+            state.addr = Some(addr);
+            state.ready.clear();
+        }
+        self.maybe_refill(&mut state);
+    }
+
+    /// Launch a background thread to refill this pool, if it needs one and doesn't have one.
+    fn maybe_refill(self: &Arc<Self>, state: &mut PoolState) {
+        if state.refilling || state.addr.is_none() || state.ready.len() >= self.depth {
+            return;
+        }
+        let weak = Arc::downgrade(self);
+        let launched = std::thread::Builder::new()
+            .name("arti-rpc-socks".to_string())
+            .spawn(move || Self::run_refill(&weak));
+        // If we can't launch a thread, we just don't refill:
+        // open_stream will make fresh connections as needed.
+        state.refilling = launched.is_ok();
+    }
+
+    /// Body for the background refill thread:
+    /// make connections until the pool is full, it fails, or it is dropped.
+    fn run_refill(weak: &Weak<Self>) {
+        loop {
+            let Some(pool) = weak.upgrade() else {
+                return;
+            };
+            let addr = {
+                let mut state = pool.state.lock().expect("poisoned");
+                match state.addr {
+                    Some(addr) if state.ready.len() < pool.depth => addr,
+                    _ => {
+                        state.refilling = false;
+                        return;
+                    }
+                }
+            };
+
+            let outcome = prewarm_socks(addr);
+
+            let mut state = pool.state.lock().expect("poisoned");
+            match outcome {
+                // If the address changed while we were connecting, we discard this connection
+                // and go around again.
+                Ok(warm) if state.addr == Some(addr) => state.ready.push_back(warm),
+                Ok(_) => {}
+                Err(_) => {
+                    // We'll try again the next time somebody takes a connection
+                    // or tells us a new address.
+                    state.refilling = false;
+                    return;
+                }
+            }
+        }
+    }
+
+    /// Return the number of connections that are currently ready.
+    #[cfg(test)]
+    pub(super) fn n_ready(&self) -> usize {
+        self.state.lock().expect("poisoned").ready.len()
+    }
+}
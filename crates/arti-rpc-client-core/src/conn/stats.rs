@@ -0,0 +1,189 @@
+//! Statistics about the activity on an RPC connection.
+//!
+//! Everything here is counted with relaxed atomics,
+//! so that keeping statistics never makes anybody wait on
+//! the lock that protects the connection's receiver state.
+
+use std::{
+    sync::atomic::{AtomicU64, Ordering},
+    time::Duration,
+};
+
+/// The number of buckets in each latency histogram of an [`RpcConnStats`].
+///
+/// Bucket 0 counts latencies of less than one microsecond.
+/// For `i >= 1`, bucket `i` counts latencies of at least `2^(i-1)`
+/// but less than `2^i` microseconds,
+/// except that the last bucket also counts every latency larger than that.
+pub const N_LATENCY_BUCKETS: usize = 32;
+
+/// A snapshot of the statistics for an [`RpcConn`](crate::RpcConn).
+///
+/// Returned by [`RpcConn::stats`](crate::RpcConn::stats).
+#[derive(Clone, Debug, Default)]
+#[non_exhaustive]
+pub struct RpcConnStats {
+    /// The number of requests that we have sent.
+    pub requests_sent: u64,
+    /// The number of requests that have received a final response.
+    pub requests_completed: u64,
+    /// The number of requests that have not yet received a final response.
+    pub n_pending: usize,
+    /// The number of responses that have arrived,
+    /// but which nobody has taken yet.
+    pub n_queued: usize,
+    /// The total length of the messages we have received, not counting framing.
+    pub bytes_read: u64,
+    /// The total length of the messages we have sent, not counting framing.
+    pub bytes_written: u64,
+    /// The number of times that one waiting thread has handed off
+    /// the job of reading from Arti to another.
+    ///
+    /// (A high value here, compared to the number of requests,
+    /// suggests that a background reader might help.)
+    pub reader_handoffs: u64,
+    /// The total length of the responses that have arrived,
+    /// but which nobody has taken yet.
+    ///
+    /// (This does not count responses for requests with callbacks.)
+    pub queued_bytes: u64,
+    /// The number of times that our background reader has stopped reading
+    /// to wait for room in a queue.
+    ///
+    /// (See [`OverflowPolicy::Block`](crate::OverflowPolicy::Block).)
+    pub reader_blocks: u64,
+    /// A histogram of the time from sending each request
+    /// to receiving its first update.
+    ///
+    /// See [`N_LATENCY_BUCKETS`] for the meaning of each bucket.
+    pub first_update_latency: [u64; N_LATENCY_BUCKETS],
+    /// A histogram of the time from sending each request
+    /// to receiving its final response.
+    ///
+    /// See [`N_LATENCY_BUCKETS`] for the meaning of each bucket.
+    pub final_latency: [u64; N_LATENCY_BUCKETS],
+}
+
+/// The lock-free counters behind an [`RpcConnStats`].
+#[derive(Default)]
+pub(super) struct ConnStats {
+    /// See [`RpcConnStats::requests_sent`].
+    pub(super) requests_sent: AtomicU64,
+    /// See [`RpcConnStats::requests_completed`].
+    pub(super) requests_completed: AtomicU64,
+    /// See [`RpcConnStats::bytes_read`].
+    pub(super) bytes_read: AtomicU64,
+    /// See [`RpcConnStats::bytes_written`].
+    pub(super) bytes_written: AtomicU64,
+    /// See [`RpcConnStats::reader_handoffs`].
+    pub(super) reader_handoffs: AtomicU64,
+    /// See [`RpcConnStats::reader_blocks`].
+    pub(super) reader_blocks: AtomicU64,
+    /// See [`RpcConnStats::first_update_latency`].
+    pub(super) first_update_latency: LatencyHistogram,
+    /// See [`RpcConnStats::final_latency`].
+    pub(super) final_latency: LatencyHistogram,
+}
+
+/// Add `n` to `counter`.
+pub(super) fn bump(counter: &AtomicU64, n: u64) {
+    counter.fetch_add(n, Ordering::Relaxed);
+}
+
+impl ConnStats {
+    /// Return a snapshot of these counters.
+    ///
+    /// The caller fills in the fields that don't come from a counter.
+    pub(super) fn snapshot(&self) -> RpcConnStats {
+        let get = |counter: &AtomicU64| counter.load(Ordering::Relaxed);
+        RpcConnStats {
+            requests_sent: get(&self.requests_sent),
+            requests_completed: get(&self.requests_completed),
+            n_pending: 0,
+            n_queued: 0,
+            bytes_read: get(&self.bytes_read),
+            bytes_written: get(&self.bytes_written),
+            reader_handoffs: get(&self.reader_handoffs),
+            queued_bytes: 0,
+            reader_blocks: get(&self.reader_blocks),
+            first_update_latency: self.first_update_latency.snapshot(),
+            final_latency: self.final_latency.snapshot(),
+        }
+    }
+}
+
+/// A histogram of latencies, bucketed by powers of two.
+///
+/// See [`N_LATENCY_BUCKETS`] for the meaning of each bucket.
+#[derive(Default)]
+pub(super) struct LatencyHistogram {
+    /// The number of latencies recorded in each bucket.
+    buckets: [AtomicU64; N_LATENCY_BUCKETS],
+}
+
+impl LatencyHistogram {
+    /// Record a single latency of `d`.
+    pub(super) fn record(&self, d: Duration) {
+        bump(&self.buckets[bucket_for(d)], 1);
+    }
+
+    /// Return the current count in each bucket.
+    fn snapshot(&self) -> [u64; N_LATENCY_BUCKETS] {
+        std::array::from_fn(|i| self.buckets[i].load(Ordering::Relaxed))
+    }
+}
+
+/// Return the index of the histogram bucket that counts `d`.
+fn bucket_for(d: Duration) -> usize {
+    let micros = u64::try_from(d.as_micros()).unwrap_or(u64::MAX);
+    let bits = (u64::BITS - micros.leading_zeros()) as usize;
+    bits.min(N_LATENCY_BUCKETS - 1)
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    #[test]
+    fn buckets() {
+        assert_eq!(bucket_for(Duration::from_nanos(999)), 0);
+        assert_eq!(bucket_for(Duration::from_micros(1)), 1);
+        assert_eq!(bucket_for(Duration::from_micros(2)), 2);
+        assert_eq!(bucket_for(Duration::from_micros(3)), 2);
+        assert_eq!(bucket_for(Duration::from_micros(4)), 3);
+        assert_eq!(bucket_for(Duration::from_millis(1)), 10);
+        assert_eq!(bucket_for(Duration::from_secs(1)), 20);
+        assert_eq!(
+            bucket_for(Duration::from_secs(86400)),
+            N_LATENCY_BUCKETS - 1
+        );
+        assert_eq!(bucket_for(Duration::MAX), N_LATENCY_BUCKETS - 1);
+    }
+
+    #[test]
+    fn record() {
+        let stats = ConnStats::default();
+        bump(&stats.requests_sent, 3);
+        stats.final_latency.record(Duration::from_micros(5));
+        stats.final_latency.record(Duration::from_micros(6));
+        let snap = stats.snapshot();
+        assert_eq!(snap.requests_sent, 3);
+        assert_eq!(snap.final_latency[3], 2);
+        assert_eq!(snap.final_latency.iter().sum::<u64>(), 2);
+        assert_eq!(snap.first_update_latency.iter().sum::<u64>(), 0);
+    }
+}
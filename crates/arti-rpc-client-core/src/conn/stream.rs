@@ -3,12 +3,15 @@
 use std::{
     io::{Error as IoError, Read as _, Write as _},
     net::{SocketAddr, TcpStream},
-    sync::Arc,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc, Mutex,
+    },
 };
 
 use serde::{Deserialize, Serialize};
 
-use super::{ErrorResponse, RpcConn};
+use super::{socks_pool::SocksPool, ErrorResponse, RpcConn};
 use crate::{msgs::request::Request, ObjectId};
 
 use tor_error::ErrorReport as _;
@@ -69,6 +72,20 @@ pub enum StreamError {
     /// The other side gave us a SOCKS error.
     #[error("SOCKS error code {0}")]
     SocksError(tor_socksproto::SocksStatus),
+
+    /// Tried to receive a stream as a file descriptor
+    /// on a connection that can't carry file descriptors.
+    #[error("RPC connection cannot receive file descriptors")]
+    FdPassingUnavailable,
+
+    /// We weren't able to have Arti send us a stream as a file descriptor.
+    #[error("Request to open stream as a file descriptor rejected")]
+    OpenStreamRejected(ErrorResponse),
+
+    /// Arti told us that it had sent a stream as a file descriptor,
+    /// but no such descriptor arrived.
+    #[error("Arti did not send the promised file descriptor")]
+    MissingFd,
 }
 
 impl From<IoError> for StreamError {
@@ -163,12 +180,7 @@ impl RpcConn {
         isolation: &str,
     ) -> Result<(ObjectId, TcpStream), StreamError> {
         let on_object = self.resolve_on_object(on_object)?;
-        let new_stream_request =
-            Request::new(on_object.clone(), "arti:new_stream_handle", NoParameters {});
-        let stream_id = self
-            .execute_internal::<SingleIdResponse>(&new_stream_request.encode()?)?
-            .map_err(StreamError::NewStreamRejected)?
-            .id;
+        let stream_id = self.new_stream_handle(on_object)?;
 
         match self.open_stream(Some(&stream_id), target, isolation) {
             Ok(tcp_stream) => Ok((stream_id, tcp_stream)),
@@ -199,46 +211,463 @@ impl RpcConn {
         isolation: &str,
     ) -> Result<TcpStream, StreamError> {
         let on_object = self.resolve_on_object(on_object)?;
-        let socks_proxy_addr = self.lookup_socks_proxy_addr()?;
-        let mut stream = TcpStream::connect(socks_proxy_addr)?;
-
-        // For information about this encoding,
-        // see https://spec.torproject.org/socks-extensions.html#extended-auth
-        let username = format!("<torS0X>1{}", on_object.as_ref());
+        let username = socks_username(&on_object);
         let password = isolation;
-        negotiate_socks(&mut stream, hostname, port, &username, password)?;
+
+        if let Some(mut warm) = self.take_pooled_socks() {
+            match negotiate_socks(
+                &mut warm.stream,
+                warm.prologue,
+                hostname,
+                port,
+                &username,
+                password,
+            ) {
+                Ok(()) => return Ok(warm.stream),
+                // Arti may have closed this connection while it was idle;
+                // fall back to making a fresh one.
+                Err(StreamError::Io(_) | StreamError::SocksProtocol(_)) => {}
+                Err(e) => return Err(e),
+            }
+        }
+
+        let mut stream = self.connect_fresh_socks()?;
+        negotiate_socks(
+            &mut stream,
+            SocksPrologue::default(),
+            hostname,
+            port,
+            &username,
+            password,
+        )?;
 
         Ok(stream)
     }
 
-    /// Ask Arti for its supported SOCKS addresses; return the first one.
-    //
-    // TODO: Currently we call this every time we want to open a stream.
-    // We could instead cache the value.
-    fn lookup_socks_proxy_addr(&self) -> Result<SocketAddr, StreamError> {
-        let session_id = self.session_id_required()?.clone();
+    /// Begin opening a new data stream, without waiting for Arti to finish connecting it.
+    ///
+    /// Behaves the same as [`open_stream()`](RpcConn::open_stream),
+    /// except that it returns as soon as the request for the stream has been sent
+    /// (or is ready to send).
+    /// Use the returned [`PendingStream`] to wait for Arti's answer
+    /// without blocking, alongside as many other pending streams as you like.
+    ///
+    /// (This function may still block briefly:
+    /// it may need to ask Arti for its SOCKS address,
+    /// and it connects to that address on the local host.)
+    pub fn open_stream_nonblocking(
+        &self,
+        on_object: Option<&ObjectId>,
+        target: (&str, u16),
+        isolation: &str,
+    ) -> Result<PendingStream, StreamError> {
+        let on_object = self.resolve_on_object(on_object)?;
+        self.begin_open_stream(&on_object, target, isolation, None)
+    }
+
+    /// Begin opening a new data stream, registering the stream with the RPC system,
+    /// without waiting for Arti to finish connecting it.
+    ///
+    /// Behaves the same as [`open_stream_nonblocking()`](RpcConn::open_stream_nonblocking),
+    /// except that the resulting [`PendingStream`] has a [`stream_id`](PendingStream::stream_id)
+    /// that can be used to identify the stream for later RPC requests.
+    ///
+    /// (This function makes a blocking request to Arti in order to get that ID.)
+    ///
+    /// If this function succeeds, the caller is responsible for releasing the ID,
+    /// whether the stream eventually succeeds or fails.
+    pub fn open_stream_as_object_nonblocking(
+        &self,
+        on_object: Option<&ObjectId>,
+        target: (&str, u16),
+        isolation: &str,
+    ) -> Result<PendingStream, StreamError> {
+        let on_object = self.resolve_on_object(on_object)?;
+        let stream_id = self.new_stream_handle(on_object)?;
+
+        match self.begin_open_stream(&stream_id, target, isolation, Some(stream_id.clone())) {
+            Ok(pending) => Ok(pending),
+            Err(e) => {
+                if let Err(_inner) = self.release_obj(stream_id) {
+                    // TODO RPC: We should log this error or something
+                }
+                Err(e)
+            }
+        }
+    }
+
+    /// Open several new data streams at once.
+    ///
+    /// Behaves like calling [`open_stream()`](RpcConn::open_stream) once for each entry
+    /// in `targets`, except that the SOCKS handshakes for the streams are performed
+    /// in parallel.
+    ///
+    /// Returns an error if we could not start opening the streams at all;
+    /// otherwise, returns a separate outcome for each entry of `targets`, in the same order.
+    pub fn open_streams(
+        &self,
+        on_object: Option<&ObjectId>,
+        targets: &[StreamTarget<'_>],
+    ) -> Result<Vec<Result<TcpStream, StreamError>>, StreamError> {
+        let on_object = self.resolve_on_object(on_object)?;
+        let on_objects = vec![on_object; targets.len()];
+        Ok(self.open_streams_on(&on_objects, targets))
+    }
+
+    /// Open several new data streams at once, registering each stream with the RPC system.
+    ///
+    /// Behaves like calling [`open_stream_as_object()`](RpcConn::open_stream_as_object)
+    /// once for each entry in `targets`, except that the stream IDs are all requested
+    /// in a single batch, and the SOCKS handshakes for the streams are performed in parallel.
+    ///
+    /// Returns an error if we could not start opening the streams at all;
+    /// otherwise, returns a separate outcome for each entry of `targets`, in the same order.
+    /// The IDs of any streams that fail are released before this function returns;
+    /// the caller is responsible for releasing the others,
+    /// perhaps with [`release_objects()`](RpcConn::release_objects).
+    #[allow(clippy::type_complexity)]
+    pub fn open_streams_as_objects(
+        &self,
+        on_object: Option<&ObjectId>,
+        targets: &[StreamTarget<'_>],
+    ) -> Result<Vec<Result<(ObjectId, TcpStream), StreamError>>, StreamError> {
+        let on_object = self.resolve_on_object(on_object)?;
+        let stream_ids = self.new_stream_handles(&on_object, targets.len())?;
+
+        let outcomes = self.open_streams_on(&stream_ids, targets);
+
+        let failed: Vec<ObjectId> = stream_ids
+            .iter()
+            .zip(&outcomes)
+            .filter(|(_, outcome)| outcome.is_err())
+            .map(|(id, _)| id.clone())
+            .collect();
+        if let Err(_inner) = self.release_objects(&failed) {
+            // TODO RPC: We should log this error or something
+        }
+
+        Ok(stream_ids
+            .into_iter()
+            .zip(outcomes)
+            .map(|(id, outcome)| outcome.map(|stream| (id, stream)))
+            .collect())
+    }
+
+    /// Tell Arti to release every object in `objects`, using a single batch of requests.
+    ///
+    /// Every release is attempted, even if some of them fail.
+    /// If any of them fail, returns the first error.
+    pub fn release_objects(&self, objects: &[ObjectId]) -> Result<(), StreamError> {
+        if objects.is_empty() {
+            return Ok(());
+        }
+        let requests = objects
+            .iter()
+            .map(|obj| Request::new(obj.clone(), "rpc:release", NoParameters {}).encode())
+            .collect::<Result<Vec<_>, _>>()?;
+        let requests: Vec<&str> = requests.iter().map(String::as_str).collect();
+
+        for outcome in self.execute_internal_batch::<EmptyResponse>(&requests)? {
+            let _empty_response: EmptyResponse =
+                outcome?.map_err(StreamError::StreamReleaseRejected)?;
+        }
+        Ok(())
+    }
+
+    /// Helper: Open one stream for each entry of `targets`,
+    /// relative to the corresponding entry of `on_objects`.
+    ///
+    /// We run up to [`MAX_PARALLEL_HANDSHAKES`] blocking SOCKS handshakes at a time,
+    /// each on its own thread.
+    fn open_streams_on(
+        &self,
+        on_objects: &[ObjectId],
+        targets: &[StreamTarget<'_>],
+    ) -> Vec<Result<TcpStream, StreamError>> {
+        debug_assert_eq!(on_objects.len(), targets.len());
+        let n = targets.len();
+        if n == 0 {
+            return Vec::new();
+        }
+
+        // Look up the proxy address now, if we need to,
+        // so that our workers don't all race to do it.
+        let cached = *self.socks_proxy_addr.lock().expect("poisoned");
+        if cached.is_none() {
+            if let Err(e) = self.lookup_socks_proxy_addr() {
+                return (0..n).map(|_| Err(e.clone())).collect();
+            }
+        }
+
+        let next = AtomicUsize::new(0);
+        let work = || {
+            let mut outcomes = Vec::new();
+            loop {
+                let idx = next.fetch_add(1, Ordering::Relaxed);
+                let (Some(on_object), Some(target)) = (on_objects.get(idx), targets.get(idx))
+                else {
+                    return outcomes;
+                };
+                let outcome = self.open_stream(
+                    Some(on_object),
+                    (target.hostname, target.port),
+                    target.isolation,
+                );
+                outcomes.push((idx, outcome));
+            }
+        };
+
+        let mut results: Vec<Option<Result<TcpStream, StreamError>>> =
+            std::iter::repeat_with(|| None).take(n).collect();
+        std::thread::scope(|scope| {
+            let workers: Vec<_> = (0..n.min(MAX_PARALLEL_HANDSHAKES))
+                .filter_map(|_| {
+                    std::thread::Builder::new()
+                        .name("arti-rpc-socks".to_string())
+                        .spawn_scoped(scope, work)
+                        .ok()
+                })
+                .collect();
+            // If we could not launch any threads, we do all the work here.
+            let mut outcomes = if workers.is_empty() {
+                work()
+            } else {
+                Vec::new()
+            };
+            for worker in workers {
+                outcomes.extend(worker.join().unwrap_or_default());
+            }
+            for (idx, outcome) in outcomes {
+                results[idx] = Some(outcome);
+            }
+        });
 
-        let proxy_info_request: Request<NoParameters> =
-            Request::new(session_id, "arti:get_rpc_proxy_info", NoParameters {});
-        let proxy_info = self.execute_internal_ok::<ProxyInfo>(&proxy_info_request.encode()?)?;
+        results
+            .into_iter()
+            .map(|r| {
+                r.unwrap_or_else(|| Err(StreamError::Internal("Stream worker panicked".into())))
+            })
+            .collect()
+    }
+
+    /// Helper: Start a nonblocking SOCKS handshake to open a stream relative to `on_object`.
+    ///
+    /// The resulting `PendingStream` will report `stream_id` as its ID.
+    fn begin_open_stream(
+        &self,
+        on_object: &ObjectId,
+        (hostname, port): (&str, u16),
+        isolation: &str,
+        stream_id: Option<ObjectId>,
+    ) -> Result<PendingStream, StreamError> {
+        let (mut stream, prologue) = match self.take_pooled_socks() {
+            Some(warm) => (warm.stream, warm.prologue),
+            None => (self.connect_fresh_socks()?, SocksPrologue::default()),
+        };
+        stream.set_nonblocking(true)?;
+
+        let mut negotiation = SocksNegotiation::new(
+            prologue,
+            hostname,
+            port,
+            &socks_username(on_object),
+            isolation,
+        )?;
+        // Send as much as we can now, so that the caller can begin by waiting for a reply.
+        let _done: bool = negotiation.advance(&mut stream)?;
+
+        Ok(PendingStream {
+            state: Mutex::new(PendingState {
+                stream: Some(stream),
+                negotiation,
+            }),
+            stream_id,
+        })
+    }
+
+    /// Helper: Take a connection from our pool of pre-warmed SOCKS connections, if we can.
+    fn take_pooled_socks(&self) -> Option<PrewarmedSocks> {
+        self.socks_pool.get().and_then(|pool| pool.take())
+    }
+
+    /// Helper: Make a new connection to Arti's SOCKS proxy,
+    /// telling our pool (if any) about the address we used.
+    fn connect_fresh_socks(&self) -> Result<TcpStream, StreamError> {
+        let (addr, stream) = self.connect_to_socks_proxy()?;
+        if let Some(pool) = self.socks_pool.get() {
+            pool.note_addr(addr);
+        }
+        Ok(stream)
+    }
+
+    /// Keep up to `depth` connections to Arti's SOCKS proxy open and ready,
+    /// so that [`open_stream`](RpcConn::open_stream) does not have to wait for them.
+    ///
+    /// Each pooled connection has already completed the initial SOCKS handshake,
+    /// so that opening a stream on it only requires sending the final request.
+    /// The pool is refilled by a background thread whenever a connection is taken from it.
+    ///
+    /// If a pool is already enabled, this function does nothing.
+    pub fn enable_socks_pool(&self, depth: usize) -> Result<(), StreamError> {
+        if depth == 0 || self.socks_pool.get().is_some() {
+            return Ok(());
+        }
+        let cached = *self.socks_proxy_addr.lock().expect("poisoned");
+        let addr = match cached {
+            Some(addr) => addr,
+            None => self.lookup_socks_proxy_addr()?,
+        };
+        let pool = self.socks_pool.get_or_init(|| SocksPool::new(depth));
+        pool.note_addr(addr);
+        Ok(())
+    }
+
+    /// Ask Arti again for its supported SOCKS addresses,
+    /// replacing any address that we have cached.
+    ///
+    /// Ordinarily, there is no need to call this method:
+    /// we look up the SOCKS address the first time we open a stream,
+    /// and look it up again if we can no longer connect to it.
+    pub fn refresh_proxy_info(&self) -> Result<(), StreamError> {
+        *self.socks_proxy_addr.lock().expect("poisoned") = None;
+        // Any answer that we prefetched may be out of date.
+        drop(self.proxy_info_prefetch.lock().expect("poisoned").take());
+        let _addr = self.lookup_socks_proxy_addr()?;
+        Ok(())
+    }
+
+    /// Open a TCP connection to Arti's SOCKS proxy.
+    ///
+    /// We use the address that we have cached, if there is one.
+    /// If we can't connect to that address, we assume that it is stale,
+    /// ask Arti for its current address, and try again.
+    ///
+    /// Return the address we used, along with the connection.
+    fn connect_to_socks_proxy(&self) -> Result<(SocketAddr, TcpStream), StreamError> {
+        let cached = *self.socks_proxy_addr.lock().expect("poisoned");
+        if let Some(addr) = cached {
+            match TcpStream::connect(addr) {
+                Ok(stream) => return Ok((addr, stream)),
+                Err(_) => self.forget_socks_proxy_addr(addr),
+            }
+        }
+
+        let addr = self.lookup_socks_proxy_addr()?;
+        match TcpStream::connect(addr) {
+            Ok(stream) => Ok((addr, stream)),
+            Err(e) => {
+                self.forget_socks_proxy_addr(addr);
+                Err(e.into())
+            }
+        }
+    }
+
+    /// Ask Arti for its supported SOCKS addresses; cache and return the first one.
+    ///
+    /// If we have already asked (with `prefetch_proxy_info`), use that answer instead.
+    pub(super) fn lookup_socks_proxy_addr(&self) -> Result<SocketAddr, StreamError> {
+        let prefetched = self.proxy_info_prefetch.lock().expect("poisoned").take();
+        let proxy_info: ProxyInfo = match prefetched {
+            Some((request, handle)) => super::wait_internal_ok(&request, handle)?,
+            None => {
+                let session_id = self.session_id_required()?;
+                self.execute_internal_ok(&proxy_info_request(session_id)?)?
+            }
+        };
         let socks_proxy_addr = proxy_info.find_socks_addr().ok_or(StreamError::NoProxy)?;
 
+        *self.socks_proxy_addr.lock().expect("poisoned") = Some(socks_proxy_addr);
         Ok(socks_proxy_addr)
     }
 
+    /// Send a request for Arti's proxy information, without waiting for the answer.
+    ///
+    /// The next time we need to look up Arti's SOCKS address, we use the answer to this request.
+    ///
+    /// Does nothing if we are not authenticated.
+    pub(super) fn prefetch_proxy_info(&self) -> Result<(), super::ProtoError> {
+        let Some(session_id) = self.session() else {
+            return Ok(());
+        };
+        let request = proxy_info_request(session_id)?;
+        let handle = self.execute_with_handle(&request)?;
+        *self.proxy_info_prefetch.lock().expect("poisoned") = Some((request, handle));
+        Ok(())
+    }
+
+    /// Forget our cached SOCKS address, if it is still `addr`.
+    ///
+    /// (If it is something else, another thread has already looked it up again.)
+    fn forget_socks_proxy_addr(&self, addr: SocketAddr) {
+        let mut cached = self.socks_proxy_addr.lock().expect("poisoned");
+        if *cached == Some(addr) {
+            *cached = None;
+        }
+    }
+
     /// Helper: Return the session ID, or an error.
     fn session_id_required(&self) -> Result<&ObjectId, StreamError> {
         self.session().ok_or(StreamError::NotAuthenticated)
     }
 
     /// Helper: Return on_object if it's present, or the session ID otherwise.
-    fn resolve_on_object(&self, on_object: Option<&ObjectId>) -> Result<ObjectId, StreamError> {
+    pub(super) fn resolve_on_object(
+        &self,
+        on_object: Option<&ObjectId>,
+    ) -> Result<ObjectId, StreamError> {
         Ok(match on_object {
             Some(obj) => obj.clone(),
             None => self.session_id_required()?.clone(),
         })
     }
 
+    /// Helper: Ask Arti for a new stream handle, relative to `on_object`.
+    fn new_stream_handle(&self, on_object: ObjectId) -> Result<ObjectId, StreamError> {
+        let new_stream_request = Request::new(on_object, "arti:new_stream_handle", NoParameters {});
+        Ok(self
+            .execute_internal::<SingleIdResponse>(&new_stream_request.encode()?)?
+            .map_err(StreamError::NewStreamRejected)?
+            .id)
+    }
+
+    /// Helper: Ask Arti for `n` new stream handles, relative to `on_object`,
+    /// using a single batch of requests.
+    fn new_stream_handles(
+        &self,
+        on_object: &ObjectId,
+        n: usize,
+    ) -> Result<Vec<ObjectId>, StreamError> {
+        if n == 0 {
+            return Ok(Vec::new());
+        }
+        let request =
+            Request::new(on_object.clone(), "arti:new_stream_handle", NoParameters {}).encode()?;
+        let requests = vec![request.as_str(); n];
+
+        let mut stream_ids = Vec::with_capacity(n);
+        let mut first_error = None;
+        for outcome in self.execute_internal_batch::<SingleIdResponse>(&requests)? {
+            match outcome
+                .map_err(StreamError::from)
+                .and_then(|r| r.map_err(StreamError::NewStreamRejected))
+            {
+                Ok(response) => stream_ids.push(response.id),
+                Err(e) => {
+                    first_error.get_or_insert(e);
+                }
+            }
+        }
+        match first_error {
+            None => Ok(stream_ids),
+            Some(e) => {
+                if let Err(_inner) = self.release_objects(&stream_ids) {
+                    // TODO RPC: We should log this error or something
+                }
+                Err(e)
+            }
+        }
+    }
+
     /// Helper: Tell Arti to release `obj`.
     fn release_obj(&self, obj: ObjectId) -> Result<(), StreamError> {
         let release_request = Request::new(obj, "rpc:release", NoParameters {});
@@ -248,25 +677,133 @@ impl RpcConn {
     }
 }
 
-/// Helper: Negotiate SOCKS5 on the provided stream, using the given parameters.
-//
-// NOTE: We could user `tor-socksproto` instead, but that pulls in a little more
-// code unnecessarily, has features we don't need, and has to handle variations
-// of SOCKS responses that we'll never see.
-fn negotiate_socks(
-    stream: &mut TcpStream,
+/// Helper: Return the text of a request for Arti's proxy information, on the session `session_id`.
+fn proxy_info_request(session_id: &ObjectId) -> Result<String, super::ProtoError> {
+    let request: Request<NoParameters> = Request::new(
+        session_id.clone(),
+        "arti:get_rpc_proxy_info",
+        NoParameters {},
+    );
+    request.encode()
+}
+
+/// One of the streams to open with [`RpcConn::open_streams`].
+#[derive(Clone, Copy, Debug)]
+#[allow(clippy::exhaustive_structs)]
+pub struct StreamTarget<'a> {
+    /// The hostname to connect to.
+    pub hostname: &'a str,
+    /// The port to connect to.
+    pub port: u16,
+    /// The isolation string for this stream,
+    /// as for [`RpcConn::open_stream`].
+    pub isolation: &'a str,
+}
+
+/// The largest number of SOCKS handshakes that
+/// [`RpcConn::open_streams`] will run at once.
+const MAX_PARALLEL_HANDSHAKES: usize = 32;
+
+/// Bytes that have already been exchanged on a SOCKS connection
+/// before we call [`negotiate_socks`] on it.
+#[derive(Default, Debug)]
+pub(super) struct SocksPrologue {
+    /// Bytes that we have already sent.
+    sent: Vec<u8>,
+    /// Bytes that we have already received.
+    received: Vec<u8>,
+}
+
+/// A connection to Arti's SOCKS proxy on which the initial handshake has been done.
+#[derive(Debug)]
+pub(super) struct PrewarmedSocks {
+    /// The connection itself.
+    stream: TcpStream,
+    /// The part of the handshake that we have already performed.
+    prologue: SocksPrologue,
+}
+
+impl PrewarmedSocks {
+    /// Return true if this connection still appears to be usable.
+    ///
+    /// Arti should not send us anything until we send our next SOCKS message;
+    /// if there is data or EOF waiting for us, the connection is no good.
+    ///
+    /// (We check this before using a connection that has been idle,
+    /// so that we don't write to a socket that Arti has already closed.)
+    pub(super) fn is_alive(&self) -> bool {
+        if self.stream.set_nonblocking(true).is_err() {
+            return false;
+        }
+        let mut byte = [0_u8; 1];
+        let idle = matches!(
+            self.stream.peek(&mut byte),
+            Err(e) if e.kind() == std::io::ErrorKind::WouldBlock
+        );
+        self.stream.set_nonblocking(false).is_ok() && idle
+    }
+}
+
+/// Helper: Open a connection to the SOCKS proxy at `addr`,
+/// and perform the part of the SOCKS5 handshake that does not depend on
+/// the target address or the authentication details.
+///
+/// (That is, send our list of supported authentication methods,
+/// and receive the proxy's choice.)
+pub(super) fn prewarm_socks(addr: SocketAddr) -> Result<PrewarmedSocks, StreamError> {
+    use tor_socksproto::{Handshake as _, NextStep as NS, SocksClientHandshake};
+
+    // Our list of authentication methods depends only on the kind of authentication
+    // we use, not its content, so we can generate it with a placeholder request.
+    let request = socks_request("placeholder", 1, "", "")?;
+    let mut buf = tor_socksproto::Buffer::new_precise();
+    let greeting = match SocksClientHandshake::new(request)
+        .step(&mut buf)
+        .map_err(StreamError::SocksProtocol)?
+    {
+        NS::Send(greeting) => greeting,
+        _ => {
+            return Err(StreamError::Internal(
+                "SOCKS handshake did not start by sending".into(),
+            ))
+        }
+    };
+
+    let mut stream = TcpStream::connect(addr)?;
+    stream.write_all(&greeting)?;
+    // A SOCKS5 method-selection reply is always two bytes long.
+    let mut reply = [0_u8; 2];
+    stream.read_exact(&mut reply)?;
+
+    Ok(PrewarmedSocks {
+        stream,
+        prologue: SocksPrologue {
+            sent: greeting,
+            received: reply.to_vec(),
+        },
+    })
+}
+
+/// Helper: Return the SOCKS username that tells Arti to open a stream relative to `on_object`.
+fn socks_username(on_object: &ObjectId) -> String {
+    // For information about this encoding,
+    // see https://spec.torproject.org/socks-extensions.html#extended-auth
+    format!("<torS0X>1{}", on_object.as_ref())
+}
+
+/// Helper: Construct the SOCKS5 request that we send for a given set of parameters.
+fn socks_request(
     hostname: &str,
     port: u16,
     username: &str,
     password: &str,
-) -> Result<(), StreamError> {
+) -> Result<tor_socksproto::SocksRequest, StreamError> {
     use tor_socksproto::{
-        Handshake as _, SocksAddr, SocksAuth, SocksClientHandshake, SocksCmd, SocksHostname,
-        SocksRequest, SocksStatus, SocksVersion,
+        SocksAddr, SocksAuth, SocksCmd, SocksHostname, SocksRequest, SocksVersion,
     };
     use StreamError as E;
 
-    let request = SocksRequest::new(
+    SocksRequest::new(
         SocksVersion::V5,
         SocksCmd::CONNECT,
         SocksAddr::Hostname(SocksHostname::try_from(hostname.to_owned()).map_err(E::SocksRequest)?),
@@ -276,32 +813,230 @@ fn negotiate_socks(
             password.to_owned().into_bytes(),
         ),
     )
-    .map_err(E::SocksRequest)?;
+    .map_err(E::SocksRequest)
+}
 
-    let mut buf = tor_socksproto::Buffer::new_precise();
-    let mut state = SocksClientHandshake::new(request);
-    let reply = loop {
-        use tor_socksproto::NextStep as NS;
-        match state.step(&mut buf).map_err(E::SocksProtocol)? {
-            NS::Recv(mut recv) => {
-                let n = stream.read(recv.buf())?;
-                recv.note_received(n).map_err(E::SocksProtocol)?;
+/// Helper: Negotiate SOCKS5 on the provided blocking stream, using the given parameters.
+///
+/// If `prologue` is nonempty, then part of the handshake has already happened on `stream`:
+/// we replay it to our handshake state machine rather than sending or receiving it again.
+//
+// NOTE: We could user `tor-socksproto` instead, but that pulls in a little more
+// code unnecessarily, has features we don't need, and has to handle variations
+// of SOCKS responses that we'll never see.
+fn negotiate_socks(
+    stream: &mut TcpStream,
+    prologue: SocksPrologue,
+    hostname: &str,
+    port: u16,
+    username: &str,
+    password: &str,
+) -> Result<(), StreamError> {
+    let mut negotiation = SocksNegotiation::new(prologue, hostname, port, username, password)?;
+    if negotiation.advance(stream)? {
+        Ok(())
+    } else {
+        // A blocking stream should never give us WouldBlock.
+        Err(StreamError::Io(Arc::new(
+            std::io::ErrorKind::WouldBlock.into(),
+        )))
+    }
+}
+
+/// An in-progress SOCKS5 handshake on a (possibly nonblocking) stream.
+struct SocksNegotiation {
+    /// The handshake state machine.
+    state: tor_socksproto::SocksClientHandshake,
+    /// The buffer that `state` uses for incoming data.
+    buf: tor_socksproto::Buffer,
+    /// The parts of the prologue that we have not yet replayed to `state`.
+    prologue: SocksPrologue,
+    /// Data that the state machine told us to send, but which we have not yet written.
+    unsent: Vec<u8>,
+    /// True if the handshake has finished successfully.
+    done: bool,
+}
+
+impl SocksNegotiation {
+    /// Begin a new SOCKS negotiation with the given parameters.
+    ///
+    /// See [`negotiate_socks`] for the meaning of `prologue`.
+    fn new(
+        prologue: SocksPrologue,
+        hostname: &str,
+        port: u16,
+        username: &str,
+        password: &str,
+    ) -> Result<Self, StreamError> {
+        let request = socks_request(hostname, port, username, password)?;
+        Ok(Self {
+            state: tor_socksproto::SocksClientHandshake::new(request),
+            buf: tor_socksproto::Buffer::new_precise(),
+            prologue,
+            unsent: Vec::new(),
+            done: false,
+        })
+    }
+
+    /// Make as much progress on the handshake as we can without blocking.
+    ///
+    /// Return `Ok(true)` if the handshake has finished successfully,
+    /// and `Ok(false)` if we need to wait until `stream` is readable
+    /// (or writable, if [`wants_write`](Self::wants_write) is true).
+    fn advance(&mut self, stream: &mut TcpStream) -> Result<bool, StreamError> {
+        use std::io::ErrorKind::{Interrupted, WouldBlock, WriteZero};
+        use tor_socksproto::{Handshake as _, NextStep as NS, SocksStatus};
+        use StreamError as E;
+
+        while !self.done {
+            if !self.unsent.is_empty() {
+                match stream.write(&self.unsent) {
+                    Ok(0) => return Err(IoError::from(WriteZero).into()),
+                    Ok(n) => {
+                        self.unsent.drain(..n);
+                    }
+                    Err(e) if e.kind() == WouldBlock => return Ok(false),
+                    Err(e) if e.kind() == Interrupted => {}
+                    Err(e) => return Err(e.into()),
+                }
+                continue;
             }
-            NS::Send(send) => stream.write_all(&send)?,
-            NS::Finished(fin) => {
-                break fin
-                    .into_output()
-                    .map_err(|bug| E::Internal(bug.report().to_string()))?
+
+            match self.state.step(&mut self.buf).map_err(E::SocksProtocol)? {
+                NS::Recv(mut recv) if !self.prologue.received.is_empty() => {
+                    let dest = recv.buf();
+                    let n = dest.len().min(self.prologue.received.len());
+                    dest[..n].copy_from_slice(&self.prologue.received[..n]);
+                    self.prologue.received.drain(..n);
+                    recv.note_received(n).map_err(E::SocksProtocol)?;
+                }
+                NS::Recv(mut recv) => match stream.read(recv.buf()) {
+                    Ok(n) => recv.note_received(n).map_err(E::SocksProtocol)?,
+                    Err(e) if e.kind() == WouldBlock => return Ok(false),
+                    Err(e) if e.kind() == Interrupted => {}
+                    Err(e) => return Err(e.into()),
+                },
+                NS::Send(send) => {
+                    let n = send.len().min(self.prologue.sent.len());
+                    if send[..n] != self.prologue.sent[..n] {
+                        return Err(E::Internal(
+                            "SOCKS handshake diverged from pre-warmed connection".into(),
+                        ));
+                    }
+                    self.prologue.sent.drain(..n);
+                    self.unsent = send[n..].to_vec();
+                }
+                NS::Finished(fin) => {
+                    let reply = fin
+                        .into_output()
+                        .map_err(|bug| E::Internal(bug.report().to_string()))?;
+                    let status = reply.status();
+                    if status != SocksStatus::SUCCEEDED {
+                        return Err(StreamError::SocksError(status));
+                    }
+                    self.done = true;
+                }
             }
         }
-    };
+        Ok(true)
+    }
 
-    let status = reply.status();
+    /// Return true if we are waiting to write data, rather than to read it.
+    fn wants_write(&self) -> bool {
+        !self.unsent.is_empty()
+    }
+}
 
-    if status == SocksStatus::SUCCEEDED {
-        Ok(())
-    } else {
-        Err(StreamError::SocksError(status))
+/// A data stream that is still being opened through Arti.
+///
+/// Returned by [`RpcConn::open_stream_nonblocking`].
+///
+/// The underlying socket is in nonblocking mode.
+/// Wait until it is readable (or writable, if [`wants_write`](Self::wants_write) is true),
+/// and then call [`advance`](Self::advance) to make progress.
+/// Repeat until `advance` returns the finished stream, or an error.
+///
+/// A `PendingStream` may be shared between threads:
+/// its state is protected by an internal lock.
+pub struct PendingStream {
+    /// The parts of this stream that change as we make progress.
+    state: Mutex<PendingState>,
+    /// If set, the ObjectId that identifies this stream within the RPC system.
+    stream_id: Option<ObjectId>,
+}
+
+/// The lock-protected state of a [`PendingStream`].
+struct PendingState {
+    /// The socket for this stream.
+    ///
+    /// This is None after we have returned it to the caller.
+    stream: Option<TcpStream>,
+    /// The state of our SOCKS handshake on `stream`.
+    negotiation: SocksNegotiation,
+}
+
+impl std::fmt::Debug for PendingStream {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("PendingStream")
+            .field("stream", &self.lock().stream)
+            .field("stream_id", &self.stream_id)
+            .finish_non_exhaustive()
+    }
+}
+
+impl PendingStream {
+    /// Helper: Lock the state of this stream.
+    fn lock(&self) -> std::sync::MutexGuard<'_, PendingState> {
+        self.state.lock().expect("poisoned")
+    }
+
+    /// Make as much progress on opening this stream as possible without blocking.
+    ///
+    /// Return `Ok(Some(stream))` once the stream is open.
+    /// The returned stream is still in nonblocking mode.
+    ///
+    /// Return `Ok(None)` if we need to wait for the socket to become ready.
+    ///
+    /// Once this has returned a stream or an error, it will only return errors.
+    pub fn advance(&self) -> Result<Option<TcpStream>, StreamError> {
+        let mut state = self.lock();
+        let state = &mut *state;
+        let stream = state.stream.as_mut().ok_or_else(|| {
+            StreamError::Internal("Tried to advance a stream that was already finished".into())
+        })?;
+        match state.negotiation.advance(stream) {
+            Ok(false) => Ok(None),
+            Ok(true) => Ok(state.stream.take()),
+            Err(e) => {
+                state.stream = None;
+                Err(e)
+            }
+        }
+    }
+
+    /// Return true if we are waiting for the socket to become writable,
+    /// rather than readable.
+    pub fn wants_write(&self) -> bool {
+        self.lock().negotiation.wants_write()
+    }
+
+    /// Call `f` on the socket for this stream, so that the caller can find out
+    /// how to wait for it to become ready.
+    ///
+    /// Return None (without calling `f`) after [`advance`](Self::advance)
+    /// has returned the stream or an error.
+    ///
+    /// (`f` runs with this stream's lock held, so it must not use this `PendingStream`.)
+    pub fn with_socket<T, F>(&self, f: F) -> Option<T>
+    where
+        F: FnOnce(&TcpStream) -> T,
+    {
+        self.lock().stream.as_ref().map(f)
+    }
+
+    /// Return the ObjectId that identifies this stream within the RPC system, if it has one.
+    pub fn stream_id(&self) -> Option<&ObjectId> {
+        self.stream_id.as_ref()
     }
 }
 
@@ -321,7 +1056,121 @@ mod test {
     #![allow(clippy::needless_pass_by_value)]
     //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
 
+    use std::{
+        io::{BufRead as _, BufReader},
+        net::TcpListener,
+        sync::{
+            atomic::{AtomicUsize, Ordering::SeqCst},
+            Mutex,
+        },
+        thread,
+        time::Duration,
+    };
+
     use super::*;
+    use crate::{conn::test::*, msgs::request::ValidatedRequest};
+
+    /// Helper: Return an authenticated dummy RpcConn, along with a thread that plays Arti,
+    /// answering every proxy info request with a proxy list containing the address in
+    /// `current_addr`.
+    ///
+    /// The thread also answers `arti:new_stream_handle` with a fresh ID of the form
+    /// `stream-N`, and `rpc:release` with an empty reply.
+    ///
+    /// The thread counts the proxy info requests it answers in `n_lookups`,
+    /// and exits when the RpcConn is dropped.
+    fn conn_with_fake_arti(
+        current_addr: &Arc<Mutex<SocketAddr>>,
+        n_lookups: &Arc<AtomicUsize>,
+    ) -> (RpcConn, thread::JoinHandle<()>) {
+        let (mut conn, sock) = dummy_connected();
+        conn.session = Some(ObjectId::try_from("session".to_string()).unwrap());
+
+        let current_addr = Arc::clone(current_addr);
+        let n_lookups = Arc::clone(n_lookups);
+        let fake_arti = thread::spawn(move || {
+            let mut sock = BufReader::new(sock);
+            let mut n_streams = 0;
+            loop {
+                let mut s = String::new();
+                if sock.read_line(&mut s).unwrap() == 0 {
+                    break;
+                }
+                let request = ValidatedRequest::from_string_strict(s.as_ref()).unwrap();
+                let fields: serde_json::Value = serde_json::from_str(&s).unwrap();
+                let result = match fields["method"].as_str().unwrap() {
+                    "arti:new_stream_handle" => {
+                        n_streams += 1;
+                        serde_json::json!({ "id": format!("stream-{n_streams}") })
+                    }
+                    "rpc:release" => serde_json::json!({}),
+                    _ => {
+                        n_lookups.fetch_add(1, SeqCst);
+                        let addr = current_addr.lock().unwrap().to_string();
+                        serde_json::json!({ "proxies": [
+                            { "listener": { "socks5": { "tcp_address": addr } } }
+                        ] })
+                    }
+                };
+                let response = serde_json::json!({
+                    "id": request.id().clone(),
+                    "result": result,
+                });
+                write_val(sock.get_mut(), &response);
+            }
+        });
+        (conn, fake_arti)
+    }
+
+    /// Helper: Act as a SOCKS5 proxy on `listener`, counting connections in `n_accepted`.
+    ///
+    /// For each connection, we check that the client speaks SOCKS5 with username authentication,
+    /// report success, and then echo the username back to the client.
+    fn fake_socks_proxy(listener: TcpListener, n_accepted: Arc<AtomicUsize>) {
+        /// Read a one-byte length, followed by that many bytes.
+        fn read_counted(s: &mut TcpStream) -> Vec<u8> {
+            let mut len = [0_u8; 1];
+            s.read_exact(&mut len).unwrap();
+            let mut v = vec![0_u8; len[0].into()];
+            s.read_exact(&mut v).unwrap();
+            v
+        }
+        thread::spawn(move || {
+            for s in listener.incoming() {
+                let mut s = s.unwrap();
+                n_accepted.fetch_add(1, SeqCst);
+                thread::spawn(move || {
+                    let mut greeting = [0_u8; 4];
+                    if s.read_exact(&mut greeting).is_err() {
+                        // The client went away without using this connection.
+                        return;
+                    }
+                    assert_eq!(greeting, [5, 2, 2, 0]);
+                    s.write_all(&[5, 2]).unwrap();
+
+                    let mut ver = [0_u8; 1];
+                    if s.read_exact(&mut ver).is_err() {
+                        // A pooled connection that was never used.
+                        return;
+                    }
+                    assert_eq!(ver, [1]);
+                    let username = read_counted(&mut s);
+                    let _password = read_counted(&mut s);
+                    s.write_all(&[1, 0]).unwrap();
+
+                    let mut cmd = [0_u8; 4];
+                    s.read_exact(&mut cmd).unwrap();
+                    assert_eq!(cmd, [5, 1, 0, 3]);
+                    let _hostname = read_counted(&mut s);
+                    let mut port = [0_u8; 2];
+                    s.read_exact(&mut port).unwrap();
+                    s.write_all(&[5, 0, 0, 1, 0, 0, 0, 0, 0, 0]).unwrap();
+
+                    s.write_all(&username).unwrap();
+                });
+            }
+        });
+    }
 
     #[test]
     fn unexpected_proxies() {
@@ -357,4 +1206,195 @@ mod test {
             "127.0.0.1:9090".parse().unwrap()
         );
     }
+
+    #[test]
+    fn proxy_addr_cache() {
+        let listener1 = TcpListener::bind("127.0.0.1:0").unwrap();
+        let listener2 = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr1 = listener1.local_addr().unwrap();
+        let addr2 = listener2.local_addr().unwrap();
+
+        let current_addr = Arc::new(Mutex::new(addr1));
+        let n_lookups = Arc::new(AtomicUsize::new(0));
+        let (conn, fake_arti) = conn_with_fake_arti(&current_addr, &n_lookups);
+
+        // The first connection looks up the address; the second uses the cached one.
+        let (a, s) = conn.connect_to_socks_proxy().unwrap();
+        assert_eq!((a, s.peer_addr().unwrap()), (addr1, addr1));
+        let (a, s) = conn.connect_to_socks_proxy().unwrap();
+        assert_eq!((a, s.peer_addr().unwrap()), (addr1, addr1));
+        assert_eq!(n_lookups.load(SeqCst), 1);
+
+        // Once the proxy goes away, we look it up again.
+        drop(listener1);
+        *current_addr.lock().unwrap() = addr2;
+        let (a, s) = conn.connect_to_socks_proxy().unwrap();
+        assert_eq!((a, s.peer_addr().unwrap()), (addr2, addr2));
+        assert_eq!(n_lookups.load(SeqCst), 2);
+
+        // We can also look it up again on demand.
+        conn.refresh_proxy_info().unwrap();
+        assert_eq!(n_lookups.load(SeqCst), 3);
+        assert_eq!(*conn.socks_proxy_addr.lock().unwrap(), Some(addr2));
+
+        drop(conn);
+        fake_arti.join().unwrap();
+    }
+
+    #[test]
+    fn socks_pool() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        let n_accepted = Arc::new(AtomicUsize::new(0));
+        fake_socks_proxy(listener, Arc::clone(&n_accepted));
+
+        let current_addr = Arc::new(Mutex::new(addr));
+        let n_lookups = Arc::new(AtomicUsize::new(0));
+        let (conn, fake_arti) = conn_with_fake_arti(&current_addr, &n_lookups);
+
+        /// Wait until the pool on `conn` has `n` connections ready.
+        fn wait_for_pool(conn: &RpcConn, n: usize) {
+            let pool = conn.socks_pool.get().unwrap();
+            for _ in 0..1000 {
+                if pool.n_ready() == n {
+                    return;
+                }
+                thread::sleep(Duration::from_millis(5));
+            }
+            panic!("pool never filled");
+        }
+        /// Open a stream on `conn`, and make sure the proxy sees the right username.
+        fn check_open_stream(conn: &RpcConn) {
+            let mut s = conn
+                .open_stream(None, ("www.example.com", 443), "iso")
+                .unwrap();
+            let mut echoed = Vec::new();
+            s.read_to_end(&mut echoed).unwrap();
+            assert_eq!(echoed, b"<torS0X>1session");
+        }
+
+        // Before the pool is enabled, we make a fresh connection every time.
+        check_open_stream(&conn);
+        assert_eq!(n_accepted.load(SeqCst), 1);
+
+        conn.enable_socks_pool(3).unwrap();
+        wait_for_pool(&conn, 3);
+        assert_eq!(n_accepted.load(SeqCst), 4);
+
+        // Streams come from the pool, which gets refilled.
+        check_open_stream(&conn);
+        check_open_stream(&conn);
+        wait_for_pool(&conn, 3);
+        assert_eq!(n_accepted.load(SeqCst), 6);
+        // We only looked up the proxy address once.
+        assert_eq!(n_lookups.load(SeqCst), 1);
+
+        drop(conn);
+        fake_arti.join().unwrap();
+    }
+
+    #[test]
+    fn nonblocking() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        let n_accepted = Arc::new(AtomicUsize::new(0));
+        fake_socks_proxy(listener, Arc::clone(&n_accepted));
+
+        let current_addr = Arc::new(Mutex::new(addr));
+        let n_lookups = Arc::new(AtomicUsize::new(0));
+        let (conn, fake_arti) = conn_with_fake_arti(&current_addr, &n_lookups);
+
+        // Start a bunch of streams, then drive them all from this thread.
+        let mut pending: Vec<PendingStream> = (0..16)
+            .map(|_| {
+                conn.open_stream_nonblocking(None, ("www.example.com", 443), "iso")
+                    .unwrap()
+            })
+            .collect();
+        let mut finished = Vec::new();
+        while !pending.is_empty() {
+            let mut still_pending = Vec::new();
+            for p in pending {
+                assert!(p.with_socket(|_| ()).is_some());
+                match p.advance().unwrap() {
+                    Some(stream) => {
+                        assert!(p.with_socket(|_| ()).is_none());
+                        assert!(p.advance().is_err());
+                        finished.push(stream);
+                    }
+                    None => still_pending.push(p),
+                }
+            }
+            pending = still_pending;
+            thread::sleep(Duration::from_millis(1));
+        }
+
+        assert_eq!(finished.len(), 16);
+        for mut s in finished {
+            s.set_nonblocking(false).unwrap();
+            let mut echoed = Vec::new();
+            s.read_to_end(&mut echoed).unwrap();
+            assert_eq!(echoed, b"<torS0X>1session");
+        }
+        assert_eq!(n_accepted.load(SeqCst), 16);
+        assert_eq!(n_lookups.load(SeqCst), 1);
+
+        drop(conn);
+        fake_arti.join().unwrap();
+    }
+
+    #[test]
+    fn open_many() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        let n_accepted = Arc::new(AtomicUsize::new(0));
+        fake_socks_proxy(listener, Arc::clone(&n_accepted));
+
+        let current_addr = Arc::new(Mutex::new(addr));
+        let n_lookups = Arc::new(AtomicUsize::new(0));
+        let (conn, fake_arti) = conn_with_fake_arti(&current_addr, &n_lookups);
+
+        // Open more streams than we handshake at once.
+        let hostnames: Vec<String> = (0..MAX_PARALLEL_HANDSHAKES * 2 + 3)
+            .map(|n| format!("host{n}.example.com"))
+            .collect();
+        let targets: Vec<StreamTarget<'_>> = hostnames
+            .iter()
+            .map(|hostname| StreamTarget {
+                hostname,
+                port: 80,
+                isolation: "iso",
+            })
+            .collect();
+        let streams = conn.open_streams(None, &targets).unwrap();
+        assert_eq!(streams.len(), targets.len());
+        for s in streams {
+            let mut echoed = Vec::new();
+            s.unwrap().read_to_end(&mut echoed).unwrap();
+            assert_eq!(echoed, b"<torS0X>1session");
+        }
+        assert_eq!(n_accepted.load(SeqCst), targets.len());
+        assert_eq!(n_lookups.load(SeqCst), 1);
+
+        // Now open some streams with IDs; each one should use its own ID.
+        let streams = conn.open_streams_as_objects(None, &targets[..5]).unwrap();
+        let mut ids = Vec::new();
+        for (n, s) in streams.into_iter().enumerate() {
+            let (id, mut s) = s.unwrap();
+            assert_eq!(id.as_ref(), format!("stream-{}", n + 1));
+            let mut echoed = Vec::new();
+            s.read_to_end(&mut echoed).unwrap();
+            assert_eq!(echoed, format!("<torS0X>1stream-{}", n + 1).as_bytes());
+            ids.push(id);
+        }
+        conn.release_objects(&ids).unwrap();
+        conn.release_objects(&[]).unwrap();
+
+        // Nothing happens at all when there are no streams to open.
+        assert!(conn.open_streams(None, &[]).unwrap().is_empty());
+        assert!(conn.open_streams_as_objects(None, &[]).unwrap().is_empty());
+
+        drop(conn);
+        fake_arti.join().unwrap();
+    }
 }
@@ -0,0 +1,61 @@
+//! Hooks to observe the progress of each request through an RPC connection.
+//!
+//! A trace hook is told about each step in the life of every request,
+//! along with the time at which that step happened,
+//! so that an application can tell whether its latency is coming from Arti,
+//! from contention to write on the connection,
+//! or from the way that responses are handed from the reader to their waiters.
+
+use std::{
+    panic::{RefUnwindSafe, UnwindSafe},
+    time::Instant,
+};
+
+use crate::msgs::{response::ValidatedResponse, AnyRequestId};
+
+/// A step in the life of a request, as reported to a trace hook.
+///
+/// (See [`RpcConn::set_trace_hook`](crate::RpcConn::set_trace_hook).)
+///
+/// For a given request, these are reported in the order that they are listed here,
+/// except that `Delivered` follows each `UpdateReceived` and `FinalReceived`.
+/// Responses that we discard (because nobody is tracking their request any longer,
+/// or because they are updates for a cancelled request)
+/// are reported as `UpdateReceived` or `FinalReceived`, but never as `Delivered`.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+#[non_exhaustive]
+pub enum TraceEvent {
+    /// The application has handed us the request, and we have assigned it an ID.
+    Submitted,
+    /// We have finished writing the request to Arti.
+    ///
+    /// (The time since `Submitted` is mostly spent waiting for other threads
+    /// to finish their own writes.)
+    Written,
+    /// We have read a non-final update for the request from Arti.
+    UpdateReceived,
+    /// We have read the final response for the request from Arti.
+    FinalReceived,
+    /// We have handed a response to whoever was waiting for it,
+    /// or to the request's callback.
+    Delivered,
+}
+
+impl TraceEvent {
+    /// Return the event that reports the arrival of `msg`.
+    pub(super) fn received(msg: &ValidatedResponse) -> Self {
+        if msg.is_final() {
+            Self::FinalReceived
+        } else {
+            Self::UpdateReceived
+        }
+    }
+}
+
+/// A function that receives every [`TraceEvent`] on a connection.
+///
+/// It receives the ID of the request, the event, and the time at which the event happened.
+///
+/// (We require the unwind-safety bounds so that `RpcConn` can be used across the FFI boundary.)
+pub(super) type TraceHook =
+    dyn Fn(&AnyRequestId, TraceEvent, Instant) + Send + Sync + UnwindSafe + RefUnwindSafe;
@@ -6,11 +6,11 @@
 pub mod err;
 mod util;
 
-use err::{ArtiRpcError, InvalidInput};
-use std::ffi::{c_char, c_int};
+use err::{ArtiRpcError, InvalidInput, WouldBlock};
+use std::ffi::{c_char, c_int, c_void};
 use util::{
-    ffi_body_raw, ffi_body_with_err, OptOutPtrExt as _, OptOutValExt, OutPtr, OutSocketOwned,
-    OutVal,
+    ffi_body_raw, ffi_body_with_err, in_array, in_str_array, OptOutPtrExt as _, OptOutValExt,
+    OutArray, OutPtr, OutPtrArray, OutSocketOwned, OutVal,
 };
 
 use crate::{
@@ -47,9 +47,148 @@ pub type ArtiRpcStr = Utf8CString;
 /// You can wait for the next message with `arti_rpc_handle_wait`.
 pub type ArtiRpcHandle = RequestHandle;
 
+/// A data stream that is still being opened through Arti.
+///
+/// Created with `arti_rpc_conn_open_stream_nonblocking`;
+/// it must eventually be freed with `arti_rpc_pending_stream_free`.
+///
+/// This is a thread-safe type: you may safely use it from multiple threads at once.
+pub type ArtiRpcPendingStream = crate::PendingStream;
+
+/// A fixed set of open connections to the same Arti instance.
+///
+/// Created with `arti_rpc_connect_pool`;
+/// it must eventually be freed with `arti_rpc_conn_pool_free`.
+///
+/// This is a thread-safe type: you may safely use it from multiple threads at once.
+/// Spreading requests across the connections in a pool with `arti_rpc_conn_pool_get`
+/// avoids the contention that comes from sending every request over a single connection.
+pub type ArtiRpcConnPool = crate::RpcConnPool;
+
+/// An RPC request that is being built, one parameter at a time.
+///
+/// Created with `arti_rpc_request_new`;
+/// it must eventually be freed with `arti_rpc_request_free`.
+///
+/// This is a thread-safe type: you may safely use it from multiple threads at once.
+/// Changes to it, and sends of it, happen one at a time.
+pub type ArtiRpcRequestBuilder = crate::RequestBuilder;
+
+/// A connection to Arti that is still being made.
+///
+/// Created with `arti_rpc_connect_async`;
+/// it must eventually be freed with `arti_rpc_pending_connect_free`.
+///
+/// This is a thread-safe type: you may safely use it from multiple threads at once.
+/// (Only one call to `arti_rpc_pending_connect_finish` or `arti_rpc_pending_connect_wait`
+/// will ever return the connection.)
+pub type ArtiRpcPendingConnect = crate::PendingConnect;
+
 /// The type of a message returned by an RPC request.
 pub type ArtiRpcResponseType = c_int;
 
+/// A way of separating messages from one another on an RPC connection,
+/// as used by `arti_rpc_connect_with_framing`.
+pub type ArtiRpcFraming = c_int;
+
+/// A constant indicating that messages should be terminated by newlines.
+///
+/// Every connection uses this framing unless it asks for another one.
+pub const ARTI_RPC_FRAMING_JSON_LINES: ArtiRpcFraming = 0;
+/// A constant indicating that each message should be preceded by its length.
+///
+/// This is cheaper for both sides to parse, especially for large messages.
+pub const ARTI_RPC_FRAMING_LENGTH_PREFIXED: ArtiRpcFraming = 1;
+
+/// A function to receive responses to a request sent with `arti_rpc_conn_execute_with_callback`.
+///
+/// It is called with the `user_data` pointer that was passed to
+/// `arti_rpc_conn_execute_with_callback`.
+///
+/// For each response, `response_type` is the type of the response
+/// (as for `arti_rpc_handle_wait`),
+/// `response` is the response itself, and `error` is NULL.
+/// If the connection fails before a final response arrives,
+/// `response_type` is zero, `response` is NULL, and `error` describes the failure.
+///
+/// The `response` and `error` pointers are only valid until the callback returns;
+/// the callback must not free them.
+pub type ArtiRpcResponseCallback = Option<
+    unsafe extern "C" fn(
+        user_data: *mut c_void,
+        response_type: ArtiRpcResponseType,
+        response: *const c_char,
+        error: *const ArtiRpcError,
+    ),
+>;
+
+/// A kind of event reported to an `ArtiRpcTraceHook`:
+/// one of the `ARTI_RPC_TRACE_EVENT_*` constants.
+pub type ArtiRpcTraceEvent = c_int;
+
+/// A trace event indicating that the application has handed us a request,
+/// and we have assigned it an ID.
+pub const ARTI_RPC_TRACE_EVENT_SUBMITTED: ArtiRpcTraceEvent = 1;
+/// A trace event indicating that we have finished writing a request to Arti.
+///
+/// (The time since `ARTI_RPC_TRACE_EVENT_SUBMITTED` is mostly spent
+/// waiting for other threads to finish their own writes.)
+pub const ARTI_RPC_TRACE_EVENT_WRITTEN: ArtiRpcTraceEvent = 2;
+/// A trace event indicating that we have read a non-final update for a request from Arti.
+pub const ARTI_RPC_TRACE_EVENT_UPDATE_RECEIVED: ArtiRpcTraceEvent = 3;
+/// A trace event indicating that we have read the final response for a request from Arti.
+pub const ARTI_RPC_TRACE_EVENT_FINAL_RECEIVED: ArtiRpcTraceEvent = 4;
+/// A trace event indicating that we have handed a response to whoever was waiting for it,
+/// or to its callback.
+///
+/// Responses that we discard are never reported with this event.
+pub const ARTI_RPC_TRACE_EVENT_DELIVERED: ArtiRpcTraceEvent = 5;
+
+/// A function to receive trace events on a connection, as installed by
+/// `arti_rpc_conn_set_trace_hook`.
+///
+/// It is called with the `user_data` pointer that was passed to `arti_rpc_conn_set_trace_hook`,
+/// the ID of the request (encoded as JSON, so that numeric and string IDs can be told apart),
+/// the `ARTI_RPC_TRACE_EVENT_*` constant for the event,
+/// and the time at which the event happened.
+///
+/// That time is in nanoseconds since the Unix epoch.
+/// It comes from a monotonic clock that was matched to the system clock
+/// when the hook was installed,
+/// so the differences between times are accurate even if the system clock later changes.
+///
+/// The `request_id` pointer is only valid until the hook returns;
+/// the hook must not free it.
+pub type ArtiRpcTraceHook = Option<
+    unsafe extern "C" fn(
+        user_data: *mut c_void,
+        request_id: *const c_char,
+        event: ArtiRpcTraceEvent,
+        timestamp_ns: u64,
+    ),
+>;
+
+/// What to do when a response would exceed a limit set with `arti_rpc_conn_set_queue_limits`:
+/// one of the `ARTI_RPC_OVERFLOW_*` constants.
+pub type ArtiRpcOverflowPolicy = c_int;
+
+/// An overflow policy: stop reading from Arti until the application has taken
+/// enough responses to make room.
+///
+/// This delays the responses to _every_ request on the connection,
+/// and pushes the back-pressure all the way to Arti.
+/// Only a background reader thread ever waits for room,
+/// so setting a limit with this policy launches one.
+pub const ARTI_RPC_OVERFLOW_BLOCK: ArtiRpcOverflowPolicy = 0;
+/// An overflow policy: discard the oldest queued updates for the request, until there is room.
+pub const ARTI_RPC_OVERFLOW_DROP_OLDEST_UPDATES: ArtiRpcOverflowPolicy = 1;
+/// An overflow policy: fail the request, discarding its queued responses.
+///
+/// Whoever next waits for the request gets `ARTI_RPC_STATUS_QUEUE_OVERFLOW`,
+/// and any further responses to it are discarded.
+/// (The request is not cancelled; you may want to cancel it yourself.)
+pub const ARTI_RPC_OVERFLOW_FAIL_REQUEST: ArtiRpcOverflowPolicy = 2;
+
 /// The type of a data stream socket.
 /// (This is always `int` on Unix-like platforms,
 /// and SOCKET on Windows.)
@@ -74,6 +213,66 @@ impl Default for ArtiRpcRawSocket {
     }
 }
 
+/// The number of buckets in each latency histogram of an `ArtiRpcConnStats`.
+//
+// (This is always equal to `crate::N_LATENCY_BUCKETS`; the compiler checks that for us
+// when we copy the histograms.)
+pub const ARTI_RPC_N_LATENCY_BUCKETS: usize = 32;
+
+/// Statistics about the activity on an `ArtiRpcConn`, as filled in by `arti_rpc_conn_get_stats`.
+///
+/// Each latency histogram has `ARTI_RPC_N_LATENCY_BUCKETS` buckets, bucketed by powers of two:
+/// bucket 0 counts latencies of less than one microsecond,
+/// and for `i >= 1`, bucket `i` counts latencies of at least `2^(i-1)`
+/// but less than `2^i` microseconds.
+/// The last bucket also counts every latency larger than that.
+#[repr(C)]
+#[derive(Default)]
+#[allow(clippy::exhaustive_structs)]
+pub struct ArtiRpcConnStats {
+    /// The number of requests that we have sent.
+    pub requests_sent: u64,
+    /// The number of requests that have received a final response.
+    pub requests_completed: u64,
+    /// The number of requests that have not yet received a final response.
+    pub n_pending: u64,
+    /// The number of responses that have arrived, but which nobody has taken yet.
+    pub n_queued: u64,
+    /// The total length of the messages that we have received, not counting framing.
+    pub bytes_read: u64,
+    /// The total length of the messages that we have sent, not counting framing.
+    pub bytes_written: u64,
+    /// The number of times that one waiting thread has handed off reading from Arti to another.
+    pub reader_handoffs: u64,
+    /// The total length of the responses that have arrived, but which nobody has taken yet.
+    pub queued_bytes: u64,
+    /// The number of times that the background reader has stopped reading,
+    /// to wait for room in a queue.
+    pub reader_blocks: u64,
+    /// A histogram of the time from sending each request to receiving its first update.
+    pub first_update_latency: [u64; ARTI_RPC_N_LATENCY_BUCKETS],
+    /// A histogram of the time from sending each request to receiving its final response.
+    pub final_latency: [u64; ARTI_RPC_N_LATENCY_BUCKETS],
+}
+
+impl From<crate::RpcConnStats> for ArtiRpcConnStats {
+    fn from(stats: crate::RpcConnStats) -> Self {
+        Self {
+            requests_sent: stats.requests_sent,
+            requests_completed: stats.requests_completed,
+            n_pending: stats.n_pending as u64,
+            n_queued: stats.n_queued as u64,
+            bytes_read: stats.bytes_read,
+            bytes_written: stats.bytes_written,
+            reader_handoffs: stats.reader_handoffs,
+            queued_bytes: stats.queued_bytes,
+            reader_blocks: stats.reader_blocks,
+            first_update_latency: stats.first_update_latency,
+            final_latency: stats.final_latency,
+        }
+    }
+}
+
 /// Try to open a new connection to an Arti instance.
 ///
 /// The location of the instance and the method to connect to it are described in
@@ -115,6 +314,225 @@ pub unsafe extern "C" fn arti_rpc_connect(
     )
 }
 
+/// Begin opening a new connection to an Arti instance, without waiting for it to be ready.
+///
+/// Behaves the same as `arti_rpc_connect`, except that
+/// the work of connecting and authenticating happens on another thread,
+/// and this function returns as soon as it has begun.
+/// It sets `*pending_out` to a newly allocated `ArtiRpcPendingConnect`.
+/// Use `arti_rpc_pending_connect_finish` or `arti_rpc_pending_connect_wait`
+/// to get the connection once it is ready.
+///
+/// As soon as Arti has told us our session,
+/// the new connection asks Arti for its proxy information, without waiting for the answer;
+/// the first call to `arti_rpc_conn_open_stream` then uses that answer,
+/// rather than making a round trip of its own.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*pending_out`.
+/// Otherwise return some other status code, set `*pending_out` to NULL, and set
+/// `*error_out` (if provided) to a newly allocated error object.
+/// (Errors that happen while connecting are reported when the connection is finished.)
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*pending_out` and `*error_out`,
+/// if set, are eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_connect_async(
+    connection_string: *const c_char,
+    pending_out: *mut *mut ArtiRpcPendingConnect,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let connection_string: Option<&str> [in_str_opt];
+            let pending_out: Option<OutPtr<ArtiRpcPendingConnect>> [out_ptr_opt];
+            err error_out : Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let connection_string = connection_string
+                .ok_or(InvalidInput::NullPointer)?;
+            let pending_out = pending_out.ok_or(InvalidInput::NullPointer)?;
+
+            let pending = RpcConnBuilder::from_connect_string(connection_string)?
+                .prefetch_proxy_info(true)
+                .connect_nonblocking()?;
+
+            pending_out.write_value_boxed(pending);
+        }
+    )
+}
+
+/// Return a file descriptor that becomes readable once `pending` is ready to finish.
+///
+/// Applications that run an event loop can add this descriptor to their `poll()` set
+/// (or equivalent), and call `arti_rpc_pending_connect_finish` once it becomes readable.
+///
+/// Return -1 if `pending` is NULL.
+///
+/// This function is not yet supported on Windows;
+/// there, it always returns `INVALID_SOCKET`.
+///
+/// # Ownership
+///
+/// The descriptor is owned by `pending`; it remains valid until `pending` is freed.
+/// The caller must not read from it, write to it, or close it.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_pending_connect_get_pollable_fd(
+    pending: *const ArtiRpcPendingConnect,
+) -> ArtiRpcRawSocket {
+    ffi_body_raw!(
+        {
+            let pending: Option<&ArtiRpcPendingConnect> [in_ptr_opt];
+        } in {
+            // Safety: Return value is a plain integer; trivially safe.
+            match pending {
+                #[cfg(unix)]
+                Some(p) => ArtiRpcRawSocket(p.pollable_fd()),
+                _ => ArtiRpcRawSocket::default(),
+            }
+        }
+    )
+}
+
+/// Return the connection from `pending`, if it is ready, without blocking.
+///
+/// If the connection is ready, return `ARTI_RPC_STATUS_SUCCESS`,
+/// and set `*rpc_conn_out` to a new ArtiRpcConn.
+///
+/// If we are still connecting, return `ARTI_RPC_STATUS_WOULD_BLOCK`,
+/// and set `*rpc_conn_out` to NULL.
+///
+/// Otherwise return some other status code, set `*rpc_conn_out` to NULL,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// Once this function has returned `ARTI_RPC_STATUS_SUCCESS` or an error,
+/// `pending` is finished: further calls will give an error.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*rpc_conn_out` and `*error_out`,
+/// if set, are eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_pending_connect_finish(
+    pending: *const ArtiRpcPendingConnect,
+    rpc_conn_out: *mut *mut ArtiRpcConn,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let pending: Option<&ArtiRpcPendingConnect> [in_ptr_opt];
+            let rpc_conn_out: Option<OutPtr<ArtiRpcConn>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let pending = pending.ok_or(InvalidInput::NullPointer)?;
+            let rpc_conn_out = rpc_conn_out.ok_or(InvalidInput::NullPointer)?;
+
+            let conn = pending.try_finish()?.ok_or(WouldBlock)?;
+            rpc_conn_out.write_value_boxed(conn);
+        }
+    }
+}
+
+/// Wait until the connection from `pending` is ready, and return it.
+///
+/// Behaves the same as `arti_rpc_pending_connect_finish`,
+/// except that it blocks until the connection is ready (or has failed),
+/// and never returns `ARTI_RPC_STATUS_WOULD_BLOCK`.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*rpc_conn_out` and `*error_out`,
+/// if set, are eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_pending_connect_wait(
+    pending: *const ArtiRpcPendingConnect,
+    rpc_conn_out: *mut *mut ArtiRpcConn,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let pending: Option<&ArtiRpcPendingConnect> [in_ptr_opt];
+            let rpc_conn_out: Option<OutPtr<ArtiRpcConn>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let pending = pending.ok_or(InvalidInput::NullPointer)?;
+            let rpc_conn_out = rpc_conn_out.ok_or(InvalidInput::NullPointer)?;
+
+            let conn = pending.wait()?;
+            rpc_conn_out.write_value_boxed(conn);
+        }
+    }
+}
+
+/// Release storage held by an `ArtiRpcPendingConnect`.
+///
+/// If the connection has not yet been returned,
+/// it is closed once it is ready.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_pending_connect_free(pending: *mut ArtiRpcPendingConnect) {
+    ffi_body_raw!(
+        {
+            let pending: Option<Box<ArtiRpcPendingConnect>> [in_ptr_consume_opt];
+        } in {
+            drop(pending);
+            // Safety: Return value is (); trivially safe.
+            ()
+        }
+    );
+}
+
+/// Try to open a new connection to an Arti instance, asking Arti to use `framing`
+/// once it has authenticated.
+///
+/// Behaves the same as `arti_rpc_connect`, except for the framing:
+/// `framing` must be one of the `ARTI_RPC_FRAMING_*` constants.
+/// If Arti doesn't support the requested framing,
+/// the connection keeps using `ARTI_RPC_FRAMING_JSON_LINES`.
+///
+/// The framing only affects how messages are sent between this library and Arti:
+/// requests and responses are always passed to and from the application as JSON strings.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*rpc_conn_out` and `*error_out`,
+/// if set, are eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_connect_with_framing(
+    connection_string: *const c_char,
+    framing: ArtiRpcFraming,
+    rpc_conn_out: *mut *mut ArtiRpcConn,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let connection_string: Option<&str> [in_str_opt];
+            let rpc_conn_out: Option<OutPtr<ArtiRpcConn>> [out_ptr_opt];
+            err error_out : Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let connection_string = connection_string
+                .ok_or(InvalidInput::NullPointer)?;
+            let framing = match framing {
+                ARTI_RPC_FRAMING_JSON_LINES => crate::llconn::Framing::JsonLines,
+                ARTI_RPC_FRAMING_LENGTH_PREFIXED => crate::llconn::Framing::LengthPrefixed,
+                _ => return Err(InvalidInput::BadFraming.into()),
+            };
+
+            let builder = RpcConnBuilder::from_connect_string(connection_string)?
+                .framing(framing);
+
+            let conn = builder.connect()?;
+
+            rpc_conn_out.write_boxed_value_if_ptr_set(conn);
+        }
+    )
+}
+
 /// Given a pointer to an RPC connection, return the object ID for its negotiated session.
 ///
 /// (The session was negotiated as part of establishing the connection.
@@ -188,6 +606,48 @@ pub unsafe extern "C" fn arti_rpc_conn_execute(
     )
 }
 
+/// Run an RPC request over `rpc_conn`, and wait up to `timeout_ms` milliseconds
+/// for a successful response.
+///
+/// Behaves as `arti_rpc_conn_execute`, except that Arti is told to give up on the
+/// request after `timeout_ms` milliseconds.
+/// If no response has arrived by then, this function cancels the request,
+/// and returns `ARTI_RPC_STATUS_TIMED_OUT`.
+///
+/// The first call to this function on a connection starts a background thread
+/// to read responses from Arti.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_execute_with_timeout(
+    rpc_conn: *const ArtiRpcConn,
+    msg: *const c_char,
+    timeout_ms: u64,
+    response_out: *mut *mut ArtiRpcStr,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let msg: Option<&str> [in_str_opt];
+            let response_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let msg = msg.ok_or(InvalidInput::NullPointer)?;
+            let timeout = std::time::Duration::from_millis(timeout_ms);
+
+            let success = rpc_conn.execute_with_timeout(msg, timeout)??;
+            response_out.write_boxed_value_if_ptr_set(Utf8CString::from(success));
+        }
+    )
+}
+
 /// Send an RPC request over `rpc_conn`, and return a handle that can wait for a successful response.
 ///
 /// The message `msg` should be a valid RPC request in JSON format.
@@ -230,272 +690,1826 @@ pub unsafe extern "C" fn arti_rpc_conn_execute_with_handle(
     )
 }
 
-/// A constant indicating that a message is a final result.
-///
-/// After a result has been received, a handle will not return any more responses,
-/// and should be freed.
-pub const ARTI_RPC_RESPONSE_TYPE_RESULT: ArtiRpcResponseType = 1;
-/// A constant indicating that a message is a non-final update.
+/// Send a batch of RPC requests over `rpc_conn`,
+/// and return a handle for each one that can wait for a successful response.
 ///
-/// After an update has been received, the handle may return additional responses.
-pub const ARTI_RPC_RESPONSE_TYPE_UPDATE: ArtiRpcResponseType = 2;
-/// A constant indicating that a message is a final error.
+/// `msgs` must point to an array of `n_msgs` strings,
+/// each of which should be a valid RPC request in JSON format.
+/// As with `arti_rpc_conn_execute_with_handle`, you can omit their `id` fields.
 ///
-/// After an error has been received, a handle will not return any more responses,
-/// and should be freed.
-pub const ARTI_RPC_RESPONSE_TYPE_ERROR: ArtiRpcResponseType = 3;
-
-impl AnyResponse {
-    /// Return an appropriate `ARTI_RPC_RESPONSE_TYPE_*` for this response.
-    fn response_type(&self) -> ArtiRpcResponseType {
-        match self {
-            Self::Success(_) => ARTI_RPC_RESPONSE_TYPE_RESULT,
-            Self::Update(_) => ARTI_RPC_RESPONSE_TYPE_UPDATE,
-            Self::Error(_) => ARTI_RPC_RESPONSE_TYPE_ERROR,
-        }
-    }
-}
-
-/// Wait until some response arrives on an arti_rpc_handle, or until an error occurs.
+/// All of the requests are written to Arti at once:
+/// this is much more efficient than sending them one at a time.
 ///
-/// On success, return `ARTI_RPC_STATUS_SUCCESS`; set `*response_out`, if present, to a
-/// newly allocated string, and set `*response_type_out`, to the type of the response.
-/// (The type will be `ARTI_RPC_RESPONSE_TYPE_RESULT` if the response is a final result,
-/// or `ARTI_RPC_RESPONSE_TYPE_ERROR` if the response is a final error,
-/// or `ARTI_RPC_RESPONSE_TYPE_UPDATE` if the response is a non-final update.)
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`, and set each element of `handles_out`
+/// to a newly allocated `ArtiRpcHandle` for the corresponding request.
 ///
-/// Otherwise return some other status code, set `*response_out` to NULL,
-/// set `*response_type_out` to zero,
+/// Otherwise return some other status code, set every element of `handles_out` to NULL,
 /// and set `*error_out` (if provided) to a newly allocated error object.
+/// In this case, none of the requests are sent.
 ///
-/// Note that receiving an error reply from Arti is _not_ treated as an error in this function.
-/// That is to say, if Arti sends back an error, this function will return `ARTI_SUCCESS`,
-/// and deliver the error from Arti in `*response_out`, setting `*response_type_out` to
-/// `ARTI_RPC_RESPONSE_TYPE_ERROR`.
-///
-/// It is safe to call this function on the same handle from multiple threads at once.
-/// If you do, each response will be sent to exactly one thread.
-/// It is unspecified which thread will receive which response or which error.
+/// (If `msgs` or `handles_out` is NULL, or any element of `msgs` is NULL,
+/// no request will be sent, and an error will be returned.)
 ///
 /// # Ownership
 ///
 /// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
 ///
-/// The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+/// The caller is responsible for making sure that every element of `handles_out`, if set,
+/// is eventually freed.
+///
+/// # Correctness requirements
+///
+/// `msgs` must point to an array of at least `n_msgs` valid pointers,
+/// and `handles_out` must point to an array with room for at least `n_msgs` pointers.
 #[allow(clippy::missing_safety_doc)]
 #[no_mangle]
-pub unsafe extern "C" fn arti_rpc_handle_wait(
-    handle: *const ArtiRpcHandle,
-    response_out: *mut *mut ArtiRpcStr,
-    response_type_out: *mut ArtiRpcResponseType,
+pub unsafe extern "C" fn arti_rpc_conn_execute_batch(
+    rpc_conn: *const ArtiRpcConn,
+    msgs: *const *const c_char,
+    n_msgs: usize,
+    handles_out: *mut *mut ArtiRpcHandle,
     error_out: *mut *mut ArtiRpcError,
 ) -> ArtiRpcStatus {
-    ffi_body_with_err! {
+    ffi_body_with_err!(
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            // Safety: We require that handles_out has room for n_msgs pointers.
+            // We do this first, so that every element is NULL if we fail.
+            let handles_out: Option<OutPtrArray<ArtiRpcHandle>> =
+                unsafe { OutPtrArray::from_opt_ptr(handles_out, n_msgs, std::ptr::null_mut) };
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            // Safety: We require that msgs holds n_msgs valid pointers.
+            let msgs: Vec<&str> = unsafe { in_str_array(msgs, n_msgs) }?;
+            let handles_out = handles_out.ok_or(InvalidInput::NullPointer)?;
+
+            let handles = rpc_conn.execute_batch(&msgs)?;
+            handles_out.write_values_boxed(handles);
+        }
+    )
+}
+
+/// Start building an RPC request to invoke `method` on the object `obj`,
+/// without having to format it as JSON.
+///
+/// Add parameters to the request with the `arti_rpc_request_set_param_*` functions,
+/// and send it with `arti_rpc_conn_submit`.
+/// A request can be sent any number of times, and reused with `arti_rpc_request_reset`:
+/// doing so avoids allocating a new request each time.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*builder_out` to a newly allocated
+/// `ArtiRpcRequestBuilder`.
+///
+/// Otherwise return some other status code, set `*builder_out` to NULL,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*builder_out`, if set,
+/// is eventually freed with `arti_rpc_request_free`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_request_new(
+    obj: *const c_char,
+    method: *const c_char,
+    builder_out: *mut *mut ArtiRpcRequestBuilder,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let obj: Option<&str> [in_str_opt];
+            let method: Option<&str> [in_str_opt];
+            let builder_out: Option<OutPtr<ArtiRpcRequestBuilder>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let obj = obj.ok_or(InvalidInput::NullPointer)?;
+            let method = method.ok_or(InvalidInput::NullPointer)?;
+            let builder_out = builder_out.ok_or(InvalidInput::NullPointer)?;
+
+            builder_out.write_value_boxed(crate::RequestBuilder::new(obj, method));
+        }
+    )
+}
+
+/// Discard every parameter of the request in `builder`,
+/// and make it into a request to invoke `method` on the object `obj`.
+///
+/// This reuses the storage that `builder` already holds.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code, and set `*error_out` (if provided)
+/// to a newly allocated error object; in this case, `builder` is unchanged.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_request_reset(
+    builder: *const ArtiRpcRequestBuilder,
+    obj: *const c_char,
+    method: *const c_char,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let builder: Option<&ArtiRpcRequestBuilder> [in_ptr_opt];
+            let obj: Option<&str> [in_str_opt];
+            let method: Option<&str> [in_str_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let builder = builder.ok_or(InvalidInput::NullPointer)?;
+            let obj = obj.ok_or(InvalidInput::NullPointer)?;
+            let method = method.ok_or(InvalidInput::NullPointer)?;
+
+            builder.reset(obj, method);
+        }
+    )
+}
+
+/// Set the parameter called `name` to the string `value`,
+/// in the request in `builder`.
+///
+/// If the parameter was already set, this replaces its old value.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code, and set `*error_out` (if provided)
+/// to a newly allocated error object; in this case, `builder` is unchanged.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_request_set_param_str(
+    builder: *const ArtiRpcRequestBuilder,
+    name: *const c_char,
+    value: *const c_char,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let builder: Option<&ArtiRpcRequestBuilder> [in_ptr_opt];
+            let name: Option<&str> [in_str_opt];
+            let value: Option<&str> [in_str_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let builder = builder.ok_or(InvalidInput::NullPointer)?;
+            let name = name.ok_or(InvalidInput::NullPointer)?;
+            let value = value.ok_or(InvalidInput::NullPointer)?;
+
+            builder.param_str(name, value);
+        }
+    )
+}
+
+/// Set the parameter called `name` to the integer `value`,
+/// in the request in `builder`.
+///
+/// Note that values larger than `±2^53-1` may not work with all JSON implementations.
+///
+/// Otherwise as for `arti_rpc_request_set_param_str`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_request_set_param_int(
+    builder: *const ArtiRpcRequestBuilder,
+    name: *const c_char,
+    value: i64,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let builder: Option<&ArtiRpcRequestBuilder> [in_ptr_opt];
+            let name: Option<&str> [in_str_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let builder = builder.ok_or(InvalidInput::NullPointer)?;
+            let name = name.ok_or(InvalidInput::NullPointer)?;
+
+            builder.param_int(name, value);
+        }
+    )
+}
+
+/// Set the parameter called `name` to the boolean `value`,
+/// in the request in `builder`.
+///
+/// Any nonzero `value` is true.
+///
+/// Otherwise as for `arti_rpc_request_set_param_str`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_request_set_param_bool(
+    builder: *const ArtiRpcRequestBuilder,
+    name: *const c_char,
+    value: c_int,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let builder: Option<&ArtiRpcRequestBuilder> [in_ptr_opt];
+            let name: Option<&str> [in_str_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let builder = builder.ok_or(InvalidInput::NullPointer)?;
+            let name = name.ok_or(InvalidInput::NullPointer)?;
+
+            builder.param_bool(name, value != 0);
+        }
+    )
+}
+
+/// Send the request in `builder` over `rpc_conn`,
+/// and return a handle that can wait for a successful response.
+///
+/// The request is given a newly generated ID.
+/// Since it was built with `ArtiRpcRequestBuilder`, it needs no validation,
+/// and this is cheaper than `arti_rpc_conn_execute_with_handle`.
+/// `builder` is unchanged, and can be sent again.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*handle_out` to a newly allocated `ArtiRpcHandle`.
+///
+/// Otherwise return some other status code, set `*handle_out` to NULL,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*handle_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_submit(
+    rpc_conn: *const ArtiRpcConn,
+    builder: *const ArtiRpcRequestBuilder,
+    handle_out: *mut *mut ArtiRpcHandle,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let builder: Option<&ArtiRpcRequestBuilder> [in_ptr_opt];
+            let handle_out: Option<OutPtr<ArtiRpcHandle>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let builder = builder.ok_or(InvalidInput::NullPointer)?;
+            let handle_out = handle_out.ok_or(InvalidInput::NullPointer)?;
+
+            let handle = rpc_conn.submit(builder)?;
+            handle_out.write_value_boxed(handle);
+        }
+    )
+}
+
+/// Release storage held by an `ArtiRpcRequestBuilder`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_request_free(builder: *mut ArtiRpcRequestBuilder) {
+    ffi_body_raw!(
+        {
+            let builder: Option<Box<ArtiRpcRequestBuilder>> [in_ptr_consume_opt];
+        } in {
+            drop(builder);
+            // Safety: Return value is (); trivially safe.
+            ()
+        }
+    );
+}
+
+/// Send an RPC request over `rpc_conn`, and arrange for `callback` to receive every response.
+///
+/// The message `msg` should be a valid RPC request in JSON format.
+/// If you omit its `id` field, one will be generated: this is typically the best way to use this function.
+///
+/// `callback` is invoked once for every update, and once for the final result or error,
+/// from whichever thread is reading from `rpc_conn` when the response arrives.
+/// That is usually a background thread that this library uses to read from `rpc_conn`,
+/// but it can also be any of your threads that is waiting for a response on `rpc_conn`.
+/// If the connection fails before a final response arrives,
+/// `callback` is instead invoked once to report the failure.
+/// After a final response or a failure, `callback` is never invoked again.
+/// See `ArtiRpcResponseCallback` for details of its arguments.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code, and set `*error_out` (if provided)
+/// to a newly allocated error object; in this case, `callback` is never invoked.
+///
+/// # Correctness requirements
+///
+/// `callback` and `user_data` must be safe to use from any thread,
+/// and `user_data` must remain valid until `callback` has received a final response or a failure.
+///
+/// `callback` must not block for long: no other responses on `rpc_conn`
+/// can be delivered while it is running.
+/// It may send other requests on `rpc_conn`,
+/// but it must not wait for their responses
+/// (as `arti_rpc_conn_execute` or `arti_rpc_handle_wait` would):
+/// doing so would deadlock.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_execute_with_callback(
+    rpc_conn: *const ArtiRpcConn,
+    msg: *const c_char,
+    callback: ArtiRpcResponseCallback,
+    user_data: *mut c_void,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let msg: Option<&str> [in_str_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let msg = msg.ok_or(InvalidInput::NullPointer)?;
+            let callback = callback.ok_or(InvalidInput::NullPointer)?;
+
+            let callback = FfiCallback { callback, user_data };
+            let _id = rpc_conn.execute_with_callback(msg, move |response| callback.invoke(response))?;
+        }
+    }
+}
+
+/// A C callback, along with the user data to give it.
+struct FfiCallback {
+    /// The function to call.
+    callback:
+        unsafe extern "C" fn(*mut c_void, ArtiRpcResponseType, *const c_char, *const ArtiRpcError),
+    /// The user data to pass to the function.
+    user_data: *mut c_void,
+}
+
+// Safety: The caller of `arti_rpc_conn_execute_with_callback` promised
+// that `callback` and `user_data` are safe to use from another thread.
+unsafe impl Send for FfiCallback {}
+
+impl FfiCallback {
+    /// Invoke this callback with a single response or error.
+    fn invoke(&self, response: Result<AnyResponse, crate::ProtoError>) {
+        match response {
+            Ok(response) => {
+                let rtype = response.response_type();
+                let msg = response.into_string();
+                // Safety: The caller promised that `callback` was safe to call with `user_data`.
+                // `msg` outlives the call.
+                unsafe { (self.callback)(self.user_data, rtype, msg.as_ptr(), std::ptr::null()) }
+            }
+            Err(e) => {
+                let err = ArtiRpcError::from(e);
+                // Safety: As above; `err` outlives the call.
+                unsafe { (self.callback)(self.user_data, 0, std::ptr::null(), &err) }
+            }
+        }
+    }
+}
+
+/// A constant indicating that a message is a final result.
+///
+/// After a result has been received, a handle will not return any more responses,
+/// and should be freed.
+pub const ARTI_RPC_RESPONSE_TYPE_RESULT: ArtiRpcResponseType = 1;
+/// A constant indicating that a message is a non-final update.
+///
+/// After an update has been received, the handle may return additional responses.
+pub const ARTI_RPC_RESPONSE_TYPE_UPDATE: ArtiRpcResponseType = 2;
+/// A constant indicating that a message is a final error.
+///
+/// After an error has been received, a handle will not return any more responses,
+/// and should be freed.
+pub const ARTI_RPC_RESPONSE_TYPE_ERROR: ArtiRpcResponseType = 3;
+
+impl AnyResponse {
+    /// Return an appropriate `ARTI_RPC_RESPONSE_TYPE_*` for this response.
+    fn response_type(&self) -> ArtiRpcResponseType {
+        match self {
+            Self::Success(_) => ARTI_RPC_RESPONSE_TYPE_RESULT,
+            Self::Update(_) => ARTI_RPC_RESPONSE_TYPE_UPDATE,
+            Self::Error(_) => ARTI_RPC_RESPONSE_TYPE_ERROR,
+        }
+    }
+}
+
+/// Wait until some response arrives on an arti_rpc_handle, or until an error occurs.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`; set `*response_out`, if present, to a
+/// newly allocated string, and set `*response_type_out`, to the type of the response.
+/// (The type will be `ARTI_RPC_RESPONSE_TYPE_RESULT` if the response is a final result,
+/// or `ARTI_RPC_RESPONSE_TYPE_ERROR` if the response is a final error,
+/// or `ARTI_RPC_RESPONSE_TYPE_UPDATE` if the response is a non-final update.)
+///
+/// Otherwise return some other status code, set `*response_out` to NULL,
+/// set `*response_type_out` to zero,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// Note that receiving an error reply from Arti is _not_ treated as an error in this function.
+/// That is to say, if Arti sends back an error, this function will return `ARTI_SUCCESS`,
+/// and deliver the error from Arti in `*response_out`, setting `*response_type_out` to
+/// `ARTI_RPC_RESPONSE_TYPE_ERROR`.
+///
+/// It is safe to call this function on the same handle from multiple threads at once.
+/// If you do, each response will be sent to exactly one thread.
+/// It is unspecified which thread will receive which response or which error.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_handle_wait(
+    handle: *const ArtiRpcHandle,
+    response_out: *mut *mut ArtiRpcStr,
+    response_type_out: *mut ArtiRpcResponseType,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let handle: Option<&ArtiRpcHandle> [in_ptr_opt];
+            let response_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
+            let response_type_out: Option<OutVal<ArtiRpcResponseType>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let handle = handle.ok_or(InvalidInput::NullPointer)?;
+
+            let response = handle.wait_with_updates()?;
+
+            let rtype = response.response_type();
+            response_type_out.write_value_if_ptr_set(rtype);
+            response_out.write_boxed_value_if_ptr_set(response.into_string());
+        }
+    }
+}
+
+/// Wait up to `timeout_ms` milliseconds for some response to arrive on an arti_rpc_handle.
+///
+/// If a response arrives in time, behave as `arti_rpc_handle_wait`.
+///
+/// If no response arrives in time, return `ARTI_RPC_STATUS_TIMED_OUT`,
+/// set `*response_out` to NULL, set `*response_type_out` to zero,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+/// The request is not cancelled: you can wait for it again,
+/// or cancel it with `arti_rpc_handle_cancel`.
+///
+/// The first time this function is called on any handle for a given connection,
+/// the connection starts a background thread to read responses from Arti.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_handle_wait_timeout(
+    handle: *const ArtiRpcHandle,
+    timeout_ms: u64,
+    response_out: *mut *mut ArtiRpcStr,
+    response_type_out: *mut ArtiRpcResponseType,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let handle: Option<&ArtiRpcHandle> [in_ptr_opt];
+            let response_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
+            let response_type_out: Option<OutVal<ArtiRpcResponseType>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let handle = handle.ok_or(InvalidInput::NullPointer)?;
+            let timeout = std::time::Duration::from_millis(timeout_ms);
+
+            let response = handle
+                .wait_with_updates_timeout(timeout)?
+                .ok_or(crate::ProtoError::TimedOut)?;
+
+            let rtype = response.response_type();
+            response_type_out.write_value_if_ptr_set(rtype);
+            response_out.write_boxed_value_if_ptr_set(response.into_string());
+        }
+    }
+}
+
+/// Check whether some response has arrived on an arti_rpc_handle, without blocking.
+///
+/// If a response is ready, behave as `arti_rpc_handle_wait`:
+/// return `ARTI_RPC_STATUS_SUCCESS`; set `*response_out`, if present, to a
+/// newly allocated string, and set `*response_type_out`, to the type of the response.
+///
+/// If no response is ready yet, return `ARTI_RPC_STATUS_WOULD_BLOCK`,
+/// set `*response_out` to NULL, set `*response_type_out` to zero,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// Otherwise return some other status code, as `arti_rpc_handle_wait` would.
+///
+/// The first time this function is called on any handle for a given connection,
+/// the connection starts a background thread to read responses from Arti.
+/// To find out when this function is worth calling again,
+/// use `arti_rpc_conn_get_pollable_fd`.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*response_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_handle_try_wait(
+    handle: *const ArtiRpcHandle,
+    response_out: *mut *mut ArtiRpcStr,
+    response_type_out: *mut ArtiRpcResponseType,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let handle: Option<&ArtiRpcHandle> [in_ptr_opt];
+            let response_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
+            let response_type_out: Option<OutVal<ArtiRpcResponseType>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let handle = handle.ok_or(InvalidInput::NullPointer)?;
+
+            let response = handle.try_wait()?.ok_or(WouldBlock)?;
+
+            let rtype = response.response_type();
+            response_type_out.write_value_if_ptr_set(rtype);
+            response_out.write_boxed_value_if_ptr_set(response.into_string());
+        }
+    }
+}
+
+/// Get a file descriptor that becomes readable whenever some response is ready on `rpc_conn`.
+///
+/// Applications that run an event loop can add this descriptor to their `poll()` set
+/// (or equivalent), and call `arti_rpc_handle_try_wait` on their outstanding handles
+/// once it becomes readable.
+/// The descriptor is level-triggered: it remains readable
+/// for as long as any response is waiting to be taken,
+/// or after the connection has failed.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*fd_out` to the descriptor.
+/// Otherwise return some other status code, set `*fd_out` to -1,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// This function is not yet supported on Windows;
+/// there, it always returns `ARTI_RPC_STATUS_NOT_SUPPORTED`.
+///
+/// # Ownership
+///
+/// The descriptor is owned by `rpc_conn`; it remains valid at least until `rpc_conn` is freed.
+/// The caller must not read from it, write to it, or close it.
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_get_pollable_fd(
+    rpc_conn: *const ArtiRpcConn,
+    fd_out: *mut ArtiRpcRawSocket,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let fd_out: Option<OutVal<ArtiRpcRawSocket>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let fd_out = fd_out.ok_or(InvalidInput::NullPointer)?;
+
+            #[cfg(unix)]
+            {
+                let fd = rpc_conn.pollable_fd()?;
+                fd_out.write_value(ArtiRpcRawSocket(fd));
+            }
+            #[cfg(not(unix))]
+            {
+                let _ = (rpc_conn, fd_out);
+                return Err(crate::ProtoError::BackgroundReader(
+                    std::sync::Arc::new(std::io::ErrorKind::Unsupported.into())
+                ).into());
+            }
+        }
+    }
+}
+
+/// Launch a dedicated background thread to read responses on `rpc_conn`,
+/// if one is not already running.
+///
+/// By default, threads that are waiting for responses take turns reading from the connection.
+/// Applications with a large number of concurrent requests per connection
+/// should call this function once, right after connecting:
+/// afterwards, a single thread reads every response
+/// and hands it directly to whoever is waiting for it.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_launch_background_reader(
+    rpc_conn: *const ArtiRpcConn,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            rpc_conn.launch_background_reader()?;
+        }
+    }
+}
+
+/// Fill `*stats_out` with statistics about the activity on `rpc_conn`.
+///
+/// The counters are maintained without locking,
+/// so collecting these statistics costs almost nothing,
+/// and calling this function does not slow down other threads' requests.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code, set every field of `*stats_out` to zero,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_get_stats(
+    rpc_conn: *const ArtiRpcConn,
+    stats_out: *mut ArtiRpcConnStats,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let stats_out: Option<OutVal<ArtiRpcConnStats>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let stats_out = stats_out.ok_or(InvalidInput::NullPointer)?;
+
+            stats_out.write_value(rpc_conn.stats().into());
+        }
+    }
+}
+
+/// Set the limits on how many responses `rpc_conn` will queue for the application,
+/// and what to do when a response would exceed them.
+///
+/// `max_request_msgs` and `max_request_bytes` limit the number of responses,
+/// and their total length, that are queued for any single request.
+/// `max_conn_bytes` limits the total length of the responses queued for the whole connection.
+/// A limit of zero means that there is no limit.
+/// (An empty queue always has room for one response, whatever the limits.)
+///
+/// `policy` must be one of the `ARTI_RPC_OVERFLOW_*` constants.
+/// Only updates are ever held back, discarded, or counted as an overflow:
+/// a final response is always queued.
+/// Responses for requests sent with `arti_rpc_conn_execute_with_callback` are never counted.
+///
+/// The new limits replace any previous ones, and apply to every response that arrives from now on.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_set_queue_limits(
+    rpc_conn: *const ArtiRpcConn,
+    max_request_msgs: usize,
+    max_request_bytes: usize,
+    max_conn_bytes: usize,
+    policy: ArtiRpcOverflowPolicy,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let policy = match policy {
+                ARTI_RPC_OVERFLOW_BLOCK => crate::OverflowPolicy::Block,
+                ARTI_RPC_OVERFLOW_DROP_OLDEST_UPDATES => crate::OverflowPolicy::DropOldestUpdates,
+                ARTI_RPC_OVERFLOW_FAIL_REQUEST => crate::OverflowPolicy::FailRequest,
+                _ => return Err(InvalidInput::BadOverflowPolicy.into()),
+            };
+            let limit = |n: usize| (n != 0).then_some(n);
+
+            let limits = crate::QueueLimits {
+                max_request_msgs: limit(max_request_msgs),
+                max_request_bytes: limit(max_request_bytes),
+                max_conn_bytes: limit(max_conn_bytes),
+                policy,
+            };
+            rpc_conn.set_queue_limits(limits)?;
+        }
+    }
+}
+
+/// Install `hook` to be told about every step in the life of each request on `rpc_conn`.
+///
+/// See `ArtiRpcTraceHook` for its arguments,
+/// and the `ARTI_RPC_TRACE_EVENT_*` constants for the events it receives.
+///
+/// A connection can have only one trace hook, and it can't be removed.
+/// When no hook is installed, tracing costs no more than checking for a hook.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code (`ARTI_RPC_STATUS_INVALID_INPUT`
+/// if `rpc_conn` already has a trace hook),
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Correctness requirements
+///
+/// `hook` and `user_data` must be safe to use from several threads at once,
+/// and `user_data` must remain valid for as long as `rpc_conn` exists.
+///
+/// `hook` is called from whichever thread caused each event,
+/// including the thread that is reading responses from Arti,
+/// without holding any of this library's locks.
+/// It should return quickly,
+/// and it must not wait for any response on `rpc_conn`.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_set_trace_hook(
+    rpc_conn: *const ArtiRpcConn,
+    hook: ArtiRpcTraceHook,
+    user_data: *mut c_void,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let hook = hook.ok_or(InvalidInput::NullPointer)?;
+
+            let hook = FfiTraceHook::new(hook, user_data);
+            rpc_conn.set_trace_hook(move |id, event, at| hook.invoke(id, event, at))?;
+        }
+    }
+}
+
+/// A C trace hook, along with the user data to give it,
+/// and what we need to convert our timestamps for it.
+struct FfiTraceHook {
+    /// The function to call.
+    hook: unsafe extern "C" fn(*mut c_void, *const c_char, ArtiRpcTraceEvent, u64),
+    /// The user data to pass to the function.
+    user_data: *mut c_void,
+    /// A moment on our monotonic clock...
+    anchor: std::time::Instant,
+    /// ... and the same moment, in nanoseconds since the Unix epoch.
+    anchor_ns: u64,
+}
+
+// Safety: The caller of `arti_rpc_conn_set_trace_hook` promised
+// that `hook` and `user_data` are safe to use from several threads at once.
+unsafe impl Send for FfiTraceHook {}
+// Safety: As above.
+unsafe impl Sync for FfiTraceHook {}
+
+impl FfiTraceHook {
+    /// Construct a new FfiTraceHook, matching our monotonic clock to the system clock.
+    fn new(
+        hook: unsafe extern "C" fn(*mut c_void, *const c_char, ArtiRpcTraceEvent, u64),
+        user_data: *mut c_void,
+    ) -> Self {
+        let anchor = std::time::Instant::now();
+        let anchor_ns = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .map(|d| u64::try_from(d.as_nanos()).unwrap_or(u64::MAX))
+            .unwrap_or(0);
+        Self {
+            hook,
+            user_data,
+            anchor,
+            anchor_ns,
+        }
+    }
+
+    /// Invoke this hook for a single event.
+    fn invoke(&self, id: &crate::AnyRequestId, event: crate::TraceEvent, at: std::time::Instant) {
+        use crate::TraceEvent as E;
+        let event = match event {
+            E::Submitted => ARTI_RPC_TRACE_EVENT_SUBMITTED,
+            E::Written => ARTI_RPC_TRACE_EVENT_WRITTEN,
+            E::UpdateReceived => ARTI_RPC_TRACE_EVENT_UPDATE_RECEIVED,
+            E::FinalReceived => ARTI_RPC_TRACE_EVENT_FINAL_RECEIVED,
+            E::Delivered => ARTI_RPC_TRACE_EVENT_DELIVERED,
+        };
+        let ns = |d: std::time::Duration| u64::try_from(d.as_nanos()).unwrap_or(u64::MAX);
+        let timestamp_ns = match at.checked_duration_since(self.anchor) {
+            Some(after) => self.anchor_ns.saturating_add(ns(after)),
+            None => self.anchor_ns.saturating_sub(ns(self.anchor - at)),
+        };
+        let Some(id) = serde_json::to_string(id)
+            .ok()
+            .and_then(|id| Utf8CString::try_from(id).ok())
+        else {
+            // This can't happen: a request ID always encodes as JSON without any NULs.
+            return;
+        };
+        // Safety: The caller promised that `hook` was safe to call with `user_data`.
+        // `id` outlives the call.
+        unsafe { (self.hook)(self.user_data, id.as_ptr(), event, timestamp_ns) }
+    }
+}
+
+/// Ask Arti to cancel the request associated with `handle`, which must belong to `rpc_conn`.
+///
+/// If Arti cancels the request, its final response will be an error;
+/// it may also finish in some other way before Arti can cancel it.
+/// Either way, you can still wait on `handle` for that final response.
+/// Any updates for the request that have not yet been received are discarded,
+/// as are any that arrive later.
+///
+/// If the request has already received its final response, this function has no effect.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_handle_cancel(
+    rpc_conn: *const ArtiRpcConn,
+    handle: *const ArtiRpcHandle,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let handle: Option<&ArtiRpcHandle> [in_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let handle = handle.ok_or(InvalidInput::NullPointer)?;
+            rpc_conn.cancel(handle.id())?;
+        }
+    }
+}
+
+/// Release storage held by an `ArtiRpcHandle`.
+///
+/// This does not cancel the request: use `arti_rpc_handle_cancel` for that.
+///
+/// Any responses that have arrived for the request, but have not been received,
+/// are discarded, as are any that arrive later.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_handle_free(handle: *mut ArtiRpcHandle) {
+    ffi_body_raw!(
+        {
+            let handle: Option<Box<ArtiRpcHandle>> [in_ptr_consume_opt];
+        } in {
+            drop(handle);
+            // Safety: Return value is (); trivially safe.
+            ()
+        }
+    );
+}
+/// Free a string returned by the Arti RPC API.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_str_free(string: *mut ArtiRpcStr) {
+    ffi_body_raw!(
+        {
+            let string: Option<Box<ArtiRpcStr>> [in_ptr_consume_opt];
+        } in {
+            drop(string);
+            // Safety: Return value is (); trivially safe.
+            ()
+        }
+    );
+}
+
+/// Return a const pointer to the underlying nul-terminated string from an `ArtiRpcStr`.
+///
+/// The resulting string is guaranteed to be valid UTF-8.
+///
+/// (Returns NULL if the input is NULL.)
+///
+/// # Correctness requirements
+///
+/// The resulting string pointer is valid only for as long as the input `string` is not freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_str_get(string: *const ArtiRpcStr) -> *const c_char {
+    ffi_body_raw!(
+        {
+            let string: Option<&ArtiRpcStr> [in_ptr_opt];
+        } in {
+            // Safety: returned pointer is null, or semantically borrowed from `string`.
+            // It is only null if `string` was null.
+            // The caller is not allowed to modify it.
+            match string {
+                Some(s) => s.as_ptr(),
+                None => std::ptr::null(),
+            }
+
+        }
+    )
+}
+
+/// Return the length of the underlying string from an `ArtiRpcStr`, in bytes.
+///
+/// The length does not include the terminating nul.
+/// Unlike `strlen()`, this function takes constant time.
+///
+/// (Returns 0 if the input is NULL.)
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_str_len(string: *const ArtiRpcStr) -> usize {
+    ffi_body_raw!(
+        {
+            let string: Option<&ArtiRpcStr> [in_ptr_opt];
+        } in {
+            // Safety: Return value is usize; trivially safe.
+            string.map(|s| s.len()).unwrap_or(0)
+        }
+    )
+}
+
+/// Find a single value within the JSON text held in an `ArtiRpcStr`,
+/// without decoding the rest of it.
+///
+/// The value is named by `pointer`, a JSON pointer as described in RFC 6901:
+/// for example, `"/result/id"` names the `id` field of a response's `result` object,
+/// and `"/result/list/0"` names the first element of its `list` array.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`;
+/// set `*value_out` to a pointer to the start of the value's JSON encoding within `string`,
+/// and set `*len_out` to its length in bytes.
+/// For example, if the value is a JSON string, it will begin and end with a quotation mark,
+/// and any escapes within it are left as they are.
+/// If there is no such value, set `*value_out` to NULL and `*len_out` to zero.
+///
+/// Otherwise return some other status code, set `*value_out` to NULL,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The returned value is borrowed from `string`, and is **not** nul-terminated.
+/// It becomes invalid as soon as `string` is freed.
+/// The caller must not modify or free it.
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_str_get_json_pointer(
+    string: *const ArtiRpcStr,
+    pointer: *const c_char,
+    value_out: *mut *const c_char,
+    len_out: *mut usize,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let string: Option<&ArtiRpcStr> [in_ptr_opt];
+            let pointer: Option<&str> [in_str_opt];
+            let value_out: Option<OutVal<*const c_char>> [out_const_ptr_opt];
+            let len_out: Option<OutVal<usize>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let string = string.ok_or(InvalidInput::NullPointer)?;
+            let pointer = pointer.ok_or(InvalidInput::NullPointer)?;
+
+            let value = crate::lookup_json_pointer(string.as_ref(), pointer)?;
+            write_borrowed_slice(value, value_out, len_out);
+        }
+    )
+}
+
+/// Find the `result` object within a response held in an `ArtiRpcStr`.
+///
+/// Behaves as `arti_rpc_str_get_json_pointer` with the pointer `"/result"`:
+/// if `response` has a `result` field, set `*value_out` and `*len_out` to
+/// the location and length of its value within `response`.
+/// If `response` is not a successful response, set `*value_out` to NULL and `*len_out` to zero.
+///
+/// # Ownership
+///
+/// As for `arti_rpc_str_get_json_pointer`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_response_get_result(
+    response: *const ArtiRpcStr,
+    value_out: *mut *const c_char,
+    len_out: *mut usize,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let response: Option<&ArtiRpcStr> [in_ptr_opt];
+            let value_out: Option<OutVal<*const c_char>> [out_const_ptr_opt];
+            let len_out: Option<OutVal<usize>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let response = response.ok_or(InvalidInput::NullPointer)?;
+
+            let value = crate::lookup_json_pointer(response.as_ref(), "/result")?;
+            write_borrowed_slice(value, value_out, len_out);
+        }
+    )
+}
+
+/// Find the `update` object within a response held in an `ArtiRpcStr`.
+///
+/// Behaves as `arti_rpc_response_get_result`, but for the `update` field
+/// of a non-final response.
+///
+/// # Ownership
+///
+/// As for `arti_rpc_str_get_json_pointer`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_response_get_update(
+    response: *const ArtiRpcStr,
+    value_out: *mut *const c_char,
+    len_out: *mut usize,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let response: Option<&ArtiRpcStr> [in_ptr_opt];
+            let value_out: Option<OutVal<*const c_char>> [out_const_ptr_opt];
+            let len_out: Option<OutVal<usize>> [out_val_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let response = response.ok_or(InvalidInput::NullPointer)?;
+
+            let value = crate::lookup_json_pointer(response.as_ref(), "/update")?;
+            write_borrowed_slice(value, value_out, len_out);
+        }
+    )
+}
+
+/// Helper: Write the location and length of `value` (if any) into `value_out` and `len_out`.
+fn write_borrowed_slice(
+    value: Option<&str>,
+    value_out: Option<OutVal<'_, *const c_char>>,
+    len_out: Option<OutVal<'_, usize>>,
+) {
+    if let Some(value) = value {
+        value_out.write_value_if_ptr_set(value.as_ptr() as *const c_char);
+        len_out.write_value_if_ptr_set(value.len());
+    }
+}
+
+/// Close and free an open Arti RPC connection.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_free(rpc_conn: *mut ArtiRpcConn) {
+    ffi_body_raw!(
+        {
+            let rpc_conn: Option<Box<ArtiRpcConn>> [in_ptr_consume_opt];
+        } in {
+            drop(rpc_conn);
+            // Safety: Return value is (); trivially safe.
+            ()
+
+        }
+    );
+}
+
+/// Try to open an anonymized data stream over Arti.
+///
+/// Use the proxy information associated with `rpc_conn` to make the stream,
+/// and store the resulting fd (or `SOCKET` on Windows) into `*socket_out`.
+///
+/// The stream will target the address `hostname`:`port`.
+///
+/// If `on_object` is provided, it is an `ObjectId` for client-like object
+/// (such as a Session or a Client)
+/// that should be used to make the stream.
+///
+/// The resulting stream will be configured
+/// not to share a circuit with any other stream
+/// having a different `isolation`.
+/// (If your application doesn't care about isolating its streams from one another,
+/// it is acceptable to leave `isolation` as an empty string.)
+///
+/// If `stream_id_out` is provided,
+/// the resulting stream will have an identifier within the RPC system,
+/// so that you can run other RPC commands on it.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code, set `*socket_out` to -1
+/// (or `INVALID_SOCKET` on Windows),
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Caveats
+///
+/// When possible, use a hostname rather than an IP address.
+/// If you *must* use an IP address, make sure that you have not gotten it
+/// by a non-anonymous DNS lookup.
+/// (Calling `gethostname()` or `getaddrinfo()` directly
+/// would lose anonymity: they inform the user's DNS server,
+/// and possibly many other parties, about the target address
+/// you are trying to visit.)
+///
+/// The resulting socket will actually be a TCP connection to Arti,
+/// not directly to your destination.
+/// Therefore, passing it to functions like `getpeername()`
+/// may give unexpected results.
+///
+/// On Unix, when `rpc_conn` is connected over a Unix domain socket,
+/// was built to accept streams as file descriptors
+/// (with `RpcConnBuilder::stream_fd_passing`, which is off by default),
+/// and `stream_id_out` is not provided,
+/// we first ask Arti to send us the stream over the RPC connection itself;
+/// in that case, the resulting socket is a Unix domain socket to Arti.
+/// If Arti doesn't support this, we fall back to its SOCKS proxy.
+///
+/// If `stream_id_out` is provided
+/// (or if Arti is configured to return streams optimistically),
+/// the data stream may still be connecting
+/// when this request returns.
+/// (TODO RPC: Document how to wait for it)
+///
+/// If `stream_id_out` is provided,
+/// the caller is responsible for releasing the ObjectId;
+/// Arti will not deallocate it even when the stream is closed.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that
+/// `*stream_id_out` and `*error_out`, if set,
+/// are eventually freed.
+///
+/// The caller is responsible for making sure that `*socket_out`, if set,
+/// is eventually closed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_open_stream(
+    rpc_conn: *const ArtiRpcConn,
+    hostname: *const c_char,
+    port: c_int,
+    on_object: *const c_char,
+    isolation: *const c_char,
+    socket_out: *mut ArtiRpcRawSocket,
+    stream_id_out: *mut *mut ArtiRpcStr,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let on_object: Option<&str> [in_str_opt];
+            let hostname: Option<&str> [in_str_opt];
+            let isolation: Option<&str> [in_str_opt];
+            let socket_out: Option<OutSocketOwned<'_>> [out_socket_owned_opt];
+            let stream_id_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let hostname = hostname.ok_or(InvalidInput::NullPointer)?;
+            let socket_out = socket_out.ok_or(InvalidInput::NullPointer)?;
+            let isolation = isolation.ok_or(InvalidInput::NullPointer)?;
+
+            let port: u16 = port.try_into().map_err(|_| InvalidInput::BadPort)?;
+            if port == 0 {
+                return Err(InvalidInput::BadPort.into());
+            }
+
+            let on_object = on_object.map(|o| ObjectId::try_from(o.to_owned()))
+                .transpose()
+                .expect("C string somehow contained NUL.");
+
+            let stream = match stream_id_out {
+                Some(stream_id_out) => {
+                    let (stream_id, stream) = rpc_conn.open_stream_as_object(
+                        on_object.as_ref(),
+                        (hostname, port),
+                        isolation)?;
+                    stream_id_out.write_value_boxed(stream_id.into());
+                    stream
+                }
+                None => {
+                    #[cfg(unix)]
+                    if let Some(stream) =
+                        rpc_conn.try_open_stream_fd(on_object.as_ref(), (hostname, port), isolation)?
+                    {
+                        socket_out.write_socket(stream);
+                        return Ok(());
+                    }
+                    rpc_conn.open_stream(on_object.as_ref(), (hostname, port), isolation)?
+                }
+            };
+
+            // We call this last so that the stream will definitely be converted to an fd, or
+            // dropped.
+            socket_out.write_socket(stream);
+        }
+    }
+}
+
+/// Begin opening a new data stream through Arti, without waiting for it to connect.
+///
+/// Behaves the same as `arti_rpc_conn_open_stream`, except that
+/// instead of waiting for Arti to report whether the stream has connected,
+/// this function returns as soon as the stream has been requested.
+/// It sets `*pending_out` to a newly allocated `ArtiRpcPendingStream`,
+/// which you can use to wait for the stream without blocking,
+/// alongside as many other pending streams as you like.
+///
+/// To do so, get the pending stream's socket with `arti_rpc_pending_stream_get_socket`,
+/// and wait until it is readable
+/// (or writable, if `arti_rpc_pending_stream_wants_write` returns 1),
+/// using `poll()` or an equivalent.
+/// Then call `arti_rpc_pending_stream_advance`,
+/// which returns `ARTI_RPC_STATUS_WOULD_BLOCK` if you need to wait again.
+///
+/// (This function may still block briefly:
+/// it may need to ask Arti for its SOCKS address,
+/// it connects to that address on the local host,
+/// and if `stream_id_out` is provided, it asks Arti for a new stream ID.)
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code, set `*pending_out` to NULL,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that
+/// `*pending_out`, `*stream_id_out`, and `*error_out`, if set,
+/// are eventually freed.
+///
+/// If `stream_id_out` is provided and this function succeeds,
+/// the caller is responsible for releasing the ObjectId,
+/// whether or not the stream eventually connects.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_open_stream_nonblocking(
+    rpc_conn: *const ArtiRpcConn,
+    hostname: *const c_char,
+    port: c_int,
+    on_object: *const c_char,
+    isolation: *const c_char,
+    pending_out: *mut *mut ArtiRpcPendingStream,
+    stream_id_out: *mut *mut ArtiRpcStr,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let on_object: Option<&str> [in_str_opt];
+            let hostname: Option<&str> [in_str_opt];
+            let isolation: Option<&str> [in_str_opt];
+            let pending_out: Option<OutPtr<ArtiRpcPendingStream>> [out_ptr_opt];
+            let stream_id_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            let hostname = hostname.ok_or(InvalidInput::NullPointer)?;
+            let pending_out = pending_out.ok_or(InvalidInput::NullPointer)?;
+            let isolation = isolation.ok_or(InvalidInput::NullPointer)?;
+
+            let port: u16 = port.try_into().map_err(|_| InvalidInput::BadPort)?;
+            if port == 0 {
+                return Err(InvalidInput::BadPort.into());
+            }
+
+            let on_object = on_object.map(|o| ObjectId::try_from(o.to_owned()))
+                .transpose()
+                .expect("C string somehow contained NUL.");
+
+            let pending = match stream_id_out {
+                Some(stream_id_out) => {
+                    let pending = rpc_conn.open_stream_as_object_nonblocking(
+                        on_object.as_ref(),
+                        (hostname, port),
+                        isolation)?;
+                    let stream_id = pending.stream_id().expect("Stream ID missing").clone();
+                    stream_id_out.write_value_boxed(stream_id.into());
+                    pending
+                }
+                None => {
+                    rpc_conn.open_stream_nonblocking(on_object.as_ref(), (hostname, port), isolation)?
+                }
+            };
+            pending_out.write_value_boxed(pending);
+        }
+    }
+}
+
+/// Open several new data streams through Arti at once.
+///
+/// Behaves like calling `arti_rpc_conn_open_stream` once for each of the `n_streams` entries
+/// in `hostnames`, `ports`, and `isolations`, except that
+/// all of the stream IDs (if requested) are obtained with a single batch of requests,
+/// and the SOCKS handshakes for the streams are performed in parallel.
+/// All of the streams are opened relative to `on_object`, if provided.
+///
+/// If we were able to try opening the streams,
+/// return `ARTI_RPC_STATUS_SUCCESS`, even if some of the streams failed,
+/// and fill in each element of the output arrays, as follows:
+///
+/// - If the corresponding stream was opened successfully,
+///   set its element of `statuses_out` to `ARTI_RPC_STATUS_SUCCESS`,
+///   its element of `sockets_out` to the stream's fd (or `SOCKET` on Windows),
+///   and its element of `stream_ids_out` (if provided) to a newly allocated
+///   `ArtiRpcStr` holding the stream's ObjectId.
+/// - Otherwise, set its element of `statuses_out` to some other status code,
+///   its element of `sockets_out` to -1 (or `INVALID_SOCKET` on Windows),
+///   its element of `stream_ids_out` (if provided) to NULL,
+///   and its element of `errors_out` (if provided) to a newly allocated error object.
+///   (The stream's ObjectId, if any, has already been released.)
+///
+/// Otherwise return some other status code,
+/// set every element of `statuses_out` to that status code,
+/// set every element of `sockets_out` to -1 (or `INVALID_SOCKET` on Windows),
+/// set every element of `stream_ids_out` and `errors_out` (if provided) to NULL,
+/// and set `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed,
+/// and that every non-NULL element of `stream_ids_out` and `errors_out` is eventually freed.
+///
+/// The caller is responsible for making sure that every valid element of `sockets_out`
+/// is eventually closed.
+///
+/// If `stream_ids_out` is provided, the caller is responsible for releasing
+/// every ObjectId that it receives, perhaps with `arti_rpc_conn_release_objects`.
+///
+/// # Correctness requirements
+///
+/// `hostnames`, `ports`, and `isolations` must each point to an array of at least `n_streams`
+/// elements; no element of `hostnames` or `isolations` may be NULL.
+///
+/// `sockets_out`, `statuses_out`, and (if provided) `stream_ids_out` and `errors_out`
+/// must each point to an array with room for at least `n_streams` elements.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_open_streams(
+    rpc_conn: *const ArtiRpcConn,
+    n_streams: usize,
+    hostnames: *const *const c_char,
+    ports: *const c_int,
+    on_object: *const c_char,
+    isolations: *const *const c_char,
+    sockets_out: *mut ArtiRpcRawSocket,
+    stream_ids_out: *mut *mut ArtiRpcStr,
+    statuses_out: *mut ArtiRpcStatus,
+    errors_out: *mut *mut ArtiRpcError,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            let on_object: Option<&str> [in_str_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            // Safety: We require that each output array, if provided, has room for n_streams
+            // elements.  We do this first, so that every element is initialized if we fail.
+            let sockets_out: Option<OutArray<ArtiRpcRawSocket>> = unsafe {
+                OutArray::from_opt_ptr(sockets_out, n_streams, ArtiRpcRawSocket::default)
+            };
+            let mut stream_ids_out: Option<OutPtrArray<ArtiRpcStr>> =
+                unsafe { OutPtrArray::from_opt_ptr(stream_ids_out, n_streams, std::ptr::null_mut) };
+            let statuses_out: Option<OutArray<ArtiRpcStatus>> = unsafe {
+                OutArray::from_opt_ptr(statuses_out, n_streams, || err::ARTI_RPC_STATUS_INTERNAL)
+            };
+            let mut errors_out: Option<OutPtrArray<ArtiRpcError>> =
+                unsafe { OutPtrArray::from_opt_ptr(errors_out, n_streams, std::ptr::null_mut) };
+            let mut statuses_out = statuses_out.ok_or(InvalidInput::NullPointer)?;
+
+            let outcomes = (|| -> Result<_, ArtiRpcError> {
+                let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+                let sockets_out = sockets_out.ok_or(InvalidInput::NullPointer)?;
+                // Safety: We require that these arrays hold n_streams valid elements.
+                let hostnames: Vec<&str> = unsafe { in_str_array(hostnames, n_streams) }?;
+                let isolations: Vec<&str> = unsafe { in_str_array(isolations, n_streams) }?;
+                let ports: &[c_int] = unsafe { in_array(ports, n_streams) }?;
+
+                let targets = hostnames
+                    .iter()
+                    .zip(&isolations)
+                    .zip(ports)
+                    .map(|((hostname, isolation), &port)| {
+                        let port: u16 = port.try_into().map_err(|_| InvalidInput::BadPort)?;
+                        if port == 0 {
+                            return Err(InvalidInput::BadPort);
+                        }
+                        Ok(crate::StreamTarget {
+                            hostname,
+                            port,
+                            isolation,
+                        })
+                    })
+                    .collect::<Result<Vec<_>, _>>()?;
+
+                let on_object = on_object.map(|o| ObjectId::try_from(o.to_owned()))
+                    .transpose()
+                    .expect("C string somehow contained NUL.");
+
+                let outcomes = if stream_ids_out.is_some() {
+                    rpc_conn
+                        .open_streams_as_objects(on_object.as_ref(), &targets)?
+                        .into_iter()
+                        .map(|outcome| outcome.map(|(id, stream)| (Some(id), stream)))
+                        .collect()
+                } else {
+                    rpc_conn
+                        .open_streams(on_object.as_ref(), &targets)?
+                        .into_iter()
+                        .map(|outcome| outcome.map(|stream| (None, stream)))
+                        .collect::<Vec<_>>()
+                };
+                Ok((sockets_out, outcomes))
+            })();
+            let (mut sockets_out, outcomes) = match outcomes {
+                Ok(v) => v,
+                Err(e) => {
+                    for idx in 0..n_streams {
+                        statuses_out.write_value(idx, e.status);
+                    }
+                    return Err(e);
+                }
+            };
+
+            for (idx, outcome) in outcomes.into_iter().enumerate() {
+                match outcome {
+                    Ok((stream_id, stream)) => {
+                        statuses_out.write_value(idx, err::ARTI_RPC_STATUS_SUCCESS);
+                        if let (Some(stream_ids_out), Some(stream_id)) =
+                            (stream_ids_out.as_mut(), stream_id)
+                        {
+                            stream_ids_out.write_value_boxed(idx, stream_id.into());
+                        }
+                        // We call this last so that the stream will definitely be converted
+                        // to an fd, or dropped.
+                        sockets_out.write_socket(idx, stream);
+                    }
+                    Err(e) => {
+                        let e = ArtiRpcError::from(e);
+                        statuses_out.write_value(idx, e.status);
+                        if let Some(errors_out) = errors_out.as_mut() {
+                            errors_out.write_value_boxed(idx, e);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Tell Arti to release every one of the `n_objects` ObjectIds in `objects`,
+/// using a single batch of requests.
+///
+/// Releasing an ObjectId tells Arti that we no longer intend to refer to it:
+/// see `rpc:release` in the RPC specification.
+/// Every release is attempted, even if some of them fail.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise (if any release failed) return some other status code,
+/// and set `*error_out` (if provided) to a newly allocated error object
+/// describing the first failure.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// # Correctness requirements
+///
+/// `objects` must point to an array of at least `n_objects` valid pointers.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_release_objects(
+    rpc_conn: *const ArtiRpcConn,
+    objects: *const *const c_char,
+    n_objects: usize,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
         {
-            let handle: Option<&ArtiRpcHandle> [in_ptr_opt];
-            let response_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
-            let response_type_out: Option<OutVal<ArtiRpcResponseType>> [out_val_opt];
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
             err error_out: Option<OutPtr<ArtiRpcError>>;
         } in {
-            let handle = handle.ok_or(InvalidInput::NullPointer)?;
-
-            let response = handle.wait_with_updates()?;
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            // Safety: We require that objects holds n_objects valid pointers.
+            let objects: Vec<&str> = unsafe { in_str_array(objects, n_objects) }?;
+            let objects: Vec<ObjectId> = objects
+                .into_iter()
+                .map(|o| ObjectId::try_from(o.to_owned()).expect("C string somehow contained NUL."))
+                .collect();
 
-            let rtype = response.response_type();
-            response_type_out.write_value_if_ptr_set(rtype);
-            response_out.write_boxed_value_if_ptr_set(response.into_string());
+            rpc_conn.release_objects(&objects)?;
         }
-    }
+    )
 }
 
-/// Release storage held by an `ArtiRpcHandle`.
+/// Return the socket for a pending stream, so that the caller can wait for it to become ready.
+///
+/// Return -1 (or `INVALID_SOCKET` on Windows) if `pending` is NULL,
+/// or if `arti_rpc_pending_stream_advance` has already finished it.
+///
+/// # Ownership
 ///
-/// NOTE, TODO: This does not cancel the request, but that is not guaranteed.
-/// Once we implement cancellation, this may behave differently.
+/// The socket is owned by `pending`:
+/// the caller must not read from it, write to it, or close it.
+/// It remains valid until `arti_rpc_pending_stream_advance` finishes `pending`,
+/// or until `pending` is freed.
 #[allow(clippy::missing_safety_doc)]
 #[no_mangle]
-pub unsafe extern "C" fn arti_rpc_handle_free(handle: *mut ArtiRpcHandle) {
+pub unsafe extern "C" fn arti_rpc_pending_stream_get_socket(
+    pending: *const ArtiRpcPendingStream,
+) -> ArtiRpcRawSocket {
     ffi_body_raw!(
         {
-            let handle: Option<Box<ArtiRpcHandle>> [in_ptr_consume_opt];
+            let pending: Option<&ArtiRpcPendingStream> [in_ptr_opt];
         } in {
-            drop(handle);
-            // Safety: Return value is (); trivially safe.
-            ()
+            // Safety: Return value is a plain integer; trivially safe.
+            pending
+                .and_then(|p| {
+                    p.with_socket(|s| {
+                        #[cfg(windows)]
+                        let raw = std::os::windows::io::AsRawSocket::as_raw_socket(s);
+                        #[cfg(not(windows))]
+                        let raw = std::os::fd::AsRawFd::as_raw_fd(s);
+                        ArtiRpcRawSocket(raw)
+                    })
+                })
+                .unwrap_or_default()
         }
-    );
+    )
 }
-/// Free a string returned by the Arti RPC API.
+
+/// Return 1 if a pending stream is waiting for its socket to become writable,
+/// and 0 if it is waiting for its socket to become readable (or if `pending` is NULL).
 #[allow(clippy::missing_safety_doc)]
 #[no_mangle]
-pub unsafe extern "C" fn arti_rpc_str_free(string: *mut ArtiRpcStr) {
+pub unsafe extern "C" fn arti_rpc_pending_stream_wants_write(
+    pending: *const ArtiRpcPendingStream,
+) -> c_int {
     ffi_body_raw!(
         {
-            let string: Option<Box<ArtiRpcStr>> [in_ptr_consume_opt];
+            let pending: Option<&ArtiRpcPendingStream> [in_ptr_opt];
         } in {
-            drop(string);
-            // Safety: Return value is (); trivially safe.
-            ()
+            // Safety: Return value is c_int; trivially safe.
+            pending.map(|p| c_int::from(p.wants_write())).unwrap_or(0)
         }
-    );
+    )
 }
 
-/// Return a const pointer to the underlying nul-terminated string from an `ArtiRpcStr`.
+/// Make as much progress on opening a pending stream as possible, without blocking.
 ///
-/// The resulting string is guaranteed to be valid UTF-8.
+/// If the stream has opened successfully, return `ARTI_RPC_STATUS_SUCCESS`,
+/// and store its fd (or `SOCKET` on Windows) into `*socket_out`.
+/// The socket is still in nonblocking mode.
 ///
-/// (Returns NULL if the input is NULL.)
+/// If the stream is still opening, return `ARTI_RPC_STATUS_WOULD_BLOCK`,
+/// and set `*socket_out` to -1 (or `INVALID_SOCKET` on Windows).
+/// The caller should wait for the stream's socket to become ready, and try again.
 ///
-/// # Correctness requirements
+/// Otherwise return some other status code, set `*socket_out` to -1
+/// (or `INVALID_SOCKET` on Windows),
+/// and set `*error_out` (if provided) to a newly allocated error object.
 ///
-/// The resulting string pointer is valid only for as long as the input `string` is not freed.
+/// Once this function has returned `ARTI_RPC_STATUS_SUCCESS` or an error,
+/// `pending` is finished: further calls will give an error.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+///
+/// The caller is responsible for making sure that `*socket_out`, if set,
+/// is eventually closed.
 #[allow(clippy::missing_safety_doc)]
 #[no_mangle]
-pub unsafe extern "C" fn arti_rpc_str_get(string: *const ArtiRpcStr) -> *const c_char {
-    ffi_body_raw!(
+pub unsafe extern "C" fn arti_rpc_pending_stream_advance(
+    pending: *const ArtiRpcPendingStream,
+    socket_out: *mut ArtiRpcRawSocket,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err! {
         {
-            let string: Option<&ArtiRpcStr> [in_ptr_opt];
+            let pending: Option<&ArtiRpcPendingStream> [in_ptr_opt];
+            let socket_out: Option<OutSocketOwned<'_>> [out_socket_owned_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
         } in {
-            // Safety: returned pointer is null, or semantically borrowed from `string`.
-            // It is only null if `string` was null.
-            // The caller is not allowed to modify it.
-            match string {
-                Some(s) => s.as_ptr(),
-                None => std::ptr::null(),
-            }
+            let pending = pending.ok_or(InvalidInput::NullPointer)?;
+            let socket_out = socket_out.ok_or(InvalidInput::NullPointer)?;
 
+            let stream = pending.advance()?.ok_or(WouldBlock)?;
+            socket_out.write_socket(stream);
         }
-    )
+    }
 }
 
-/// Close and free an open Arti RPC connection.
+/// Release storage held by an `ArtiRpcPendingStream`.
+///
+/// If the stream has not yet been returned by `arti_rpc_pending_stream_advance`,
+/// its socket is closed.
 #[allow(clippy::missing_safety_doc)]
 #[no_mangle]
-pub unsafe extern "C" fn arti_rpc_conn_free(rpc_conn: *mut ArtiRpcConn) {
+pub unsafe extern "C" fn arti_rpc_pending_stream_free(pending: *mut ArtiRpcPendingStream) {
     ffi_body_raw!(
         {
-            let rpc_conn: Option<Box<ArtiRpcConn>> [in_ptr_consume_opt];
+            let pending: Option<Box<ArtiRpcPendingStream>> [in_ptr_consume_opt];
         } in {
-            drop(rpc_conn);
+            drop(pending);
             // Safety: Return value is (); trivially safe.
             ()
-
         }
     );
 }
 
-/// Try to open an anonymized data stream over Arti.
-///
-/// Use the proxy information associated with `rpc_conn` to make the stream,
-/// and store the resulting fd (or `SOCKET` on Windows) into `*socket_out`.
-///
-/// The stream will target the address `hostname`:`port`.
-///
-/// If `on_object` is provided, it is an `ObjectId` for client-like object
-/// (such as a Session or a Client)
-/// that should be used to make the stream.
-///
-/// The resulting stream will be configured
-/// not to share a circuit with any other stream
-/// having a different `isolation`.
-/// (If your application doesn't care about isolating its streams from one another,
-/// it is acceptable to leave `isolation` as an empty string.)
+/// Ask Arti again for the proxy information associated with `rpc_conn`.
 ///
-/// If `stream_id_out` is provided,
-/// the resulting stream will have an identifier within the RPC system,
-/// so that you can run other RPC commands on it.
+/// Ordinarily, there is no need to call this function:
+/// `arti_rpc_conn_open_stream` looks up Arti's SOCKS address the first time it is called,
+/// remembers it, and looks it up again whenever it can no longer connect to it.
+/// Call this function if you know that Arti's proxy configuration has changed.
 ///
 /// On success, return `ARTI_RPC_STATUS_SUCCESS`.
-/// Otherwise return some other status code, set `*socket_out` to -1
-/// (or `INVALID_SOCKET` on Windows),
+/// Otherwise return some other status code,
 /// and set `*error_out` (if provided) to a newly allocated error object.
 ///
-/// # Caveats
+/// # Ownership
 ///
-/// When possible, use a hostname rather than an IP address.
-/// If you *must* use an IP address, make sure that you have not gotten it
-/// by a non-anonymous DNS lookup.
-/// (Calling `gethostname()` or `getaddrinfo()` directly
-/// would lose anonymity: they inform the user's DNS server,
-/// and possibly many other parties, about the target address
-/// you are trying to visit.)
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_refresh_proxy_info(
+    rpc_conn: *const ArtiRpcConn,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
+            err error_out: Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
+            rpc_conn.refresh_proxy_info()?;
+        }
+    )
+}
+
+/// Keep up to `depth` connections to Arti's SOCKS proxy open and ready,
+/// so that `arti_rpc_conn_open_stream` can use them without waiting.
 ///
-/// The resulting socket will actually be a TCP connection to Arti,
-/// not directly to your destination.
-/// Therefore, passing it to functions like `getpeername()`
-/// may give unexpected results.
+/// Each pooled connection has already done the initial part of the SOCKS handshake,
+/// so that opening a stream on it only requires sending the final request.
+/// The pool is refilled in the background whenever a connection is taken from it.
 ///
-/// If `stream_id_out` is provided
-/// (or if Arti is configured to return streams optimistically),
-/// the data stream may still be connecting
-/// when this request returns.
-/// (TODO RPC: Document how to wait for it)
+/// If a pool is already enabled on `rpc_conn`, or `depth` is 0, this function does nothing.
 ///
-/// If `stream_id_out` is provided,
-/// the caller is responsible for releasing the ObjectId;
-/// Arti will not deallocate it even when the stream is closed.
+/// On success, return `ARTI_RPC_STATUS_SUCCESS`.
+/// Otherwise return some other status code,
+/// and set `*error_out` (if provided) to a newly allocated error object.
 ///
 /// # Ownership
 ///
-/// The caller is responsible for making sure that
-/// `*stream_id_out` and `*error_out`, if set,
-/// are eventually freed.
-///
-/// The caller is responsible for making sure that `*socket_out`, if set,
-/// is eventually closed.
+/// The caller is responsible for making sure that `*error_out`, if set, is eventually freed.
 #[allow(clippy::missing_safety_doc)]
 #[no_mangle]
-pub unsafe extern "C" fn arti_rpc_conn_open_stream(
+pub unsafe extern "C" fn arti_rpc_conn_enable_socks_pool(
     rpc_conn: *const ArtiRpcConn,
-    hostname: *const c_char,
-    port: c_int,
-    on_object: *const c_char,
-    isolation: *const c_char,
-    socket_out: *mut ArtiRpcRawSocket,
-    stream_id_out: *mut *mut ArtiRpcStr,
+    depth: usize,
     error_out: *mut *mut ArtiRpcError,
 ) -> ArtiRpcStatus {
-    ffi_body_with_err! {
+    ffi_body_with_err!(
         {
             let rpc_conn: Option<&ArtiRpcConn> [in_ptr_opt];
-            let on_object: Option<&str> [in_str_opt];
-            let hostname: Option<&str> [in_str_opt];
-            let isolation: Option<&str> [in_str_opt];
-            let socket_out: Option<OutSocketOwned<'_>> [out_socket_owned_opt];
-            let stream_id_out: Option<OutPtr<ArtiRpcStr>> [out_ptr_opt];
             err error_out: Option<OutPtr<ArtiRpcError>>;
         } in {
             let rpc_conn = rpc_conn.ok_or(InvalidInput::NullPointer)?;
-            let hostname = hostname.ok_or(InvalidInput::NullPointer)?;
-            let socket_out = socket_out.ok_or(InvalidInput::NullPointer)?;
-            let isolation = isolation.ok_or(InvalidInput::NullPointer)?;
+            rpc_conn.enable_socks_pool(depth)?;
+        }
+    )
+}
 
-            let port: u16 = port.try_into().map_err(|_| InvalidInput::BadPort)?;
-            if port == 0 {
-                return Err(InvalidInput::BadPort.into());
-            }
+/// Try to open `n_conns` new connections to an Arti instance, as a pool.
+///
+/// The location of the instance and the method to connect to it are described in
+/// `connection_string`, as for `arti_rpc_connect`.
+/// Each connection is authenticated separately, and negotiates its own session.
+/// If `n_conns` is 0, a single connection is opened.
+///
+/// On success, return `ARTI_RPC_STATUS_SUCCESS` and set `*pool_out` to a new ArtiRpcConnPool.
+/// Otherwise return some other status code, set `*pool_out` to NULL, and set
+/// `*error_out` (if provided) to a newly allocated error object.
+///
+/// # Ownership
+///
+/// The caller is responsible for making sure that `*pool_out` and `*error_out`,
+/// if set, are eventually freed.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_connect_pool(
+    connection_string: *const c_char,
+    n_conns: usize,
+    pool_out: *mut *mut ArtiRpcConnPool,
+    error_out: *mut *mut ArtiRpcError,
+) -> ArtiRpcStatus {
+    ffi_body_with_err!(
+        {
+            let connection_string: Option<&str> [in_str_opt];
+            let pool_out: Option<OutPtr<ArtiRpcConnPool>> [out_ptr_opt];
+            err error_out : Option<OutPtr<ArtiRpcError>>;
+        } in {
+            let connection_string = connection_string
+                .ok_or(InvalidInput::NullPointer)?;
 
-            let on_object = on_object.map(|o| ObjectId::try_from(o.to_owned()))
-                .transpose()
-                .expect("C string somehow contained NUL.");
+            let builder = RpcConnBuilder::from_connect_string(connection_string)?;
 
-            let stream = match stream_id_out {
-                Some(stream_id_out) => {
-                    let (stream_id, stream) = rpc_conn.open_stream_as_object(
-                        on_object.as_ref(),
-                        (hostname, port),
-                        isolation)?;
-                    stream_id_out.write_value_boxed(stream_id.into());
-                    stream
-                }
-                None => {
-                    rpc_conn.open_stream(on_object.as_ref(), (hostname, port), isolation)?
-                }
-            };
+            let pool = crate::RpcConnPool::connect(&builder, n_conns)?;
 
-            // We call this last so that the stream will definitely be converted to an fd, or
-            // dropped.
-            socket_out.write_socket(stream);
+            pool_out.write_boxed_value_if_ptr_set(pool);
+        }
+    )
+}
+
+/// Return the connection in `pool` that currently has the fewest outstanding requests.
+///
+/// (Returns NULL if `pool` is NULL.)
+///
+/// Object IDs are only meaningful on the connection that created them:
+/// if a request refers to an object that you got from an earlier request,
+/// you must send it on the same connection as that earlier request.
+///
+/// # Ownership
+///
+/// The resulting connection belongs to `pool`:
+/// it lives for no longer than `pool`, and you must not free it with `arti_rpc_conn_free`.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_pool_get(
+    pool: *const ArtiRpcConnPool,
+) -> *const ArtiRpcConn {
+    ffi_body_raw! {
+        {
+            let pool: Option<&ArtiRpcConnPool> [in_ptr_opt];
+        } in {
+            // Safety: returned pointer is null, or semantically borrowed from `pool`.
+            // It is only null if `pool` was null.
+            match pool {
+                Some(p) => p.get() as *const ArtiRpcConn,
+                None => std::ptr::null(),
+            }
         }
     }
 }
+
+/// Return the number of connections in `pool`.
+///
+/// (Returns 0 if `pool` is NULL.)
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_pool_len(pool: *const ArtiRpcConnPool) -> usize {
+    ffi_body_raw!(
+        {
+            let pool: Option<&ArtiRpcConnPool> [in_ptr_opt];
+        } in {
+            // Safety: Return value is usize; trivially safe.
+            pool.map(|p| p.connections().len()).unwrap_or(0)
+        }
+    )
+}
+
+/// Close and free every connection in an `ArtiRpcConnPool`.
+///
+/// # Correctness requirements
+///
+/// No connection from `arti_rpc_conn_pool_get` may be used after this function is called.
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn arti_rpc_conn_pool_free(pool: *mut ArtiRpcConnPool) {
+    ffi_body_raw!(
+        {
+            let pool: Option<Box<ArtiRpcConnPool>> [in_ptr_consume_opt];
+        } in {
+            drop(pool);
+            // Safety: Return value is (); trivially safe.
+            ()
+        }
+    );
+}
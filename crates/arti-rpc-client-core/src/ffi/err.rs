@@ -156,6 +156,27 @@ pub(crate) enum FfiStatus {
     /// but that may change in the future.)
     [c"Not authenticated"]
     NotAuthenticated = 12,
+
+    /// A non-blocking operation could not complete without blocking.
+    ///
+    /// (For example, we tried to get a response to a request with `arti_rpc_handle_try_wait`,
+    /// but no response was ready yet.  Try again later.)
+    [c"Operation would block"]
+    WouldBlock = 13,
+
+    /// An operation did not complete before its deadline.
+    ///
+    /// (For example, we waited for a response with `arti_rpc_handle_wait_timeout`,
+    /// but none arrived in time.)
+    [c"Operation timed out"]
+    TimedOut = 14,
+
+    /// A request failed because too many of its responses were waiting to be taken.
+    ///
+    /// (This only happens once you have set a limit with `arti_rpc_conn_set_queue_limits`,
+    /// using `ARTI_RPC_OVERFLOW_FAIL_REQUEST`.)
+    [c"Too many responses queued"]
+    QueueOverflow = 15,
 }
 }
 
@@ -256,6 +277,14 @@ pub(super) enum InvalidInput {
     /// Tried to use an invalid port.
     #[error("Port was not in range 1..65535")]
     BadPort,
+
+    /// Tried to use an unrecognized `ARTI_RPC_FRAMING_*` value.
+    #[error("Unrecognized framing")]
+    BadFraming,
+
+    /// Tried to use an unrecognized `ARTI_RPC_OVERFLOW_*` value.
+    #[error("Unrecognized overflow policy")]
+    BadOverflowPolicy,
 }
 
 impl From<void::Void> for InvalidInput {
@@ -273,6 +302,20 @@ impl IntoFfiError for InvalidInput {
     }
 }
 
+/// A non-blocking operation could not complete without blocking.
+#[derive(Clone, Debug, thiserror::Error)]
+#[error("Operation would block")]
+pub(super) struct WouldBlock;
+
+impl IntoFfiError for WouldBlock {
+    fn status(&self) -> FfiStatus {
+        FfiStatus::WouldBlock
+    }
+    fn as_error(&self) -> Option<&(dyn StdError + 'static)> {
+        Some(self)
+    }
+}
+
 impl IntoFfiError for crate::ConnectError {
     fn status(&self) -> FfiStatus {
         use crate::ConnectError as E;
@@ -283,6 +326,8 @@ impl IntoFfiError for crate::ConnectError {
             E::AuthenticationRejected(_) => F::BadAuth,
             E::BadMessage(_) => F::PeerProtocolViolation,
             E::ProtoError(e) => e.status(),
+            E::AlreadyFinished => F::InvalidInput,
+            E::ConnectThreadFailed => F::Internal,
         }
     }
 
@@ -318,6 +363,9 @@ impl IntoFfiError for crate::StreamError {
                 // possibly with a different call.  See #1580.
                 F::ProxyStreamFailed
             }
+            E::FdPassingUnavailable => F::NotSupported,
+            E::OpenStreamRejected(_) => F::RequestFailed,
+            E::MissingFd => F::PeerProtocolViolation,
         }
     }
 
@@ -338,6 +386,13 @@ impl IntoFfiError for crate::ProtoError {
             E::DuplicateWait => F::Internal,
             E::CouldNotEncode(_) => F::Internal,
             E::InternalRequestFailed(_) => F::PeerProtocolViolation,
+            E::BackgroundReader(e) if e.kind() == std::io::ErrorKind::Unsupported => {
+                F::NotSupported
+            }
+            E::BackgroundReader(_) => F::Internal,
+            E::TimedOut => F::TimedOut,
+            E::TraceHookAlreadySet => F::InvalidInput,
+            E::QueueOverflow => F::QueueOverflow,
         }
     }
     fn as_error(&self) -> Option<&(dyn StdError + 'static)> {
@@ -358,6 +413,15 @@ impl IntoFfiError for crate::BuilderError {
     }
 }
 
+impl IntoFfiError for crate::InvalidJsonPointer {
+    fn status(&self) -> FfiStatus {
+        FfiStatus::InvalidInput
+    }
+    fn as_error(&self) -> Option<&(dyn StdError + 'static)> {
+        Some(self)
+    }
+}
+
 impl IntoFfiError for ErrorResponse {
     fn status(&self) -> FfiStatus {
         FfiStatus::RequestFailed
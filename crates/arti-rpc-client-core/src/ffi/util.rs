@@ -137,6 +137,145 @@ impl<'a> OutSocketOwned<'a> {
     }
 }
 
+/// Helper for output parameters represented as an array of `n` values, `T *out`.
+///
+/// Like [`OutVal`], except that it has one value per element.
+/// When an `OutArray` is constructed, every element of the array is initialized,
+/// so that even if the FFI code panics, every element will be set to _something_.
+///
+/// Each element should be written at most once.
+pub(super) struct OutArray<'a, T>(&'a mut [T]);
+
+/// Alias for an `OutArray` representing an array of `n` pointers, `T **out`.
+pub(super) type OutPtrArray<'a, T> = OutArray<'a, *mut T>;
+
+impl<'a, T> OutArray<'a, T> {
+    /// Construct `Option<Self>` from a possibly NULL pointer to `n` elements;
+    /// initialize every element with `initial_value()` if possible.
+    ///
+    /// # Safety
+    ///
+    /// The pointer, if set, must be valid for writing `n` consecutive `T` values,
+    /// and must not alias any other pointers.
+    /// It is safe for those values to be uninitialized.
+    ///
+    /// # No panics!
+    ///
+    /// As for [`OutVal::from_opt_ptr`], provided that `initial_value` does not panic.
+    pub(super) unsafe fn from_opt_ptr(
+        ptr: *mut T,
+        n: usize,
+        initial_value: impl Fn() -> T,
+    ) -> Option<Self> {
+        if ptr.is_null() {
+            return None;
+        }
+        for idx in 0..n {
+            // SAFETY: the caller promises that `ptr` is valid for `n` writes.
+            unsafe { ptr.add(idx).write(initial_value()) };
+        }
+        // SAFETY: We have just initialized all `n` elements;
+        // the caller promises that they are valid and unaliased.
+        Some(OutArray(unsafe { std::slice::from_raw_parts_mut(ptr, n) }))
+    }
+
+    /// Write `value` into the element at `idx`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `idx` is out of range.
+    pub(super) fn write_value(&mut self, idx: usize, value: T) {
+        self.0[idx] = value;
+    }
+}
+
+impl<'a, T> OutArray<'a, *mut T> {
+    /// Box `value`, and write it into the element at `idx`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `idx` is out of range.
+    pub(super) fn write_value_boxed(&mut self, idx: usize, value: T) {
+        self.write_value(idx, Box::into_raw(Box::new(value)));
+    }
+
+    /// Consume this `OutPtrArray` and the provided values,
+    /// boxing each value and writing it into the corresponding element.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the number of values does not match the size of the array.
+    pub(super) fn write_values_boxed(mut self, values: Vec<T>) {
+        assert_eq!(self.0.len(), values.len());
+        for (idx, value) in values.into_iter().enumerate() {
+            self.write_value_boxed(idx, value);
+        }
+    }
+}
+
+impl<'a> OutArray<'a, ArtiRpcRawSocket> {
+    /// Take ownership of the provided socket,
+    /// consume it,
+    /// and store its associated `ArtiRpcRawSocket` into the element at `idx`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `idx` is out of range.
+    pub(super) fn write_socket<T: IntoRawSocketTrait>(&mut self, idx: usize, socket: T) {
+        #[cfg(windows)]
+        let sock = socket.into_raw_socket();
+
+        #[cfg(not(windows))]
+        let sock = socket.into_raw_fd();
+
+        self.write_value(idx, ArtiRpcRawSocket(sock));
+    }
+}
+
+/// Try to convert a pointer to `n` values of type `T` into a slice.
+///
+/// Unlike the conversions in `arg_conversion`, a NULL pointer is not allowed.
+///
+/// # Safety
+///
+/// `input`, if set, must be valid for reading `n` consecutive `T` values,
+/// which must not be modified for the lifetime `'a`.
+pub(super) unsafe fn in_array<'a, T>(
+    input: *const T,
+    n: usize,
+) -> Result<&'a [T], super::err::InvalidInput> {
+    if input.is_null() {
+        return Err(super::err::InvalidInput::NullPointer);
+    }
+    // SAFETY: the caller promises that `input` is valid for `n` reads.
+    Ok(unsafe { std::slice::from_raw_parts(input, n) })
+}
+
+/// Try to convert an array of `n` `const char *` values into a `Vec<&str>`.
+///
+/// Unlike the conversions in `arg_conversion`, NULL pointers are not allowed,
+/// either for the array or for any of its elements.
+/// Non-UTF-8 inputs will give an error.
+///
+/// # Safety
+///
+/// `input`, if set, must be valid for reading `n` consecutive `const char *` values,
+/// and each of them must obey the safety properties of [`CStr::from_ptr`](std::ffi::CStr::from_ptr).
+pub(super) unsafe fn in_str_array<'a>(
+    input: *const *const std::ffi::c_char,
+    n: usize,
+) -> Result<Vec<&'a str>, super::err::InvalidInput> {
+    use super::err::InvalidInput;
+    // SAFETY: the caller promises that `input` is valid for `n` reads.
+    let ptrs = unsafe { in_array(input, n) }?;
+    ptrs.iter()
+        .map(|&p| {
+            // SAFETY: the caller promises that each element is a valid C string.
+            unsafe { arg_conversion::in_str_opt(p) }?.ok_or(InvalidInput::NullPointer)
+        })
+        .collect()
+}
+
 /// Implement the body of an FFI function.
 ///
 /// This macro handles the calling convention of an FFI function.
@@ -245,6 +384,7 @@ impl<'a> OutSocketOwned<'a> {
 /// | `in_ptr_consume_opt` | `*mut T`        | `Option<Box<T>>`   | N                 |
 /// | `out_ptr_opt`        | `*mut *mut T`   | `Option<OutPtr<T>>`| N                 |
 /// | `out_val_opt`        | `*mut T`        | `Option<OutVal<T>>`| N                 |
+/// | `out_const_ptr_opt`  | `*mut *const T` | `Option<OutVal<*const T>>`| N          |
 /// | `out_socket_owned_opt` | *mut ArtiRpcRawSocket` | `Option<OutSocketOwned>`| N   |
 /// | `in_mut_ptr_opt`     | (NO!)           | (Do not add!)      | (NO!)             |
 ///
@@ -301,6 +441,10 @@ impl<'a> OutSocketOwned<'a> {
 /// (Note that immediately upon conversion, if `out` is non-NULL,
 /// `*out` is set to NULL.  See documentation for `OptPtr`.)
 ///
+/// The `out_const_ptr_opt` method has the same requirements as `out_ptr_opt`,
+/// except that `*out` holds a "*const T".
+/// (We use it to return pointers that borrow from some other object.)
+///
 /// The return value of `BODY` becomes the return value of the C FFI function.
 /// It is the macro user's responsibility to ensure
 /// that it conforms to the published API.
@@ -614,6 +758,25 @@ pub(super) mod arg_conversion {
         Ok(unsafe { crate::ffi::util::OutPtr::from_opt_ptr(input, std::ptr::null_mut()) })
     }
 
+    /// Try to convert a mutable pointer-to-const-pointer into an `Option<OutVal<*const T>>`.
+    ///
+    /// A null pointer is allowed, and converted into None.
+    ///
+    /// Whatever the target of the original pointer (`input: *mut *const T`), if `input` is non-null.
+    /// then `*input` is initialized to NULL.
+    ///
+    /// It is safe for `*input` to be uninitialized.
+    ///
+    /// # Safety
+    ///
+    /// As for
+    /// [`<*mut *const T>::as_uninit_mut`](https://doc.rust-lang.org/std/primitive.pointer.html#method.as_uninit_mut).
+    pub(in crate::ffi) unsafe fn out_const_ptr_opt<'a, T>(
+        input: *mut *const T,
+    ) -> Result<Option<OutVal<'a, *const T>>, Void> {
+        Ok(unsafe { crate::ffi::util::OutVal::from_opt_ptr(input, std::ptr::null()) })
+    }
+
     /// Try to convert a mutable pointer-to-value into an `Option<OutVal<T>>`.
     ///
     /// A null pointer is allowed, and converted into None.
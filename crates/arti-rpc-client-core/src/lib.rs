@@ -51,5 +51,16 @@ mod msgs;
 #[macro_use]
 mod util;
 
-pub use conn::{BuilderError, ConnectError, ProtoError, RpcConn, RpcConnBuilder, StreamError};
-pub use msgs::{request::InvalidRequestError, response::RpcError, AnyRequestId, ObjectId};
+pub use conn::{
+    register_inproc_connector, unregister_inproc_connector, BuilderError, ConnectError,
+    InprocConnector, InprocStreams, OverflowPolicy, PendingConnect, PendingStream, ProtoError,
+    QueueLimits, RpcConn, RpcConnBuilder, RpcConnPool, RpcConnStats, StreamError, StreamTarget,
+    TraceEvent, N_LATENCY_BUCKETS,
+};
+pub use msgs::{
+    builder::RequestBuilder,
+    pointer::{lookup_json_pointer, InvalidJsonPointer},
+    request::InvalidRequestError,
+    response::RpcError,
+    AnyRequestId, ObjectId,
+};
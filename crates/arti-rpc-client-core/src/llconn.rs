@@ -1,6 +1,10 @@
 //! Lowest-level API interface to an active RPC connection.
 //!
 //! Treats messages as unrelated strings, and validates outgoing messages for correctness.
+//!
+//! Messages are framed in one of two ways (see [`Framing`]):
+//! newline-terminated JSON, which every connection starts with,
+//! or length-prefixed JSON, which a connection can switch to after authentication.
 
 use crate::{
     msgs::{
@@ -9,7 +13,47 @@ use crate::{
     },
     util::define_from_for_arc,
 };
-use std::{io, sync::Arc};
+use std::{
+    io::{self, Read as _},
+    sync::Arc,
+};
+
+/// A way of separating messages from one another on an RPC connection.
+///
+/// In either case, each message is a single JSON object.
+#[derive(Clone, Copy, Debug, Default, Eq, PartialEq)]
+#[non_exhaustive]
+pub enum Framing {
+    /// Each message is terminated by a newline.
+    ///
+    /// Every connection starts out using this framing.
+    #[default]
+    JsonLines,
+    /// Each message is preceded by its length in bytes,
+    /// as a 4-byte big-endian integer.
+    ///
+    /// This spares the receiver from scanning every message for its end.
+    LengthPrefixed,
+}
+
+/// The length of the length prefix on each message, under [`Framing::LengthPrefixed`].
+const LENGTH_PREFIX_LEN: usize = 4;
+
+/// The largest message that we accept under [`Framing::LengthPrefixed`], by default.
+///
+/// This is not the same kind of limit as the largest _request_ that Arti accepts.
+/// That limit protects Arti from its clients,
+/// and requests are small, since applications write them.
+/// Responses are written by Arti, and can legitimately be much larger
+/// (a list of every relay, for instance),
+/// so this limit only exists to catch a corrupt or hostile length:
+/// we never allocate space for a message before its bytes arrive,
+/// and a response can't be longer than 4 GiB anyway.
+///
+/// Applications can change it with
+/// [`RpcConnBuilder::max_response_len`](crate::RpcConnBuilder::max_response_len).
+/// (Under [`Framing::JsonLines`], as before, responses have no limit.)
+pub(crate) const DEFAULT_MAX_RESPONSE_LEN: usize = 1 << 30;
 
 /// A low-level reader type, wrapping a boxed [`Read`](io::Read).
 ///
@@ -18,6 +62,15 @@ use std::{io, sync::Arc};
 pub struct Reader {
     /// The underlying reader.
     backend: Box<dyn io::BufRead + Send>,
+    /// The capacity to use when allocating a buffer for the next message.
+    ///
+    /// We set this based on the length of the last message we received,
+    /// since consecutive messages tend to be similar in size.
+    capacity_hint: usize,
+    /// The framing that we expect on incoming messages.
+    framing: Framing,
+    /// The largest message that we accept under [`Framing::LengthPrefixed`].
+    max_response_len: usize,
 }
 
 /// A low-level writer type, wrapping a boxed [`Write`](io::Write).
@@ -26,6 +79,8 @@ pub struct Reader {
 pub struct Writer {
     /// The underlying writer.
     backend: Box<dyn io::Write + Send>,
+    /// The framing that we use on outgoing messages.
+    framing: Framing,
 }
 
 impl Reader {
@@ -36,30 +91,105 @@ impl Reader {
     {
         Self {
             backend: Box::new(backend),
+            capacity_hint: MIN_CAPACITY_HINT,
+            framing: Framing::default(),
+            max_response_len: DEFAULT_MAX_RESPONSE_LEN,
         }
     }
 
+    /// Crate-internal: Change the framing that we expect on incoming messages.
+    ///
+    /// The caller must make sure that the other side changes its framing
+    /// at exactly the same point in the stream.
+    pub(crate) fn set_framing(&mut self, framing: Framing) {
+        self.framing = framing;
+    }
+
+    /// Crate-internal: Change the largest message that we accept under
+    /// [`Framing::LengthPrefixed`].
+    pub(crate) fn set_max_response_len(&mut self, max_response_len: usize) {
+        self.max_response_len = max_response_len;
+    }
+
     /// Receive an inbound reply.
     ///
     /// Blocks as needed until the reply is available.
     ///
     /// Returns `Ok(None)` on end-of-stream.
     pub fn read_msg(&mut self) -> io::Result<Option<UnparsedResponse>> {
-        let mut s = String::new();
+        if self.framing == Framing::LengthPrefixed {
+            return self.read_length_prefixed();
+        }
+        let mut s = String::with_capacity(self.capacity_hint);
 
         // TODO: possibly ensure that the value is legit?
         match self.backend.read_line(&mut s) {
             Err(e) => Err(e),
             Ok(0) => Ok(None),
-            Ok(_) if s.ends_with('\n') => Ok(Some(UnparsedResponse::new(s))),
+            Ok(n) if s.ends_with('\n') => {
+                // Leave room for the nul that we'll add when we hand this to the application,
+                // so that doing so doesn't reallocate.
+                self.capacity_hint = (n + 1).max(MIN_CAPACITY_HINT);
+                Ok(Some(UnparsedResponse::new(s)))
+            }
             // NOTE: This can happen if we hit EOF.
             //
             // We discard any truncated lines in this case.
             Ok(_) => Ok(None),
         }
     }
+
+    /// Helper: Receive an inbound reply framed according to [`Framing::LengthPrefixed`].
+    ///
+    /// As with newline-terminated messages, we treat a truncated message as end-of-stream.
+    fn read_length_prefixed(&mut self) -> io::Result<Option<UnparsedResponse>> {
+        let mut prefix = [0_u8; LENGTH_PREFIX_LEN];
+        if !read_exact_or_eof(&mut self.backend, &mut prefix)? {
+            return Ok(None);
+        }
+        let len = usize::try_from(u32::from_be_bytes(prefix))
+            .ok()
+            .filter(|&len| len <= self.max_response_len)
+            .ok_or_else(|| {
+                io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "Response from Arti was too long",
+                )
+            })?;
+
+        // We don't trust `len` enough to allocate it all up front:
+        // we start with our usual guess, and grow the buffer as bytes arrive.
+        // (Either way, we leave room for the newline that we add, to match the other framing,
+        // and for the nul that we'll add when we hand this to the application.)
+        let mut body = Vec::with_capacity(len.min(self.capacity_hint) + 2);
+        let n_read = (&mut self.backend)
+            .take(len as u64)
+            .read_to_end(&mut body)?;
+        if n_read < len {
+            return Ok(None);
+        }
+        self.capacity_hint = (len + 2).max(MIN_CAPACITY_HINT);
+        body.push(b'\n');
+        let s =
+            String::from_utf8(body).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+        Ok(Some(UnparsedResponse::new(s)))
+    }
 }
 
+/// Helper: Fill `buf` from `r`.
+///
+/// Return `Ok(false)` if `r` reaches end-of-stream before `buf` is full.
+fn read_exact_or_eof<R: io::Read + ?Sized>(r: &mut R, buf: &mut [u8]) -> io::Result<bool> {
+    match r.read_exact(buf) {
+        Ok(()) => Ok(true),
+        Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => Ok(false),
+        Err(e) => Err(e),
+    }
+}
+
+/// The smallest buffer that we'll allocate for an incoming message.
+const MIN_CAPACITY_HINT: usize = 128;
+
 impl Writer {
     /// Create a new writer, wrapping an [`io::Write`].
     pub fn new<T>(backend: T) -> Self
@@ -68,9 +198,18 @@ impl Writer {
     {
         Self {
             backend: Box::new(backend),
+            framing: Framing::default(),
         }
     }
 
+    /// Crate-internal: Change the framing that we use on outgoing messages.
+    ///
+    /// The caller must make sure that the other side changes its framing
+    /// at exactly the same point in the stream.
+    pub(crate) fn set_framing(&mut self, framing: Framing) {
+        self.framing = framing;
+    }
+
     /// Send an outbound request.
     ///
     /// Return an error if an IO problems occurred, or if the request was not well-formed.
@@ -84,8 +223,73 @@ impl Writer {
     ///
     /// (This is reliable since we never construct a `ValidRequest` except by encoding a
     /// known-correct object.)
-    pub(crate) fn send_valid(&mut self, request: &ValidatedRequest) -> io::Result<()> {
-        self.backend.write_all(request.as_ref().as_bytes())
+    pub(crate) fn send_valid(&mut self, request: &ValidatedRequest<'_>) -> io::Result<()> {
+        self.send_valid_batch(std::slice::from_ref(request))
+    }
+
+    /// Crate-internal: Send a batch of requests that are known to be valid,
+    /// using as few vectored writes as the backend allows.
+    ///
+    /// Like `send_valid`, but lets us hand a burst of requests to the kernel
+    /// in a single `writev` rather than one `write` per request.
+    ///
+    /// Each request is written straight from the buffers that hold its parts,
+    /// without copying them together first.
+    pub(crate) fn send_valid_batch(&mut self, requests: &[ValidatedRequest<'_>]) -> io::Result<()> {
+        // The length prefix for each request, if we are using them.
+        let prefixes: Vec<[u8; LENGTH_PREFIX_LEN]> = match self.framing {
+            Framing::JsonLines => Vec::new(),
+            Framing::LengthPrefixed => requests
+                .iter()
+                .map(|r| {
+                    let len = u32::try_from(r.len())
+                        .map_err(|_| io::Error::from(io::ErrorKind::InvalidInput))?;
+                    Ok(len.to_be_bytes())
+                })
+                .collect::<io::Result<_>>()?,
+        };
+        // The parts of each request that we have not yet written.
+        let mut remaining: Vec<&[u8]> = match self.framing {
+            Framing::JsonLines => requests
+                .iter()
+                .flat_map(|r| {
+                    let [head, body] = r.parts();
+                    [head, body, b"\n"]
+                })
+                .collect(),
+            Framing::LengthPrefixed => prefixes
+                .iter()
+                .zip(requests)
+                .flat_map(|(prefix, r)| {
+                    let [head, body] = r.parts();
+                    [&prefix[..], head, body]
+                })
+                .collect(),
+        };
+        remaining.retain(|b| !b.is_empty());
+        let mut first = 0;
+        while first < remaining.len() {
+            let slices: Vec<io::IoSlice<'_>> = remaining[first..]
+                .iter()
+                .map(|b| io::IoSlice::new(b))
+                .collect();
+            let mut n_written = match self.backend.write_vectored(&slices) {
+                Ok(0) => return Err(io::ErrorKind::WriteZero.into()),
+                Ok(n) => n,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            };
+            // Skip over everything that was written completely...
+            while first < remaining.len() && n_written >= remaining[first].len() {
+                n_written -= remaining[first].len();
+                first += 1;
+            }
+            // ...and trim the request that was written partially, if any.
+            if let Some(partial) = remaining.get_mut(first) {
+                *partial = &partial[n_written..];
+            }
+        }
+        Ok(())
     }
 
     /// Flush any queued data in this writer.
@@ -233,4 +437,127 @@ mod test {
             matches!(r, Err(SendRequestError::Io(e)) if e.kind() == io::ErrorKind::NotConnected)
         );
     }
+
+    /// A writer that accepts at most `limit` bytes per call,
+    /// spanning multiple buffers when given a vectored write.
+    struct Trickle {
+        limit: usize,
+        data: Arc<std::sync::Mutex<Vec<u8>>>,
+    }
+    impl io::Write for Trickle {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.write_vectored(&[io::IoSlice::new(buf)])
+        }
+
+        fn write_vectored(&mut self, bufs: &[io::IoSlice<'_>]) -> io::Result<usize> {
+            let mut data = self.data.lock().unwrap();
+            let mut n = 0;
+            for b in bufs {
+                let take = b.len().min(self.limit - n);
+                data.extend_from_slice(&b[..take]);
+                n += take;
+            }
+            Ok(n)
+        }
+
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn write_batch() {
+        let texts: Vec<String> = (0..10)
+            .map(|n| format!(r#"{{"id":{n},"obj":"foo","method":"arti:x-frob","params":{{}}}}"#))
+            .collect();
+        let mut requests: Vec<ValidatedRequest> = texts
+            .iter()
+            .map(|t| ValidatedRequest::from_string_strict(t).unwrap())
+            .collect();
+        // (One of these gets its ID spliced in.)
+        requests.push(
+            ValidatedRequest::from_string_loose(
+                r#"{"obj":"foo","method":"arti:x-frob","params":{}}"#,
+                || 10.into(),
+            )
+            .unwrap(),
+        );
+        let expected: String = requests.iter().map(|r| r.text()).collect();
+
+        for limit in [1, 7, 50, 1000] {
+            let data = Arc::new(std::sync::Mutex::new(Vec::new()));
+            let mut w = Writer::new(Trickle {
+                limit,
+                data: Arc::clone(&data),
+            });
+            w.send_valid_batch(&requests).unwrap();
+            assert_eq!(data.lock().unwrap().as_slice(), expected.as_bytes());
+        }
+
+        let mut w = Writer::new(NeverConnected);
+        let r = w.send_valid_batch(&requests);
+        assert_eq!(r.unwrap_err().kind(), io::ErrorKind::NotConnected);
+    }
+
+    #[test]
+    fn length_prefixed() {
+        /// Helper: Return `body` as a message under `Framing::LengthPrefixed`.
+        fn frame(body: &str) -> Vec<u8> {
+            let mut v = u32::try_from(body.len()).unwrap().to_be_bytes().to_vec();
+            v.extend_from_slice(body.as_bytes());
+            v
+        }
+
+        // Reading: every complete message gets a newline, as with JSON lines.
+        let mut v = frame(r#"{"id":7,"result":{}}"#);
+        v.extend(frame(r#"{"id":8,"result":{"x":"y\nz"}}"#));
+        v.extend(&frame(r#"{"id":9,"result":{}}"#)[..10]);
+        let mut r = Reader::new(Cursor::new(v));
+        r.set_framing(Framing::LengthPrefixed);
+        let msg = r.read_msg().unwrap().unwrap();
+        assert_eq!(msg.as_ref(), "{\"id\":7,\"result\":{}}\n");
+        let msg = r.read_msg().unwrap().unwrap();
+        assert_eq!(msg.as_ref(), "{\"id\":8,\"result\":{\"x\":\"y\\nz\"}}\n");
+        // A truncated message is treated as EOF.
+        assert!(r.read_msg().unwrap().is_none());
+        assert!(r.read_msg().unwrap().is_none());
+
+        // A length that is merely large is fine: we wait for the bytes,
+        // and here they never come.
+        let mut v = u32::try_from((1 << 24) + 1).unwrap().to_be_bytes().to_vec();
+        v.extend_from_slice(b"{}");
+        let mut r = Reader::new(Cursor::new(v));
+        r.set_framing(Framing::LengthPrefixed);
+        assert!(r.read_msg().unwrap().is_none());
+
+        // We reject an overlong message before reading (or allocating space for) its body.
+        let mut v = frame(r#"{"id":7,"result":{}}"#);
+        v.extend(frame(r#"{"id":8,"result":{"x":"too long"}}"#));
+        let mut r = Reader::new(Cursor::new(v));
+        r.set_framing(Framing::LengthPrefixed);
+        r.set_max_response_len(24);
+        assert!(r.read_msg().unwrap().is_some());
+        assert_eq!(r.read_msg().unwrap_err().kind(), io::ErrorKind::InvalidData);
+
+        // Writing, alone and in batches.
+        let texts: Vec<String> = (0..4)
+            .map(|n| format!(r#"{{"id":{n},"obj":"foo","method":"arti:x-frob","params":{{}}}}"#))
+            .collect();
+        let requests: Vec<ValidatedRequest> = texts
+            .iter()
+            .map(|t| ValidatedRequest::from_string_strict(t).unwrap())
+            .collect();
+        let expected: Vec<u8> = texts.iter().flat_map(|t| frame(t)).collect();
+        for limit in [1, 7, 1000] {
+            let data = Arc::new(std::sync::Mutex::new(Vec::new()));
+            let mut w = Writer::new(Trickle {
+                limit,
+                data: Arc::clone(&data),
+            });
+            w.set_framing(Framing::LengthPrefixed);
+            w.send_valid(&requests[0]).unwrap();
+            w.send_valid_batch(&requests[1..]).unwrap();
+            assert_eq!(data.lock().unwrap().as_slice(), expected.as_slice());
+        }
+    }
 }
@@ -0,0 +1,307 @@
+//! Support for building RPC requests without formatting or parsing JSON text.
+
+use std::{
+    borrow::Cow,
+    fmt::Write as _,
+    sync::{Mutex, MutexGuard},
+};
+
+use super::{request::ValidatedRequest, AnyRequestId};
+
+/// A request that an application is building, one parameter at a time.
+///
+/// We encode the request as it is built,
+/// so sending it needs no validation or re-encoding.
+/// A `RequestBuilder` can be sent any number of times with [`RpcConn::submit`](crate::RpcConn::submit),
+/// and reused for a new request with [`reset`](Self::reset),
+/// so that a loop that sends many requests can avoid allocating a new one each time.
+///
+/// Setting a parameter that is already set replaces its old value.
+///
+/// A `RequestBuilder` may be used from several threads at once:
+/// each change, and each send, happens while holding an internal lock.
+#[derive(Debug)]
+pub struct RequestBuilder {
+    /// The request itself, as encoded so far.
+    inner: Mutex<BuiltRequest>,
+}
+
+/// The lock-protected contents of a [`RequestBuilder`].
+#[derive(Clone, Debug)]
+pub(crate) struct BuiltRequest {
+    /// The body of the request, as encoded so far.
+    ///
+    /// This holds every field of the request except for its `id`,
+    /// without the request's opening brace.
+    /// It is always valid to send, followed by the closing braces in [`CLOSE_PARAMS`].
+    buf: String,
+    /// The length of `buf` at the point where the `params` object was opened.
+    params_start: usize,
+    /// The location in `buf` of each parameter that we have set, in order.
+    params: Vec<ParamSpan>,
+    /// A buffer for the opening brace and `id` field that we send before `buf`.
+    ///
+    /// We keep this around so that sending the request doesn't need to allocate.
+    head: String,
+}
+
+/// The location of one parameter within [`BuiltRequest::buf`].
+#[derive(Clone, Debug)]
+struct ParamSpan {
+    /// The offset of the parameter's encoded name.
+    start: usize,
+    /// The offset just after the parameter's encoded name.
+    name_end: usize,
+    /// The offset just after the parameter's encoded value.
+    end: usize,
+}
+
+/// The text that follows the last parameter of a request.
+const CLOSE_PARAMS: &str = "}}";
+
+impl Clone for RequestBuilder {
+    fn clone(&self) -> Self {
+        RequestBuilder {
+            inner: Mutex::new(self.lock().clone()),
+        }
+    }
+}
+
+impl RequestBuilder {
+    /// Start building a request to invoke `method` on the object `obj`.
+    pub fn new(obj: &str, method: &str) -> Self {
+        let builder = RequestBuilder {
+            inner: Mutex::new(BuiltRequest {
+                buf: String::new(),
+                params_start: 0,
+                params: Vec::new(),
+                head: String::new(),
+            }),
+        };
+        builder.reset(obj, method);
+        builder
+    }
+
+    /// Crate-internal: Lock this request, to send it or change it.
+    pub(crate) fn lock(&self) -> MutexGuard<'_, BuiltRequest> {
+        self.inner.lock().expect("poisoned")
+    }
+
+    /// Discard every field of this request,
+    /// and start building a new request to invoke `method` on the object `obj`.
+    ///
+    /// This reuses our existing buffers.
+    pub fn reset(&self, obj: &str, method: &str) {
+        let mut inner = self.lock();
+        let inner = &mut *inner;
+        inner.buf.clear();
+        inner.params.clear();
+        inner.buf.push_str("\"obj\":");
+        push_json_str(&mut inner.buf, obj);
+        inner.buf.push_str(",\"method\":");
+        push_json_str(&mut inner.buf, method);
+        inner.buf.push_str(",\"params\":{");
+        inner.params_start = inner.buf.len();
+        inner.buf.push_str(CLOSE_PARAMS);
+    }
+
+    /// Set the parameter called `name` to the string `value`.
+    pub fn param_str(&self, name: &str, value: &str) -> &Self {
+        self.lock().set_param(name, |buf| push_json_str(buf, value));
+        self
+    }
+
+    /// Set the parameter called `name` to the integer `value`.
+    ///
+    /// Note that values larger than `±2^53-1` may not work with all JSON implementations.
+    pub fn param_int(&self, name: &str, value: i64) -> &Self {
+        self.lock().set_param(name, |buf| {
+            write!(buf, "{value}").expect("Can't write to a string?");
+        });
+        self
+    }
+
+    /// Set the parameter called `name` to the boolean `value`.
+    pub fn param_bool(&self, name: &str, value: bool) -> &Self {
+        self.lock().set_param(name, |buf| {
+            buf.push_str(if value { "true" } else { "false" });
+        });
+        self
+    }
+}
+
+impl BuiltRequest {
+    /// Helper: Set the parameter called `name` to the value that `push_value` encodes,
+    /// removing any earlier value for it.
+    fn set_param<F>(&mut self, name: &str, push_value: F)
+    where
+        F: FnOnce(&mut String),
+    {
+        let buf = &mut self.buf;
+        buf.truncate(buf.len() - CLOSE_PARAMS.len());
+        if !self.params.is_empty() {
+            buf.push(',');
+        }
+        let mut start = buf.len();
+        push_json_str(buf, name);
+        let name_len = buf.len() - start;
+
+        // Since our encoding is deterministic, two names are the same
+        // exactly when their encodings are.
+        let old = self
+            .params
+            .iter()
+            .position(|p| buf[p.start..p.name_end] == buf[start..]);
+        if let Some(idx) = old {
+            let old = self.params.remove(idx);
+            // Remove the old parameter, along with a comma next to it.
+            // (There is always a comma after it, since we've just added a parameter.)
+            let removed = if idx == 0 {
+                old.start..old.end + 1
+            } else {
+                old.start - 1..old.end
+            };
+            let n_removed = removed.len();
+            buf.replace_range(removed, "");
+            for p in &mut self.params[idx..] {
+                p.start -= n_removed;
+                p.name_end -= n_removed;
+                p.end -= n_removed;
+            }
+            start -= n_removed;
+        }
+
+        buf.push(':');
+        push_value(buf);
+        self.params.push(ParamSpan {
+            start,
+            name_end: start + name_len,
+            end: buf.len(),
+        });
+        buf.push_str(CLOSE_PARAMS);
+    }
+
+    /// Crate-internal: Return this request, ready to send with the ID `id`.
+    pub(crate) fn to_validated(&mut self, id: AnyRequestId) -> ValidatedRequest<'_> {
+        let head = &mut self.head;
+        head.clear();
+        head.push_str("{\"id\":");
+        match &id {
+            AnyRequestId::Number(n) => write!(head, "{n}").expect("Can't write to a string?"),
+            AnyRequestId::String(s) => push_json_str(head, s),
+        }
+        head.push(',');
+        ValidatedRequest::from_trusted_parts(Cow::Borrowed(head), Cow::Borrowed(&self.buf), id)
+    }
+}
+
+/// Append `s` to `buf`, encoded as a JSON string.
+fn push_json_str(buf: &mut String, s: &str) {
+    buf.reserve(s.len() + 2);
+    buf.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => buf.push_str("\\\""),
+            '\\' => buf.push_str("\\\\"),
+            '\n' => buf.push_str("\\n"),
+            '\r' => buf.push_str("\\r"),
+            '\t' => buf.push_str("\\t"),
+            c if u32::from(c) < 0x20 => {
+                write!(buf, "\\u{:04x}", u32::from(c)).expect("Can't write to a string?");
+            }
+            c => buf.push(c),
+        }
+    }
+    buf.push('"');
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use crate::util::assert_same_json;
+
+    /// Return the text that `b` would send with the ID `id`,
+    /// after making sure that it is a valid request.
+    fn sent(b: &RequestBuilder, id: AnyRequestId) -> String {
+        let text = b.lock().to_validated(id.clone()).text();
+        let valid = ValidatedRequest::from_string_strict(&text).unwrap();
+        assert_eq!(valid.id(), &id);
+        text
+    }
+
+    #[test]
+    fn build() {
+        let b = RequestBuilder::new("session", "arti:get_client");
+        assert_same_json!(
+            &sent(&b, 7.into()),
+            r#"{"id":7, "obj":"session", "method":"arti:get_client", "params":{}}"#
+        );
+
+        b.param_str("name", "a \"quoted\"\n\\ name\u{1}")
+            .param_int("n", -12)
+            .param_bool("yes", true);
+        let text = sent(&b, "with \"quotes\"".to_string().into());
+        assert_eq!(text.matches('\n').count(), 1);
+        assert_same_json!(
+            &text,
+            r#"{"id":"with \"quotes\"", "obj":"session", "method":"arti:get_client",
+                "params":{"name":"a \"quoted\"\n\\ name\u0001", "n":-12, "yes":true}}"#
+        );
+
+        // Resetting reuses the buffers.
+        let capacity = b.lock().buf.capacity();
+        let head_capacity = b.lock().head.capacity();
+        b.reset("connection", "rpc:release");
+        b.param_bool("no", false);
+        assert_same_json!(
+            &sent(&b, AnyRequestId::Number(-3)),
+            r#"{"id":-3, "obj":"connection", "method":"rpc:release", "params":{"no":false}}"#
+        );
+        assert_eq!(b.lock().buf.capacity(), capacity);
+        assert_eq!(b.lock().head.capacity(), head_capacity);
+    }
+
+    #[test]
+    fn replace_param() {
+        let b = RequestBuilder::new("s", "x:y");
+        // Replacing the first, a middle, and the last parameter.
+        b.param_int("a", 1)
+            .param_int("b", 2)
+            .param_int("c", 3)
+            .param_str("a", "one")
+            .param_bool("c", false)
+            .param_int("c", 33)
+            .param_str("\"", "q")
+            .param_int("b", 22);
+        let text = sent(&b, 1.into());
+        // (We compare the text, since a JSON parser would hide duplicate keys.)
+        assert_eq!(
+            text,
+            r#"{"id":1,"obj":"s","method":"x:y","params":{"a":"one","c":33,"\"":"q","b":22}}"#
+                .to_owned()
+                + "\n"
+        );
+
+        // Replacing the only parameter.
+        b.reset("s", "x:y");
+        b.param_int("a", 1).param_int("a", 2);
+        assert_eq!(
+            sent(&b, 2.into()),
+            "{\"id\":2,\"obj\":\"s\",\"method\":\"x:y\",\"params\":{\"a\":2}}\n"
+        );
+    }
+}
@@ -0,0 +1,337 @@
+//! Support for finding a single value inside a JSON document, as named by a JSON pointer.
+//!
+//! Applications often want only one field of a response (such as `/result/id`).
+//! Rather than having them decode the whole response again,
+//! we walk the text of the response just far enough to find the field they asked for,
+//! skipping over every other value without decoding it,
+//! and hand back the slice of the original text that holds the value.
+//!
+//! (See [RFC 6901](https://www.rfc-editor.org/rfc/rfc6901) for the syntax of JSON pointers.)
+
+use std::borrow::Cow;
+
+/// An error returned when a string is not a well-formed JSON pointer.
+#[derive(Clone, Debug, thiserror::Error)]
+#[non_exhaustive]
+pub enum InvalidJsonPointer {
+    /// The pointer was neither empty nor started with `/`.
+    #[error("JSON pointer did not start with '/'")]
+    MissingSlash,
+    /// The pointer contained a `~` that was not part of `~0` or `~1`.
+    #[error("JSON pointer contained an invalid '~' escape")]
+    BadEscape,
+}
+
+/// Return the text of the value within `json` that `pointer` refers to.
+///
+/// The returned slice borrows from `json`,
+/// and is itself the JSON encoding of the value (with any surrounding whitespace removed).
+/// For example, looking up `/result/id` in `{"id":3,"result":{"id":"x"}}`
+/// gives `"x"`, including its quotation marks.
+///
+/// Return `Ok(None)` if `json` has no such value.
+///
+/// This function assumes that `json` has already been validated
+/// (as every response from [`RpcConn`](crate::RpcConn) has been).
+/// If it is not well-formed JSON, we may return `None` or an unhelpful slice,
+/// but we will not panic.
+pub fn lookup_json_pointer<'a>(
+    json: &'a str,
+    pointer: &str,
+) -> Result<Option<&'a str>, InvalidJsonPointer> {
+    let tokens = if pointer.is_empty() {
+        Vec::new()
+    } else {
+        let rest = pointer
+            .strip_prefix('/')
+            .ok_or(InvalidJsonPointer::MissingSlash)?;
+        rest.split('/')
+            .map(unescape_token)
+            .collect::<Result<Vec<_>, _>>()?
+    };
+
+    let mut scanner = Scanner { json, pos: 0 };
+    for token in &tokens {
+        if scanner.descend(token).is_none() {
+            return Ok(None);
+        }
+    }
+    Ok(scanner.value())
+}
+
+/// Replace the `~1` and `~0` escapes in a single JSON pointer token.
+fn unescape_token(token: &str) -> Result<Cow<'_, str>, InvalidJsonPointer> {
+    if !token.contains('~') {
+        return Ok(Cow::Borrowed(token));
+    }
+    let mut out = String::with_capacity(token.len());
+    let mut chars = token.chars();
+    while let Some(c) = chars.next() {
+        if c == '~' {
+            match chars.next() {
+                Some('0') => out.push('~'),
+                Some('1') => out.push('/'),
+                _ => return Err(InvalidJsonPointer::BadEscape),
+            }
+        } else {
+            out.push(c);
+        }
+    }
+    Ok(Cow::Owned(out))
+}
+
+/// A cursor over the text of a JSON document.
+///
+/// Every method leaves `pos` at a byte offset that is either `json.len()`
+/// or the position of an ASCII byte, so slicing `json` at `pos` is always
+/// on a character boundary for well-formed input.
+/// (For malformed input, we use `str::get` so that we never panic.)
+struct Scanner<'a> {
+    /// The document that we're scanning.
+    json: &'a str,
+    /// Our current position within `json`, in bytes.
+    pos: usize,
+}
+
+impl<'a> Scanner<'a> {
+    /// Return the byte at our current position, if any.
+    fn peek(&self) -> Option<u8> {
+        self.json.as_bytes().get(self.pos).copied()
+    }
+
+    /// Advance past any whitespace.
+    fn skip_ws(&mut self) {
+        while matches!(self.peek(), Some(b' ' | b'\t' | b'\n' | b'\r')) {
+            self.pos += 1;
+        }
+    }
+
+    /// Advance past `byte`, after any whitespace; return None if `byte` is not next.
+    fn expect(&mut self, byte: u8) -> Option<()> {
+        self.skip_ws();
+        (self.peek() == Some(byte)).then(|| self.pos += 1)
+    }
+
+    /// Advance past a string, which must start at our current position.
+    ///
+    /// Return the raw (still escaped) contents of the string.
+    fn skip_string(&mut self) -> Option<&'a str> {
+        let bytes = self.json.as_bytes();
+        if self.peek() != Some(b'"') {
+            return None;
+        }
+        let start = self.pos + 1;
+        let mut pos = start;
+        loop {
+            match bytes.get(pos)? {
+                b'\\' => pos += 2,
+                b'"' => break,
+                _ => pos += 1,
+            }
+        }
+        self.pos = pos + 1;
+        self.json.get(start..pos)
+    }
+
+    /// Advance past a single value, which must start at our current position.
+    ///
+    /// We only check as much of the value's syntax as we need to find its end.
+    fn skip_value(&mut self) -> Option<()> {
+        match self.peek()? {
+            b'"' => self.skip_string().map(|_| ()),
+            b'{' | b'[' => {
+                // Skip the whole container at once,
+                // counting brackets but otherwise only looking at strings.
+                let mut depth = 0_usize;
+                loop {
+                    match self.peek()? {
+                        b'"' => {
+                            self.skip_string()?;
+                            continue;
+                        }
+                        b'{' | b'[' => depth += 1,
+                        b'}' | b']' => {
+                            depth -= 1;
+                            if depth == 0 {
+                                self.pos += 1;
+                                return Some(());
+                            }
+                        }
+                        _ => {}
+                    }
+                    self.pos += 1;
+                }
+            }
+            _ => {
+                // A number, `true`, `false`, or `null`.
+                let start = self.pos;
+                while !matches!(
+                    self.peek(),
+                    None | Some(b',' | b'}' | b']' | b' ' | b'\t' | b'\n' | b'\r')
+                ) {
+                    self.pos += 1;
+                }
+                (self.pos > start).then_some(())
+            }
+        }
+    }
+
+    /// Move from the start of an object or array to the start of its member named by `token`.
+    ///
+    /// Return None if there is no such member.
+    fn descend(&mut self, token: &str) -> Option<()> {
+        self.skip_ws();
+        match self.peek()? {
+            b'{' => {
+                self.pos += 1;
+                self.skip_ws();
+                if self.peek()? == b'}' {
+                    return None;
+                }
+                loop {
+                    self.skip_ws();
+                    let key = self.skip_string()?;
+                    self.expect(b':')?;
+                    self.skip_ws();
+                    if key_matches(key, token) {
+                        return Some(());
+                    }
+                    self.skip_value()?;
+                    self.expect(b',')?;
+                }
+            }
+            b'[' => {
+                let index = array_index(token)?;
+                self.pos += 1;
+                self.skip_ws();
+                if self.peek()? == b']' {
+                    return None;
+                }
+                for _ in 0..index {
+                    self.skip_ws();
+                    self.skip_value()?;
+                    self.expect(b',')?;
+                }
+                self.skip_ws();
+                Some(())
+            }
+            _ => None,
+        }
+    }
+
+    /// Return the text of the value at our current position.
+    fn value(mut self) -> Option<&'a str> {
+        self.skip_ws();
+        let start = self.pos;
+        self.skip_value()?;
+        self.json.get(start..self.pos)
+    }
+}
+
+/// Return true if `raw_key` (the still-escaped contents of a JSON string) is equal to `token`.
+fn key_matches(raw_key: &str, token: &str) -> bool {
+    if raw_key.contains('\\') {
+        // Escaped keys are rare, so it's okay to allocate here.
+        serde_json::from_str::<String>(&format!("\"{}\"", raw_key))
+            .map(|key| key == token)
+            .unwrap_or(false)
+    } else {
+        raw_key == token
+    }
+}
+
+/// Decode `token` as an array index, as permitted by RFC 6901.
+///
+/// (That is: decimal digits, with no leading zeros.)
+fn array_index(token: &str) -> Option<usize> {
+    if token.is_empty()
+        || !token.bytes().all(|b| b.is_ascii_digit())
+        || (token.len() > 1 && token.starts_with('0'))
+    {
+        return None;
+    }
+    token.parse().ok()
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    const DOC: &str = r#"{"id": 7, "result": { "id" : "obj-1", "list": [1, [2, 3], {"x}": "]"}, null],
+        "a/b": true, "m~n": -2.5e3, "esc\"aped": "yes", "s": "a\"b" }}"#;
+
+    fn get(p: &str) -> Option<&'static str> {
+        lookup_json_pointer(DOC, p).unwrap()
+    }
+
+    #[test]
+    fn found() {
+        assert_eq!(get(""), Some(DOC));
+        assert_eq!(get("/id"), Some("7"));
+        assert_eq!(get("/result/id"), Some(r#""obj-1""#));
+        assert_eq!(get("/result/list/0"), Some("1"));
+        assert_eq!(get("/result/list/1"), Some("[2, 3]"));
+        assert_eq!(get("/result/list/1/1"), Some("3"));
+        assert_eq!(get("/result/list/2/x}"), Some(r#""]""#));
+        assert_eq!(get("/result/list/3"), Some("null"));
+        assert_eq!(get("/result/a~1b"), Some("true"));
+        assert_eq!(get("/result/m~0n"), Some("-2.5e3"));
+        assert_eq!(get(r#"/result/esc"aped"#), Some(r#""yes""#));
+        assert_eq!(get("/result/s"), Some(r#""a\"b""#));
+
+        let result = get("/result").unwrap();
+        assert!(result.starts_with('{') && result.ends_with('}'));
+        let _: serde_json::Value = serde_json::from_str(result).unwrap();
+    }
+
+    #[test]
+    fn not_found() {
+        for p in [
+            "/ID",
+            "/update",
+            "/id/x",
+            "/result/list/4",
+            "/result/list/01",
+            "/result/list/-",
+            "/result/list/x",
+            "/result/nothing",
+            "/result/id/0",
+        ] {
+            assert_eq!(get(p), None, "{}", p);
+        }
+        assert_eq!(lookup_json_pointer("{}", "/x").unwrap(), None);
+        assert_eq!(lookup_json_pointer("[]", "/0").unwrap(), None);
+        assert_eq!(lookup_json_pointer(r#"{"x":"#, "/x").unwrap(), None);
+        assert_eq!(lookup_json_pointer(r#"{"x":[1,"#, "/x").unwrap(), None);
+    }
+
+    #[test]
+    fn bad_pointer() {
+        assert!(matches!(
+            lookup_json_pointer(DOC, "result"),
+            Err(InvalidJsonPointer::MissingSlash)
+        ));
+        assert!(matches!(
+            lookup_json_pointer(DOC, "/result/~2"),
+            Err(InvalidJsonPointer::BadEscape)
+        ));
+        assert!(matches!(
+            lookup_json_pointer(DOC, "/result/~"),
+            Err(InvalidJsonPointer::BadEscape)
+        ));
+    }
+}
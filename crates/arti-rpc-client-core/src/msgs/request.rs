@@ -8,7 +8,7 @@
 //!   with all of its fields present.
 //! - [`ValidatedRequest`] is for a string that we have validated as a request.
 
-use std::sync::Arc;
+use std::{borrow::Cow, sync::Arc, time::Duration};
 
 use serde::{Deserialize, Serialize};
 
@@ -81,7 +81,11 @@ struct ParsedRequestFields {
     /// The identifier for this request.
     ///
     /// Used to match a request with its responses.
-    id: AnyRequestId,
+    ///
+    /// This is None only if the request had no `id` at all:
+    /// an `id` of `null` is invalid.
+    #[serde(default, deserialize_with = "deserialize_present_id")]
+    id: Option<AnyRequestId>,
     /// The ID for the object to which this request is addressed.
     ///
     /// (Every request goes to a single object.)
@@ -95,65 +99,224 @@ struct ParsedRequestFields {
     params: JsonAnyObj,
 }
 
-/// A known-valid request, encoded as a string (in a single line, with a terminating newline).
-#[derive(derive_more::AsRef, Debug, Clone)]
-pub(crate) struct ValidatedRequest {
-    /// The message itself, as encoded.
-    #[as_ref]
-    msg: String,
+/// Serde helper: deserialize an `id` field that is present.
+///
+/// (Unlike the default for an `Option`, this rejects `null`.)
+fn deserialize_present_id<'de, D>(deserializer: D) -> Result<Option<AnyRequestId>, D::Error>
+where
+    D: serde::Deserializer<'de>,
+{
+    AnyRequestId::deserialize(deserializer).map(Some)
+}
+
+/// A known-valid request, ready to send.
+///
+/// We don't re-encode the application's request:
+/// we send its text as-is, after prepending an `id` to it if it had none.
+#[derive(Debug, Clone)]
+pub(crate) struct ValidatedRequest<'a> {
+    /// Text to send before `body`.
+    ///
+    /// This is empty unless we added an `id` to the request,
+    /// in which case it holds the request's opening brace and the new `id` field.
+    ///
+    /// (It is borrowed when the request came from a [`RequestBuilder`](super::builder::RequestBuilder),
+    /// which keeps a buffer for it.)
+    head: Cow<'a, str>,
+    /// The rest of the request, on a single line, without a terminating newline.
+    ///
+    /// This borrows the text that the application gave us,
+    /// unless that text spanned more than one line.
+    body: Cow<'a, str>,
     /// The ID for this request.
     id: AnyRequestId,
 }
 
-impl ValidatedRequest {
+impl<'a> ValidatedRequest<'a> {
     /// Return the Id associated with this request.
     pub(crate) fn id(&self) -> &AnyRequestId {
         &self.id
     }
 
-    /// Try to construct a validated request from a `serde_json::Value`.
-    fn from_json_value(val: serde_json::Value) -> Result<Self, InvalidRequestError> {
-        let mut msg = serde_json::to_string(&val)
-            .map_err(|e| InvalidRequestError::ReencodeFailed(Arc::new(e)))?;
-        debug_assert!(!msg.contains('\n'));
-        msg.push('\n');
+    /// Return the parts of this request, to be sent one after another.
+    ///
+    /// (The terminating newline is not included.)
+    pub(crate) fn parts(&self) -> [&[u8]; 2] {
+        [self.head.as_bytes(), self.body.as_bytes()]
+    }
 
-        let req: ParsedRequestFields = serde_json::from_value(val)
-            .map_err(|e| InvalidRequestError::InvalidFormat(Arc::new(e)))?;
-        let id = req.id;
+    /// Return the length of this request, not including the terminating newline.
+    pub(crate) fn len(&self) -> usize {
+        self.head.len() + self.body.len()
+    }
 
-        Ok(ValidatedRequest { id, msg })
+    /// Construct a request from parts that are already known to be valid.
+    ///
+    /// `head` must hold the request's opening brace and its `id` field (encoding `id`),
+    /// and `body` must hold the rest of the request, on a single line.
+    pub(crate) fn from_trusted_parts(
+        head: Cow<'a, str>,
+        body: Cow<'a, str>,
+        id: AnyRequestId,
+    ) -> Self {
+        debug_assert!(!head.contains('\n') && !body.contains('\n'));
+        ValidatedRequest { head, body, id }
     }
 
     /// Try to construct a validated request using `s`.
-    pub(crate) fn from_string_strict(s: &str) -> Result<Self, InvalidRequestError> {
-        let value: serde_json::Value =
-            serde_json::from_str(s).map_err(|e| InvalidRequestError::InvalidJson(Arc::new(e)))?;
-        Self::from_json_value(value)
+    ///
+    /// If it has no `id`, and `id_generator` is provided, add an `id` using `id_generator`.
+    fn validate<F>(s: &'a str, id_generator: Option<F>) -> Result<Self, InvalidRequestError>
+    where
+        F: FnOnce() -> AnyRequestId,
+    {
+        let fields: ParsedRequestFields = serde_json::from_str(s).map_err(parse_error)?;
+        // A struct will also deserialize from a JSON array,
+        // so make sure that we really have an object.
+        let s = s.trim();
+        let Some(after_brace) = s.strip_prefix('{') else {
+            return Err(InvalidRequestError::InvalidFormat(Arc::new(
+                serde::de::Error::custom("request was not a JSON object"),
+            )));
+        };
+
+        // A newline can't appear inside a valid JSON string (it must be escaped),
+        // so every newline here is whitespace, and can become a space.
+        let one_line = |s: &'a str| -> Cow<'a, str> {
+            if s.contains('\n') {
+                Cow::Owned(s.replace('\n', " "))
+            } else {
+                Cow::Borrowed(s)
+            }
+        };
+
+        match (fields.id, id_generator) {
+            (Some(id), _) => Ok(ValidatedRequest {
+                head: Cow::Borrowed(""),
+                body: one_line(s),
+                id,
+            }),
+            (None, Some(id_generator)) => {
+                // We know that the object has fields, so we can put ours first,
+                // followed by a comma.
+                let id = id_generator();
+                let encoded_id = serde_json::to_string(&id)
+                    .map_err(|e| InvalidRequestError::ReencodeFailed(Arc::new(e)))?;
+                Ok(ValidatedRequest {
+                    head: Cow::Owned(format!("{{\"id\":{encoded_id},")),
+                    body: one_line(after_brace),
+                    id,
+                })
+            }
+            (None, None) => Err(InvalidRequestError::InvalidFormat(Arc::new(
+                serde::de::Error::missing_field("id"),
+            ))),
+        }
+    }
+
+    /// Try to construct a validated request using `s`.
+    pub(crate) fn from_string_strict(s: &'a str) -> Result<Self, InvalidRequestError> {
+        Self::validate(s, None::<fn() -> AnyRequestId>)
     }
 
     /// Try to construct a ValidatedRequest from the string in `s`.
     ///
     /// If it has no `id`, add one using `id_generator`.
     pub(crate) fn from_string_loose<F>(
-        s: &str,
+        s: &'a str,
         id_generator: F,
     ) -> Result<Self, InvalidRequestError>
     where
         F: FnOnce() -> AnyRequestId,
     {
-        let mut value: serde_json::Value =
-            serde_json::from_str(s).map_err(|e| InvalidRequestError::InvalidJson(Arc::new(e)))?;
+        Self::validate(s, Some(id_generator))
+    }
 
-        if let Some(obj) = value.as_object_mut() {
-            obj.entry("id")
-                .or_insert_with(|| id_generator().into_json_value());
-        }
+    /// Return the text of this request, with a terminating newline.
+    #[cfg(test)]
+    pub(crate) fn text(&self) -> String {
+        format!("{}{}\n", self.head, self.body)
+    }
+}
 
-        Self::from_json_value(value)
+/// Helper: Convert an error from parsing a request into an [`InvalidRequestError`].
+fn parse_error(e: serde_json::Error) -> InvalidRequestError {
+    match e.classify() {
+        serde_json::error::Category::Data => InvalidRequestError::InvalidFormat(Arc::new(e)),
+        _ => InvalidRequestError::InvalidJson(Arc::new(e)),
     }
 }
 
+/// Return a copy of the request in `s`, with `timeout` recorded in its `meta` field.
+///
+/// (Arti cancels a request with a `timeout_ms` once that many milliseconds have passed.)
+///
+/// As with [`ValidatedRequest`], we don't re-encode the request:
+/// we splice the new field into the application's text,
+/// replacing any `timeout_ms` that was already there.
+pub(crate) fn with_timeout(s: &str, timeout: Duration) -> Result<String, InvalidRequestError> {
+    /// The only field of a request that we need to look at here.
+    ///
+    /// (Parsing into this also makes sure that the request is well-formed JSON.)
+    #[derive(Deserialize)]
+    struct MetaField {
+        /// The request's `meta`, if it has one.
+        #[serde(default)]
+        #[allow(dead_code)] // We only check that this parses; we find it again below.
+        meta: Option<serde::de::IgnoredAny>,
+    }
+    let not_object = |what: &'static str| {
+        InvalidRequestError::InvalidFormat(Arc::new(serde::de::Error::custom(what)))
+    };
+
+    let _: MetaField = serde_json::from_str(s).map_err(parse_error)?;
+    let s = s.trim();
+    let Some(after_brace) = s.strip_prefix('{') else {
+        return Err(not_object("request was not a JSON object"));
+    };
+    // (Round up, so that a tiny nonzero timeout doesn't become "no time at all".)
+    let ms = timeout.as_nanos().div_ceil(1_000_000);
+    let ms = u64::try_from(ms).unwrap_or(u64::MAX);
+
+    // Helper: Return the byte offset of `part`, a slice of `s`, within `s`.
+    let offset = |part: &str| part.as_ptr() as usize - s.as_ptr() as usize;
+    // Helper: Return the separator to put after a new first field, before `rest`.
+    let sep = |rest: &str| {
+        if rest.trim_start().starts_with('}') {
+            ""
+        } else {
+            ","
+        }
+    };
+
+    // These can't fail, since "/meta" and "/meta/timeout_ms" are well-formed pointers.
+    let lookup = |pointer| {
+        super::pointer::lookup_json_pointer(s, pointer)
+            .ok()
+            .flatten()
+    };
+    let Some(meta) = lookup("/meta") else {
+        return Ok(format!(
+            "{{\"meta\":{{\"timeout_ms\":{ms}}}{}{after_brace}",
+            sep(after_brace)
+        ));
+    };
+    let Some(after_meta_brace) = meta.strip_prefix('{') else {
+        return Err(not_object("request's meta was not a JSON object"));
+    };
+    if let Some(old) = lookup("/meta/timeout_ms") {
+        let start = offset(old);
+        return Ok(format!("{}{ms}{}", &s[..start], &s[start + old.len()..]));
+    }
+    let start = offset(after_meta_brace);
+    Ok(format!(
+        "{}\"timeout_ms\":{ms}{}{}",
+        &s[..start],
+        sep(after_meta_brace),
+        &s[start..]
+    ))
+}
+
 /// Crate-internal: The "meta" field in a request.
 #[derive(Deserialize, Serialize, Debug, Default)]
 #[cfg_attr(test, derive(Eq, PartialEq))]
@@ -175,6 +338,9 @@ pub(crate) struct RequestMeta {
 /// All identifiers are prefixed with `"!aut o!--"`:
 /// if you don't use that string in your own IDs,
 /// you won't have any collisions.
+///
+/// (An `RpcConn` prefers the IDs from its pending table, which are faster to look up,
+/// and only uses these once that table's slab is full.)
 #[derive(Debug, Default)]
 pub(crate) struct IdGenerator {
     /// The number
@@ -224,13 +390,13 @@ mod test {
     #[test]
     fn parse_requests() {
         let req1: ParsedRequestFields = serde_json::from_str(REQ1).unwrap();
-        assert_eq!(req1.id, 7.into());
+        assert_eq!(req1.id, Some(7.into()));
         assert_eq!(req1.obj.as_ref(), "hi");
         assert_eq!(req1.updates_requested(), true);
         assert_eq!(req1.method, "twiddle");
 
         let req2: ParsedRequestFields = serde_json::from_str(REQ2).unwrap();
-        assert_eq!(req2.id, "fred".to_string().into());
+        assert_eq!(req2.id, Some("fred".to_string().into()));
         assert_eq!(req2.obj.as_ref(), "hi");
         assert_eq!(req2.updates_requested(), false);
         assert_eq!(req2.method, "twiddle");
@@ -244,8 +410,10 @@ mod test {
             let val1 = ValidatedRequest::from_string_strict(r).unwrap();
             let val2 = ValidatedRequest::from_string_loose(r, || panic!()).unwrap();
 
-            assert_same_json!(val1.as_ref(), val2.as_ref());
-            assert_same_json!(val1.as_ref(), r);
+            assert_same_json!(&val1.text(), &val2.text());
+            assert_same_json!(&val1.text(), r);
+            // We send the application's own text.
+            assert_eq!(val1.text(), format!("{r}\n"));
         }
     }
 
@@ -268,8 +436,12 @@ mod test {
             r#"{"obj":"hi", "id": [], "method":"twiddle", "params":{"stuff":"nonsense"}}"#,
             // weird method
             r#"{"obj":"hi", "id": 7, "method":6", "params":{"stuff":"nonsense"}}"#,
+            // null id.
+            r#"{"obj":"hi", "id": null, "method":"twiddle", "params":{"stuff":"nonsense"}}"#,
+            // an array, not an object.
+            r#"[7, "hi", null, "twiddle", {}]"#,
         ] {
-            let r: Result<ParsedRequestFields, _> = serde_json::from_str(dbg!(text));
+            let r = ValidatedRequest::from_string_strict(dbg!(text));
             assert!(r.is_err());
         }
     }
@@ -280,7 +452,13 @@ mod test {
         let validated = ValidatedRequest::from_string_loose(no_id, || 7.into()).unwrap();
         let expected_with_id =
             r#"{"id": 7, "obj":"hi", "method":"twiddle", "params":{"stuff":"nonsense"}}"#;
-        assert_same_json!(validated.as_ref(), expected_with_id);
+        assert_same_json!(&validated.text(), expected_with_id);
+        assert_eq!(
+            validated.text(),
+            r#"{"id":7,"obj":"hi", "method":"twiddle", "params":{"stuff":"nonsense"}}"#.to_owned()
+                + "\n"
+        );
+        assert!(matches!(validated.body, Cow::Borrowed(_)));
     }
 
     #[test]
@@ -301,6 +479,61 @@ mod test {
             "params":{"stuff":"nonsense"},
             "explosions": -70
             }"#;
-        assert_same_json!(validated.as_ref(), expected_with_id);
+        assert_same_json!(&validated.text(), expected_with_id);
+        // Everything is on one line.
+        assert_eq!(validated.text().matches('\n').count(), 1);
+    }
+
+    #[test]
+    fn add_timeout() {
+        let orig = r#"{"obj":"hi", "meta": {"updates": true}, "method":"twiddle", "params":{}}"#;
+        let with = with_timeout(orig, Duration::from_micros(1500)).unwrap();
+        let expected = r#"{"obj":"hi", "meta": {"updates": true, "timeout_ms": 2}, "method":"twiddle", "params":{}}"#;
+        assert_same_json!(&with, expected);
+
+        let orig = r#"{"obj":"hi", "method":"twiddle", "params":{}}"#;
+        let with = with_timeout(orig, Duration::from_secs(3)).unwrap();
+        let expected =
+            r#"{"obj":"hi", "meta": {"timeout_ms": 3000}, "method":"twiddle", "params":{}}"#;
+        assert_same_json!(&with, expected);
+
+        // The rest of the application's text survives exactly,
+        // including numbers that wouldn't survive a trip through f64.
+        let orig = r#"{"obj":"hi","method":"x","params":{"n":123456789012345678901234567890}}"#;
+        assert_eq!(
+            with_timeout(orig, Duration::from_secs(1)).unwrap(),
+            r#"{"meta":{"timeout_ms":1000},"obj":"hi","method":"x","params":{"n":123456789012345678901234567890}}"#
+        );
+        let orig = r#"{"obj":"hi", "meta":{ }, "method":"x", "params":{}}"#;
+        assert_eq!(
+            with_timeout(orig, Duration::from_secs(1)).unwrap(),
+            r#"{"obj":"hi", "meta":{"timeout_ms":1000 }, "method":"x", "params":{}}"#
+        );
+        let orig = r#"{"obj":"hi", "meta":{"timeout_ms": 5, "x":1}, "method":"x", "params":{}}"#;
+        assert_eq!(
+            with_timeout(orig, Duration::from_secs(1)).unwrap(),
+            r#"{"obj":"hi", "meta":{"timeout_ms": 1000, "x":1}, "method":"x", "params":{}}"#
+        );
+        // A string that merely mentions a field doesn't confuse us.
+        let orig = r#"{"obj":"{\"meta\":{}}", "method":"x", "params":{"meta":{}}}"#;
+        let with = with_timeout(orig, Duration::from_secs(1)).unwrap();
+        let expected = r#"{"obj":"{\"meta\":{}}", "meta":{"timeout_ms":1000}, "method":"x", "params":{"meta":{}}}"#;
+        assert_same_json!(&with, expected);
+
+        // We can't add a timeout to a meta that isn't an object, or to a request that isn't one.
+        for bad in [
+            r#"{"obj":"hi", "meta": null, "method":"x", "params":{}}"#,
+            r#"{"obj":"hi", "meta": [], "method":"x", "params":{}}"#,
+            r#"[{"obj":"hi"}]"#,
+        ] {
+            assert!(matches!(
+                with_timeout(bad, Duration::from_secs(1)),
+                Err(InvalidRequestError::InvalidFormat(_))
+            ));
+        }
+        assert!(matches!(
+            with_timeout("{", Duration::from_secs(1)),
+            Err(InvalidRequestError::InvalidJson(_))
+        ));
     }
 }
@@ -27,12 +27,11 @@ impl UnparsedResponse {
 }
 
 /// A response that we have validated for correct syntax,
-/// re-encoded in canonical form,
-/// and enough to find the information we need about it
+/// and decoded enough to find the information we need about it
 /// to deliver it to the application.
 #[derive(Clone, Debug)]
 pub(crate) struct ValidatedResponse {
-    /// The re-encoded text of this response.
+    /// The text of this response, exactly as we received it.
     pub(crate) msg: Utf8CString,
     /// The metadata from this response.
     pub(crate) meta: ResponseMeta,
@@ -59,23 +58,25 @@ define_from_for_arc!( serde_json::Error => DecodeResponseError [JsonProtocolViol
 
 impl UnparsedResponse {
     /// If this response is well-formed, and it corresponds to a single request,
-    /// re-encode it and return it as a ValidatedResponse.
+    /// return it as a ValidatedResponse.
     pub(crate) fn try_validate(self) -> Result<ValidatedResponse, DecodeResponseError> {
-        // We're using serde_json::Value in order to preserve any unrecognized fields
-        // in the response when we re-encode it.
+        // We validate the response in a single streaming pass,
+        // without building a serde_json::Value or re-encoding it:
+        // `Response` only decodes the fields that we need in order to route the message,
+        // and skips over everything else.
         //
-        // The alternative would be to preserve unrecognized fields using serde(flatten) and a
-        // JsonMap in each struct.  But that creates a risk of forgetting to do so in some
-        // struct that we create in the future.
-        let json: serde_json::Value = serde_json::from_str(&self.msg)?;
-        let mut msg: String = serde_json::to_string(&json)?;
-        debug_assert!(!msg.contains('\n'));
-        msg.push('\n');
+        // Since a successful parse means that the text is well-formed JSON,
+        // we can deliver it to the application verbatim,
+        // preserving any fields that we don't recognize.
+        let response: Response = serde_json::from_str(&self.msg)?;
+        let mut msg = self.msg;
+        if !msg.ends_with('\n') {
+            msg.push('\n');
+        }
         let msg: Utf8CString = msg.try_into().map_err(|_| {
             // (This should be impossible; serde_json rejects NULs.)
             DecodeResponseError::ProtocolViolation("Unexpected NUL in validated message")
         })?;
-        let response: Response = serde_json::from_value(json)?;
         let meta = match ResponseMeta::try_from_response(&response) {
             Ok(m) => m?,
             Err(_) => {
@@ -129,32 +130,103 @@ pub(crate) enum ResponseKind {
 
 /// Serde-only type: decodes enough fields from a response in order to validate it
 /// and route it to the application.
-#[derive(Deserialize, Debug)]
+//
+// Note: We implement Deserialize by hand, rather than using `#[serde(flatten)]`
+// on `body`: with `flatten`, serde would buffer every field of the response
+// into an intermediate representation before decoding it.
+#[derive(Debug)]
 struct Response {
     /// The request ID for this response.
     ///
     /// This field is mandatory for any non-Error response.
     id: Option<AnyRequestId>,
     /// The body as decoded for this response.
-    #[serde(flatten)]
     body: ResponseBody,
 }
 
 /// Inner type to implement `Response``
-#[derive(Deserialize, Debug)]
+#[derive(Debug)]
 enum ResponseBody {
     /// Arti reports that an error has occurred.
     ///
     /// In this case, we decode the error to make sure it's well-formed.
-    #[serde(rename = "error")]
     Error(RpcError),
     /// Arti reports that the request completed successfully.
-    #[serde(rename = "result")]
     Success(JsonAnyObj),
     /// Arti reports an incremental update for the request.
-    #[serde(rename = "update")]
     Update(JsonAnyObj),
 }
+
+impl<'de> Deserialize<'de> for Response {
+    fn deserialize<D>(deserializer: D) -> Result<Self, D::Error>
+    where
+        D: serde::Deserializer<'de>,
+    {
+        use serde::de::Error as _;
+
+        /// The keys of a response object that we care about.
+        ///
+        /// (Decoding keys this way never allocates.)
+        #[derive(Deserialize)]
+        #[serde(field_identifier, rename_all = "lowercase")]
+        enum Field {
+            /// The `id` field.
+            Id,
+            /// The `error` field.
+            Error,
+            /// The `result` field.
+            Result,
+            /// The `update` field.
+            Update,
+            /// Some unrecognized field.
+            #[serde(other)]
+            Other,
+        }
+
+        /// Visitor to implement deserialize.
+        struct Vis;
+        impl<'de> serde::de::Visitor<'de> for Vis {
+            type Value = Response;
+            fn expecting(&self, formatter: &mut std::fmt::Formatter) -> std::fmt::Result {
+                formatter.write_str("an RPC response object")
+            }
+            fn visit_map<A>(self, mut map: A) -> Result<Self::Value, A::Error>
+            where
+                A: serde::de::MapAccess<'de>,
+            {
+                let mut id = None;
+                let mut body = None;
+                while let Some(key) = map.next_key::<Field>()? {
+                    let new_body = match key {
+                        Field::Id => {
+                            if id.is_some() {
+                                return Err(A::Error::duplicate_field("id"));
+                            }
+                            id = Some(map.next_value()?);
+                            continue;
+                        }
+                        Field::Error => ResponseBody::Error(map.next_value()?),
+                        Field::Result => ResponseBody::Success(map.next_value()?),
+                        Field::Update => ResponseBody::Update(map.next_value()?),
+                        Field::Other => {
+                            let _: serde::de::IgnoredAny = map.next_value()?;
+                            continue;
+                        }
+                    };
+                    if body.replace(new_body).is_some() {
+                        return Err(A::Error::custom("multiple response bodies"));
+                    }
+                }
+                let body = body.ok_or_else(|| {
+                    A::Error::custom("expected one of `error`, `result`, or `update`")
+                })?;
+                Ok(Response { id, body })
+            }
+        }
+
+        deserializer.deserialize_map(Vis)
+    }
+}
 impl<'a> From<&'a ResponseBody> for ResponseKind {
     fn from(value: &'a ResponseBody) -> Self {
         use ResponseBody as RMB;
@@ -404,4 +476,24 @@ mod test {
         // we cannot rely on the order of the fields.
         assert_eq!(json_orig, json_reencoded);
     }
+
+    #[test]
+    fn verbatim() {
+        // We deliver responses exactly as we received them.
+        let response = r#"{"xyzzy":"plugh",  "id":"x\u0079", "result":{"b":1,"a":[2]}}"#;
+        let valid = UnparsedResponse::new(format!("{response}\n"))
+            .try_validate()
+            .unwrap();
+        let msg: &str = valid.msg.as_ref();
+        assert_eq!(msg.strip_suffix('\n').unwrap(), response);
+        assert_eq!(valid.id(), &AnyRequestId::from("xy".to_string()));
+        assert_eq!(valid.meta.kind, ResponseKind::Success);
+
+        // More than one body is an error.
+        let bad = UnparsedResponse::new(r#"{"id":7, "result":{}, "update":{}}"#.into());
+        assert!(matches!(
+            bad.try_validate(),
+            Err(DecodeResponseError::JsonProtocolViolation(_))
+        ));
+    }
 }
@@ -33,6 +33,10 @@ pub struct Utf8CString {
     /// (We do not _yet_ depend on this invariant for safety in our rust code, but we do promise in
     /// our C ffi that it will hold.)
     string: Box<CStr>,
+    /// The length of `string` in bytes, not including the terminating nul.
+    ///
+    /// We store this because `CStr::to_bytes` is not guaranteed to take constant time.
+    len: usize,
 }
 
 impl AsRef<CStr> for Utf8CString {
@@ -57,8 +61,10 @@ impl TryFrom<String> for Utf8CString {
 
     fn try_from(value: String) -> Result<Self, Self::Error> {
         // Safety: Since `value` is a `String`, it is guaranteed to be UTF-8.
+        let len = value.len();
         Ok(Utf8CString {
             string: CString::new(value)?.into_boxed_c_str(),
+            len,
         })
     }
 }
@@ -82,6 +88,11 @@ enum Utf8CStringFromBytesError {
 }
 
 impl Utf8CString {
+    /// Return the length of this string in bytes, not including the terminating nul.
+    pub(crate) fn len(&self) -> usize {
+        self.len
+    }
+
     /// Try to construct a new `Utf8CString` from a given byte slice.
     fn try_from_bytes(bytes: &[u8]) -> Result<Self, Utf8CStringFromBytesError> {
         let s: &str = std::str::from_utf8(bytes)?;
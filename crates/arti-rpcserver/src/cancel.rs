@@ -64,7 +64,6 @@ impl<F> Cancel<F> {
 
 impl CancelHandle {
     /// Cancel the associated future, if it has not already finished.
-    #[allow(dead_code)] // TODO RPC
     pub(crate) fn cancel(&self) {
         let mut inner = self.inner.lock().expect("poisoned lock");
         inner.cancelled = true;
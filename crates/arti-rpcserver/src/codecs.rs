@@ -1,13 +1,176 @@
 //! Helper types for framing Json objects into async read/writes
+//!
+//! Every connection starts out with newline-terminated Json objects,
+//! but a client can ask to switch to length-prefixed Json objects
+//! when it authenticates.  (See [`Framing`].)
 
 use std::marker::PhantomData;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
 
-use asynchronous_codec::JsonCodec;
-use bytes::BytesMut;
+use asynchronous_codec::{JsonCodec, JsonCodecError};
+use bytes::{Buf as _, BufMut as _, BytesMut};
 use serde::Serialize;
 
 use crate::msgs::BoxedResponse;
 use crate::msgs::FlexibleRequest;
+use crate::msgs::RequestId;
+
+/// A way of separating messages from one another on an RPC connection.
+#[derive(Clone, Copy, Debug, Default, Eq, PartialEq, serde::Serialize, serde::Deserialize)]
+pub(crate) enum Framing {
+    /// Each message is a Json object terminated by a newline.
+    ///
+    /// (When decoding, we don't actually require the newline.)
+    #[default]
+    #[serde(rename = "jsonlines")]
+    JsonLines,
+    /// Each message is a Json object preceded by its length in bytes,
+    /// as a 4-byte big-endian integer.
+    #[serde(rename = "length-prefixed")]
+    LengthPrefixed,
+}
+
+/// The length of the length prefix on each message, under [`Framing::LengthPrefixed`].
+const LENGTH_PREFIX_LEN: usize = 4;
+
+/// The largest request that we will accept under [`Framing::LengthPrefixed`].
+///
+/// (Without a limit, a client could make us buffer up to 4 GiB.)
+const MAX_REQUEST_LEN: usize = 1 << 24;
+
+/// The most space that we reserve at a time while waiting for the rest of a request.
+///
+/// We don't trust a request's length prefix enough to reserve all of it up front,
+/// or a client could make us allocate [`MAX_REQUEST_LEN`] per connection just by claiming it.
+const MAX_RESERVE_CHUNK: usize = 1 << 16;
+
+/// Shared state that lets an RPC connection change its framing partway through.
+///
+/// A method (in practice, `auth:authenticate`) calls [`request`](Self::request)
+/// to ask for a new framing.  When that method succeeds, its connection calls
+/// [`note_finished`](Self::note_finished), and once the final
+/// response to that method has been encoded, our decoder and encoder both switch
+/// to the new framing.
+///
+/// This is safe because the client must not send anything in the new framing
+/// until it has received that response.
+#[derive(Debug, Default)]
+pub(crate) struct FramingSwitch {
+    /// True if we are currently using [`Framing::LengthPrefixed`].
+    length_prefixed: AtomicBool,
+    /// The pending change of framing, if any.
+    pending: Mutex<PendingSwitch>,
+}
+
+/// A change of framing that has not yet taken effect.
+#[derive(Debug, Default)]
+struct PendingSwitch {
+    /// A framing requested by a method that has not yet finished.
+    requested: Option<Framing>,
+    /// A framing to switch to once we have encoded the final response with this ID.
+    after: Option<(RequestId, Framing)>,
+}
+
+impl FramingSwitch {
+    /// Return the framing that we are currently using.
+    fn current(&self) -> Framing {
+        if self.length_prefixed.load(Ordering::Acquire) {
+            Framing::LengthPrefixed
+        } else {
+            Framing::JsonLines
+        }
+    }
+
+    /// Ask to switch to `framing` once the currently running method has sent its response.
+    ///
+    /// The caller must not await anything between calling this function and returning
+    /// its final response, so that no other method can finish in between.
+    pub(crate) fn request(&self, framing: Framing) {
+        self.pending.lock().expect("lock poisoned").requested = Some(framing);
+    }
+
+    /// Note that the method with ID `id` has finished.
+    ///
+    /// If it requested a new framing and `succeeded`, arrange to switch
+    /// once its final response has been encoded.
+    pub(crate) fn note_finished(&self, id: &RequestId, succeeded: bool) {
+        let mut pending = self.pending.lock().expect("lock poisoned");
+        if let Some(framing) = pending.requested.take() {
+            if succeeded && framing != self.current() {
+                pending.after = Some((id.clone(), framing));
+            }
+        }
+    }
+
+    /// Note that we have just encoded `response`; switch framing if we were waiting for it.
+    fn note_encoded(&self, response: &BoxedResponse) {
+        if !response.body.is_final() {
+            return;
+        }
+        let mut pending = self.pending.lock().expect("lock poisoned");
+        let Some((id, framing)) = &pending.after else {
+            return;
+        };
+        if response.id.as_ref() == Some(id) {
+            self.length_prefixed
+                .store(*framing == Framing::LengthPrefixed, Ordering::Release);
+            pending.after = None;
+        }
+    }
+}
+
+/// A decoder for [`FlexibleRequest`]s, in whatever framing our [`FramingSwitch`] says.
+pub(crate) struct RequestDecoder {
+    /// The decoder we use for [`Framing::JsonLines`].
+    json: JsonCodec<(), FlexibleRequest>,
+    /// Tells us which framing to use.
+    switch: std::sync::Arc<FramingSwitch>,
+}
+
+impl RequestDecoder {
+    /// Construct a new decoder, using the framing from `switch`.
+    pub(crate) fn new(switch: std::sync::Arc<FramingSwitch>) -> Self {
+        Self {
+            json: JsonCodec::new(),
+            switch,
+        }
+    }
+}
+
+impl asynchronous_codec::Decoder for RequestDecoder {
+    type Item = FlexibleRequest;
+
+    type Error = JsonCodecError;
+
+    fn decode(&mut self, src: &mut BytesMut) -> Result<Option<Self::Item>, Self::Error> {
+        match self.switch.current() {
+            Framing::JsonLines => self.json.decode(src),
+            Framing::LengthPrefixed => {
+                let Some(prefix) = src.get(..LENGTH_PREFIX_LEN) else {
+                    return Ok(None);
+                };
+                let prefix: [u8; LENGTH_PREFIX_LEN] =
+                    prefix.try_into().expect("slice had the wrong length");
+                let len = u32::from_be_bytes(prefix) as usize;
+                if len > MAX_REQUEST_LEN {
+                    return Err(std::io::Error::new(
+                        std::io::ErrorKind::InvalidData,
+                        "RPC request too long",
+                    )
+                    .into());
+                }
+                if src.len() < LENGTH_PREFIX_LEN + len {
+                    src.reserve((LENGTH_PREFIX_LEN + len - src.len()).min(MAX_RESERVE_CHUNK));
+                    return Ok(None);
+                }
+                src.advance(LENGTH_PREFIX_LEN);
+                let body = src.split_to(len);
+                Ok(Some(serde_json::from_slice(&body)?))
+            }
+        }
+    }
+}
 
 /// A stream of [`Request`](crate::msgs::Request)
 /// taken from `T` (an `AsyncRead`) and deserialized from Json.
@@ -40,13 +203,52 @@ where
     type Error = asynchronous_codec::JsonCodecError;
 
     fn encode(&mut self, item: Self::Item<'_>, dst: &mut BytesMut) -> Result<(), Self::Error> {
-        use std::fmt::Write as _;
-        let j = serde_json::to_string(&item)?;
-        // The jsonlines format won't work if serde_json starts adding newlines in the middle.
-        debug_assert!(!j.contains('\n'));
-        writeln!(dst, "{}", j).expect("write! of string on BytesMut failed");
-        Ok(())
+        encode_json_line(&item, dst)
+    }
+}
+
+/// Serialize `item` onto the end of `dst` as Json, followed by a newline.
+///
+/// We serialize directly into `dst`, so that encoding a response doesn't need
+/// an allocation of its own.  On error, `dst` is left as it was.
+fn encode_json_line<T: Serialize + ?Sized>(
+    item: &T,
+    dst: &mut BytesMut,
+) -> Result<(), JsonCodecError> {
+    let start = dst.len();
+    if let Err(e) = serde_json::to_writer((&mut *dst).writer(), item) {
+        dst.truncate(start);
+        return Err(e.into());
     }
+    // The jsonlines format won't work if serde_json starts adding newlines in the middle.
+    debug_assert!(!dst[start..].contains(&b'\n'));
+    dst.put_u8(b'\n');
+    Ok(())
+}
+
+/// Serialize `item` onto the end of `dst` as Json, preceded by its length.
+///
+/// As with [`encode_json_line`], we serialize directly into `dst`,
+/// and fill in the length prefix afterwards.  On error, `dst` is left as it was.
+fn encode_length_prefixed<T: Serialize + ?Sized>(
+    item: &T,
+    dst: &mut BytesMut,
+) -> Result<(), JsonCodecError> {
+    let start = dst.len();
+    dst.put_u32(0);
+    if let Err(e) = serde_json::to_writer((&mut *dst).writer(), item) {
+        dst.truncate(start);
+        return Err(e.into());
+    }
+    let body_len = dst.len() - start - LENGTH_PREFIX_LEN;
+    let Ok(len) = u32::try_from(body_len) else {
+        dst.truncate(start);
+        return Err(
+            std::io::Error::new(std::io::ErrorKind::InvalidData, "RPC response too long").into(),
+        );
+    };
+    dst[start..start + LENGTH_PREFIX_LEN].copy_from_slice(&len.to_be_bytes());
+    Ok(())
 }
 
 /// A stream of [`BoxedResponse`] serialized as newline-terminated json objects
@@ -55,6 +257,37 @@ where
 pub(crate) type ResponseSink<T> =
     asynchronous_codec::FramedWrite<T, JsonLinesEncoder<BoxedResponse>>;
 
+/// An encoder for [`BoxedResponse`]s, in whatever framing our [`FramingSwitch`] says.
+///
+/// This is also where we tell the `FramingSwitch` that a response has been encoded,
+/// so that a change of framing takes effect right after the response that announced it.
+pub(crate) struct ResponseEncoder {
+    /// Tells us which framing to use.
+    switch: std::sync::Arc<FramingSwitch>,
+}
+
+impl ResponseEncoder {
+    /// Construct a new encoder, using the framing from `switch`.
+    pub(crate) fn new(switch: std::sync::Arc<FramingSwitch>) -> Self {
+        Self { switch }
+    }
+}
+
+impl asynchronous_codec::Encoder for ResponseEncoder {
+    type Item<'a> = BoxedResponse;
+
+    type Error = JsonCodecError;
+
+    fn encode(&mut self, item: Self::Item<'_>, dst: &mut BytesMut) -> Result<(), Self::Error> {
+        match self.switch.current() {
+            Framing::JsonLines => encode_json_line(&item, dst)?,
+            Framing::LengthPrefixed => encode_length_prefixed(&item, dst)?,
+        }
+        self.switch.note_encoded(&item);
+        Ok(())
+    }
+}
+
 #[cfg(test)]
 mod test {
     // @@ begin test lint list maintained by maint/add_warning @@
@@ -119,4 +352,100 @@ mod test {
         // Make sure that the output is what we expected.
         assert_eq!(std::str::from_utf8(&buf).unwrap(), &expect);
     }
+
+    #[test]
+    fn encode_failure() {
+        // A response that can't be serialized leaves no partial output behind.
+        struct Unserializable;
+        impl serde::Serialize for Unserializable {
+            fn serialize<S: serde::Serializer>(&self, _: S) -> Result<S::Ok, S::Error> {
+                Err(serde::ser::Error::custom("nope"))
+            }
+        }
+
+        let mut dst = BytesMut::from(&b"{}\n"[..]);
+        assert!(encode_json_line(&Unserializable, &mut dst).is_err());
+        assert!(encode_length_prefixed(&Unserializable, &mut dst).is_err());
+        assert_eq!(&dst[..], b"{}\n");
+    }
+
+    #[test]
+    fn switch_framing() {
+        use asynchronous_codec::{Decoder as _, Encoder as _};
+        use std::sync::Arc;
+
+        let switch = Arc::new(FramingSwitch::default());
+        let mut dec = RequestDecoder::new(switch.clone());
+        let mut enc = ResponseEncoder::new(switch.clone());
+        let req = r#"{"id":3,"obj":"x","method":"auth:authenticate","params":{}}"#;
+
+        let mut src = BytesMut::from(format!("{}\n", req).as_str());
+        assert!(matches!(
+            dec.decode(&mut src),
+            Ok(Some(FlexibleRequest::Valid(_)))
+        ));
+
+        // A change is scheduled by a successful method, but only takes effect
+        // once that method's final response has been encoded.
+        switch.request(Framing::LengthPrefixed);
+        switch.note_finished(&RequestId::Int(3), true);
+        assert_eq!(switch.current(), Framing::JsonLines);
+        let mut dst = BytesMut::new();
+        let update = BoxedResponse {
+            id: Some(RequestId::Int(3)),
+            body: ResponseBody::Update(Box::new(Empty {})),
+        };
+        enc.encode(update, &mut dst).unwrap();
+        assert_eq!(switch.current(), Framing::JsonLines);
+        let done = BoxedResponse {
+            id: Some(RequestId::Int(3)),
+            body: ResponseBody::Success(Box::new(Empty {})),
+        };
+        enc.encode(done, &mut dst).unwrap();
+        assert_eq!(switch.current(), Framing::LengthPrefixed);
+        assert_eq!(
+            std::str::from_utf8(&dst).unwrap(),
+            "{\"id\":3,\"update\":{}}\n{\"id\":3,\"result\":{}}\n"
+        );
+
+        // Now everything is length-prefixed.
+        let mut dst = BytesMut::new();
+        let r = BoxedResponse {
+            id: Some(RequestId::Int(4)),
+            body: ResponseBody::Success(Box::new(Empty {})),
+        };
+        enc.encode(r, &mut dst).unwrap();
+        assert_eq!(&dst[..], b"\x00\x00\x00\x14{\"id\":4,\"result\":{}}");
+
+        let mut src = BytesMut::new();
+        src.extend_from_slice(&(req.len() as u32).to_be_bytes());
+        src.extend_from_slice(&req.as_bytes()[..10]);
+        assert!(matches!(dec.decode(&mut src), Ok(None)));
+        src.extend_from_slice(&req.as_bytes()[10..]);
+        assert!(matches!(
+            dec.decode(&mut src),
+            Ok(Some(FlexibleRequest::Valid(_)))
+        ));
+        assert!(src.is_empty());
+
+        // A large length prefix alone doesn't make us reserve space for all of it.
+        let mut src = BytesMut::new();
+        src.extend_from_slice(&(MAX_REQUEST_LEN as u32).to_be_bytes());
+        assert!(matches!(dec.decode(&mut src), Ok(None)));
+        assert!(src.capacity() < MAX_RESERVE_CHUNK * 2);
+
+        // Overlong requests are rejected.
+        let mut src = BytesMut::from(&b"\xff\xff\xff\xff{}"[..]);
+        assert!(dec.decode(&mut src).is_err());
+
+        // A failed method doesn't change anything.
+        switch.request(Framing::JsonLines);
+        switch.note_finished(&RequestId::Int(5), false);
+        let r = BoxedResponse {
+            id: Some(RequestId::Int(5)),
+            body: ResponseBody::Success(Box::new(Empty {})),
+        };
+        enc.encode(r, &mut BytesMut::new()).unwrap();
+        assert_eq!(switch.current(), Framing::LengthPrefixed);
+    }
 }
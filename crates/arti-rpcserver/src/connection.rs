@@ -1,18 +1,25 @@
 //! RPC connection support, mainloop, and protocol implementation.
 
 pub(crate) mod auth;
+mod methods;
+mod updates;
 
 use std::{
     collections::HashMap,
     io::Error as IoError,
-    pin::Pin,
-    sync::{Arc, Mutex, RwLock, Weak},
+    pin::{pin, Pin},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex, OnceLock, RwLock, Weak,
+    },
+    time::Duration,
 };
 
 use asynchronous_codec::JsonCodecError;
 use derive_deftly::Deftly;
 use futures::{
     channel::mpsc,
+    future::{Either, Fuse, Ready},
     stream::{FusedStream, FuturesUnordered},
     FutureExt, Sink, SinkExt as _, StreamExt,
 };
@@ -20,10 +27,14 @@ use rpc::dispatch::BoxedUpdateSink;
 use serde_json::error::Category as JsonErrorCategory;
 use tor_async_utils::{mpsc_channel_no_memquota, SinkExt as _};
 
+#[cfg(unix)]
+use crate::PendingFds;
 use crate::{
     cancel::{Cancel, CancelHandle},
+    codecs::{FramingSwitch, RequestDecoder, ResponseEncoder},
     err::RequestParseError,
     globalid::{GlobalId, MacKey},
+    mgr::SleepFuture,
     msgs::{BoxedResponse, FlexibleRequest, ReqMeta, Request, RequestId, ResponseBody},
     objmap::{GenIdx, ObjMap},
     RpcMgr,
@@ -78,6 +89,20 @@ pub struct Connection {
 
     /// A reference to the manager associated with this session.
     mgr: Weak<RpcMgr>,
+
+    /// The framing that we're using on this connection, and any pending change to it.
+    framing: Arc<FramingSwitch>,
+
+    /// True if this connection was set up with [`Connection::run_inproc`],
+    /// and so comes from code in our own process.
+    inproc: AtomicBool,
+
+    /// Where methods put file descriptors to send to our client,
+    /// if whatever writes our responses can send them.
+    ///
+    /// Set by [`Connection::set_pending_fds`].
+    #[cfg(unix)]
+    pending_fds: OnceLock<Arc<PendingFds>>,
 }
 
 /// The inner, lock-protected part of an RPC connection.
@@ -104,6 +129,76 @@ struct Inner {
 /// How many updates can be pending, per connection, before they start to block?
 const UPDATE_CHAN_SIZE: usize = 128;
 
+/// Tracks the responses that [`Connection::run_loop`] has written to its sink
+/// but not yet flushed.
+struct UnflushedResponses {
+    /// True if we have written any responses since we last flushed.
+    pending: bool,
+    /// The longest that we may hold a response before flushing it.
+    ///
+    /// If this is zero, we flush every response as soon as we write it.
+    max_delay: Duration,
+    /// The manager for our connection, which we use to wait for `max_delay`.
+    mgr: Weak<RpcMgr>,
+    /// A timer that expires once we have held our oldest unflushed response for `max_delay`.
+    ///
+    /// Terminated if there is no such response, or if we have no way to sleep.
+    deadline: Fuse<SleepFuture>,
+}
+
+impl UnflushedResponses {
+    /// Construct a new `UnflushedResponses`, using the settings from `mgr`.
+    fn new(mgr: &Weak<RpcMgr>) -> Self {
+        let max_delay = mgr
+            .upgrade()
+            .map_or(Duration::ZERO, |mgr| mgr.max_response_delay());
+        Self {
+            pending: false,
+            max_delay,
+            mgr: Weak::clone(mgr),
+            deadline: Fuse::terminated(),
+        }
+    }
+
+    /// Write `response` to `sink`, flushing it at once only if we can't hold it.
+    async fn send(
+        &mut self,
+        sink: &mut BoxedResponseSink,
+        response: BoxedResponse,
+    ) -> Result<(), ConnectionError> {
+        if self.max_delay.is_zero() {
+            return sink.send(response).await.map_err(ConnectionError::writing);
+        }
+        sink.feed(response)
+            .await
+            .map_err(ConnectionError::writing)?;
+        if !self.pending {
+            self.pending = true;
+            if let Some(sleep) = self.mgr.upgrade().and_then(|mgr| mgr.sleep(self.max_delay)) {
+                self.deadline = sleep.fuse();
+            }
+        }
+        Ok(())
+    }
+
+    /// Flush every response that we have written to `sink`.
+    async fn flush(&mut self, sink: &mut BoxedResponseSink) -> Result<(), ConnectionError> {
+        self.pending = false;
+        self.deadline = Fuse::terminated();
+        sink.flush().await.map_err(ConnectionError::writing)
+    }
+
+    /// Return a future that is ready at once if we have anything to flush,
+    /// and that is never ready otherwise.
+    fn if_pending(&self) -> Fuse<Ready<()>> {
+        if self.pending {
+            futures::future::ready(()).fuse()
+        } else {
+            Fuse::terminated()
+        }
+    }
+}
+
 /// A type-erased [`FusedStream`] yielding [`Request`]s.
 //
 // (We name this type and [`BoxedResponseSink`] below so as to keep the signature for run_loop
@@ -163,9 +258,40 @@ impl Connection {
             connection_id,
             global_id_mac_key,
             mgr,
+            framing: Arc::new(FramingSwitch::default()),
+            inproc: AtomicBool::new(false),
+            #[cfg(unix)]
+            pending_fds: OnceLock::new(),
         })
     }
 
+    /// Note that this connection's client is in our own process.
+    pub(crate) fn set_inproc(&self) {
+        self.inproc.store(true, Ordering::Release);
+    }
+
+    /// Return true if this connection's client is in our own process.
+    pub(crate) fn is_inproc(&self) -> bool {
+        self.inproc.load(Ordering::Acquire)
+    }
+
+    /// Tell this connection that whatever writes its responses
+    /// also sends its client the file descriptors that are pushed onto `fds`.
+    ///
+    /// Methods can then use [`Connection::pending_fds`] to send descriptors to the client.
+    /// Only the first call has any effect.
+    #[cfg(unix)]
+    pub fn set_pending_fds(&self, fds: Arc<PendingFds>) {
+        let _ignore_already_set = self.pending_fds.set(fds);
+    }
+
+    /// Return the place to put file descriptors for this connection's client,
+    /// or None if this connection can't send them.
+    #[cfg(unix)]
+    pub fn pending_fds(&self) -> Option<&Arc<PendingFds>> {
+        self.pending_fds.get()
+    }
+
     /// If possible, convert an `ObjectId` into a `GenIdx` that can be used in
     /// this connection's ObjMap.
     fn id_into_local_idx(&self, id: &rpc::ObjectId) -> Result<GenIdx, rpc::LookupError> {
@@ -256,13 +382,13 @@ impl Connection {
     {
         let write = Box::pin(asynchronous_codec::FramedWrite::new(
             output,
-            crate::codecs::JsonLinesEncoder::<BoxedResponse>::default(),
+            ResponseEncoder::new(Arc::clone(&self.framing)),
         ));
 
         let read = Box::pin(
             asynchronous_codec::FramedRead::new(
                 input,
-                asynchronous_codec::JsonCodec::<(), FlexibleRequest>::new(),
+                RequestDecoder::new(Arc::clone(&self.framing)),
             )
             .fuse(),
         );
@@ -289,6 +415,11 @@ impl Connection {
         //
         // Note that the blocking behavior here is deliberate: We want _all_ of
         // these reads to start blocking when response_sink.send is blocked.
+        //
+        // We don't flush after every response.  Instead, we check these streams
+        // in order, and flush only once none of them is ready, so that responses
+        // which are ready together reach the client in a single write.
+        // While we stay busy, we still flush at least once every `max_response_delay`.
 
         // TODO RPC should this queue participate in memquota?
         let (tx_response, mut rx_response) =
@@ -297,6 +428,8 @@ impl Connection {
         let mut finished_requests = FuturesUnordered::new();
         finished_requests.push(futures::future::pending().boxed());
 
+        let mut unflushed = UnflushedResponses::new(&self.mgr);
+
         /// Helper: enforce an explicit "continue".
         struct Continue;
 
@@ -304,23 +437,29 @@ impl Connection {
         // so that any internal `returns` and `?`s do not escape the function.
         let outcome = async {
             loop {
-                let _: Continue = futures::select! {
-                    r = finished_requests.next() => {
-                        // A task is done, so we can forget about it.
-                        let () = r.expect("Somehow, future::pending() terminated.");
+                let mut flush_if_idle = unflushed.if_pending();
+                let _: Continue = futures::select_biased! {
+                    () = &mut unflushed.deadline => {
+                        // We have held a response for as long as we may.
+                        unflushed.flush(&mut response_sink).await?;
                         Continue
                     }
 
                     r = rx_response.next() => {
                         // The future for some request has sent a response (success,
                         // failure, or update), so we can inform the client.
-                        let update = r.expect("Somehow, tx_update got closed.");
-                        debug_assert!(! update.body.is_final());
+                        let response = r.expect("Somehow, tx_update got closed.");
                         // Calling `await` here (and below) is deliberate: we _want_
                         // to stop reading the client's requests if the client is
                         // not reading their responses (or not) reading them fast
                         // enough.
-                        response_sink.send(update).await.map_err(ConnectionError::writing)?;
+                        unflushed.send(&mut response_sink, response).await?;
+                        Continue
+                    }
+
+                    r = finished_requests.next() => {
+                        // A task is done, so we can forget about it.
+                        let () = r.expect("Somehow, future::pending() terminated.");
                         Continue
                     }
 
@@ -342,10 +481,7 @@ impl Connection {
                                 let response = BoxedResponse::from_error(
                                     bad_req.id().cloned(), bad_req.error()
                                 );
-                                response_sink
-                                    .send(response)
-                                    .await
-                                    .map_err( ConnectionError::writing)?;
+                                unflushed.send(&mut response_sink, response).await?;
                                 if bad_req.id().is_none() {
                                     // The spec says we must close the connection in this case.
                                     return Err(bad_req.error().into());
@@ -362,11 +498,24 @@ impl Connection {
                             }
                         }
                     }
+
+                    () = flush_if_idle => {
+                        // Nothing else is ready, so this is a good time to flush.
+                        unflushed.flush(&mut response_sink).await?;
+                        Continue
+                    }
                 };
             }
         }
         .await;
 
+        // Don't drop any responses that we have written but not yet flushed.
+        // (This matters when the client has closed its side of the connection,
+        // or sent a request that makes us close it.)
+        if unflushed.pending {
+            let _ignore_err = response_sink.flush().await;
+        }
+
         match outcome {
             Err(e) if e.is_connection_close() => Ok(()),
             other => other,
@@ -386,7 +535,25 @@ impl Connection {
             method,
         } = request;
 
-        let update_sender: BoxedUpdateSink = if meta.updates {
+        // If the client asked us to thin out this request's updates,
+        // the method sends them to a `LatestSink`, and we forward them from there.
+        let update_filter = meta
+            .update_filter
+            .as_ref()
+            .filter(|filter| meta.updates && !filter.is_trivial());
+        let mut forward_updates = None;
+
+        let update_sender: BoxedUpdateSink = if let Some(filter) = update_filter {
+            let (sink, stream) = updates::latest_only();
+            forward_updates = Some(updates::forward_updates(
+                stream,
+                id.clone(),
+                filter.min_interval(),
+                Weak::clone(&self.mgr),
+                tx_response.clone(),
+            ));
+            Box::pin(sink)
+        } else if meta.updates {
             let id_clone = id.clone();
             let sink =
                 tx_response
@@ -403,16 +570,40 @@ impl Connection {
             Box::pin(sink)
         };
 
+        // If the client gave us a deadline, and we know how to sleep, prepare to enforce it.
+        let timeout = meta
+            .timeout_ms
+            .map(Duration::from_millis)
+            .and_then(|d| self.mgr.upgrade()?.sleep(d));
+
         // Create `run_method_lowlevel` future, and make it cancellable.
         let fut = self.run_method_lowlevel(update_sender, obj, method, meta);
         let (handle, fut) = Cancel::new(fut);
         self.register_request(id.clone(), handle);
 
-        // Run the cancellable future to completion, and figure out how to respond.
-        let body = match fut.await {
-            Ok(Ok(value)) => ResponseBody::Success(value),
+        // Run the cancellable future to completion (or until it times out).
+        let outcome = async {
+            match timeout {
+                Some(timeout) => match futures::future::select(pin!(fut), timeout).await {
+                    Either::Left((outcome, _)) => Some(outcome),
+                    // Dropping the method's future here stops it from running any further.
+                    Either::Right(((), _)) => None,
+                },
+                None => Some(fut.await),
+            }
+        };
+        // If we are forwarding updates, keep doing so until the method is done
+        // and its last update is queued, so that its final response comes after them.
+        let (outcome, _) = futures::join!(
+            outcome,
+            futures::future::OptionFuture::from(forward_updates)
+        );
+
+        // Figure out how to respond.
+        let body = match outcome {
+            Some(Ok(Ok(value))) => ResponseBody::Success(value),
             // TODO: If we're going to box this, let's do so earlier.
-            Ok(Err(err)) => {
+            Some(Ok(Err(err))) => {
                 if err.is_internal() {
                     tracing::warn!(
                         "Reporting an internal error on an RPC connection: {:?}",
@@ -421,9 +612,17 @@ impl Connection {
                 }
                 ResponseBody::Error(Box::new(err))
             }
-            Err(_cancelled) => ResponseBody::Error(Box::new(rpc::RpcError::from(RequestCancelled))),
+            Some(Err(_cancelled)) => {
+                ResponseBody::Error(Box::new(rpc::RpcError::from(RequestCancelled)))
+            }
+            None => ResponseBody::Error(Box::new(rpc::RpcError::from(RequestTimedOut))),
         };
 
+        // If this method asked to change our framing, the change takes effect
+        // right after this response (but only if the method succeeded).
+        self.framing
+            .note_finished(&id, matches!(body, ResponseBody::Success(_)));
+
         // Send the response.
         //
         // (It's okay to ignore the error here, since it can only mean that the
@@ -664,3 +863,13 @@ impl tor_error::HasKind for RequestCancelled {
         tor_error::ErrorKind::Other
     }
 }
+
+/// A request took longer than the `timeout_ms` that the client gave it.
+#[derive(thiserror::Error, Clone, Debug, serde::Serialize)]
+#[error("RPC request timed out")]
+pub(crate) struct RequestTimedOut;
+impl tor_error::HasKind for RequestTimedOut {
+    fn kind(&self) -> tor_error::ErrorKind {
+        tor_error::ErrorKind::Other
+    }
+}
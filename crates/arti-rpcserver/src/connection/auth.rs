@@ -7,6 +7,7 @@
 use std::sync::Arc;
 
 use super::Connection;
+use crate::codecs::Framing;
 use derive_deftly::Deftly;
 use tor_rpcbase as rpc;
 use tor_rpcbase::templates::*;
@@ -82,12 +83,17 @@ pub struct RpcAuthentication {}
 /// Conceptually, an authentication scheme answers the question "How can the
 /// Arti process know you have permissions to use or administer it?"
 ///
-/// TODO RPC: The only supported one for now is "inherent:unix_path"
+/// TODO RPC: The only supported ones for now are "inherent:unix_path" and "inherent:inproc"
 #[derive(Debug, Copy, Clone, serde::Serialize, serde::Deserialize)]
 enum AuthenticationScheme {
     /// Inherent authority based on the ability to access an AF_UNIX address.
     #[serde(rename = "inherent:unix_path")]
     InherentUnixPath,
+    /// Inherent authority based on running in the same process as Arti.
+    ///
+    /// (See [`Connection::run_inproc`].)
+    #[serde(rename = "inherent:inproc")]
+    InherentInproc,
 }
 
 /// Ask which authentication methods are supported.
@@ -120,14 +126,17 @@ impl rpc::RpcMethod for AuthQuery {
 }
 /// Implement `auth:AuthQuery` on a connection.
 async fn conn_authquery(
-    _conn: Arc<Connection>,
+    conn: Arc<Connection>,
     _query: Box<AuthQuery>,
     _ctx: Arc<dyn rpc::Context>,
 ) -> Result<SupportedAuth, rpc::RpcError> {
-    // Right now, every connection supports the same scheme.
-    Ok(SupportedAuth {
-        schemes: vec![AuthenticationScheme::InherentUnixPath],
-    })
+    // Every connection supports inherent:unix_path;
+    // only in-process connections support inherent:inproc.
+    let mut schemes = vec![AuthenticationScheme::InherentUnixPath];
+    if conn.is_inproc() {
+        schemes.push(AuthenticationScheme::InherentInproc);
+    }
+    Ok(SupportedAuth { schemes })
 }
 rpc::static_rpc_invoke_fn! {
     conn_authquery;
@@ -138,7 +147,7 @@ rpc::static_rpc_invoke_fn! {
 /// After connecting to Arti, clients use this method to create a Session,
 /// which they then use to access other functionality.
 ///
-/// For now, only the `inherent:unix_path` method is supported;
+/// For now, only the `inherent:unix_path` and `inherent:inproc` methods are supported;
 /// other methods will be implemented in the future.
 ///
 /// You typically won't need to invoke this method yourself;
@@ -150,8 +159,13 @@ rpc::static_rpc_invoke_fn! {
 struct Authenticate {
     /// The authentication scheme as enumerated in the spec.
     ///
-    /// TODO RPC: The only supported one for now is "inherent:unix_path"
+    /// TODO RPC: The only supported ones for now are "inherent:unix_path" and "inherent:inproc"
     scheme: AuthenticationScheme,
+    /// The framing to use on this connection after our reply.
+    ///
+    /// If this is absent, we keep using newline-terminated Json objects.
+    #[serde(default)]
+    framing: Option<Framing>,
 }
 
 /// A reply from the `Authenticate` method.
@@ -159,6 +173,11 @@ struct Authenticate {
 struct AuthenticateReply {
     /// An handle for a `Session` object.
     session: rpc::ObjectId,
+    /// The framing that we will use on this connection after this reply.
+    ///
+    /// We only include this if the client asked for a framing.
+    #[serde(skip_serializing_if = "Option::is_none")]
+    framing: Option<Framing>,
 }
 
 impl rpc::RpcMethod for Authenticate {
@@ -168,8 +187,11 @@ impl rpc::RpcMethod for Authenticate {
 
 /// An error during authentication.
 #[derive(Debug, Clone, thiserror::Error, serde::Serialize)]
-#[allow(dead_code)] // TODO RPC
-enum AuthenticationFailure {}
+enum AuthenticationFailure {
+    /// The client asked for a scheme that this connection does not support.
+    #[error("Authentication scheme not supported on this connection")]
+    SchemeNotSupported,
+}
 
 impl tor_error::HasKind for AuthenticationFailure {
     fn kind(&self) -> tor_error::ErrorKind {
@@ -191,7 +213,14 @@ async fn authenticate_connection(
         // For now, we only support AF_UNIX connections, and we assume that if
         // you have permission to open such a connection to us, you have
         // permission to use Arti. We will refine this later on!
+        //
         AuthenticationScheme::InherentUnixPath => {}
+        // Only code in our own process can get an in-process connection,
+        // so we only accept this scheme on connections that were made that way.
+        AuthenticationScheme::InherentInproc if unauth.is_inproc() => {}
+        AuthenticationScheme::InherentInproc => {
+            return Err(AuthenticationFailure::SchemeNotSupported.into());
+        }
     }
 
     let auth = RpcAuthentication {};
@@ -200,7 +229,15 @@ async fn authenticate_connection(
         mgr.create_session(&auth)
     };
     let session = ctx.register_owned(session);
-    Ok(AuthenticateReply { session })
+    // (We must not await anything after this, so that the switch happens
+    // immediately after our reply.)
+    if let Some(framing) = method.framing {
+        unauth.framing.request(framing);
+    }
+    Ok(AuthenticateReply {
+        session,
+        framing: method.framing,
+    })
 }
 rpc::static_rpc_invoke_fn! {
     authenticate_connection;
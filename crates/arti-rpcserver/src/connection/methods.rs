@@ -0,0 +1,63 @@
+//! RPC methods that act on the connection itself, once it is authenticated.
+
+use std::sync::Arc;
+
+use derive_deftly::Deftly;
+use tor_rpcbase as rpc;
+use tor_rpcbase::templates::*;
+
+use super::Connection;
+use crate::msgs::RequestId;
+
+/// Cancel a request that is running on this connection.
+///
+/// If the request is still running, it finishes with a "request cancelled" error,
+/// and this method returns success.
+/// If there is no such request (perhaps because it has already finished),
+/// this method returns an error and has no effect.
+///
+/// The replies to the two requests may arrive in either order.
+#[derive(Debug, serde::Deserialize, Deftly)]
+#[derive_deftly(DynMethod)]
+#[deftly(rpc(method_name = "rpc:cancel"))]
+struct RpcCancel {
+    /// The ID of the request to cancel.
+    request_id: RequestId,
+}
+
+impl rpc::RpcMethod for RpcCancel {
+    type Output = rpc::Nil;
+    type Update = rpc::NoUpdates;
+}
+
+/// An error from trying to cancel a request that wasn't running.
+#[derive(Clone, Debug, thiserror::Error, serde::Serialize)]
+#[error("No request with that ID is running")]
+struct RequestNotFound;
+
+impl tor_error::HasKind for RequestNotFound {
+    fn kind(&self) -> tor_error::ErrorKind {
+        tor_error::ErrorKind::Other
+    }
+}
+
+/// Implement `rpc:cancel` on a connection.
+async fn conn_cancel(
+    conn: Arc<Connection>,
+    method: Box<RpcCancel>,
+    _ctx: Arc<dyn rpc::Context>,
+) -> Result<rpc::Nil, rpc::RpcError> {
+    let handle = conn
+        .inner
+        .lock()
+        .expect("lock poisoned")
+        .inflight
+        .get(&method.request_id)
+        .cloned()
+        .ok_or(RequestNotFound)?;
+    handle.cancel();
+    Ok(rpc::NIL)
+}
+rpc::static_rpc_invoke_fn! {
+    conn_cancel;
+}
@@ -0,0 +1,274 @@
+//! Support for thinning out a request's updates, as its `update_filter` asks.
+//!
+//! Without a filter, every update that a method sends goes onto the connection's
+//! queue of responses, and from there to the client.
+//! With a filter, the method sends its updates to a [`LatestSink`] instead,
+//! which holds on to only the most recent one:
+//! a new update replaces any update that we have not yet queued.
+//! If the filter has a minimum interval,
+//! we also wait that long after queueing each update before we queue the next.
+
+use std::{
+    pin::Pin,
+    sync::{Arc, Mutex, Weak},
+    task::{Context, Poll, Waker},
+    time::Duration,
+};
+
+use futures::{channel::mpsc, Sink, SinkExt as _, Stream, StreamExt as _};
+use tor_rpcbase as rpc;
+
+use crate::{
+    msgs::{BoxedResponse, RequestId, ResponseBody},
+    RpcMgr,
+};
+
+/// State shared between a [`LatestSink`] and its [`LatestStream`].
+struct Inner {
+    /// The most recent update, if we have one that the stream hasn't taken yet.
+    latest: Option<rpc::RpcValue>,
+    /// True once the sink has been closed or dropped.
+    sink_closed: bool,
+    /// True once the stream has been dropped.
+    stream_dropped: bool,
+    /// A waker to use in telling the stream that something has changed.
+    waker: Option<Waker>,
+}
+
+impl Inner {
+    /// Wake the stream, if it is waiting.
+    fn wake(&mut self) {
+        if let Some(waker) = self.waker.take() {
+            waker.wake();
+        }
+    }
+}
+
+/// A sink for a method's updates, which keeps only the most recent one.
+///
+/// Sending never blocks: each update replaces any update that the matching
+/// [`LatestStream`] has not yet taken.
+pub(super) struct LatestSink {
+    /// State shared with the [`LatestStream`].
+    inner: Arc<Mutex<Inner>>,
+}
+
+/// A stream of the updates sent to a [`LatestSink`], skipping any that were replaced.
+///
+/// Ends once the sink is gone, and its last update (if any) has been taken.
+pub(super) struct LatestStream {
+    /// State shared with the [`LatestSink`].
+    inner: Arc<Mutex<Inner>>,
+}
+
+/// Return a new [`LatestSink`], and the [`LatestStream`] that receives its updates.
+pub(super) fn latest_only() -> (LatestSink, LatestStream) {
+    let inner = Arc::new(Mutex::new(Inner {
+        latest: None,
+        sink_closed: false,
+        stream_dropped: false,
+        waker: None,
+    }));
+    let sink = LatestSink {
+        inner: Arc::clone(&inner),
+    };
+    (sink, LatestStream { inner })
+}
+
+impl LatestSink {
+    /// Tell the stream that no more updates are coming.
+    fn mark_closed(&self) {
+        let mut inner = self.inner.lock().expect("lock poisoned");
+        inner.sink_closed = true;
+        inner.wake();
+    }
+}
+
+impl Drop for LatestSink {
+    fn drop(&mut self) {
+        self.mark_closed();
+    }
+}
+
+impl Sink<rpc::RpcValue> for LatestSink {
+    type Error = rpc::SendUpdateError;
+
+    fn poll_ready(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<Result<(), Self::Error>> {
+        Poll::Ready(Ok(()))
+    }
+
+    fn start_send(self: Pin<&mut Self>, item: rpc::RpcValue) -> Result<(), Self::Error> {
+        let mut inner = self.inner.lock().expect("lock poisoned");
+        if inner.stream_dropped || inner.sink_closed {
+            return Err(rpc::SendUpdateError::ConnectionClosed);
+        }
+        // Any update that we haven't forwarded yet is out of date now.
+        inner.latest = Some(item);
+        inner.wake();
+        Ok(())
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<Result<(), Self::Error>> {
+        Poll::Ready(Ok(()))
+    }
+
+    fn poll_close(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<Result<(), Self::Error>> {
+        self.mark_closed();
+        Poll::Ready(Ok(()))
+    }
+}
+
+impl LatestStream {
+    /// Return `Ready` once the sink has been closed or dropped.
+    ///
+    /// (There may still be an update left to take, even then.)
+    fn poll_sink_closed(&self, cx: &mut Context<'_>) -> Poll<()> {
+        let mut inner = self.inner.lock().expect("lock poisoned");
+        if inner.sink_closed {
+            Poll::Ready(())
+        } else {
+            inner.waker = Some(cx.waker().clone());
+            Poll::Pending
+        }
+    }
+}
+
+impl Drop for LatestStream {
+    fn drop(&mut self) {
+        self.inner.lock().expect("lock poisoned").stream_dropped = true;
+    }
+}
+
+impl Stream for LatestStream {
+    type Item = rpc::RpcValue;
+
+    fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        let mut inner = self.inner.lock().expect("lock poisoned");
+        if let Some(update) = inner.latest.take() {
+            Poll::Ready(Some(update))
+        } else if inner.sink_closed {
+            Poll::Ready(None)
+        } else {
+            inner.waker = Some(cx.waker().clone());
+            Poll::Pending
+        }
+    }
+}
+
+/// Queue each update from `updates` on `tx_response`, as an update to the request `id`.
+///
+/// If `min_interval` is present, wait at least that long after queueing each update
+/// before we queue another, unless the method has finished in the meantime.
+///
+/// Returns once `updates` has ended, or once the connection has closed.
+pub(super) async fn forward_updates(
+    mut updates: LatestStream,
+    id: RequestId,
+    min_interval: Option<Duration>,
+    mgr: Weak<RpcMgr>,
+    mut tx_response: mpsc::Sender<BoxedResponse>,
+) {
+    while let Some(update) = updates.next().await {
+        let response = BoxedResponse {
+            id: Some(id.clone()),
+            body: ResponseBody::Update(update),
+        };
+        if tx_response.send(response).await.is_err() {
+            // The connection has closed; dropping `updates` tells the method so.
+            return;
+        }
+        let Some(sleep) = min_interval.and_then(|d| mgr.upgrade()?.sleep(d)) else {
+            continue;
+        };
+        // Once the method is done, there's no reason to hold back its last update.
+        let sink_closed = futures::future::poll_fn(|cx| updates.poll_sink_closed(cx));
+        futures::future::select(sleep, sink_closed).await;
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use futures::FutureExt as _;
+    use futures_await_test::async_test;
+
+    /// Return `n` as an update.
+    fn update(n: u32) -> rpc::RpcValue {
+        Box::new(n)
+    }
+
+    /// Return the Json encoding of `response`'s body.
+    fn body_json(response: &BoxedResponse) -> String {
+        match &response.body {
+            ResponseBody::Update(u) => serde_json::to_string(u).unwrap(),
+            _ => panic!("Not an update"),
+        }
+    }
+
+    #[async_test]
+    async fn keeps_latest() {
+        let (mut sink, mut stream) = latest_only();
+        sink.send(update(1)).await.unwrap();
+        sink.send(update(2)).await.unwrap();
+        sink.send(update(3)).await.unwrap();
+        // Only the last of these is still around.
+        let u = stream.next().await.unwrap();
+        assert_eq!(serde_json::to_string(&u).unwrap(), "3");
+        assert!(stream.next().now_or_never().is_none());
+
+        // Once the sink is gone, we get its last update, and then the end of the stream.
+        sink.send(update(4)).await.unwrap();
+        drop(sink);
+        let u = stream.next().await.unwrap();
+        assert_eq!(serde_json::to_string(&u).unwrap(), "4");
+        assert!(stream.next().await.is_none());
+    }
+
+    #[async_test]
+    async fn stream_dropped() {
+        let (mut sink, stream) = latest_only();
+        drop(stream);
+        assert!(matches!(
+            sink.send(update(1)).await,
+            Err(rpc::SendUpdateError::ConnectionClosed)
+        ));
+    }
+
+    #[async_test]
+    async fn forward() {
+        let (mut sink, stream) = latest_only();
+        let (tx, mut rx) = mpsc::channel(4);
+        sink.send(update(1)).await.unwrap();
+        sink.send(update(2)).await.unwrap();
+        drop(sink);
+        // (With no RpcMgr, there's no way to sleep, so the interval isn't enforced.)
+        forward_updates(
+            stream,
+            RequestId::Int(5),
+            Some(Duration::from_secs(3600)),
+            Weak::new(),
+            tx,
+        )
+        .await;
+
+        let r = rx.next().await.unwrap();
+        assert_eq!(r.id, Some(RequestId::Int(5)));
+        assert_eq!(body_json(&r), "2");
+        // `forward_updates` dropped its sender, so there's nothing else.
+        assert!(rx.next().await.is_none());
+    }
+}
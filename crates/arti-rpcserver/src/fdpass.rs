@@ -0,0 +1,107 @@
+//! Support for sending file descriptors to an RPC client along with our responses.
+
+use std::{collections::VecDeque, os::fd::OwnedFd, sync::Mutex};
+
+/// File descriptors that are waiting to be sent to a connection's client.
+///
+/// When a connection runs over a Unix domain socket,
+/// a method can hand its client a file descriptor (such as one end of a data stream)
+/// by pushing it onto the connection's `PendingFds`
+/// (see [`Connection::pending_fds`](crate::Connection::pending_fds)).
+/// Whatever writes the connection's responses to the socket
+/// takes descriptors from here, and attaches them as `SCM_RIGHTS` ancillary data
+/// to the next bytes that it writes.
+///
+/// Since a method pushes its descriptor before it returns,
+/// the descriptor always reaches the client with (or before) the response that names it.
+/// Methods name a descriptor by its index:
+/// the number of descriptors that were pushed before it on the same connection.
+#[derive(Debug, Default)]
+pub struct PendingFds {
+    /// The descriptors themselves, and our count of them.
+    inner: Mutex<PendingFdsInner>,
+}
+
+/// The state behind a [`PendingFds`].
+#[derive(Debug, Default)]
+struct PendingFdsInner {
+    /// The number of descriptors that have ever been pushed.
+    n_pushed: u64,
+    /// The descriptors that have been pushed, but not yet taken, oldest first.
+    queue: VecDeque<OwnedFd>,
+}
+
+impl PendingFds {
+    /// Queue `fd` to be sent to the client.
+    ///
+    /// Return its index: the number of descriptors queued before it.
+    pub fn push(&self, fd: OwnedFd) -> u64 {
+        let mut inner = self.inner.lock().expect("poisoned");
+        let index = inner.n_pushed;
+        inner.n_pushed += 1;
+        inner.queue.push_back(fd);
+        index
+    }
+
+    /// Remove and return up to `max` of the oldest queued descriptors, in order.
+    ///
+    /// The caller must send the descriptors in the order that they are returned,
+    /// and must send them before it writes any of the responses that it writes afterwards.
+    pub fn take(&self, max: usize) -> Vec<OwnedFd> {
+        let mut inner = self.inner.lock().expect("poisoned");
+        let n = max.min(inner.queue.len());
+        inner.queue.drain(..n).collect()
+    }
+
+    /// Return true if no descriptors are waiting to be taken.
+    pub fn is_empty(&self) -> bool {
+        self.inner.lock().expect("poisoned").queue.is_empty()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use std::os::fd::AsRawFd as _;
+
+    #[test]
+    fn push_and_take() {
+        let fds = PendingFds::default();
+        assert!(fds.is_empty());
+        let files: Vec<OwnedFd> = (0..3)
+            .map(|_| std::fs::File::open("/dev/null").unwrap().into())
+            .collect();
+        let raw: Vec<_> = files.iter().map(|f| f.as_raw_fd()).collect();
+        let indices: Vec<u64> = files.into_iter().map(|f| fds.push(f)).collect();
+        assert_eq!(indices, vec![0, 1, 2]);
+
+        let first = fds.take(2);
+        assert_eq!(
+            first.iter().map(|f| f.as_raw_fd()).collect::<Vec<_>>(),
+            raw[..2]
+        );
+        assert!(!fds.is_empty());
+        let rest = fds.take(2);
+        assert_eq!(rest.len(), 1);
+        assert_eq!(rest[0].as_raw_fd(), raw[2]);
+        assert!(fds.is_empty());
+
+        // Indices keep counting after the queue empties.
+        let f: OwnedFd = std::fs::File::open("/dev/null").unwrap().into();
+        assert_eq!(fds.push(f), 3);
+    }
+}
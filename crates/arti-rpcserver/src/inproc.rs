@@ -0,0 +1,509 @@
+//! In-memory streams for running an RPC connection inside the same process as its client.
+//!
+//! When an application links Arti directly, it doesn't need to send its RPC
+//! messages through a socket.  Instead, it can use [`Connection::run_inproc`]
+//! to get a pair of blocking streams that talk directly to the connection,
+//! and hand them to its RPC client library.
+//! (In `arti-rpc-client-core`, that means registering a connector for `inproc:` connect strings.)
+
+use std::{
+    collections::VecDeque,
+    future::Future,
+    io::{self, Read as _},
+    pin::Pin,
+    sync::{Arc, Condvar, Mutex},
+    task::{Context, Poll, Waker},
+};
+
+use crate::{Connection, ConnectionError};
+
+/// The most bytes that we will buffer in each direction before the writer has to wait.
+const PIPE_CAPACITY: usize = 1 << 16;
+
+/// A one-way byte channel between a blocking (synchronous) end and an async end.
+///
+/// A blocking end waits on `cond`; an async end registers its waker in the state.
+#[derive(Default)]
+struct Pipe {
+    /// The lock-protected state of this pipe.
+    state: Mutex<PipeState>,
+    /// Notified whenever `state` changes, to wake up the blocking end.
+    cond: Condvar,
+}
+
+/// The mutable state of a [`Pipe`].
+#[derive(Default)]
+struct PipeState {
+    /// Bytes that have been written but not yet read.
+    buf: VecDeque<u8>,
+    /// True if the reading end has been dropped.
+    reader_closed: bool,
+    /// True if the writing end has been dropped or closed.
+    writer_closed: bool,
+    /// The waker for the async end, if it is waiting.
+    waker: Option<Waker>,
+}
+
+impl Pipe {
+    /// Lock this pipe's state.
+    fn lock(&self) -> std::sync::MutexGuard<'_, PipeState> {
+        self.state.lock().expect("lock poisoned")
+    }
+
+    /// Tell the other end of this pipe that `state` has changed.
+    fn notify(&self, state: &mut PipeState) {
+        if let Some(waker) = state.waker.take() {
+            waker.wake();
+        }
+        self.cond.notify_all();
+    }
+
+    /// Try to move some bytes from this pipe into `out`.
+    ///
+    /// Return None if there is nothing to read yet.
+    fn try_read(&self, state: &mut PipeState, out: &mut [u8]) -> Option<io::Result<usize>> {
+        if out.is_empty() {
+            Some(Ok(0))
+        } else if !state.buf.is_empty() {
+            let n = state.buf.read(out);
+            self.notify(state);
+            Some(n)
+        } else if state.writer_closed {
+            Some(Ok(0))
+        } else {
+            None
+        }
+    }
+
+    /// Try to move some bytes from `data` into this pipe.
+    ///
+    /// Return None if the pipe is full.
+    fn try_write(&self, state: &mut PipeState, data: &[u8]) -> Option<io::Result<usize>> {
+        if state.reader_closed {
+            Some(Err(io::ErrorKind::BrokenPipe.into()))
+        } else if data.is_empty() {
+            Some(Ok(0))
+        } else if state.buf.len() < PIPE_CAPACITY {
+            let n = std::cmp::min(data.len(), PIPE_CAPACITY - state.buf.len());
+            state.buf.extend(&data[..n]);
+            self.notify(state);
+            Some(Ok(n))
+        } else {
+            None
+        }
+    }
+
+    /// Mark the reading end of this pipe as closed.
+    fn close_reader(&self) {
+        let mut state = self.lock();
+        state.reader_closed = true;
+        state.buf.clear();
+        self.notify(&mut state);
+    }
+
+    /// Mark the writing end of this pipe as closed.
+    fn close_writer(&self) {
+        let mut state = self.lock();
+        state.writer_closed = true;
+        self.notify(&mut state);
+    }
+}
+
+/// The blocking end of an in-process RPC connection that receives Arti's responses.
+pub struct InprocReader(Arc<Pipe>);
+
+/// The blocking end of an in-process RPC connection that carries requests to Arti.
+pub struct InprocWriter(Arc<Pipe>);
+
+/// The async end of an in-process RPC connection that receives requests.
+struct ServerReader(Arc<Pipe>);
+
+/// The async end of an in-process RPC connection that carries responses.
+struct ServerWriter(Arc<Pipe>);
+
+impl io::Read for InprocReader {
+    fn read(&mut self, out: &mut [u8]) -> io::Result<usize> {
+        let mut state = self.0.lock();
+        loop {
+            if let Some(result) = self.0.try_read(&mut state, out) {
+                return result;
+            }
+            state = self.0.cond.wait(state).expect("lock poisoned");
+        }
+    }
+}
+
+impl io::Write for InprocWriter {
+    fn write(&mut self, data: &[u8]) -> io::Result<usize> {
+        let mut state = self.0.lock();
+        loop {
+            if let Some(result) = self.0.try_write(&mut state, data) {
+                return result;
+            }
+            state = self.0.cond.wait(state).expect("lock poisoned");
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        // Everything we write is immediately visible to the reader.
+        Ok(())
+    }
+}
+
+impl futures::AsyncRead for ServerReader {
+    fn poll_read(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        out: &mut [u8],
+    ) -> Poll<io::Result<usize>> {
+        let mut state = self.0.lock();
+        match self.0.try_read(&mut state, out) {
+            Some(result) => Poll::Ready(result),
+            None => {
+                state.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+impl futures::AsyncWrite for ServerWriter {
+    fn poll_write(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        data: &[u8],
+    ) -> Poll<io::Result<usize>> {
+        let mut state = self.0.lock();
+        match self.0.try_write(&mut state, data) {
+            Some(result) => Poll::Ready(result),
+            None => {
+                state.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Poll::Ready(Ok(()))
+    }
+
+    fn poll_close(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        self.0.close_writer();
+        Poll::Ready(Ok(()))
+    }
+}
+
+impl Drop for InprocReader {
+    fn drop(&mut self) {
+        self.0.close_reader();
+    }
+}
+
+impl Drop for ServerReader {
+    fn drop(&mut self) {
+        self.0.close_reader();
+    }
+}
+
+impl Drop for InprocWriter {
+    fn drop(&mut self) {
+        self.0.close_writer();
+    }
+}
+
+impl Drop for ServerWriter {
+    fn drop(&mut self) {
+        self.0.close_writer();
+    }
+}
+
+impl Connection {
+    /// Prepare to run this connection over in-memory streams, for a client in this process.
+    ///
+    /// Return a reader that will receive this connection's responses,
+    /// a writer that will send it requests,
+    /// and a future that must be spawned (or otherwise polled) to actually run the connection.
+    ///
+    /// The future finishes once the writer has been dropped,
+    /// or on any error (as with [`Connection::run`]).
+    pub fn run_inproc(
+        self: Arc<Self>,
+    ) -> (
+        InprocReader,
+        InprocWriter,
+        impl Future<Output = Result<(), ConnectionError>> + Send + 'static,
+    ) {
+        // This is the only way to make an in-process connection,
+        // so it's the only way to get one that accepts `inherent:inproc`.
+        self.set_inproc();
+        let requests = Arc::new(Pipe::default());
+        let responses = Arc::new(Pipe::default());
+        let fut = self.run(
+            ServerReader(Arc::clone(&requests)),
+            ServerWriter(Arc::clone(&responses)),
+        );
+        (InprocReader(responses), InprocWriter(requests), fut)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use crate::RpcMgr;
+    use derive_deftly::Deftly;
+    use futures::{AsyncReadExt as _, AsyncWriteExt as _};
+    use futures_await_test::async_test;
+    use std::io::{BufRead as _, BufReader, Read as _, Write as _};
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::time::Duration;
+    use tor_rpcbase::{self as rpc, templates::*};
+    use tor_rtcompat::SleepProvider;
+
+    /// An object to hand out as the session for a test connection.
+    #[derive(Deftly)]
+    #[derive_deftly(Object)]
+    struct TestSession;
+
+    /// Send `request` on `w`, and return the next reply that arrives on `r`.
+    fn call(
+        w: &mut InprocWriter,
+        r: &mut BufReader<InprocReader>,
+        request: &str,
+    ) -> serde_json::Value {
+        writeln!(w, "{request}").unwrap();
+        let mut line = String::new();
+        r.read_line(&mut line).unwrap();
+        serde_json::from_str(&line).unwrap()
+    }
+
+    /// Ask for the supported schemes, then try to authenticate with `inherent:inproc`.
+    ///
+    /// Return the schemes, and the reply to the authentication attempt.
+    fn try_inproc_auth(
+        mut w: InprocWriter,
+        r: InprocReader,
+        fut: impl Future<Output = Result<(), ConnectionError>> + Send + 'static,
+    ) -> (serde_json::Value, serde_json::Value) {
+        let mut r = BufReader::new(r);
+        let server = std::thread::spawn(move || futures::executor::block_on(fut));
+        let query = call(
+            &mut w,
+            &mut r,
+            r#"{"id":1,"obj":"connection","method":"auth:query","params":{}}"#,
+        );
+        let auth = call(
+            &mut w,
+            &mut r,
+            r#"{"id":2,"obj":"connection","method":"auth:authenticate","params":{"scheme":"inherent:inproc"}}"#,
+        );
+        drop(w);
+        server.join().unwrap().unwrap();
+        (query["result"]["schemes"].clone(), auth)
+    }
+
+    /// A [`ServerWriter`] that counts how many times it is written to.
+    struct CountingWriter {
+        /// The writer that we wrap.
+        inner: ServerWriter,
+        /// The number of nonempty writes so far.
+        writes: Arc<AtomicUsize>,
+    }
+
+    impl futures::AsyncWrite for CountingWriter {
+        fn poll_write(
+            mut self: Pin<&mut Self>,
+            cx: &mut Context<'_>,
+            data: &[u8],
+        ) -> Poll<io::Result<usize>> {
+            let result = Pin::new(&mut self.inner).poll_write(cx, data);
+            if matches!(&result, Poll::Ready(Ok(n)) if *n > 0) {
+                self.writes.fetch_add(1, Ordering::SeqCst);
+            }
+            result
+        }
+
+        fn poll_flush(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+            Pin::new(&mut self.inner).poll_flush(cx)
+        }
+
+        fn poll_close(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+            Pin::new(&mut self.inner).poll_close(cx)
+        }
+    }
+
+    /// A [`SleepProvider`] whose sleeps are over as soon as they begin.
+    #[derive(Clone)]
+    struct NoSleep;
+
+    impl SleepProvider for NoSleep {
+        type SleepFuture = futures::future::Ready<()>;
+        fn sleep(&self, _duration: Duration) -> Self::SleepFuture {
+            futures::future::ready(())
+        }
+    }
+
+    /// Send three `auth:query` requests at once to a new connection on `mgr`,
+    /// and read all three replies.
+    ///
+    /// If `close_early` is true, close our side of the connection
+    /// as soon as we have sent the requests.
+    ///
+    /// Return the IDs of the replies, and the number of writes the connection made.
+    fn run_pipelined(mgr: &Arc<RpcMgr>, close_early: bool) -> (Vec<serde_json::Value>, usize) {
+        let requests = Arc::new(Pipe::default());
+        let responses = Arc::new(Pipe::default());
+        let mut w = InprocWriter(Arc::clone(&requests));
+        let mut r = BufReader::new(InprocReader(Arc::clone(&responses)));
+        for id in 1..=3 {
+            writeln!(
+                w,
+                r#"{{"id":{id},"obj":"connection","method":"auth:query","params":{{}}}}"#
+            )
+            .unwrap();
+        }
+        let w = if close_early {
+            drop(w);
+            None
+        } else {
+            Some(w)
+        };
+
+        let writes = Arc::new(AtomicUsize::new(0));
+        let output = CountingWriter {
+            inner: ServerWriter(responses),
+            writes: Arc::clone(&writes),
+        };
+        let fut = mgr.new_connection().run(ServerReader(requests), output);
+        let server = std::thread::spawn(move || futures::executor::block_on(fut));
+
+        let ids = (0..3)
+            .map(|_| {
+                let mut line = String::new();
+                r.read_line(&mut line).unwrap();
+                let reply: serde_json::Value = serde_json::from_str(&line).unwrap();
+                assert!(reply["result"]["schemes"].is_array());
+                reply["id"].clone()
+            })
+            .collect();
+        drop(w);
+        server.join().unwrap().unwrap();
+        // The connection has no more replies for us.
+        let mut rest = String::new();
+        r.read_to_string(&mut rest).unwrap();
+        assert_eq!(rest, "");
+
+        (ids, writes.load(Ordering::SeqCst))
+    }
+
+    #[test]
+    fn responses_coalesced() {
+        let mgr = RpcMgr::new(|_| Arc::new(TestSession) as Arc<dyn rpc::Object>).unwrap();
+        let (ids, writes) = run_pipelined(&mgr, false);
+        assert_eq!(ids, vec![1, 2, 3]);
+        // All three replies were ready together, so they go out in one write.
+        assert_eq!(writes, 1);
+    }
+
+    #[test]
+    fn responses_flushed_at_deadline() {
+        // Once max_response_delay has passed, we flush, even if we're still busy.
+        let mgr = RpcMgr::new(|_| Arc::new(TestSession) as Arc<dyn rpc::Object>).unwrap();
+        mgr.set_sleep_provider(NoSleep);
+        let (ids, writes) = run_pipelined(&mgr, false);
+        assert_eq!(ids, vec![1, 2, 3]);
+        assert_eq!(writes, 3);
+
+        // With no delay allowed, we flush every reply by itself.
+        let mgr = RpcMgr::new(|_| Arc::new(TestSession) as Arc<dyn rpc::Object>).unwrap();
+        mgr.set_max_response_delay(Duration::ZERO);
+        let (ids, writes) = run_pipelined(&mgr, false);
+        assert_eq!(ids, vec![1, 2, 3]);
+        assert_eq!(writes, 3);
+    }
+
+    #[test]
+    fn responses_flushed_before_close() {
+        // The client closes its side before we're idle: we still flush what we have.
+        let mgr = RpcMgr::new(|_| Arc::new(TestSession) as Arc<dyn rpc::Object>).unwrap();
+        let (ids, writes) = run_pipelined(&mgr, true);
+        assert_eq!(ids, vec![1, 2, 3]);
+        assert_eq!(writes, 1);
+    }
+
+    #[test]
+    fn inproc_auth_only_inproc() {
+        let mgr = RpcMgr::new(|_| Arc::new(TestSession) as Arc<dyn rpc::Object>).unwrap();
+
+        // A connection that is running over some other stream doesn't offer or accept
+        // inherent:inproc.
+        let requests = Arc::new(Pipe::default());
+        let responses = Arc::new(Pipe::default());
+        let fut = mgr.new_connection().run(
+            ServerReader(Arc::clone(&requests)),
+            ServerWriter(Arc::clone(&responses)),
+        );
+        let (schemes, auth) = try_inproc_auth(InprocWriter(requests), InprocReader(responses), fut);
+        assert_eq!(schemes, serde_json::json!(["inherent:unix_path"]));
+        assert_eq!(auth["id"], 2);
+        assert!(auth.get("result").is_none());
+        assert!(auth.get("error").is_some());
+
+        // An in-process connection does.
+        let (r, w, fut) = mgr.new_connection().run_inproc();
+        let (schemes, auth) = try_inproc_auth(w, r, fut);
+        assert_eq!(
+            schemes,
+            serde_json::json!(["inherent:unix_path", "inherent:inproc"])
+        );
+        assert!(auth["result"]["session"].is_string());
+    }
+
+    #[async_test]
+    async fn pipe_both_ways() {
+        let requests = Arc::new(Pipe::default());
+        let responses = Arc::new(Pipe::default());
+        let (mut r, mut w) = (
+            InprocReader(Arc::clone(&responses)),
+            InprocWriter(Arc::clone(&requests)),
+        );
+        let (mut sr, mut sw) = (ServerReader(requests), ServerWriter(responses));
+
+        // More than fits in the pipe at once, so that both ends have to wait.
+        let msg: Vec<u8> = (0..PIPE_CAPACITY * 3).map(|i| (i % 251) as u8).collect();
+        let msg2 = msg.clone();
+        let client = std::thread::spawn(move || {
+            w.write_all(&msg2).unwrap();
+            drop(w);
+            let mut echoed = Vec::new();
+            r.read_to_end(&mut echoed).unwrap();
+            echoed
+        });
+
+        let mut got = Vec::new();
+        sr.read_to_end(&mut got).await.unwrap();
+        assert_eq!(got, msg);
+        sw.write_all(&got).await.unwrap();
+        sw.close().await.unwrap();
+        assert_eq!(client.join().unwrap(), msg);
+
+        // Once the reader is gone, writes fail.
+        drop(sr);
+        let mut w = InprocWriter(Arc::new(Pipe::default()));
+        drop(ServerReader(Arc::clone(&w.0)));
+        assert_eq!(w.write(b"x").unwrap_err().kind(), io::ErrorKind::BrokenPipe);
+    }
+}
@@ -44,7 +44,10 @@ mod cancel;
 mod codecs;
 mod connection;
 mod err;
+#[cfg(unix)]
+mod fdpass;
 mod globalid;
+mod inproc;
 mod mgr;
 mod msgs;
 mod objmap;
@@ -52,7 +55,10 @@ mod session;
 mod stream;
 
 pub use connection::{auth::RpcAuthentication, Connection, ConnectionError};
-pub use mgr::RpcMgr;
+#[cfg(unix)]
+pub use fdpass::PendingFds;
+pub use inproc::{InprocReader, InprocWriter};
+pub use mgr::{RpcMgr, DEFAULT_MAX_RESPONSE_DELAY};
 pub use session::RpcSession;
 
 /// Return a list of RPC methods that will be needed to use `arti-rpcserver` with the given runtime.
@@ -1,10 +1,16 @@
 //! Top-level `RpcMgr` to launch sessions.
 
-use std::sync::{Arc, Mutex, RwLock, Weak};
+use std::{
+    future::Future,
+    pin::Pin,
+    sync::{Arc, Mutex, OnceLock, RwLock, Weak},
+    time::Duration,
+};
 
 use rand::Rng;
 use rpc::InvalidMethodName;
 use tor_rpcbase as rpc;
+use tor_rtcompat::SleepProvider;
 use tracing::warn;
 use weak_table::WeakValueHashMap;
 
@@ -19,6 +25,15 @@ use crate::{
 // TODO RPC: Perhaps this should return a Result?
 type SessionFactory = Box<dyn Fn(&RpcAuthentication) -> Arc<dyn rpc::Object> + Send + Sync>;
 
+/// A future that finishes once some amount of time has passed.
+pub(crate) type SleepFuture = Pin<Box<dyn Future<Output = ()> + Send>>;
+
+/// A function we use to wait for time to pass, when enforcing request timeouts.
+type SleepFn = Box<dyn Fn(Duration) -> SleepFuture + Send + Sync>;
+
+/// The default for [`RpcMgr::set_max_response_delay`].
+pub const DEFAULT_MAX_RESPONSE_DELAY: Duration = Duration::from_millis(1);
+
 /// Shared state, configuration, and data for all RPC sessions.
 ///
 /// An RpcMgr knows how to listen for incoming RPC connections, and launch sessions based on them.
@@ -45,6 +60,16 @@ pub struct RpcMgr {
     /// is successful.
     session_factory: SessionFactory,
 
+    /// A function that we use to wait for request timeouts to expire.
+    ///
+    /// Set by [`RpcMgr::set_sleep_provider`]; until then, we don't enforce timeouts.
+    sleep_fn: OnceLock<SleepFn>,
+
+    /// The longest that a connection may hold a response before flushing it.
+    ///
+    /// Set by [`RpcMgr::set_max_response_delay`]; see there for details.
+    max_response_delay: OnceLock<Duration>,
+
     /// Lock-protected view of the manager's state.
     ///
     /// **NOTE: observe the [Lock hierarchy](crate::mgr::Inner#lock-hierarchy)**
@@ -130,6 +155,8 @@ impl RpcMgr {
             global_id_mac_key: MacKey::new(&mut rand::thread_rng()),
             dispatch_table: Arc::new(RwLock::new(rpc::DispatchTable::from_inventory())),
             session_factory: Box::new(make_session),
+            sleep_fn: OnceLock::new(),
+            max_response_delay: OnceLock::new(),
             inner: Mutex::new(Inner {
                 connections: WeakValueHashMap::new(),
             }),
@@ -166,6 +193,46 @@ impl RpcMgr {
         func(&mut table)
     }
 
+    /// Tell this manager how to wait for time to pass.
+    ///
+    /// Until this is called, the manager ignores any `timeout_ms` that clients set on their requests.
+    /// Only the first call has any effect.
+    pub fn set_sleep_provider<SP: SleepProvider>(&self, sleep_provider: SP) {
+        let _ignore_already_set = self
+            .sleep_fn
+            .set(Box::new(move |d| Box::pin(sleep_provider.sleep(d))));
+    }
+
+    /// Return a future that finishes after `duration`,
+    /// or None if we have no way to sleep.
+    pub(crate) fn sleep(&self, duration: Duration) -> Option<SleepFuture> {
+        self.sleep_fn.get().map(|f| f(duration))
+    }
+
+    /// Tell this manager how long its connections may hold responses before flushing them.
+    ///
+    /// When several responses are ready at once (for example, because a client
+    /// sent a batch of requests), a connection writes them all and then flushes once.
+    /// While the connection is still busy, it flushes at least once every `delay`.
+    /// (This limit is only enforced once [`set_sleep_provider`](Self::set_sleep_provider)
+    /// has been called.)
+    ///
+    /// A `delay` of zero turns coalescing off: every response is flushed on its own.
+    ///
+    /// Defaults to 1 millisecond.  Only the first call has any effect,
+    /// and it only affects connections made afterwards.
+    pub fn set_max_response_delay(&self, delay: Duration) {
+        let _ignore_already_set = self.max_response_delay.set(delay);
+    }
+
+    /// Return the longest that a connection may hold a response before flushing it.
+    pub(crate) fn max_response_delay(&self) -> Duration {
+        self.max_response_delay
+            .get()
+            .copied()
+            .unwrap_or(DEFAULT_MAX_RESPONSE_DELAY)
+    }
+
     /// Start a new session based on this RpcMgr, with a given TorClient.
     pub fn new_connection(self: &Arc<Self>) -> Arc<Connection> {
         let connection_id = ConnectionId::from(rand::thread_rng().gen::<[u8; 16]>());
@@ -44,6 +44,55 @@ pub(crate) struct ReqMeta {
     /// If any feature in this list is not available, the request must be rejected.
     #[serde(default)]
     pub(crate) require: Vec<String>,
+
+    /// If present, the number of milliseconds after which we should give up on this request.
+    ///
+    /// (We only enforce this if our [`RpcMgr`](crate::RpcMgr) has a way to sleep.)
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub(crate) timeout_ms: Option<u64>,
+
+    /// If present, instructions for dropping or merging this request's updates
+    /// before we send them.
+    ///
+    /// (Ignored unless `updates` is true.)
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub(crate) update_filter: Option<UpdateFilter>,
+}
+
+/// A client's instructions for thinning out the updates to a single request.
+///
+/// A client that only cares about the current state of something
+/// can use this to receive that state, without receiving every change along the way.
+//
+// NOTE: As with ReqMeta, `Default` must give the correct value for an absent field.
+#[derive(Debug, Clone, Serialize, Deserialize, Default)]
+pub(crate) struct UpdateFilter {
+    /// If present, the smallest number of milliseconds to leave between two updates.
+    ///
+    /// Updates sent in the meantime are merged: only the latest of them is delivered.
+    ///
+    /// (We only enforce this if our [`RpcMgr`](crate::RpcMgr) has a way to sleep.)
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub(crate) min_interval_ms: Option<u64>,
+
+    /// If true, we may discard any update that we have not yet sent
+    /// once a newer one is available.
+    ///
+    /// (This is always the case when `min_interval_ms` is present.)
+    #[serde(default)]
+    pub(crate) latest_only: bool,
+}
+
+impl UpdateFilter {
+    /// Return true if this filter would let every update through.
+    pub(crate) fn is_trivial(&self) -> bool {
+        !self.latest_only && self.min_interval_ms.is_none()
+    }
+
+    /// Return the smallest interval to leave between two updates, if any.
+    pub(crate) fn min_interval(&self) -> Option<std::time::Duration> {
+        self.min_interval_ms.map(std::time::Duration::from_millis)
+    }
 }
 
 /// A single Request received from an RPC client.
@@ -236,6 +285,29 @@ mod test {
                 method: Box::new(DummyMethod { stuff: 0 })
             }
         );
+
+        let r = parse_request(
+            r#"{"id": 8, "obj": "hello", "meta": {"timeout_ms": 250}, "method": "x-test:dummy", "params": {} }"#,
+        );
+        assert_eq!(r.meta.timeout_ms, Some(250));
+        assert!(!r.meta.updates);
+        assert!(r.meta.update_filter.is_none());
+
+        let r = parse_request(
+            r#"{"id": 9, "obj": "hello", "meta": {"updates": true, "update_filter": {"min_interval_ms": 500}}, "method": "x-test:dummy", "params": {} }"#,
+        );
+        let filter = r.meta.update_filter.unwrap();
+        assert_eq!(
+            filter.min_interval(),
+            Some(std::time::Duration::from_millis(500))
+        );
+        assert!(!filter.latest_only);
+        assert!(!filter.is_trivial());
+
+        let r = parse_request(
+            r#"{"id": 10, "obj": "hello", "meta": {"updates": true, "update_filter": {}}, "method": "x-test:dummy", "params": {} }"#,
+        );
+        assert!(r.meta.update_filter.unwrap().is_trivial());
     }
 
     #[test]
@@ -14,6 +14,8 @@ use crate::onion_proxy::{
 #[cfg(not(feature = "onion-service-service"))]
 use crate::onion_proxy_disabled::{OnionServiceProxyConfigMap, OnionServiceProxyConfigMapBuilder};
 use arti_client::TorClientConfig;
+#[cfg(feature = "rpc")]
+use std::time::Duration;
 #[cfg(feature = "onion-service-service")]
 use tor_config::define_list_builder_accessors;
 use tor_config::resolve_alternative_specs;
@@ -203,6 +205,15 @@ pub struct RpcConfig {
     /// Location to listen for incoming RPC connections.
     #[builder(default = "default_rpc_path()")]
     pub(crate) rpc_listen: Option<CfgPath>,
+
+    /// The longest that an RPC connection may hold a response before sending it.
+    ///
+    /// When several responses are ready at once, Arti sends them together;
+    /// this bounds how long the first of them can wait for the others.
+    /// Set this to zero to send every response on its own.
+    #[builder(default = "arti_rpcserver::DEFAULT_MAX_RESPONSE_DELAY")]
+    #[builder_field_attr(serde(default, with = "humantime_serde::option"))]
+    pub(crate) max_response_delay: Duration,
 }
 
 /// Return the default value for our configuration path.
@@ -623,6 +634,7 @@ mod test {
                 // RPC-only settings
                 "rpc",
                 "rpc.rpc_listen",
+                "rpc.max_response_delay",
             ],
         );
 
@@ -4,7 +4,7 @@ use anyhow::Result;
 use arti_rpcserver::RpcMgr;
 use futures::task::SpawnExt;
 use session::ArtiRpcSession;
-use std::{path::Path, sync::Arc};
+use std::{path::Path, sync::Arc, time::Duration};
 
 use arti_client::TorClient;
 use tor_rtcompat::Runtime;
@@ -12,13 +12,15 @@ use tor_rtcompat::Runtime;
 pub(crate) mod conntarget;
 mod proxyinfo;
 mod session;
+#[cfg(feature = "tokio")]
+mod streamfd;
 
 pub(crate) use session::{RpcStateSender, RpcVisibleArtiState};
 
 cfg_if::cfg_if! {
     if #[cfg(all(feature="tokio", not(target_os="windows")))] {
         use tokio_crate::net::UnixListener ;
-        use tokio_util::compat::{TokioAsyncReadCompatExt, TokioAsyncWriteCompatExt};
+        use tokio_util::compat::TokioAsyncReadCompatExt;
     } else if #[cfg(all(feature="async-std", not(target_os="windows")))] {
         use async_std::os::unix::net::UnixListener;
     } else if #[cfg(target_os="windows")] {
@@ -32,9 +34,13 @@ cfg_if::cfg_if! {
 
 /// Run an RPC listener task to accept incoming connections at the Unix
 /// socket address of `path`.
+///
+/// Each connection holds responses for at most `max_response_delay`
+/// while it waits for others to send along with them.
 pub(crate) fn launch_rpc_listener<R: Runtime>(
     runtime: &R,
     path: impl AsRef<Path>,
+    max_response_delay: Duration,
     client: TorClient<R>,
     rpc_state: Arc<RpcVisibleArtiState>,
 ) -> Result<Arc<RpcMgr>> {
@@ -50,6 +56,11 @@ pub(crate) fn launch_rpc_listener<R: Runtime>(
     // TODO: If we accumulate a large number of generics like this, we should do this elsewhere.
     rpc_mgr.register_rpc_methods(TorClient::<R>::rpc_methods());
     rpc_mgr.register_rpc_methods(arti_rpcserver::rpc_methods::<R>());
+    #[cfg(feature = "tokio")]
+    rpc_mgr.register_rpc_methods(streamfd::rpc_methods::<R>());
+    // Let the manager enforce the timeouts that clients give their requests.
+    rpc_mgr.set_sleep_provider(runtime.clone());
+    rpc_mgr.set_max_response_delay(max_response_delay);
 
     let rt_clone = runtime.clone();
     let rpc_mgr_clone = rpc_mgr.clone();
@@ -78,8 +89,13 @@ async fn run_rpc_listener<R: Runtime>(
         let connection = rpc_mgr.new_connection();
         let (input, output) = stream.into_split();
 
+        // With tokio, we can send file descriptors along with our responses.
         #[cfg(feature = "tokio")]
-        let (input, output) = (input.compat(), output.compat_write());
+        let (input, output) = {
+            let fds = Arc::new(arti_rpcserver::PendingFds::default());
+            connection.set_pending_fds(Arc::clone(&fds));
+            (input.compat(), streamfd::FdPassingWriter::new(output, fds))
+        };
 
         runtime.spawn(async {
             let result = connection.run(input, output).await;
@@ -37,6 +37,9 @@ pub(super) struct ArtiRpcSession {
     pub(super) arti_state: Arc<RpcVisibleArtiState>,
     /// The underlying RpcSession object that we delegate to.
     session: Arc<arti_rpcserver::RpcSession>,
+    /// Our runtime, for methods that need to launch background tasks.
+    #[cfg(feature = "tokio")]
+    pub(super) spawner: Arc<dyn futures::task::Spawn + Send + Sync>,
 }
 
 /// Information about the current global top-level Arti state,
@@ -83,6 +86,8 @@ impl ArtiRpcSession {
         Arc::new(ArtiRpcSession {
             session,
             arti_state,
+            #[cfg(feature = "tokio")]
+            spawner: Arc::new(client_root.runtime().clone()),
         })
     }
 }
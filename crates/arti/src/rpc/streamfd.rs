@@ -0,0 +1,486 @@
+//! Support for opening data streams and sending them to RPC clients as file descriptors.
+//!
+//! When an RPC client reaches us over a Unix domain socket,
+//! it can use the experimental `arti:x_open_stream_fd` method
+//! instead of connecting to our SOCKS port.
+//! We open the stream ourselves, create a socketpair, splice one end of it to the stream,
+//! and send the other end back over the RPC connection as `SCM_RIGHTS` ancillary data.
+//! That saves the client a loopback connection and a SOCKS handshake.
+//!
+//! To make this possible, we give every connection that we accept a [`PendingFds`],
+//! and write its responses with a [`FdPassingWriter`],
+//! which attaches those descriptors to the bytes that it writes.
+
+use std::{
+    io,
+    os::fd::{AsRawFd as _, OwnedFd, RawFd},
+    pin::Pin,
+    sync::Arc,
+    task::{ready, Context, Poll},
+};
+
+use arti_client::{
+    isolation::IsolationHelper, rpc::ConnectWithPrefs, IntoTorAddr as _, StreamPrefs, TorClient,
+};
+use arti_rpcserver::{Connection, PendingFds};
+use derive_deftly::Deftly;
+use futures::{
+    task::{Spawn, SpawnExt as _},
+    AsyncRead, AsyncReadExt as _, AsyncWrite, FutureExt as _,
+};
+use tokio_crate::{io::Interest, net::unix::OwnedWriteHalf};
+use tokio_util::compat::{TokioAsyncReadCompatExt as _, TokioAsyncWriteCompatExt as _};
+use tor_error::into_internal;
+use tor_rpcbase::{self as rpc, RpcError, RpcErrorKind};
+use tor_rtcompat::Runtime;
+
+use super::session::ArtiRpcSession;
+use crate::socks::copy_interactive;
+
+/// The most file descriptors that we attach to a single write.
+///
+/// This must be no more than clients can receive with a single read:
+/// `arti-rpc-client-core` accepts 8.
+const MAX_FDS_PER_WRITE: usize = 8;
+
+/// The writing half of an RPC connection on a Unix domain socket,
+/// which sends the descriptors from a [`PendingFds`] along with its data.
+pub(super) struct FdPassingWriter {
+    /// The socket that we write to.
+    sock: OwnedWriteHalf,
+    /// The connection's queue of descriptors to send.
+    fds: Arc<PendingFds>,
+    /// Descriptors that we have taken from `fds`, but not yet managed to send.
+    sending: Vec<OwnedFd>,
+}
+
+impl FdPassingWriter {
+    /// Wrap `sock`, sending every descriptor that is pushed onto `fds`.
+    pub(super) fn new(sock: OwnedWriteHalf, fds: Arc<PendingFds>) -> Self {
+        Self {
+            sock,
+            fds,
+            sending: Vec::new(),
+        }
+    }
+}
+
+impl AsyncWrite for FdPassingWriter {
+    fn poll_write(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        data: &[u8],
+    ) -> Poll<io::Result<usize>> {
+        use tokio_crate::io::AsyncWrite as _;
+
+        let this = self.get_mut();
+        if this.sending.is_empty() {
+            this.sending = this.fds.take(MAX_FDS_PER_WRITE);
+        }
+        if this.sending.is_empty() || data.is_empty() {
+            return Pin::new(&mut this.sock).poll_write(cx, data);
+        }
+        // If there are still more descriptors to send after these,
+        // send only one byte with these, so that the rest go out before the bytes after it.
+        let data = if this.fds.is_empty() {
+            data
+        } else {
+            &data[..1]
+        };
+
+        let sock = this.sock.as_ref();
+        loop {
+            ready!(sock.poll_write_ready(cx))?;
+            match sock.try_io(Interest::WRITABLE, || {
+                sendmsg_with_fds(sock.as_raw_fd(), data, &this.sending)
+            }) {
+                Ok(n) => {
+                    // The kernel has its own references to the descriptors now.
+                    this.sending.clear();
+                    return Poll::Ready(Ok(n));
+                }
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => continue,
+                Err(e) => return Poll::Ready(Err(e)),
+            }
+        }
+    }
+
+    fn poll_flush(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        use tokio_crate::io::AsyncWrite as _;
+        Pin::new(&mut self.sock).poll_flush(cx)
+    }
+
+    fn poll_close(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        use tokio_crate::io::AsyncWrite as _;
+        Pin::new(&mut self.sock).poll_shutdown(cx)
+    }
+}
+
+/// Space for the ancillary data of a single write, aligned as `cmsghdr` requires.
+#[repr(C)]
+struct CmsgBuf {
+    /// Forces the alignment of `buf`.
+    _align: [libc::cmsghdr; 0],
+    /// The space itself; more than `CMSG_SPACE` of [`MAX_FDS_PER_WRITE`] descriptors.
+    buf: [u8; 256],
+}
+
+/// Write `data` to the socket `sock` without blocking, attaching `fds` as `SCM_RIGHTS`.
+///
+/// Return the number of bytes written.
+/// If any bytes were written, all of `fds` were sent with them.
+fn sendmsg_with_fds(sock: RawFd, data: &[u8], fds: &[OwnedFd]) -> io::Result<usize> {
+    assert!(!fds.is_empty() && fds.len() <= MAX_FDS_PER_WRITE);
+    let mut cmsg_buf = CmsgBuf {
+        _align: [],
+        buf: [0; 256],
+    };
+    let fd_bytes = std::mem::size_of_val(fds) as libc::c_uint;
+    // Safety: CMSG_SPACE only does arithmetic.
+    let cmsg_space = unsafe { libc::CMSG_SPACE(fd_bytes) } as usize;
+    assert!(cmsg_space <= cmsg_buf.buf.len());
+
+    let mut iov = libc::iovec {
+        iov_base: data.as_ptr() as *mut libc::c_void,
+        iov_len: data.len(),
+    };
+    // Safety: msghdr is a plain C struct, for which all-zeroes is a valid value.
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf.buf.as_mut_ptr().cast();
+    // (The type of msg_controllen varies by platform.)
+    msg.msg_controllen = cmsg_space as _;
+
+    // Safety: `msg` has room for one header with `fds.len()` descriptors,
+    // so CMSG_FIRSTHDR returns a header inside `cmsg_buf`, and its data has room for them.
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(fd_bytes) as _;
+        let fd_data = libc::CMSG_DATA(cmsg).cast::<libc::c_int>();
+        for (i, fd) in fds.iter().enumerate() {
+            fd_data.add(i).write_unaligned(fd.as_raw_fd());
+        }
+    }
+
+    loop {
+        // Safety: `msg` refers to `iov` and `cmsg_buf`, which outlive this call.
+        // `iov` refers to `data`, which the kernel only reads.
+        let n = unsafe { libc::sendmsg(sock, &msg, libc::MSG_DONTWAIT) };
+        match usize::try_from(n) {
+            Ok(n) => return Ok(n),
+            Err(_) => {
+                let e = io::Error::last_os_error();
+                if e.kind() != io::ErrorKind::Interrupted {
+                    return Err(e);
+                }
+            }
+        }
+    }
+}
+
+/// Open a data stream to a given target,
+/// and send it back over this RPC connection as a file descriptor.
+///
+/// The stream is one end of a Unix domain socketpair;
+/// Arti relays everything written to it over Tor, and vice versa.
+/// The descriptor reaches the client as `SCM_RIGHTS` ancillary data,
+/// attached to the bytes of this method's reply, or of some reply before it.
+///
+/// The reply is `{"fd_index": N}`,
+/// where `N` is the number of descriptors that Arti sent on this connection before this one.
+///
+/// This method is only available on connections to an RPC listener on a Unix domain socket.
+/// On other connections, it fails with an error saying that it is not implemented.
+///
+/// Like a SOCKS connection made using this object's ID,
+/// the stream is built using this object (a session or a client).
+/// `isolation` plays the same role as a SOCKS password:
+/// streams with different `isolation` never share a circuit.
+#[derive(Debug, serde::Deserialize, Deftly)]
+#[derive_deftly(rpc::DynMethod)]
+#[deftly(rpc(method_name = "arti:x_open_stream_fd"))]
+struct OpenStreamFd {
+    /// The hostname (or address) to connect to.
+    hostname: String,
+    /// The port to connect to.
+    port: u16,
+    /// The isolation string for this stream.
+    #[serde(default)]
+    isolation: String,
+}
+
+impl rpc::RpcMethod for OpenStreamFd {
+    type Output = OpenStreamFdReply;
+    type Update = rpc::NoUpdates;
+}
+
+/// The reply to a successful [`OpenStreamFd`].
+#[derive(Debug, serde::Serialize)]
+struct OpenStreamFdReply {
+    /// The index of the descriptor that holds the new stream.
+    fd_index: u64,
+}
+
+/// An isolation key for streams opened with [`OpenStreamFd`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+struct StreamFdIsolation(Box<str>);
+
+impl IsolationHelper for StreamFdIsolation {
+    fn compatible_same_type(&self, other: &Self) -> bool {
+        self == other
+    }
+
+    fn join_same_type(&self, other: &Self) -> Option<Self> {
+        if self == other {
+            Some(self.clone())
+        } else {
+            None
+        }
+    }
+}
+
+/// An error from creating the socketpair for a stream.
+#[derive(Clone, Debug, thiserror::Error)]
+#[error("Unable to create a socketpair")]
+struct SocketPairError(#[source] Arc<io::Error>);
+
+impl tor_error::HasKind for SocketPairError {
+    fn kind(&self) -> tor_error::ErrorKind {
+        tor_error::ErrorKind::LocalResourceExhausted
+    }
+}
+
+/// Implementation for OpenStreamFd on ArtiRpcSession.
+async fn rpc_session_open_stream_fd(
+    session: Arc<ArtiRpcSession>,
+    method: Box<OpenStreamFd>,
+    ctx: Arc<dyn rpc::Context>,
+) -> Result<OpenStreamFdReply, RpcError> {
+    let spawner = Arc::clone(&session.spawner);
+    open_stream_fd(session, *method, ctx, spawner.as_ref()).await
+}
+rpc::static_rpc_invoke_fn! {rpc_session_open_stream_fd;}
+
+/// Implementation for OpenStreamFd on TorClient.
+async fn client_open_stream_fd<R: Runtime>(
+    client: Arc<TorClient<R>>,
+    method: Box<OpenStreamFd>,
+    ctx: Arc<dyn rpc::Context>,
+) -> Result<OpenStreamFdReply, RpcError> {
+    let runtime = client.runtime().clone();
+    open_stream_fd(client, *method, ctx, &runtime).await
+}
+
+/// Return the [`OpenStreamFd`] implementations that depend on our runtime.
+pub(super) fn rpc_methods<R: Runtime>() -> Vec<rpc::dispatch::InvokerEnt> {
+    rpc::invoker_ent_list![client_open_stream_fd::<R>]
+}
+
+/// Open the stream that `method` asks for, using `object`,
+/// and send it to the client of the connection `ctx`.
+async fn open_stream_fd(
+    object: Arc<dyn rpc::Object>,
+    method: OpenStreamFd,
+    ctx: Arc<dyn rpc::Context>,
+    spawner: &(dyn Spawn + Send + Sync),
+) -> Result<OpenStreamFdReply, RpcError> {
+    // Check this first, so that we don't build a stream that we can't send.
+    let _ = connection_fds(ctx.as_ref())?;
+
+    let target = (method.hostname.as_str(), method.port)
+        .into_tor_addr()
+        .map_err(arti_client::Error::from)?;
+    let mut prefs = StreamPrefs::new();
+    prefs.set_isolation(StreamFdIsolation(method.isolation.into()));
+    let connect = ConnectWithPrefs { target, prefs };
+    let stream = *rpc::invoke_special_method(Arc::clone(&ctx), object, Box::new(connect))
+        .await
+        .map_err(|e| RpcError::from(into_internal!("unable to delegate to RPC object")(e)))?;
+
+    send_stream_fd(ctx.as_ref(), spawner, stream?)
+}
+
+/// Return the queue of descriptors for the client of the connection `ctx`,
+/// or an error if that connection can't send descriptors.
+fn connection_fds(ctx: &dyn rpc::Context) -> Result<Arc<PendingFds>, RpcError> {
+    let not_impl = || {
+        RpcError::new(
+            "This connection can't send file descriptors".to_string(),
+            RpcErrorKind::MethodNotImpl,
+        )
+    };
+    let connection = ctx
+        .lookup_object(&rpc::ObjectId::from("connection"))
+        .map_err(|_| not_impl())?
+        .downcast_arc::<Connection>()
+        .map_err(|_| not_impl())?;
+    connection.pending_fds().cloned().ok_or_else(not_impl)
+}
+
+/// Splice `stream` to one end of a new socketpair,
+/// and queue the other end to be sent to the client of the connection `ctx`.
+fn send_stream_fd<S>(
+    ctx: &dyn rpc::Context,
+    spawner: &(dyn Spawn + Send + Sync),
+    stream: S,
+) -> Result<OpenStreamFdReply, RpcError>
+where
+    S: AsyncRead + AsyncWrite + Send + 'static,
+{
+    let fds = connection_fds(ctx)?;
+    let socket_err = |e| SocketPairError(Arc::new(e));
+
+    let (ours, theirs) = std::os::unix::net::UnixStream::pair().map_err(socket_err)?;
+    ours.set_nonblocking(true).map_err(socket_err)?;
+    let ours = tokio_crate::net::UnixStream::from_std(ours).map_err(socket_err)?;
+    let (ours_r, ours_w) = ours.into_split();
+    let (stream_r, stream_w) = stream.split();
+
+    spawner.spawn(copy_interactive(ours_r.compat(), stream_w).map(|_| ()))?;
+    spawner.spawn(copy_interactive(stream_r, ours_w.compat_write()).map(|_| ()))?;
+
+    let fd_index = fds.push(OwnedFd::from(theirs));
+    Ok(OpenStreamFdReply { fd_index })
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use arti_rpc_client_core::RpcConnBuilder;
+    use arti_rpcserver::RpcMgr;
+    use futures::{task::SpawnExt as _, FutureExt as _};
+    use std::io::{Read as _, Write as _};
+    use tor_rtcompat::PreferredRuntime;
+
+    /// A session whose streams lead to a local echo server, rather than over Tor.
+    #[derive(Deftly)]
+    #[derive_deftly(rpc::Object)]
+    struct EchoSession {
+        /// The runtime that we use to splice streams.
+        runtime: PreferredRuntime,
+    }
+
+    /// Implementation for OpenStreamFd on EchoSession.
+    async fn echo_session_open_stream_fd(
+        session: Arc<EchoSession>,
+        method: Box<OpenStreamFd>,
+        ctx: Arc<dyn rpc::Context>,
+    ) -> Result<OpenStreamFdReply, RpcError> {
+        assert_eq!(method.hostname, "www.example.com");
+        let (stream, mut echo) = std::os::unix::net::UnixStream::pair().unwrap();
+        std::thread::spawn(move || {
+            let mut buf = [0_u8; 64];
+            loop {
+                match echo.read(&mut buf) {
+                    Ok(0) | Err(_) => break,
+                    Ok(n) => echo.write_all(&buf[..n]).unwrap(),
+                }
+            }
+        });
+        stream.set_nonblocking(true).unwrap();
+        let stream = tokio_crate::net::UnixStream::from_std(stream).unwrap();
+        send_stream_fd(ctx.as_ref(), &session.runtime, stream.compat())
+    }
+    rpc::static_rpc_invoke_fn! {echo_session_open_stream_fd;}
+
+    #[test]
+    fn open_stream_fd() {
+        tor_rtcompat::test_with_one_runtime!(|rt| async move {
+            let dir = tempfile::TempDir::new().unwrap();
+            let path = dir.path().join("rpc.sock");
+            let listener = tokio_crate::net::UnixListener::bind(&path).unwrap();
+            let session_rt = rt.clone();
+            let mgr = RpcMgr::new(move |_| {
+                Arc::new(EchoSession {
+                    runtime: session_rt.clone(),
+                }) as Arc<dyn rpc::Object>
+            })
+            .unwrap();
+            rt.spawn(super::super::run_rpc_listener(rt.clone(), listener, mgr).map(|_| ()))
+                .unwrap();
+
+            let (tx, rx) = futures::channel::oneshot::channel();
+            std::thread::spawn(move || {
+                let conn = RpcConnBuilder::new_unix_socket(&path)
+                    .stream_fd_passing(true)
+                    .connect()
+                    .unwrap();
+                // Open two streams at once, to check that each reaches the client that asked.
+                let mut streams: Vec<_> = (0..2)
+                    .map(|_| {
+                        conn.open_stream_fd(None, ("www.example.com", 80), "")
+                            .unwrap()
+                    })
+                    .collect();
+                for (i, s) in streams.iter_mut().enumerate() {
+                    let msg = format!("hello {i}");
+                    s.write_all(msg.as_bytes()).unwrap();
+                    let mut echoed = vec![0_u8; msg.len()];
+                    s.read_exact(&mut echoed).unwrap();
+                    assert_eq!(echoed, msg.as_bytes());
+                }
+                let _ = tx.send(());
+            });
+            rx.await.unwrap();
+        });
+    }
+
+    #[test]
+    fn sendmsg_several_fds() {
+        // Check that our ancillary data is laid out the way the kernel expects.
+        let (a, b) = std::os::unix::net::UnixStream::pair().unwrap();
+        let fds: Vec<OwnedFd> = (0..MAX_FDS_PER_WRITE)
+            .map(|_| std::fs::File::open("/dev/null").unwrap().into())
+            .collect();
+        assert_eq!(sendmsg_with_fds(a.as_raw_fd(), b"x", &fds).unwrap(), 1);
+
+        let mut buf = [0_u8; 4];
+        let mut cmsg_buf = CmsgBuf {
+            _align: [],
+            buf: [0; 256],
+        };
+        let mut iov = libc::iovec {
+            iov_base: buf.as_mut_ptr().cast(),
+            iov_len: buf.len(),
+        };
+        let n_fds = unsafe {
+            let mut msg: libc::msghdr = std::mem::zeroed();
+            msg.msg_iov = &mut iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cmsg_buf.buf.as_mut_ptr().cast();
+            msg.msg_controllen = cmsg_buf.buf.len() as _;
+            assert_eq!(libc::recvmsg(b.as_raw_fd(), &mut msg, 0), 1);
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            assert_eq!((*cmsg).cmsg_type, libc::SCM_RIGHTS);
+            let header_len = libc::CMSG_DATA(cmsg) as usize - cmsg as usize;
+            let n_fds =
+                ((*cmsg).cmsg_len as usize - header_len) / std::mem::size_of::<libc::c_int>();
+            for i in 0..n_fds {
+                let fd = libc::CMSG_DATA(cmsg)
+                    .cast::<libc::c_int>()
+                    .add(i)
+                    .read_unaligned();
+                libc::close(fd);
+            }
+            n_fds
+        };
+        assert_eq!(n_fds, MAX_FDS_PER_WRITE);
+    }
+}
@@ -716,7 +716,7 @@ where
 /// This function assumes that the writer might need to be flushed for
 /// any buffered data to be sent.  It tries to minimize the number of
 /// flushes, however, by only flushing the writer when the reader has no data.
-async fn copy_interactive<R, W>(mut reader: R, mut writer: W) -> IoResult<()>
+pub(crate) async fn copy_interactive<R, W>(mut reader: R, mut writer: W) -> IoResult<()>
 where
     R: AsyncRead + Unpin,
     W: AsyncWrite + Unpin,
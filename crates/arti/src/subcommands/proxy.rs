@@ -150,8 +150,13 @@ async fn run_proxy<R: Runtime>(
         if let Some(listen_path) = rpc_path {
             let (rpc_state, rpc_state_sender) = rpc::RpcVisibleArtiState::new();
             // TODO Conceivably this listener belongs on a renamed "proxy" list.
-            let rpc_mgr =
-                rpc::launch_rpc_listener(&runtime, listen_path, client.clone(), rpc_state)?;
+            let rpc_mgr = rpc::launch_rpc_listener(
+                &runtime,
+                listen_path,
+                arti_config.rpc().max_response_delay,
+                client.clone(),
+                rpc_state,
+            )?;
             Some((rpc_mgr, rpc_state_sender))
         } else {
             None
@@ -0,0 +1,368 @@
+/**
+ * # Equi-X C API header.
+ *
+ * ## What this library does
+ *
+ * Equi-X is the client puzzle that Tor onion services use as a proof of work.
+ * This library exposes the Rust `equix` crate through a set of C functions,
+ * for applications that need to verify or solve Equi-X puzzles
+ * without linking tevador's original C implementation.
+ *
+ * The names here do not overlap with those in tevador's `equix.h`,
+ * so a program can link both implementations at once.
+ *
+ * To build the library, run
+ * `cargo rustc -p equix --release --features ffi --crate-type cdylib`
+ * (or `--crate-type staticlib`).
+ *
+ * ## Using this library
+ *
+ * To check proofs, use `equix_verify_bytes()`,
+ * or `equix_verify_batch()` to check many proofs at once.
+ * Building the HashX program for a challenge costs much more than checking a solution,
+ * and `equix_verify_batch()` builds only one program for each distinct challenge.
+ *
+ * To solve a single challenge, use `equix_solve_with_memory()`.
+ * To search for an acceptable solution by trying many nonces on several threads,
+ * use `equix_solve_parallel()`.
+ * The solver needs about 2 MB of temporary memory for each challenge;
+ * allocate it once with `equix_solver_memory_new()`, and reuse it.
+ *
+ * Except when noted otherwise, all functions in this library are thread-safe.
+ *
+ * ## Error handling
+ *
+ * On success, fallible functions return `EQUIX_STATUS_SUCCESS`.  On failure,
+ * they return some other status code.
+ * Use `equix_status_to_str()` to describe a status code.
+ *
+ * ## Interface conventions
+ *
+ * - All functions check for NULL pointers in their arguments,
+ *   except where a NULL pointer is documented to have some meaning.
+ *   - As in C tor, `foo_free()` functions treat `foo_free(NULL)` as a no-op.
+ *
+ * - All identifiers are prefixed with `EQUIX`, `Equix`, or `equix` as appropriate.
+ *
+ * - Byte strings are passed as a pointer and a length.
+ *   Solutions are always `EQUIX_SOLUTION_BYTES` long.
+ *
+ * ## Correctness requirements
+ *
+ * If any correctness requirements stated here or elsewhere are violated,
+ * it is Undefined Behaviour.
+ * Violations will not be detected by the library.
+ *
+ * - If you pass a non-NULL pointer to a function, the pointer must be properly aligned.
+ *   It must point to valid, initialized data of the correct type and length.
+ * - If you receive a pointer of type `struct Type *`,
+ *   and we do not give you the definition of `struct Type`,
+ *   you must not attempt to dereference the pointer.
+ * - You may not call any `_free()` function on an object that is currently in use.
+ *   After you have `_freed()` an object, you may not use it again.
+ * - All objects passed as input to a library function must not be mutated
+ *   while that function is running.
+ * - An `EquixSolverMemory` may only be used by one function at a time.
+ **/
+
+#ifndef ARTI_EQUIX_H_
+#define ARTI_EQUIX_H_
+
+/* Automatically generated by cbindgen. Don't modify manually. */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The function has returned successfully.
+ */
+#define EQUIX_STATUS_SUCCESS 0
+
+/**
+ * One or more of the inputs to a library function was invalid.
+ */
+#define EQUIX_STATUS_INVALID_INPUT 1
+
+/**
+ * No HashX program can be built for this challenge.
+ *
+ * This happens for a small fraction of challenges.
+ * Solvers must skip such challenges, and verifiers must reject them.
+ */
+#define EQUIX_STATUS_CHALLENGE_UNUSABLE 2
+
+/**
+ * The HashX compiler failed, and `EQUIX_RUNTIME_COMPILE_ONLY` was requested.
+ */
+#define EQUIX_STATUS_COMPILER_FAILED 3
+
+/**
+ * A solution was not well formed: its items were not in the required order.
+ */
+#define EQUIX_STATUS_SOLUTION_ORDER 4
+
+/**
+ * A solution was well formed, but it did not solve its challenge.
+ */
+#define EQUIX_STATUS_SOLUTION_HASH_SUM 5
+
+/**
+ * We tried every nonce that we were allowed to, and found no acceptable solution.
+ */
+#define EQUIX_STATUS_NOT_FOUND 6
+
+/**
+ * Some internal error occurred.
+ */
+#define EQUIX_STATUS_INTERNAL 7
+
+/**
+ * Try to compile each HashX program, and fall back to the interpreter on failure.
+ *
+ * This is the default, and the right choice for most applications.
+ */
+#define EQUIX_RUNTIME_TRY_COMPILE 0
+
+/**
+ * Always use the HashX interpreter.
+ */
+#define EQUIX_RUNTIME_INTERPRET_ONLY 1
+
+/**
+ * Always compile each HashX program; fail with `EQUIX_STATUS_COMPILER_FAILED` if we can't.
+ */
+#define EQUIX_RUNTIME_COMPILE_ONLY 2
+
+/**
+ * Always use the HashX batch interpreter, which evaluates many inputs at once.
+ *
+ * Slower than the compiler, but faster than `EQUIX_RUNTIME_INTERPRET_ONLY` for solving.
+ */
+#define EQUIX_RUNTIME_INTERPRET_BATCH 3
+
+/**
+ * The length of an encoded Equi-X solution, in bytes.
+ */
+#define EQUIX_SOLUTION_BYTES 16
+
+/**
+ * The largest number of solutions that `equix_solve_with_memory` can return for a single challenge.
+ */
+#define EQUIX_MAX_SOLUTIONS 8
+
+/**
+ * The largest nonce that `equix_solve_parallel` can search through, in bytes.
+ */
+#define EQUIX_MAX_NONCE_BYTES 16
+
+/**
+ * A status code returned by an equix function.
+ *
+ * On success, a function will return `EQUIX_STATUS_SUCCESS (0)`.
+ * On failure, a function will return some other status code.
+ */
+typedef uint32_t EquixStatus;
+
+/**
+ * Which HashX runtime to use when building a program for a challenge.
+ */
+typedef uint32_t EquixRuntime;
+
+/**
+ * Reusable memory for the Equi-X solver.
+ *
+ * Solving a challenge needs about 2 MB of temporary memory;
+ * holding on to one of these avoids allocating it for every challenge.
+ *
+ * Create one with `equix_solver_memory_new`, and free it with `equix_solver_memory_free`.
+ *
+ * This type is not thread-safe: you must not use the same `EquixSolverMemory`
+ * from more than one thread at once.
+ */
+typedef struct EquixSolverMemory EquixSolverMemory;
+
+/**
+ * A single proof to check with `equix_verify_batch`.
+ */
+typedef struct EquixProof {
+  /**
+   * The challenge that this proof claims to solve.
+   *
+   * Must point to `challenge_len` readable bytes.
+   */
+  const uint8_t *challenge;
+  /**
+   * The length of `challenge`, in bytes.
+   */
+  size_t challenge_len;
+  /**
+   * The encoded solution to check.
+   */
+  uint8_t solution[EQUIX_SOLUTION_BYTES];
+} EquixProof;
+
+/**
+ * A function that decides whether to accept a solution found by `equix_solve_parallel`.
+ *
+ * It receives the `user_data` given to `equix_solve_parallel`,
+ * the challenge that was solved (including its nonce),
+ * and the solution itself (`EQUIX_SOLUTION_BYTES` long).
+ * It returns nonzero to accept the solution, and zero to keep searching.
+ *
+ * The pointers it receives are only valid until it returns.
+ * It may be called from several threads at once.
+ */
+typedef int (*EquixAcceptFn)(void *user_data,
+                             const uint8_t *challenge,
+                             size_t challenge_len,
+                             const uint8_t *solution);
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/**
+ * Return a string representing the meaning of a given `EquixStatus`.
+ *
+ * The result will always be non-NULL, even if the status is unrecognized.
+ */
+const char *equix_status_to_str(EquixStatus status);
+
+/**
+ * Allocate a new `EquixSolverMemory`.
+ *
+ * The result will always be non-NULL.
+ * It must eventually be freed with `equix_solver_memory_free`.
+ */
+EquixSolverMemory *equix_solver_memory_new(void);
+
+/**
+ * Free an `EquixSolverMemory`.
+ *
+ * (If `mem` is NULL, this is a no-op.)
+ *
+ * # Safety
+ *
+ * `mem` must be NULL, or have been returned by `equix_solver_memory_new`
+ * and not freed since.
+ */
+void equix_solver_memory_free(EquixSolverMemory *mem);
+
+/**
+ * Check whether `solution` (`EQUIX_SOLUTION_BYTES` long) solves `challenge`.
+ *
+ * Return `EQUIX_STATUS_SUCCESS` if it does.
+ * Otherwise, return `EQUIX_STATUS_SOLUTION_ORDER` or `EQUIX_STATUS_SOLUTION_HASH_SUM`
+ * if the solution is wrong,
+ * or `EQUIX_STATUS_CHALLENGE_UNUSABLE` if the challenge can never be solved.
+ *
+ * # Safety
+ *
+ * `challenge` must point to `challenge_len` readable bytes,
+ * and `solution` must point to `EQUIX_SOLUTION_BYTES` readable bytes.
+ */
+EquixStatus equix_verify_bytes(EquixRuntime runtime,
+                               const uint8_t *challenge,
+                               size_t challenge_len,
+                               const uint8_t *solution);
+
+/**
+ * Check every proof in `proofs` (`n_proofs` long).
+ *
+ * Store the outcome for each proof in the corresponding entry of `results_out`
+ * (also `n_proofs` long), using the same status codes as `equix_verify_bytes`.
+ * If `n_valid_out` is non-NULL, set `*n_valid_out` to the number of valid proofs.
+ *
+ * Proofs that share a challenge share a single HashX program,
+ * so a batch that repeats challenges costs much less than verifying each proof on its own.
+ * We only keep one program at a time, however many distinct challenges the batch holds.
+ *
+ * Return `EQUIX_STATUS_SUCCESS` if every result was stored,
+ * whether or not the proofs themselves were valid.
+ *
+ * # Safety
+ *
+ * `proofs` and `results_out` must each point to arrays of `n_proofs` elements,
+ * and the `challenge` of each proof must point to `challenge_len` readable bytes.
+ */
+EquixStatus equix_verify_batch(EquixRuntime runtime,
+                               const EquixProof *proofs,
+                               size_t n_proofs,
+                               EquixStatus *results_out,
+                               size_t *n_valid_out);
+
+/**
+ * Find the solutions to `challenge`.
+ *
+ * Store up to `max_solutions` solutions in `solutions_out`,
+ * one after another, each `EQUIX_SOLUTION_BYTES` long;
+ * set `*n_solutions_out` to the number stored.
+ * (A challenge has at most `EQUIX_MAX_SOLUTIONS` solutions, and often none.)
+ *
+ * If `mem` is non-NULL, use it as the solver's temporary memory;
+ * otherwise, allocate temporary memory for this call alone.
+ *
+ * # Safety
+ *
+ * `challenge` must point to `challenge_len` readable bytes,
+ * `solutions_out` must point to `max_solutions * EQUIX_SOLUTION_BYTES` writable bytes,
+ * and `mem` must be NULL or a valid `EquixSolverMemory` that nothing else is using.
+ */
+EquixStatus equix_solve_with_memory(EquixRuntime runtime,
+                                    const uint8_t *challenge,
+                                    size_t challenge_len,
+                                    EquixSolverMemory *mem,
+                                    uint8_t *solutions_out,
+                                    size_t max_solutions,
+                                    size_t *n_solutions_out);
+
+/**
+ * Search for an acceptable solution to `challenge`, trying many nonces on several threads.
+ *
+ * The nonce is the `nonce_len` bytes of `challenge` starting at `nonce_offset`,
+ * read as a little-endian integer.
+ * (`nonce_len` must be between 1 and `EQUIX_MAX_NONCE_BYTES`.)
+ * Starting from the nonce that `challenge` already holds,
+ * we try up to `max_attempts` consecutive nonces, wrapping around at the end of the nonce field.
+ * We skip nonces for which the challenge is unusable.
+ *
+ * We run one search thread for each of the `n_threads` entries of `mems`,
+ * and each thread uses its entry as its solver memory.
+ * (Entries may be NULL, in which case the thread allocates its own memory.)
+ *
+ * We pass each solution we find to `accept`, until it accepts one.
+ * (If `accept` is NULL, we accept the first solution we find.)
+ * We then store the solution in `solution_out` (`EQUIX_SOLUTION_BYTES` long),
+ * write its nonce back into `challenge`, and return `EQUIX_STATUS_SUCCESS`.
+ * Since the threads race, this is not necessarily the lowest acceptable nonce.
+ *
+ * If no nonce yields an acceptable solution, return `EQUIX_STATUS_NOT_FOUND`,
+ * and leave `challenge` unchanged.
+ *
+ * # Safety
+ *
+ * `challenge` must point to `challenge_len` readable and writable bytes;
+ * `mems` must point to an array of `n_threads` entries,
+ * each of them NULL or a valid `EquixSolverMemory` that nothing else is using;
+ * `solution_out` must point to `EQUIX_SOLUTION_BYTES` writable bytes;
+ * and `accept` must be safe to call with `user_data` from several threads at once.
+ */
+EquixStatus equix_solve_parallel(EquixRuntime runtime,
+                                 uint8_t *challenge,
+                                 size_t challenge_len,
+                                 size_t nonce_offset,
+                                 size_t nonce_len,
+                                 uint64_t max_attempts,
+                                 EquixSolverMemory *const *mems,
+                                 size_t n_threads,
+                                 EquixAcceptFn accept,
+                                 void *user_data,
+                                 uint8_t *solution_out);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  /* ARTI_EQUIX_H_ */
@@ -0,0 +1,816 @@
+//! Exposed C APIs for equix.
+//!
+//! See the top-level documentation in `equix.h` for the conventions
+//! that affect the safety of these functions.
+//! (These include things like "all input pointers must be valid" and so on.)
+
+use std::ffi::{c_char, c_int, c_void};
+use std::panic::{catch_unwind, UnwindSafe};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Mutex;
+
+use crate::{EquiXBuilder, Error, HashError, RuntimeOption, Solution, SolverMemory};
+
+/// A status code returned by an equix function.
+///
+/// On success, a function will return `EQUIX_STATUS_SUCCESS (0)`.
+/// On failure, a function will return some other status code.
+pub type EquixStatus = u32;
+
+/// The function has returned successfully.
+pub const EQUIX_STATUS_SUCCESS: EquixStatus = 0;
+
+/// One or more of the inputs to a library function was invalid.
+pub const EQUIX_STATUS_INVALID_INPUT: EquixStatus = 1;
+
+/// No HashX program can be built for this challenge.
+///
+/// This happens for a small fraction of challenges.
+/// Solvers must skip such challenges, and verifiers must reject them.
+pub const EQUIX_STATUS_CHALLENGE_UNUSABLE: EquixStatus = 2;
+
+/// The HashX compiler failed, and `EQUIX_RUNTIME_COMPILE_ONLY` was requested.
+pub const EQUIX_STATUS_COMPILER_FAILED: EquixStatus = 3;
+
+/// A solution was not well formed: its items were not in the required order.
+pub const EQUIX_STATUS_SOLUTION_ORDER: EquixStatus = 4;
+
+/// A solution was well formed, but it did not solve its challenge.
+pub const EQUIX_STATUS_SOLUTION_HASH_SUM: EquixStatus = 5;
+
+/// We tried every nonce that we were allowed to, and found no acceptable solution.
+pub const EQUIX_STATUS_NOT_FOUND: EquixStatus = 6;
+
+/// Some internal error occurred.
+pub const EQUIX_STATUS_INTERNAL: EquixStatus = 7;
+
+/// Which HashX runtime to use when building a program for a challenge.
+pub type EquixRuntime = u32;
+
+/// Try to compile each HashX program, and fall back to the interpreter on failure.
+///
+/// This is the default, and the right choice for most applications.
+pub const EQUIX_RUNTIME_TRY_COMPILE: EquixRuntime = 0;
+
+/// Always use the HashX interpreter.
+pub const EQUIX_RUNTIME_INTERPRET_ONLY: EquixRuntime = 1;
+
+/// Always compile each HashX program; fail with `EQUIX_STATUS_COMPILER_FAILED` if we can't.
+pub const EQUIX_RUNTIME_COMPILE_ONLY: EquixRuntime = 2;
+
+/// Always use the HashX batch interpreter, which evaluates many inputs at once.
+///
+/// Slower than the compiler, but faster than `EQUIX_RUNTIME_INTERPRET_ONLY` for solving.
+pub const EQUIX_RUNTIME_INTERPRET_BATCH: EquixRuntime = 3;
+
+/// The length of an encoded Equi-X solution, in bytes.
+pub const EQUIX_SOLUTION_BYTES: usize = 16;
+
+/// The largest number of solutions that `equix_solve_with_memory` can return for a single challenge.
+pub const EQUIX_MAX_SOLUTIONS: usize = 8;
+
+// (These are literals, so that cbindgen can see them.)
+const _: () = assert!(EQUIX_SOLUTION_BYTES == Solution::NUM_BYTES);
+const _: () = assert!(EQUIX_MAX_SOLUTIONS == crate::SolutionArray::CAPACITY);
+
+/// The largest nonce that `equix_solve_parallel` can search through, in bytes.
+pub const EQUIX_MAX_NONCE_BYTES: usize = 16;
+
+/// Reusable memory for the Equi-X solver.
+///
+/// Solving a challenge needs about 2 MB of temporary memory;
+/// holding on to one of these avoids allocating it for every challenge.
+///
+/// Create one with `equix_solver_memory_new`, and free it with `equix_solver_memory_free`.
+///
+/// This type is not thread-safe: you must not use the same `EquixSolverMemory`
+/// from more than one thread at once.
+pub type EquixSolverMemory = SolverMemory;
+
+/// A single proof to check with `equix_verify_batch`.
+#[repr(C)]
+#[derive(Clone, Debug)]
+#[allow(clippy::exhaustive_structs)]
+pub struct EquixProof {
+    /// The challenge that this proof claims to solve.
+    ///
+    /// Must point to `challenge_len` readable bytes.
+    pub challenge: *const u8,
+    /// The length of `challenge`, in bytes.
+    pub challenge_len: usize,
+    /// The encoded solution to check.
+    pub solution: [u8; EQUIX_SOLUTION_BYTES],
+}
+
+/// A function that decides whether to accept a solution found by `equix_solve_parallel`.
+///
+/// It receives the `user_data` given to `equix_solve_parallel`,
+/// the challenge that was solved (including its nonce),
+/// and the solution itself (`EQUIX_SOLUTION_BYTES` long).
+/// It returns nonzero to accept the solution, and zero to keep searching.
+///
+/// The pointers it receives are only valid until it returns.
+/// It may be called from several threads at once.
+pub type EquixAcceptFn = unsafe extern "C" fn(
+    user_data: *mut c_void,
+    challenge: *const u8,
+    challenge_len: usize,
+    solution: *const u8,
+) -> c_int;
+
+/// Return a string representing the meaning of a given `EquixStatus`.
+///
+/// The result will always be non-NULL, even if the status is unrecognized.
+#[no_mangle]
+pub extern "C" fn equix_status_to_str(status: EquixStatus) -> *const c_char {
+    match status {
+        EQUIX_STATUS_SUCCESS => c"Success",
+        EQUIX_STATUS_INVALID_INPUT => c"Invalid input",
+        EQUIX_STATUS_CHALLENGE_UNUSABLE => c"No HashX program exists for this challenge",
+        EQUIX_STATUS_COMPILER_FAILED => c"HashX compiler failed",
+        EQUIX_STATUS_SOLUTION_ORDER => c"Solution is not well formed",
+        EQUIX_STATUS_SOLUTION_HASH_SUM => c"Solution does not solve this challenge",
+        EQUIX_STATUS_NOT_FOUND => c"No acceptable solution found",
+        EQUIX_STATUS_INTERNAL => c"Internal error",
+        _ => c"(unrecognized status)",
+    }
+    .as_ptr()
+}
+
+/// Allocate a new `EquixSolverMemory`.
+///
+/// The result will always be non-NULL.
+/// It must eventually be freed with `equix_solver_memory_free`.
+#[no_mangle]
+pub extern "C" fn equix_solver_memory_new() -> *mut EquixSolverMemory {
+    abort_on_panic(|| Box::into_raw(Box::new(SolverMemory::new())))
+}
+
+/// Free an `EquixSolverMemory`.
+///
+/// (If `mem` is NULL, this is a no-op.)
+///
+/// # Safety
+///
+/// `mem` must be NULL, or have been returned by `equix_solver_memory_new`
+/// and not freed since.
+#[no_mangle]
+pub unsafe extern "C" fn equix_solver_memory_free(mem: *mut EquixSolverMemory) {
+    abort_on_panic(|| {
+        if !mem.is_null() {
+            // Safety: `mem` came from Box::into_raw, and has not been freed.
+            drop(unsafe { Box::from_raw(mem) });
+        }
+    });
+}
+
+/// Check whether `solution` (`EQUIX_SOLUTION_BYTES` long) solves `challenge`.
+///
+/// Return `EQUIX_STATUS_SUCCESS` if it does.
+/// Otherwise, return `EQUIX_STATUS_SOLUTION_ORDER` or `EQUIX_STATUS_SOLUTION_HASH_SUM`
+/// if the solution is wrong,
+/// or `EQUIX_STATUS_CHALLENGE_UNUSABLE` if the challenge can never be solved.
+///
+/// # Safety
+///
+/// `challenge` must point to `challenge_len` readable bytes,
+/// and `solution` must point to `EQUIX_SOLUTION_BYTES` readable bytes.
+#[no_mangle]
+pub unsafe extern "C" fn equix_verify_bytes(
+    runtime: EquixRuntime,
+    challenge: *const u8,
+    challenge_len: usize,
+    solution: *const u8,
+) -> EquixStatus {
+    abort_on_panic(|| {
+        let Some(builder) = builder_for(runtime) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        // Safety: our caller guarantees that these point to enough readable bytes.
+        let Some(challenge) = (unsafe { in_bytes(challenge, challenge_len) }) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        let Some(solution) = (unsafe { in_solution(solution) }) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        status_of(builder.verify_bytes(challenge, solution))
+    })
+}
+
+/// Check every proof in `proofs` (`n_proofs` long).
+///
+/// Store the outcome for each proof in the corresponding entry of `results_out`
+/// (also `n_proofs` long), using the same status codes as `equix_verify_bytes`.
+/// If `n_valid_out` is non-NULL, set `*n_valid_out` to the number of valid proofs.
+///
+/// Proofs that share a challenge share a single HashX program,
+/// so a batch that repeats challenges costs much less than verifying each proof on its own.
+/// We only keep one program at a time, however many distinct challenges the batch holds.
+///
+/// Return `EQUIX_STATUS_SUCCESS` if every result was stored,
+/// whether or not the proofs themselves were valid.
+///
+/// # Safety
+///
+/// `proofs` and `results_out` must each point to arrays of `n_proofs` elements,
+/// and the `challenge` of each proof must point to `challenge_len` readable bytes.
+#[no_mangle]
+pub unsafe extern "C" fn equix_verify_batch(
+    runtime: EquixRuntime,
+    proofs: *const EquixProof,
+    n_proofs: usize,
+    results_out: *mut EquixStatus,
+    n_valid_out: *mut usize,
+) -> EquixStatus {
+    abort_on_panic(|| {
+        let Some(builder) = builder_for(runtime) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        if n_proofs == 0 {
+            // Safety: our caller guarantees that this is NULL or valid.
+            if let Some(n_valid_out) = unsafe { n_valid_out.as_mut() } {
+                *n_valid_out = 0;
+            }
+            return EQUIX_STATUS_SUCCESS;
+        }
+        if proofs.is_null() || results_out.is_null() {
+            return EQUIX_STATUS_INVALID_INPUT;
+        }
+        // Safety: our caller guarantees that these are arrays of `n_proofs` elements.
+        let proofs = unsafe { std::slice::from_raw_parts(proofs, n_proofs) };
+        let results = unsafe { std::slice::from_raw_parts_mut(results_out, n_proofs) };
+
+        // First, reject what we can without building any programs,
+        // and collect the rest.
+        let mut pending = Vec::with_capacity(n_proofs);
+        for (index, (proof, result)) in proofs.iter().zip(results.iter_mut()).enumerate() {
+            // Safety: our caller guarantees that each challenge is readable.
+            let Some(challenge) = (unsafe { in_bytes(proof.challenge, proof.challenge_len) })
+            else {
+                *result = EQUIX_STATUS_INVALID_INPUT;
+                continue;
+            };
+            // Check the solution's order before we build any program for it:
+            // that's much cheaper, and it rejects most garbage.
+            match Solution::try_from_bytes(&proof.solution) {
+                Ok(solution) => pending.push((challenge, index, solution)),
+                Err(e) => *result = status_of(Err(e)),
+            }
+        }
+
+        // Then group the rest by challenge, and build one program for each group,
+        // dropping it before we build the next.
+        // (The sort is stable, so each group stays in its original order.)
+        pending.sort_by(|a, b| a.0.cmp(b.0));
+        let mut n_valid = 0;
+        for group in pending.chunk_by(|a, b| a.0 == b.0) {
+            let program = builder.build(group[0].0);
+            for (_, index, solution) in group {
+                let result = match &program {
+                    Ok(equix) => status_of(equix.verify(solution)),
+                    Err(e) => status_of(Err(e.clone())),
+                };
+                if result == EQUIX_STATUS_SUCCESS {
+                    n_valid += 1;
+                }
+                results[*index] = result;
+            }
+        }
+
+        // Safety: our caller guarantees that this is NULL or valid.
+        if let Some(n_valid_out) = unsafe { n_valid_out.as_mut() } {
+            *n_valid_out = n_valid;
+        }
+        EQUIX_STATUS_SUCCESS
+    })
+}
+
+/// Find the solutions to `challenge`.
+///
+/// Store up to `max_solutions` solutions in `solutions_out`,
+/// one after another, each `EQUIX_SOLUTION_BYTES` long;
+/// set `*n_solutions_out` to the number stored.
+/// (A challenge has at most `EQUIX_MAX_SOLUTIONS` solutions, and often none.)
+///
+/// If `mem` is non-NULL, use it as the solver's temporary memory;
+/// otherwise, allocate temporary memory for this call alone.
+///
+/// # Safety
+///
+/// `challenge` must point to `challenge_len` readable bytes,
+/// `solutions_out` must point to `max_solutions * EQUIX_SOLUTION_BYTES` writable bytes,
+/// and `mem` must be NULL or a valid `EquixSolverMemory` that nothing else is using.
+#[no_mangle]
+pub unsafe extern "C" fn equix_solve_with_memory(
+    runtime: EquixRuntime,
+    challenge: *const u8,
+    challenge_len: usize,
+    mem: *mut EquixSolverMemory,
+    solutions_out: *mut u8,
+    max_solutions: usize,
+    n_solutions_out: *mut usize,
+) -> EquixStatus {
+    abort_on_panic(|| {
+        // Safety: our caller guarantees that this is NULL or valid.
+        let Some(n_solutions_out) = (unsafe { n_solutions_out.as_mut() }) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        *n_solutions_out = 0;
+        let Some(builder) = builder_for(runtime) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        // Safety: our caller guarantees that this points to enough readable bytes.
+        let Some(challenge) = (unsafe { in_bytes(challenge, challenge_len) }) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        if max_solutions > 0 && solutions_out.is_null() {
+            return EQUIX_STATUS_INVALID_INPUT;
+        }
+        let equix = match builder.build(challenge) {
+            Ok(equix) => equix,
+            Err(e) => return status_of(Err(e)),
+        };
+
+        let mut local_mem = None;
+        // Safety: our caller guarantees that this is NULL, or valid and unused.
+        let mem = match unsafe { mem.as_mut() } {
+            Some(mem) => mem,
+            None => local_mem.insert(SolverMemory::new()),
+        };
+        let solutions = equix.solve_with_memory(mem);
+
+        let n = solutions.len().min(max_solutions);
+        for (i, solution) in solutions.iter().take(n).enumerate() {
+            // Safety: our caller guarantees that solutions_out has room for max_solutions > i.
+            unsafe {
+                std::ptr::copy_nonoverlapping(
+                    solution.to_bytes().as_ptr(),
+                    solutions_out.add(i * EQUIX_SOLUTION_BYTES),
+                    EQUIX_SOLUTION_BYTES,
+                );
+            }
+        }
+        *n_solutions_out = n;
+        EQUIX_STATUS_SUCCESS
+    })
+}
+
+/// Search for an acceptable solution to `challenge`, trying many nonces on several threads.
+///
+/// The nonce is the `nonce_len` bytes of `challenge` starting at `nonce_offset`,
+/// read as a little-endian integer.
+/// (`nonce_len` must be between 1 and `EQUIX_MAX_NONCE_BYTES`.)
+/// Starting from the nonce that `challenge` already holds,
+/// we try up to `max_attempts` consecutive nonces, wrapping around at the end of the nonce field.
+/// We skip nonces for which the challenge is unusable.
+///
+/// We run one search thread for each of the `n_threads` entries of `mems`,
+/// and each thread uses its entry as its solver memory.
+/// (Entries may be NULL, in which case the thread allocates its own memory.)
+///
+/// We pass each solution we find to `accept`, until it accepts one.
+/// (If `accept` is NULL, we accept the first solution we find.)
+/// We then store the solution in `solution_out` (`EQUIX_SOLUTION_BYTES` long),
+/// write its nonce back into `challenge`, and return `EQUIX_STATUS_SUCCESS`.
+/// Since the threads race, this is not necessarily the lowest acceptable nonce.
+///
+/// If no nonce yields an acceptable solution, return `EQUIX_STATUS_NOT_FOUND`,
+/// and leave `challenge` unchanged.
+///
+/// # Safety
+///
+/// `challenge` must point to `challenge_len` readable and writable bytes;
+/// `mems` must point to an array of `n_threads` entries,
+/// each of them NULL or a valid `EquixSolverMemory` that nothing else is using;
+/// `solution_out` must point to `EQUIX_SOLUTION_BYTES` writable bytes;
+/// and `accept` must be safe to call with `user_data` from several threads at once.
+#[no_mangle]
+#[allow(clippy::too_many_arguments)]
+pub unsafe extern "C" fn equix_solve_parallel(
+    runtime: EquixRuntime,
+    challenge: *mut u8,
+    challenge_len: usize,
+    nonce_offset: usize,
+    nonce_len: usize,
+    max_attempts: u64,
+    mems: *const *mut EquixSolverMemory,
+    n_threads: usize,
+    accept: Option<EquixAcceptFn>,
+    user_data: *mut c_void,
+    solution_out: *mut u8,
+) -> EquixStatus {
+    abort_on_panic(|| {
+        let Some(builder) = builder_for(runtime) else {
+            return EQUIX_STATUS_INVALID_INPUT;
+        };
+        if challenge.is_null()
+            || mems.is_null()
+            || solution_out.is_null()
+            || n_threads == 0
+            || !(1..=EQUIX_MAX_NONCE_BYTES).contains(&nonce_len)
+            || nonce_offset
+                .checked_add(nonce_len)
+                .filter(|&end| end <= challenge_len)
+                .is_none()
+        {
+            return EQUIX_STATUS_INVALID_INPUT;
+        }
+        // Safety: our caller guarantees that these are valid, and not used by anything else.
+        let challenge = unsafe { std::slice::from_raw_parts_mut(challenge, challenge_len) };
+        let mems = unsafe { std::slice::from_raw_parts(mems, n_threads) };
+        let accept = Acceptor { accept, user_data };
+
+        let search = Search {
+            builder: &builder,
+            template: &*challenge,
+            nonce_range: nonce_offset..(nonce_offset + nonce_len),
+            max_attempts,
+            next_attempt: AtomicU64::new(0),
+            done: AtomicBool::new(false),
+            found: Mutex::new(None),
+            accept: &accept,
+        };
+        std::thread::scope(|scope| {
+            for &mem in mems {
+                let mem = SendMem(mem);
+                let search = &search;
+                scope.spawn(move || {
+                    let mem = mem;
+                    let mut local_mem = None;
+                    // Safety: our caller guarantees that each entry is NULL, or valid and unused.
+                    let mem = match unsafe { mem.0.as_mut() } {
+                        Some(mem) => mem,
+                        None => local_mem.insert(SolverMemory::new()),
+                    };
+                    search.run(mem);
+                });
+            }
+        });
+
+        let Some((found_challenge, solution)) =
+            search.found.into_inner().unwrap_or_else(|e| e.into_inner())
+        else {
+            return EQUIX_STATUS_NOT_FOUND;
+        };
+        challenge.copy_from_slice(&found_challenge);
+        // Safety: our caller guarantees that solution_out is EQUIX_SOLUTION_BYTES long.
+        unsafe {
+            std::ptr::copy_nonoverlapping(solution.as_ptr(), solution_out, EQUIX_SOLUTION_BYTES);
+        }
+        EQUIX_STATUS_SUCCESS
+    })
+}
+
+/// The state shared by the threads of one `equix_solve_parallel` call.
+struct Search<'a> {
+    /// The builder to use for each challenge.
+    builder: &'a EquiXBuilder,
+    /// The challenge as our caller gave it to us, holding the first nonce to try.
+    template: &'a [u8],
+    /// The position of the nonce within the challenge.
+    nonce_range: std::ops::Range<usize>,
+    /// The number of nonces to try in total.
+    max_attempts: u64,
+    /// The offset from the first nonce of the next nonce to try.
+    next_attempt: AtomicU64,
+    /// True once some thread has found an acceptable solution.
+    done: AtomicBool,
+    /// The challenge and solution that were accepted, if any.
+    found: Mutex<Option<(Vec<u8>, [u8; EQUIX_SOLUTION_BYTES])>>,
+    /// The function that decides which solutions to accept.
+    accept: &'a Acceptor,
+}
+
+impl Search<'_> {
+    /// Try nonces, until some thread finds an acceptable solution or we run out.
+    fn run(&self, mem: &mut SolverMemory) {
+        let mut challenge = self.template.to_vec();
+        while !self.done.load(Ordering::Relaxed) {
+            let attempt = self.next_attempt.fetch_add(1, Ordering::Relaxed);
+            if attempt >= self.max_attempts {
+                return;
+            }
+            challenge.copy_from_slice(self.template);
+            add_le_bytes(&mut challenge[self.nonce_range.clone()], attempt);
+
+            let Ok(equix) = self.builder.build(&challenge) else {
+                // This challenge is unusable; try another nonce.
+                continue;
+            };
+            for solution in equix.solve_with_memory(mem) {
+                let bytes = solution.to_bytes();
+                if self.accept.accepts(&challenge, &bytes) {
+                    let mut found = self.found.lock().unwrap_or_else(|e| e.into_inner());
+                    if found.is_none() {
+                        *found = Some((challenge.clone(), bytes));
+                    }
+                    self.done.store(true, Ordering::Relaxed);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/// An application's function for accepting solutions, along with its data.
+struct Acceptor {
+    /// The function, or None to accept every solution.
+    accept: Option<EquixAcceptFn>,
+    /// The data to pass to `accept`.
+    user_data: *mut c_void,
+}
+
+// Safety: The caller of `equix_solve_parallel` guarantees that `accept`
+// may be called with `user_data` from several threads at once.
+unsafe impl Sync for Acceptor {}
+
+impl Acceptor {
+    /// Return true if the application accepts `solution` as an answer to `challenge`.
+    fn accepts(&self, challenge: &[u8], solution: &[u8; EQUIX_SOLUTION_BYTES]) -> bool {
+        match self.accept {
+            None => true,
+            // Safety: The pointers are valid for the duration of the call,
+            // and our caller guarantees that `accept` is safe to call with `user_data`.
+            Some(accept) => unsafe {
+                accept(
+                    self.user_data,
+                    challenge.as_ptr(),
+                    challenge.len(),
+                    solution.as_ptr(),
+                ) != 0
+            },
+        }
+    }
+}
+
+/// A pointer to solver memory, which we hand to exactly one search thread.
+struct SendMem(*mut SolverMemory);
+
+// Safety: The caller of `equix_solve_parallel` guarantees that nothing else
+// is using this memory, and we only give it to one thread.
+unsafe impl Send for SendMem {}
+
+/// Add `n` to the little-endian integer in `slice`, wrapping around on overflow.
+fn add_le_bytes(slice: &mut [u8], mut n: u64) {
+    let mut carry = 0_u16;
+    for byte in slice {
+        let sum = u16::from(*byte) + (n & 0xff) as u16 + carry;
+        *byte = sum as u8;
+        carry = sum >> 8;
+        n >>= 8;
+        if n == 0 && carry == 0 {
+            break;
+        }
+    }
+}
+
+/// Return an `EquiXBuilder` for `runtime`, or None if `runtime` is not recognized.
+fn builder_for(runtime: EquixRuntime) -> Option<EquiXBuilder> {
+    let option = match runtime {
+        EQUIX_RUNTIME_TRY_COMPILE => RuntimeOption::TryCompile,
+        EQUIX_RUNTIME_INTERPRET_ONLY => RuntimeOption::InterpretOnly,
+        EQUIX_RUNTIME_COMPILE_ONLY => RuntimeOption::CompileOnly,
+        EQUIX_RUNTIME_INTERPRET_BATCH => RuntimeOption::InterpretBatch,
+        _ => return None,
+    };
+    let mut builder = EquiXBuilder::new();
+    builder.runtime(option);
+    Some(builder)
+}
+
+/// Return the `EquixStatus` for the outcome of a verification.
+fn status_of(outcome: Result<(), Error>) -> EquixStatus {
+    match outcome {
+        Ok(()) => EQUIX_STATUS_SUCCESS,
+        Err(Error::Order) => EQUIX_STATUS_SOLUTION_ORDER,
+        Err(Error::HashSum) => EQUIX_STATUS_SOLUTION_HASH_SUM,
+        Err(Error::Hash(HashError::ProgramConstraints)) => EQUIX_STATUS_CHALLENGE_UNUSABLE,
+        Err(Error::Hash(HashError::Compiler(_))) => EQUIX_STATUS_COMPILER_FAILED,
+        Err(Error::Hash(_)) => EQUIX_STATUS_INTERNAL,
+    }
+}
+
+/// Return the `len` bytes at `ptr` as a slice, or None if `ptr` is NULL.
+///
+/// (If `len` is zero, `ptr` may be NULL.)
+///
+/// # Safety
+///
+/// If `ptr` is non-NULL, it must point to `len` readable bytes,
+/// which must stay valid and unmodified for the lifetime `'a`.
+unsafe fn in_bytes<'a>(ptr: *const u8, len: usize) -> Option<&'a [u8]> {
+    if len == 0 {
+        Some(&[])
+    } else if ptr.is_null() {
+        None
+    } else {
+        // Safety: guaranteed by our caller.
+        Some(unsafe { std::slice::from_raw_parts(ptr, len) })
+    }
+}
+
+/// Return the solution at `ptr`, or None if `ptr` is NULL.
+///
+/// # Safety
+///
+/// If `ptr` is non-NULL, it must point to `EQUIX_SOLUTION_BYTES` readable bytes,
+/// which must stay valid and unmodified for the lifetime `'a`.
+unsafe fn in_solution<'a>(ptr: *const u8) -> Option<&'a [u8; EQUIX_SOLUTION_BYTES]> {
+    // Safety: guaranteed by our caller.
+    unsafe { ptr.cast::<[u8; EQUIX_SOLUTION_BYTES]>().as_ref() }
+}
+
+/// Run `body` and catch panics.  If one occurs, abort the process.
+///
+/// We wrap the body of every C ffi function with this function,
+/// even if we do not think that the body can actually panic,
+/// since unwinding into C is undefined behavior.
+fn abort_on_panic<F, T>(body: F) -> T
+where
+    F: FnOnce() -> T + UnwindSafe,
+{
+    #[allow(clippy::print_stderr)]
+    match catch_unwind(body) {
+        Ok(x) => x,
+        Err(_panic_info) => {
+            eprintln!("Internal panic in equix library: aborting!");
+            std::process::abort();
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    #[test]
+    fn le_bytes() {
+        let mut b = [0xff, 0xff, 0x00];
+        add_le_bytes(&mut b, 1);
+        assert_eq!(b, [0x00, 0x00, 0x01]);
+        let mut b = [0xfe, 0xff];
+        add_le_bytes(&mut b, 0x0103);
+        assert_eq!(b, [0x01, 0x01]);
+        let mut b = [0x01];
+        add_le_bytes(&mut b, 0x1ff);
+        assert_eq!(b, [0x00]);
+    }
+
+    #[test]
+    fn solve_and_verify() {
+        let challenge = 0_u32.to_le_bytes();
+        let mut solutions = [0_u8; EQUIX_SOLUTION_BYTES * EQUIX_MAX_SOLUTIONS];
+        let mut n = 0;
+        let mem = equix_solver_memory_new();
+        let status = unsafe {
+            equix_solve_with_memory(
+                EQUIX_RUNTIME_TRY_COMPILE,
+                challenge.as_ptr(),
+                challenge.len(),
+                mem,
+                solutions.as_mut_ptr(),
+                EQUIX_MAX_SOLUTIONS,
+                &mut n,
+            )
+        };
+        unsafe { equix_solver_memory_free(mem) };
+        assert_eq!(status, EQUIX_STATUS_SUCCESS);
+        assert_eq!(n, 1);
+
+        let mut solution = [0_u8; EQUIX_SOLUTION_BYTES];
+        solution.copy_from_slice(&solutions[..EQUIX_SOLUTION_BYTES]);
+        let status = unsafe {
+            equix_verify_bytes(
+                EQUIX_RUNTIME_INTERPRET_ONLY,
+                challenge.as_ptr(),
+                challenge.len(),
+                solution.as_ptr(),
+            )
+        };
+        assert_eq!(status, EQUIX_STATUS_SUCCESS);
+
+        // A batch with a repeated challenge, an unordered solution, and a wrong one.
+        let mut unordered = solution;
+        unordered.swap(0, 2);
+        unordered.swap(1, 3);
+        let other_challenge = 1_u32.to_le_bytes();
+        let proof = |c: &[u8], solution| EquixProof {
+            challenge: c.as_ptr(),
+            challenge_len: c.len(),
+            solution,
+        };
+        let proofs = [
+            proof(&challenge, solution),
+            proof(&challenge, unordered),
+            proof(&other_challenge, solution),
+            proof(&challenge, solution),
+        ];
+        let mut results = [EQUIX_STATUS_INTERNAL; 4];
+        let mut n_valid = 0;
+        let status = unsafe {
+            equix_verify_batch(
+                EQUIX_RUNTIME_TRY_COMPILE,
+                proofs.as_ptr(),
+                proofs.len(),
+                results.as_mut_ptr(),
+                &mut n_valid,
+            )
+        };
+        assert_eq!(status, EQUIX_STATUS_SUCCESS);
+        assert_eq!(
+            results,
+            [
+                EQUIX_STATUS_SUCCESS,
+                EQUIX_STATUS_SOLUTION_ORDER,
+                EQUIX_STATUS_SOLUTION_HASH_SUM,
+                EQUIX_STATUS_SUCCESS
+            ]
+        );
+        assert_eq!(n_valid, 2);
+    }
+
+    /// An `EquixAcceptFn` that accepts solutions whose first byte is even.
+    unsafe extern "C" fn accept_even(
+        user_data: *mut c_void,
+        _challenge: *const u8,
+        _challenge_len: usize,
+        solution: *const u8,
+    ) -> c_int {
+        let calls = unsafe { &*user_data.cast::<AtomicU64>() };
+        calls.fetch_add(1, Ordering::Relaxed);
+        c_int::from(unsafe { *solution } % 2 == 0)
+    }
+
+    #[test]
+    fn solve_parallel() {
+        // A prefix, a two-byte nonce, and a suffix.
+        let mut challenge = *b"prefix\x00\x00suffix";
+        let mems = [equix_solver_memory_new(), std::ptr::null_mut()];
+        let calls = AtomicU64::new(0);
+        let mut solution = [0_u8; EQUIX_SOLUTION_BYTES];
+        let status = unsafe {
+            equix_solve_parallel(
+                EQUIX_RUNTIME_TRY_COMPILE,
+                challenge.as_mut_ptr(),
+                challenge.len(),
+                6,
+                2,
+                1000,
+                mems.as_ptr(),
+                mems.len(),
+                Some(accept_even),
+                std::ptr::addr_of!(calls).cast_mut().cast(),
+                solution.as_mut_ptr(),
+            )
+        };
+        unsafe { equix_solver_memory_free(mems[0]) };
+        assert_eq!(status, EQUIX_STATUS_SUCCESS);
+        assert!(calls.load(Ordering::Relaxed) >= 1);
+        assert_eq!(solution[0] % 2, 0);
+        assert_eq!(&challenge[..6], b"prefix");
+        assert_eq!(&challenge[8..], b"suffix");
+        let status = unsafe {
+            equix_verify_bytes(
+                EQUIX_RUNTIME_TRY_COMPILE,
+                challenge.as_ptr(),
+                challenge.len(),
+                solution.as_ptr(),
+            )
+        };
+        assert_eq!(status, EQUIX_STATUS_SUCCESS);
+
+        // With no attempts allowed, we find nothing.
+        let before = challenge;
+        let status = unsafe {
+            equix_solve_parallel(
+                EQUIX_RUNTIME_TRY_COMPILE,
+                challenge.as_mut_ptr(),
+                challenge.len(),
+                6,
+                2,
+                0,
+                mems[1..].as_ptr(),
+                1,
+                None,
+                std::ptr::null_mut(),
+                solution.as_mut_ptr(),
+            )
+        };
+        assert_eq!(status, EQUIX_STATUS_NOT_FOUND);
+        assert_eq!(challenge, before);
+    }
+}
@@ -47,6 +47,9 @@ mod err;
 mod solution;
 mod solver;
 
+#[cfg(feature = "ffi")]
+pub mod ffi;
+
 // Export bucket_array::mem API only to the fuzzer.
 // (This is not stable; you should not use it except for testing.)
 #[cfg(feature = "bucket-array")]
@@ -8,7 +8,7 @@ use crate::bucket_array::{
     hash::Insert, hash::KeyValueBucketArray, mem::BucketArrayMemory, mem::Uninit,
 };
 use crate::collision::{self, PackedCollision};
-use crate::solution::{self, HashValue, Solution, SolutionArray, SolutionItem, EQUIHASH_N};
+use crate::solution::{HashValue, Solution, SolutionArray, SolutionItem, EQUIHASH_N};
 use arrayvec::ArrayVec;
 use hashx::HashX;
 
@@ -125,6 +125,12 @@ struct OverlaySecond {
     layer2_values: Layer2ValueMem,
 }
 
+/// Number of [`SolutionItem`] values to hash at once while filling [`Layer0`]
+const HASH_BATCH: usize = 256;
+
+// The batches must exactly cover the full range of [`SolutionItem`] values.
+const _: () = assert!((SolutionItem::MAX as usize + 1) % HASH_BATCH == 0);
+
 /// Search for solutions, iterating the entire [`SolutionItem`] space and using
 /// temporary memory to locate partial sum collisions at each tree layer.
 pub(crate) fn find_solutions(func: &HashX, mem: &mut SolverMemory, results: &mut SolutionArray) {
@@ -133,9 +139,17 @@ pub(crate) fn find_solutions(func: &HashX, mem: &mut SolverMemory, results: &mut
 
     // Enumerate all hash values into the first layer
     let mut layer0 = Layer0::new(&mut overlay.layer0_keys, &mut mem.heap.layer0_values);
-    for item in SolutionItem::MIN..=SolutionItem::MAX {
-        let hash = solution::item_hash(func, item);
-        let _ = layer0.insert(hash, item);
+    // Hash in batches, so the batch interpreter can evaluate many items at once
+    let mut inputs = [0_u64; HASH_BATCH];
+    let mut hashes: [HashValue; HASH_BATCH] = [0; HASH_BATCH];
+    for first in (0..=SolutionItem::MAX as usize).step_by(HASH_BATCH) {
+        for (i, input) in inputs.iter_mut().enumerate() {
+            *input = (first + i) as u64;
+        }
+        func.hash_many_into(&inputs, &mut hashes);
+        for (i, hash) in hashes.iter().enumerate() {
+            let _ = layer0.insert(*hash, (first + i) as SolutionItem);
+        }
     }
 
     // Now form the first layer of the Equihash tree,
@@ -43,6 +43,7 @@ fn hashx_bench(c: &mut Criterion) {
 
     runtimes_bench_generate(&mut c.benchmark_group("generate"), &runtimes);
     runtimes_bench_hash(&mut c.benchmark_group("hash"), &runtimes);
+    runtimes_bench_hash_many(&mut c.benchmark_group("hash-many"));
 }
 
 fn runtimes_bench_generate(group: &mut BenchmarkGroup<'_, WallTime>, runtimes: &[Runtime]) {
@@ -124,6 +125,48 @@ fn runtimes_bench_hash(group: &mut BenchmarkGroup<'_, WallTime>, runtimes: &[Run
     }
 }
 
+/// Number of inputs to hash at once with `hash_many`, for each seed
+const HASH_MANY_INPUTS: u64 = 1 << 12;
+
+fn runtimes_bench_hash_many(group: &mut BenchmarkGroup<'_, WallTime>) {
+    // Batch evaluation with each runtime, including the batch interpreter
+    // that stands in for the compiler when it's unavailable.
+    let mut options = vec![
+        (RuntimeOption::InterpretOnly, "interp"),
+        (RuntimeOption::InterpretBatch, "interp-batch"),
+    ];
+    #[cfg(any(target_arch = "aarch64", target_arch = "x86_64"))]
+    options.push((RuntimeOption::CompileOnly, std::env::consts::ARCH));
+
+    let inputs: Vec<u64> = (0..HASH_MANY_INPUTS).collect();
+    let mut output = vec![0_u64; inputs.len()];
+    let mut rng = StdRng::from_entropy();
+    let mut seed = [0u8; 4];
+
+    for (option, name) in options {
+        group.bench_function(format!("{}-hash-many", name), |b| {
+            b.iter_custom(|seed_iters| {
+                let mut total_timer: Duration = Default::default();
+                for _ in 0..seed_iters {
+                    let instance = loop {
+                        rng.fill_bytes(&mut seed);
+                        match HashXBuilder::new().runtime(option).build(&seed) {
+                            Ok(hashx) => break hashx,
+                            Err(Error::ProgramConstraints) => continue,
+                            Err(e) => panic!("{:?}", e),
+                        }
+                    };
+                    let seed_timer = Instant::now();
+                    instance.hash_many_into(black_box(&inputs), &mut output);
+                    black_box(&output);
+                    total_timer += seed_timer.elapsed();
+                }
+                total_timer / HASH_MANY_INPUTS as u32
+            })
+        });
+    }
+}
+
 fn bench_generate<F: FnMut([u8; 32]) -> T + Copy, T>(
     group: &mut BenchmarkGroup<'_, WallTime>,
     generate: F,
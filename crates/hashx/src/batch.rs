@@ -0,0 +1,356 @@
+//! Batch evaluation of HashX programs, on several inputs at once
+//!
+//! The interpreter in [`crate::program`] computes one hash at a time, and
+//! most of its time goes to dispatching instructions. Here we run the same
+//! program on [`LANES`] inputs together, keeping each register as an array
+//! with one element per lane. Each instruction is dispatched once per batch,
+//! and the per-lane arithmetic is written as simple loops over arrays which
+//! the compiler can turn into SIMD instructions.
+//!
+//! Branches are the one place where lanes can disagree. HashX takes at most
+//! one branch per hash, always back to the most recent `Target`. When some
+//! lanes take a branch, we re-run the instructions between the target and
+//! the branch with a write mask covering only those lanes, and then carry
+//! on with every lane together. (Lanes that have already taken their branch
+//! can't take another, so the re-run never needs to test for branches.)
+//!
+//! On x86_64 we build a second copy of this code with AVX2 enabled, and
+//! choose between the copies at runtime. Other targets use the vector
+//! instructions in their baseline, such as NEON on aarch64.
+
+// Loops over lanes are clearest as plain index loops, and vectorize well that way.
+#![allow(clippy::needless_range_loop)]
+
+use crate::program::{Instruction, InstructionArray, Program};
+use crate::register::NUM_REGISTERS;
+use crate::siphash::SipState;
+
+/// Number of inputs that we hash at once
+pub(crate) const LANES: usize = 8;
+
+/// One 64-bit value for each lane
+type Lanes = [u64; LANES];
+
+/// Values for all registers, in all lanes
+type LaneRegisters = [Lanes; NUM_REGISTERS];
+
+/// A write mask that includes every lane
+const ALL_LANES: Lanes = [u64::MAX; LANES];
+
+/// Compute the first 64-bit word of the hash of each input, into `output`.
+///
+/// `inputs` and `output` must have the same length.
+pub(crate) fn hash_many_into(program: &Program, key: SipState, inputs: &[u64], output: &mut [u64]) {
+    debug_assert_eq!(inputs.len(), output.len());
+
+    #[cfg(target_arch = "x86_64")]
+    if std::arch::is_x86_feature_detected!("avx2") {
+        // SAFETY: We just checked that this CPU supports AVX2.
+        unsafe { hash_many_into_avx2(program.into(), key, inputs, output) };
+        return;
+    }
+
+    hash_many_into_generic(program.into(), key, inputs, output);
+}
+
+/// [`hash_many_into_generic()`], compiled with AVX2 instructions enabled
+///
+/// # Safety
+///
+/// The CPU must support AVX2.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+unsafe fn hash_many_into_avx2(
+    program: &InstructionArray,
+    key: SipState,
+    inputs: &[u64],
+    output: &mut [u64],
+) {
+    hash_many_into_generic(program, key, inputs, output);
+}
+
+/// Compute hashes one batch of [`LANES`] inputs at a time.
+///
+/// A final partial batch is padded with zeroes, and its extra results discarded.
+#[inline(always)]
+fn hash_many_into_generic(
+    program: &InstructionArray,
+    key: SipState,
+    inputs: &[u64],
+    output: &mut [u64],
+) {
+    for (inputs, output) in inputs.chunks(LANES).zip(output.chunks_mut(LANES)) {
+        let mut lane_inputs = [0_u64; LANES];
+        lane_inputs[..inputs.len()].copy_from_slice(inputs);
+        let mut regs = init_registers(key, &lane_inputs);
+        interpret(program, &mut regs);
+        let digest = digest_first_word(key, &regs);
+        output.copy_from_slice(&digest[..output.len()]);
+    }
+}
+
+/// Four [`Lanes`] of SipHash state
+#[derive(Clone, Copy)]
+struct SipLanes {
+    /// State word v0, in each lane
+    v0: Lanes,
+    /// State word v1, in each lane
+    v1: Lanes,
+    /// State word v2, in each lane
+    v2: Lanes,
+    /// State word v3, in each lane
+    v3: Lanes,
+}
+
+impl SipLanes {
+    /// Start with the same state in every lane.
+    #[inline(always)]
+    fn splat(key: SipState) -> Self {
+        Self {
+            v0: [key.v0; LANES],
+            v1: [key.v1; LANES],
+            v2: [key.v2; LANES],
+            v3: [key.v3; LANES],
+        }
+    }
+
+    /// One `SipRound`, in every lane, as in [`SipState::sip_round()`]
+    #[inline(always)]
+    fn sip_round(&mut self) {
+        for i in 0..LANES {
+            let mut s = SipState {
+                v0: self.v0[i],
+                v1: self.v1[i],
+                v2: self.v2[i],
+                v3: self.v3[i],
+            };
+            s.sip_round();
+            self.v0[i] = s.v0;
+            self.v1[i] = s.v1;
+            self.v2[i] = s.v2;
+            self.v3[i] = s.v3;
+        }
+    }
+}
+
+/// Set up the registers for each lane, as in [`crate::register::RegisterFile::new()`].
+#[inline(always)]
+fn init_registers(key: SipState, inputs: &Lanes) -> LaneRegisters {
+    let mut s = SipLanes::splat(key);
+    for i in 0..LANES {
+        s.v1[i] ^= 0xee;
+        s.v3[i] ^= inputs[i];
+    }
+    s.sip_round();
+    s.sip_round();
+    for i in 0..LANES {
+        s.v0[i] ^= inputs[i];
+        s.v2[i] ^= 0xee;
+    }
+    s.sip_round();
+    s.sip_round();
+    s.sip_round();
+    s.sip_round();
+
+    let mut t = s;
+    for i in 0..LANES {
+        t.v1[i] ^= 0xdd;
+    }
+    t.sip_round();
+    t.sip_round();
+    t.sip_round();
+    t.sip_round();
+
+    [s.v0, s.v1, s.v2, s.v3, t.v0, t.v1, t.v2, t.v3]
+}
+
+/// Compute the first output word for each lane,
+/// as in [`crate::register::RegisterFile::digest()`].
+#[inline(always)]
+fn digest_first_word(key: SipState, regs: &LaneRegisters) -> Lanes {
+    let mut x = SipLanes::splat(key);
+    let mut y = SipLanes::splat(key);
+    for i in 0..LANES {
+        x.v0[i] = regs[0][i].wrapping_add(key.v0);
+        x.v1[i] = regs[1][i].wrapping_add(key.v1);
+        x.v2[i] = regs[2][i];
+        x.v3[i] = regs[3][i];
+        y.v0[i] = regs[4][i];
+        y.v1[i] = regs[5][i];
+        y.v2[i] = regs[6][i].wrapping_add(key.v2);
+        y.v3[i] = regs[7][i].wrapping_add(key.v3);
+    }
+    x.sip_round();
+    y.sip_round();
+    let mut result = [0_u64; LANES];
+    for i in 0..LANES {
+        result[i] = x.v0[i] ^ y.v0[i];
+    }
+    result
+}
+
+/// Run `program` from start to finish in every lane, with up to one branch per lane.
+///
+/// This has the same behavior as [`Program::interpret()`] in each lane.
+#[inline(always)]
+fn interpret(program: &InstructionArray, regs: &mut LaneRegisters) {
+    let mut branch_target = None;
+    let mut allow_branch = [true; LANES];
+    let mut mulh_result = [0_u32; LANES];
+
+    for (pc, inst) in program.iter().enumerate() {
+        match inst {
+            Instruction::Target => branch_target = Some(pc),
+            Instruction::Branch { mask } => {
+                let mut taken = [0_u64; LANES];
+                let mut any_taken = false;
+                for i in 0..LANES {
+                    if allow_branch[i] && (mask & mulh_result[i]) == 0 {
+                        allow_branch[i] = false;
+                        taken[i] = u64::MAX;
+                        any_taken = true;
+                    }
+                }
+                if any_taken {
+                    let target = branch_target
+                        .expect("generated programs always have a target before branch");
+                    for inst in &program[target..pc] {
+                        execute::<true>(inst, regs, &mut mulh_result, &taken);
+                    }
+                }
+            }
+            inst => execute::<false>(inst, regs, &mut mulh_result, &ALL_LANES),
+        }
+    }
+}
+
+/// Run one non-branching instruction in the lanes included by `mask`.
+///
+/// If `MASKED` is false, `mask` must be [`ALL_LANES`], and we ignore it.
+/// `Target` and `Branch` instructions do nothing here.
+#[inline(always)]
+fn execute<const MASKED: bool>(
+    inst: &Instruction,
+    regs: &mut LaneRegisters,
+    mulh_result: &mut [u32; LANES],
+    mask: &Lanes,
+) {
+    /// Common implementation for lane-wise operations on two registers
+    macro_rules! binary_reg_op {
+        ($dst:ident, $src:ident, |$a:ident, $b:ident| $op:expr) => {{
+            let a = regs[$dst.as_usize()];
+            let b = regs[$src.as_usize()];
+            let mut r = [0_u64; LANES];
+            for i in 0..LANES {
+                let ($a, $b) = (a[i], b[i]);
+                r[i] = $op;
+            }
+            store::<MASKED>(&mut regs[$dst.as_usize()], &r, mask);
+        }};
+    }
+
+    /// Common implementation for lane-wise operations on one register
+    macro_rules! unary_op {
+        ($dst:ident, |$a:ident| $op:expr) => {{
+            let a = regs[$dst.as_usize()];
+            let mut r = [0_u64; LANES];
+            for i in 0..LANES {
+                let $a = a[i];
+                r[i] = $op;
+            }
+            store::<MASKED>(&mut regs[$dst.as_usize()], &r, mask);
+        }};
+    }
+
+    /// Common implementation for wide multiply operations
+    ///
+    /// This stores the low 32 bits of each result for later branch tests.
+    macro_rules! mulh_op {
+        ($dst:ident, $src:ident, $sign:ty, $wide:ty) => {{
+            let a = regs[$dst.as_usize()];
+            let b = regs[$src.as_usize()];
+            let mut r = [0_u64; LANES];
+            for i in 0..LANES {
+                let wa = <$wide>::from(a[i] as $sign);
+                let wb = <$wide>::from(b[i] as $sign);
+                r[i] = (wa.wrapping_mul(wb) >> 64) as u64;
+                if !MASKED || mask[i] != 0 {
+                    mulh_result[i] = r[i] as u32;
+                }
+            }
+            store::<MASKED>(&mut regs[$dst.as_usize()], &r, mask);
+        }};
+    }
+
+    match inst {
+        Instruction::Target | Instruction::Branch { .. } => {}
+        Instruction::AddShift {
+            dst,
+            src,
+            left_shift,
+        } => binary_reg_op!(dst, src, |a, b| a
+            .wrapping_add(b.wrapping_shl((*left_shift).into()))),
+        Instruction::Rotate { dst, right_rotate } => {
+            unary_op!(dst, |a| a.rotate_right((*right_rotate).into()));
+        }
+        Instruction::Mul { dst, src } => binary_reg_op!(dst, src, |a, b| a.wrapping_mul(b)),
+        Instruction::Sub { dst, src } => binary_reg_op!(dst, src, |a, b| a.wrapping_sub(b)),
+        Instruction::Xor { dst, src } => binary_reg_op!(dst, src, |a, b| a ^ b),
+        Instruction::UMulH { dst, src } => mulh_op!(dst, src, u64, u128),
+        Instruction::SMulH { dst, src } => mulh_op!(dst, src, i64, i128),
+        Instruction::XorConst { dst, src } => {
+            let b_sign_extended = i64::from(*src) as u64;
+            unary_op!(dst, |a| a ^ b_sign_extended);
+        }
+        Instruction::AddConst { dst, src } => {
+            let b_sign_extended = i64::from(*src) as u64;
+            unary_op!(dst, |a| a.wrapping_add(b_sign_extended));
+        }
+    }
+}
+
+/// Store `value` into the lanes of `dst` that are included by `mask`.
+///
+/// If `MASKED` is false, store into every lane.
+#[inline(always)]
+fn store<const MASKED: bool>(dst: &mut Lanes, value: &Lanes, mask: &Lanes) {
+    if MASKED {
+        for i in 0..LANES {
+            dst[i] ^= (dst[i] ^ value[i]) & mask[i];
+        }
+    } else {
+        *dst = *value;
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::LANES;
+    use crate::{HashXBuilder, RuntimeOption};
+
+    #[test]
+    fn batch_matches_scalar() {
+        // Enough seeds that some lanes take a branch while others don't.
+        for seed in 0_u32..64 {
+            let seed = seed.to_le_bytes();
+            let Ok(scalar) = HashXBuilder::new()
+                .runtime(RuntimeOption::InterpretOnly)
+                .build(&seed)
+            else {
+                continue;
+            };
+            let batch = HashXBuilder::new()
+                .runtime(RuntimeOption::InterpretBatch)
+                .build(&seed)
+                .expect("same seed built before");
+
+            // Include a partial batch at the end.
+            let inputs: Vec<u64> = (0..(LANES as u64 * 40 + 3))
+                .map(|i| i.wrapping_mul(0x9e37_79b9_7f4a_7c15))
+                .collect();
+            let expected: Vec<u64> = inputs.iter().map(|&i| scalar.hash_to_u64(i)).collect();
+            assert_eq!(batch.hash_many(&inputs), expected);
+            assert_eq!(scalar.hash_many(&inputs), expected);
+        }
+    }
+}
@@ -41,6 +41,7 @@
 #![allow(clippy::needless_raw_string_hashes)] // complained-about code is fine, often best
 //! <!-- @@ end lint list maintained by maint/add_warning @@ -->
 
+mod batch;
 mod compiler;
 mod constraints;
 mod err;
@@ -65,10 +66,20 @@ pub use crate::siphash::SipState;
 pub enum RuntimeOption {
     /// Choose the interpreted runtime, without trying the compiler at all.
     InterpretOnly,
+    /// Choose the interpreted runtime, without trying the compiler at all,
+    /// and use a batch interpreter for [`HashX::hash_many()`].
+    ///
+    /// The batch interpreter runs the program on several inputs at once,
+    /// using SIMD instructions where the CPU has them.
+    /// It gives the same results as [`RuntimeOption::InterpretOnly`], faster.
+    InterpretBatch,
     /// Choose the compiled runtime only, and fail if it experiences any errors.
     CompileOnly,
     /// Always try the compiler first but fall back to the interpreter on error.
     /// (This is the default)
+    ///
+    /// The fallback interpreter uses batch evaluation for [`HashX::hash_many()`],
+    /// as with [`RuntimeOption::InterpretBatch`].
     #[default]
     TryCompile,
 }
@@ -113,6 +124,9 @@ pub struct HashX {
 enum RuntimeProgram {
     /// Select the interpreted runtime, and hold a Program for it to run.
     Interpret(Program),
+    /// Select the interpreted runtime with batch evaluation,
+    /// and hold a Program for it to run.
+    InterpretBatch(Program),
     /// Select the compiled runtime, and hold an executable code page.
     Compiled(Executable),
 }
@@ -134,7 +148,7 @@ impl HashX {
     /// [`HashXBuilder`].
     pub fn runtime(&self) -> Runtime {
         match &self.program {
-            RuntimeProgram::Interpret(_) => Runtime::Interpret,
+            RuntimeProgram::Interpret(_) | RuntimeProgram::InterpretBatch(_) => Runtime::Interpret,
             RuntimeProgram::Compiled(_) => Runtime::Compiled,
         }
     }
@@ -144,6 +158,36 @@ impl HashX {
         self.hash_to_regs(input).digest(self.register_key)[0]
     }
 
+    /// Calculate the first 64-bit word of the hash for each of several inputs.
+    ///
+    /// This gives the same results as calling [`Self::hash_to_u64()`] on each input.
+    /// When the interpreter is in use, it is faster, unless the
+    /// interpreter was chosen with [`RuntimeOption::InterpretOnly`].
+    pub fn hash_many(&self, inputs: &[u64]) -> Vec<u64> {
+        let mut output = vec![0; inputs.len()];
+        self.hash_many_into(inputs, &mut output);
+        output
+    }
+
+    /// Calculate the first 64-bit word of the hash for each of several inputs,
+    /// and store the results in `output`.
+    ///
+    /// This is [`Self::hash_many()`], without allocating a new `Vec`.
+    /// Panics if `inputs` and `output` are not the same length.
+    pub fn hash_many_into(&self, inputs: &[u64], output: &mut [u64]) {
+        assert_eq!(inputs.len(), output.len(), "mismatched output length");
+        match &self.program {
+            RuntimeProgram::InterpretBatch(program) => {
+                batch::hash_many_into(program, self.register_key, inputs, output);
+            }
+            _ => {
+                for (input, output) in inputs.iter().zip(output.iter_mut()) {
+                    *output = self.hash_to_u64(*input);
+                }
+            }
+        }
+    }
+
     /// Calculate the hash function at its full output width, returning a fixed
     /// size byte array.
     pub fn hash_to_bytes(&self, input: u64) -> [u8; Self::FULL_SIZE] {
@@ -160,7 +204,9 @@ impl HashX {
     fn hash_to_regs(&self, input: u64) -> register::RegisterFile {
         let mut regs = register::RegisterFile::new(self.register_key, input);
         match &self.program {
-            RuntimeProgram::Interpret(program) => program.interpret(&mut regs),
+            RuntimeProgram::Interpret(program) | RuntimeProgram::InterpretBatch(program) => {
+                program.interpret(&mut regs);
+            }
             RuntimeProgram::Compiled(executable) => executable.invoke(&mut regs),
         }
         regs
@@ -218,12 +264,13 @@ impl HashXBuilder {
             register_key,
             program: match self.runtime {
                 RuntimeOption::InterpretOnly => RuntimeProgram::Interpret(program),
+                RuntimeOption::InterpretBatch => RuntimeProgram::InterpretBatch(program),
                 RuntimeOption::CompileOnly => {
                     RuntimeProgram::Compiled(Architecture::compile((&program).into())?)
                 }
                 RuntimeOption::TryCompile => match Architecture::compile((&program).into()) {
                     Ok(exec) => RuntimeProgram::Compiled(exec),
-                    Err(_) => RuntimeProgram::Interpret(program),
+                    Err(_) => RuntimeProgram::InterpretBatch(program),
                 },
             },
         })
@@ -63,6 +63,21 @@ fn seed2_interp() {
     );
 }
 
+#[test]
+fn seed1_interp_batch() {
+    let func = HashXBuilder::new()
+        .runtime(hashx::RuntimeOption::InterpretBatch)
+        .build(SEED1)
+        .unwrap();
+    println!("{:?}\n", func);
+    assert_eq!(
+        func.hash_many(&[0, 123456]),
+        [0x98eacb7d56542f2b, 0xaf937ca60ad5bdae]
+    );
+    assert_eq!(func.hash_to_bytes(0), HASH_SEED1_0);
+    assert_eq!(func.hash_to_bytes(123456), HASH_SEED1_123456);
+}
+
 #[cfg(not(all(
     feature = "compiler",
     any(target_arch = "x86_64", target_arch = "aarch64")
@@ -82,6 +97,25 @@ fn compiler_not_available() {
     }
 }
 
+#[cfg(not(all(
+    feature = "compiler",
+    any(target_arch = "x86_64", target_arch = "aarch64")
+)))]
+#[test]
+fn try_compile_falls_back() {
+    // Without a compiler, the default runtime falls back to the batch interpreter.
+    let func = HashXBuilder::new()
+        .runtime(hashx::RuntimeOption::TryCompile)
+        .build(SEED2)
+        .unwrap();
+    assert!(matches!(func.runtime(), hashx::Runtime::Interpret));
+    assert_eq!(
+        func.hash_many(&[123456, 987654321123456789]),
+        [0xaab0bbf45b153dab, 0x7432327c49f0fe8d]
+    );
+    assert_eq!(func.hash_to_bytes(123456), HASH_SEED2_123456);
+}
+
 #[cfg(all(
     feature = "compiler",
     any(target_arch = "x86_64", target_arch = "aarch64")
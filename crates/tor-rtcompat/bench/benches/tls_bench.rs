@@ -0,0 +1,250 @@
+//! This is a wallclock time microbenchmark for the TLS providers in
+//! tor-rtcompat, using the Criterion framework.
+//!
+//! For each TLS backend, we measure how many handshakes we can make one
+//! after another, how long each handshake takes while others are in
+//! progress, and how quickly we can send 514-byte cells (the size of a
+//! Tor channel cell) over an established connection.
+//!
+//! tor-rtcompat only implements the client side of TLS, so every backend
+//! talks to the same server: a set of threads using native-tls.  Only the
+//! client side changes from one backend to the next.
+//!
+//! By default, the server uses the certificate in tor-rtcompat's test.pfx.
+//! To use the certificates written by `make-cert -n COUNT -o DIR` instead,
+//! set `TOR_RTCOMPAT_BENCH_CERTS=DIR`; the server will present each
+//! certificate listed in `DIR/manifest.txt` in turn.
+
+use criterion::{
+    black_box, criterion_group, criterion_main, measurement::WallTime, BenchmarkGroup, BenchmarkId,
+    Criterion, Throughput,
+};
+use futures::io::{AsyncReadExt, AsyncWriteExt};
+use native_tls::{Identity, TlsAcceptor};
+use std::fs;
+use std::io::{Read, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream};
+use std::path::Path;
+use std::time::{Duration, Instant};
+use tor_rtcompat::tls::{CertifiedConn, TlsConnector};
+use tor_rtcompat::tokio::{TokioNativeTlsRuntime, TokioRustlsRuntime};
+use tor_rtcompat::{BlockOn, NetStreamProvider, Runtime, TlsProvider};
+
+/// Environment variable naming a directory of certificates from `make-cert -n`
+const CERTS_ENV: &str = "TOR_RTCOMPAT_BENCH_CERTS";
+
+/// Length of a Tor channel cell, in bytes
+const CELL_LEN: usize = 514;
+
+/// Number of cells the client sends before waiting for the server to catch up
+const CELLS_PER_BATCH: usize = 256;
+
+/// Number of bytes in one batch of cells
+const BATCH_LEN: usize = CELL_LEN * CELLS_PER_BATCH;
+
+/// Numbers of handshakes to run at once, when measuring latency under concurrency
+const CONCURRENCY: [usize; 3] = [1, 8, 32];
+
+/// SNI hostname to send; the server ignores it
+const SNI_HOSTNAME: &str = "www.example.com";
+
+/// The TLS stream type for a runtime's TCP connections
+type TlsStreamOf<R> = <R as TlsProvider<<R as NetStreamProvider>::Stream>>::TlsStream;
+
+/// The TLS connector type for a runtime's TCP connections
+type ConnectorOf<R> = <R as TlsProvider<<R as NetStreamProvider>::Stream>>::Connector;
+
+/// Return one TLS acceptor for each certificate that the server should present.
+fn load_acceptors() -> Vec<TlsAcceptor> {
+    let identities = match std::env::var_os(CERTS_ENV) {
+        Some(dir) => load_make_cert_output(Path::new(&dir)),
+        None => {
+            // See the simple_tls test in tor-rtcompat for how this was made.
+            static PFX_ID: &[u8] = include_bytes!("../../src/test.pfx");
+            vec![Identity::from_pkcs12(PFX_ID, "abc").expect("Couldn't load test.pfx")]
+        }
+    };
+    identities
+        .into_iter()
+        .map(|identity| TlsAcceptor::new(identity).expect("Couldn't make TLS acceptor"))
+        .collect()
+}
+
+/// Load every key and certificate listed in the manifest.txt file
+/// that `make-cert -n` wrote to `dir`.
+fn load_make_cert_output(dir: &Path) -> Vec<Identity> {
+    let manifest = fs::read_to_string(dir.join("manifest.txt")).expect("Couldn't read manifest");
+    let identities: Vec<_> = manifest
+        .lines()
+        .filter(|line| !line.starts_with('#') && !line.trim().is_empty())
+        .map(|line| {
+            let fields: Vec<&str> = line.split_whitespace().collect();
+            let [_index, key, cert, ..] = fields[..] else {
+                panic!("Malformed line in manifest: {line:?}");
+            };
+            let key = fs::read(dir.join(key)).expect("Couldn't read key");
+            let cert = fs::read(dir.join(cert)).expect("Couldn't read certificate");
+            Identity::from_pkcs8(&cert, &key).expect("Couldn't load key and certificate")
+        })
+        .collect();
+    assert!(!identities.is_empty(), "No certificates in manifest");
+    identities
+}
+
+/// Start a TLS server on localhost, and return its address.
+///
+/// Each connection gets its own thread, and the next acceptor in `acceptors`.
+/// Once the handshake is done, the server reads whatever the client sends,
+/// and writes a single byte back after every [`BATCH_LEN`] bytes.
+fn start_server(acceptors: Vec<TlsAcceptor>) -> SocketAddr {
+    let listener = TcpListener::bind("127.0.0.1:0").expect("Couldn't bind");
+    let addr = listener.local_addr().expect("No local address");
+    std::thread::spawn(move || {
+        for (n, stream) in listener.incoming().enumerate() {
+            let Ok(stream) = stream else { continue };
+            let acceptor = acceptors[n % acceptors.len()].clone();
+            std::thread::spawn(move || serve(&acceptor, stream));
+        }
+    });
+    addr
+}
+
+/// Handle a single connection to the server started by [`start_server`].
+fn serve(acceptor: &TlsAcceptor, stream: TcpStream) {
+    let _ = stream.set_nodelay(true);
+    let Ok(mut tls) = acceptor.accept(stream) else {
+        return;
+    };
+    let mut buf = vec![0_u8; BATCH_LEN];
+    let mut received = 0;
+    loop {
+        match tls.read(&mut buf) {
+            Ok(0) | Err(_) => return,
+            Ok(n) => received += n,
+        }
+        while received >= BATCH_LEN {
+            received -= BATCH_LEN;
+            if tls.write_all(&[1]).is_err() {
+                return;
+            }
+        }
+    }
+}
+
+/// Open a TCP connection to `addr`, and make a TLS handshake over it.
+async fn handshake<R: Runtime>(
+    runtime: &R,
+    connector: &ConnectorOf<R>,
+    addr: SocketAddr,
+) -> TlsStreamOf<R> {
+    let stream = NetStreamProvider::<SocketAddr>::connect(runtime, &addr)
+        .await
+        .expect("Couldn't connect");
+    let tls = connector
+        .negotiate_unvalidated(stream, SNI_HOSTNAME)
+        .await
+        .expect("Handshake failed");
+    black_box(tls.peer_certificate().expect("No peer certificate"));
+    tls
+}
+
+/// Benchmark making one handshake at a time.
+fn bench_handshake<R: Runtime>(
+    group: &mut BenchmarkGroup<'_, WallTime>,
+    name: &str,
+    runtime: &R,
+    addr: SocketAddr,
+) {
+    let connector = runtime.tls_connector();
+    group.bench_function(name, |b| {
+        b.iter(|| runtime.block_on(handshake(runtime, &connector, addr)));
+    });
+}
+
+/// Benchmark the latency of each handshake, while `concurrency` handshakes
+/// run at once.
+fn bench_concurrent_handshake<R: Runtime>(
+    group: &mut BenchmarkGroup<'_, WallTime>,
+    name: &str,
+    runtime: &R,
+    addr: SocketAddr,
+    concurrency: usize,
+) {
+    let connector = &runtime.tls_connector();
+    let id = BenchmarkId::new(name, concurrency);
+    group.bench_with_input(id, &concurrency, |b, &concurrency| {
+        b.iter_custom(|iters| {
+            runtime.block_on(async {
+                let mut total = Duration::ZERO;
+                let mut done = 0_u64;
+                while done < iters {
+                    let latencies =
+                        futures::future::join_all((0..concurrency).map(move |_| async move {
+                            let start = Instant::now();
+                            let tls = handshake(runtime, connector, addr).await;
+                            let elapsed = start.elapsed();
+                            drop(tls);
+                            elapsed
+                        }))
+                        .await;
+                    total += latencies.into_iter().sum::<Duration>();
+                    done += concurrency as u64;
+                }
+                // We ran whole batches; scale to the number of iterations we were asked for.
+                total.mul_f64(iters as f64 / done as f64)
+            })
+        });
+    });
+}
+
+/// Benchmark sending batches of cells over a single connection.
+fn bench_cell_throughput<R: Runtime>(
+    group: &mut BenchmarkGroup<'_, WallTime>,
+    name: &str,
+    runtime: &R,
+    addr: SocketAddr,
+) {
+    let connector = runtime.tls_connector();
+    let mut tls = runtime.block_on(handshake(runtime, &connector, addr));
+    let cell = [0x55_u8; CELL_LEN];
+    group.bench_function(name, |b| {
+        b.iter(|| {
+            runtime.block_on(async {
+                for _ in 0..CELLS_PER_BATCH {
+                    tls.write_all(&cell).await.expect("Write failed");
+                }
+                tls.flush().await.expect("Flush failed");
+                let mut ack = [0_u8; 1];
+                tls.read_exact(&mut ack).await.expect("Read failed");
+            });
+        });
+    });
+}
+
+fn tls_bench(c: &mut Criterion) {
+    let addr = start_server(load_acceptors());
+    let native_tls = TokioNativeTlsRuntime::create().expect("Couldn't make runtime");
+    let rustls = TokioRustlsRuntime::create().expect("Couldn't make runtime");
+
+    let mut group = c.benchmark_group("tls_handshake");
+    group.throughput(Throughput::Elements(1));
+    bench_handshake(&mut group, "native-tls", &native_tls, addr);
+    bench_handshake(&mut group, "rustls", &rustls, addr);
+    group.finish();
+
+    let mut group = c.benchmark_group("tls_handshake_concurrent");
+    for concurrency in CONCURRENCY {
+        bench_concurrent_handshake(&mut group, "native-tls", &native_tls, addr, concurrency);
+        bench_concurrent_handshake(&mut group, "rustls", &rustls, addr, concurrency);
+    }
+    group.finish();
+
+    let mut group = c.benchmark_group("tls_cell_throughput");
+    group.throughput(Throughput::Bytes(BATCH_LEN as u64));
+    bench_cell_throughput(&mut group, "native-tls", &native_tls, addr);
+    bench_cell_throughput(&mut group, "rustls", &rustls, addr);
+    group.finish();
+}
+
+criterion_group!(benches, tls_bench);
+criterion_main!(benches);
@@ -7,11 +7,31 @@
 //
 // This is not meant to be used for anything but testing Arti.  If you use
 // it for something else, you might regret it deeply.
+//
+// To build it:
+//
+//     cc -O2 -o make-cert make-cert.c -lssl -lcrypto -lpthread
+//
+// Run with no arguments, it writes a single link key and certificate to
+// test.key and test.crt in the current directory.
+//
+// Run as "make-cert -n COUNT [-j THREADS] [-o DIR]", it writes COUNT
+// distinct link keys and certificates into DIR (default: "."), as
+// NNNNNN.key and NNNNNN.crt.  They are all signed by a single signing key,
+// which it writes (with a self-signed certificate) as signer.key and
+// signer.crt.  It generates keys on THREADS threads at once (default: one
+// per CPU), and writes a list of what it made to manifest.txt: one line per
+// certificate, giving its index, its key file, its certificate file, and
+// the SHA-256 digest of the certificate, in hex.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/opensslv.h>
 #include <openssl/err.h>
@@ -115,11 +135,289 @@ tor_tls_create_certificate(EVP_PKEY *pkey,
 
 
 
+/* Return a new context for generating 2048-bit RSA keys, or NULL. */
+static EVP_PKEY_CTX *
+new_keygen_ctx(void)
+{
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+  if (!ctx)
+    return NULL;
+  if (EVP_PKEY_keygen_init(ctx) <= 0 ||
+      EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0) {
+    EVP_PKEY_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+/* Write `pkey` to `key_path` and `x509` to `cert_path`, as PEM.  Return 0 on
+ * success and -1 on failure. */
+static int
+write_key_and_cert(const char *key_path, EVP_PKEY *pkey,
+                   const char *cert_path, X509 *x509)
+{
+  int ok = 1;
+  FILE *key = fopen(key_path, "w");
+  if (!key)
+    return -1;
+  ok &= PEM_write_PrivateKey(key, pkey, NULL, NULL, 0, NULL, NULL) == 1;
+  ok &= fclose(key) == 0;
+
+  FILE *cert = fopen(cert_path, "w");
+  if (!cert)
+    return -1;
+  ok &= PEM_write_X509(cert, x509) == 1;
+  ok &= fclose(cert) == 0;
+  return ok ? 0 : -1;
+}
+
+/* Everything that the threads of a batch share. */
+struct batch {
+  const char *dir;
+  unsigned long count;
+  EVP_PKEY *sign;
+  const char *cname_sign;
+
+  pthread_mutex_t lock;
+  /* The index of the next certificate to make.  Protected by `lock`. */
+  unsigned long next;
+  /* True if any thread has failed.  Protected by `lock`. */
+  int failed;
+
+  /* The hex SHA-256 digest of each certificate, by index.  Each thread only
+   * writes the entries for the certificates that it made. */
+  char (*digests)[2 * SHA256_DIGEST_LENGTH + 1];
+};
+
+/* Make one link key and certificate for `b`, with index `idx`.  Use `ctx` to
+ * generate the key.  Return 0 on success and -1 on failure. */
+static int
+batch_make_one(struct batch *b, EVP_PKEY_CTX *ctx, unsigned long idx)
+{
+  EVP_PKEY *link = NULL;
+  X509 *x509 = NULL;
+  int result = -1;
+  char cname[64], key_path[4096], cert_path[4096];
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned int digest_len = sizeof(digest);
+
+  if (EVP_PKEY_keygen(ctx, &link) != 1)
+    goto done;
+  snprintf(cname, sizeof(cname), "www.cert%06lu.net", idx);
+  if (!(x509 = tor_tls_create_certificate(link, b->sign, cname,
+                                          b->cname_sign, 86400)))
+    goto done;
+
+  snprintf(key_path, sizeof(key_path), "%s/%06lu.key", b->dir, idx);
+  snprintf(cert_path, sizeof(cert_path), "%s/%06lu.crt", b->dir, idx);
+  if (write_key_and_cert(key_path, link, cert_path, x509) < 0)
+    goto done;
+
+  if (!X509_digest(x509, EVP_sha256(), digest, &digest_len))
+    goto done;
+  for (unsigned int i = 0; i < digest_len; ++i)
+    sprintf(&b->digests[idx][2 * i], "%02x", digest[i]);
+
+  result = 0;
+ done:
+  if (x509)
+    X509_free(x509);
+  if (link)
+    EVP_PKEY_free(link);
+  return result;
+}
+
+/* Body for each thread in a batch: make certificates until there are no more
+ * to make, or until some thread fails. */
+static void *
+batch_worker(void *arg)
+{
+  struct batch *b = arg;
+  /* EVP_PKEY_CTX objects can't be shared between threads, so each thread has
+   * its own. */
+  EVP_PKEY_CTX *ctx = new_keygen_ctx();
+  int ok = ctx != NULL;
+
+  while (ok) {
+    pthread_mutex_lock(&b->lock);
+    unsigned long idx = b->next;
+    int stop = b->failed || idx >= b->count;
+    if (!stop)
+      ++b->next;
+    pthread_mutex_unlock(&b->lock);
+    if (stop)
+      break;
+    ok = batch_make_one(b, ctx, idx) == 0;
+  }
+
+  if (!ok) {
+    pthread_mutex_lock(&b->lock);
+    b->failed = 1;
+    pthread_mutex_unlock(&b->lock);
+  }
+  if (ctx)
+    EVP_PKEY_CTX_free(ctx);
+  return NULL;
+}
+
+/* Make `count` certificates in `dir`, using `n_threads` threads.  Return an
+ * exit status for main. */
+static int
+run_batch(const char *dir, unsigned long count, unsigned long n_threads)
+{
+  struct batch b;
+  EVP_PKEY_CTX *ctx = NULL;
+  X509 *sign_cert = NULL;
+  FILE *manifest = NULL;
+  int result = 1;
+  char key_path[4096], cert_path[4096], manifest_path[4096];
+
+  memset(&b, 0, sizeof(b));
+  b.dir = dir;
+  b.count = count;
+  b.cname_sign = "www.signer.com";
+  pthread_mutex_init(&b.lock, NULL);
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    perror(dir);
+    goto done;
+  }
+
+  /* Every link certificate is signed by the same key, so we only make one. */
+  ctx = new_keygen_ctx();
+  if (!ctx || EVP_PKEY_keygen(ctx, &b.sign) != 1) {
+    fprintf(stderr, "Error making signing key\n");
+    goto done;
+  }
+
+  sign_cert = tor_tls_create_certificate(b.sign, b.sign, b.cname_sign,
+                                         b.cname_sign, 86400);
+  snprintf(key_path, sizeof(key_path), "%s/signer.key", dir);
+  snprintf(cert_path, sizeof(cert_path), "%s/signer.crt", dir);
+  if (!sign_cert ||
+      write_key_and_cert(key_path, b.sign, cert_path, sign_cert) < 0) {
+    fprintf(stderr, "Error writing signing key\n");
+    goto done;
+  }
+
+  if (!(b.digests = calloc(count ? count : 1, sizeof(*b.digests)))) {
+    fprintf(stderr, "Out of memory\n");
+    goto done;
+  }
+
+  if (n_threads > count)
+    n_threads = count ? count : 1;
+  pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+  if (!threads) {
+    fprintf(stderr, "Out of memory\n");
+    goto done;
+  }
+  unsigned long n_started = 0;
+  for (; n_started < n_threads; ++n_started) {
+    if (pthread_create(&threads[n_started], NULL, batch_worker, &b) != 0)
+      break;
+  }
+  if (n_started == 0) {
+    /* No threads at all; do the work ourselves. */
+    batch_worker(&b);
+  }
+  for (unsigned long i = 0; i < n_started; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (b.failed) {
+    fprintf(stderr, "Error making certificates\n");
+    goto done;
+  }
+
+  snprintf(manifest_path, sizeof(manifest_path), "%s/manifest.txt", dir);
+  if (!(manifest = fopen(manifest_path, "w"))) {
+    perror(manifest_path);
+    goto done;
+  }
+  fprintf(manifest, "# index key cert sha256(cert); signed by signer.crt\n");
+  for (unsigned long i = 0; i < count; ++i) {
+    fprintf(manifest, "%06lu %06lu.key %06lu.crt %s\n",
+            i, i, i, b.digests[i]);
+  }
+  int closed = fclose(manifest) == 0;
+  manifest = NULL;
+  if (!closed) {
+    perror(manifest_path);
+    goto done;
+  }
+
+  printf("OK: %lu certificates in %s.\n", count, dir);
+  result = 0;
+ done:
+  if (manifest)
+    fclose(manifest);
+  free(b.digests);
+  if (sign_cert)
+    X509_free(sign_cert);
+  if (b.sign)
+    EVP_PKEY_free(b.sign);
+  if (ctx)
+    EVP_PKEY_CTX_free(ctx);
+  pthread_mutex_destroy(&b.lock);
+  return result;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-n COUNT [-j THREADS] [-o DIR]]\n", prog);
+  exit(1);
+}
+
+/* Parse `arg` as a number for the option `opt`, or exit. */
+static unsigned long
+parse_count(const char *prog, int opt, const char *arg)
+{
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || errno) {
+    fprintf(stderr, "%s: bad number for -%c: %s\n", prog, opt, arg);
+    usage(prog);
+  }
+  return n;
+}
+
 int
 main(int argc, char **argv)
 {
   OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS, NULL);
 
+  int opt, batch_mode = 0;
+  unsigned long count = 0, n_threads = 0;
+  const char *dir = ".";
+  while ((opt = getopt(argc, argv, "n:j:o:")) != -1) {
+    switch (opt) {
+      case 'n':
+        count = parse_count(argv[0], opt, optarg);
+        batch_mode = 1;
+        break;
+      case 'j':
+        n_threads = parse_count(argv[0], opt, optarg);
+        break;
+      case 'o':
+        dir = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc || (!batch_mode && (n_threads || strcmp(dir, "."))))
+    usage(argv[0]);
+  if (batch_mode) {
+    if (n_threads == 0) {
+      long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      n_threads = n_cpus > 0 ? (unsigned long) n_cpus : 1;
+    }
+    return run_batch(dir, count, n_threads);
+  }
+
   EVP_PKEY *link = NULL, *sign = NULL;
   EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
   assert(ctx);